@@ -0,0 +1,150 @@
+/* Includes ------------------------------------------------------------------*/
+
+#include <string.h>
+
+#include <fibre/ascii_protocol.hpp>
+
+/* Private functions ---------------------------------------------------------*/
+
+// @brief Splits off the first space-separated token of the string.
+// @return The length of the token. *str and *length are advanced to the
+//         start of the next token.
+static size_t next_token(char ** str, size_t * length, char ** token) {
+    while (*length && **str == ' ') {
+        (*str)++;
+        (*length)--;
+    }
+    *token = *str;
+    size_t token_length = 0;
+    while (token_length < *length && (*str)[token_length] != ' ')
+        token_length++;
+    *str += token_length;
+    *length -= token_length;
+    return token_length;
+}
+
+/* Function implementations --------------------------------------------------*/
+
+EndpointPathTable::EndpointPathTable(EndpointProvider& provider) {
+    // Count the paths first to size the table for a load factor of at most 1/2
+    struct Counter : EndpointPathSink {
+        size_t n_paths = 0;
+        void add_path(uint32_t path_hash, const char * name, Endpoint* endpoint) final { n_paths++; }
+    } counter;
+    provider.register_paths(counter);
+
+    size_t size = 1;
+    while (size < 2 * counter.n_paths)
+        size <<= 1;
+    entries_ = std::vector<Entry>(size, Entry{ 0, std::string(), nullptr });
+    provider.register_paths(*this);
+}
+
+void EndpointPathTable::add_path(uint32_t path_hash, const char * name, Endpoint* endpoint) {
+    size_t mask = entries_.size() - 1;
+    size_t i = path_hash & mask;
+    while (entries_[i].endpoint)
+        i = (i + 1) & mask;
+    entries_[i] = { path_hash, prefix_ + name, endpoint };
+}
+
+void EndpointPathTable::enter_object(const char * name) {
+    prefix_ += name;
+    prefix_ += '.';
+}
+
+void EndpointPathTable::leave_object() {
+    prefix_.pop_back();
+    prefix_.erase(prefix_.rfind('.') + 1); // npos + 1 clears the whole prefix
+}
+
+Endpoint* EndpointPathTable::find(const char * path, size_t length) const {
+    uint32_t path_hash = hash_path(PATH_HASH_INIT, path, length);
+
+    // The hash alone could match a different path, so also compare the path
+    size_t mask = entries_.size() - 1;
+    for (size_t i = path_hash & mask; entries_[i].endpoint; i = (i + 1) & mask) {
+        const Entry& entry = entries_[i];
+        if (entry.path_hash == path_hash && !entry.path.compare(0, std::string::npos, path, length))
+            return entry.endpoint;
+    }
+    return nullptr;
+}
+
+int AsciiProtocol::process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) {
+    for (size_t i = 0; i < length; ++i) {
+        char c = buffer[i];
+        if (c == '\n' || c == '\r') {
+            if (line_too_long_) {
+                respond("line too long", 13);
+            } else if (line_length_) {
+                line_[line_length_] = 0;
+                process_line(line_, line_length_);
+            }
+            line_length_ = 0;
+            line_too_long_ = false;
+        } else if (line_length_ < sizeof(line_) - 1) {
+            line_[line_length_++] = c;
+        } else {
+            line_too_long_ = true;
+        }
+    }
+    flush();
+    if (processed_bytes)
+        *processed_bytes += length;
+    return 0;
+}
+
+void AsciiProtocol::process_line(char * line, size_t length) {
+    char * command;
+    char * path;
+    char * value;
+    size_t command_length = next_token(&line, &length, &command);
+    size_t path_length = next_token(&line, &length, &path);
+    size_t value_length = next_token(&line, &length, &value);
+    path[path_length] = 0;
+    value[value_length] = 0;
+
+    if (command_length != 1 || (command[0] != 'r' && command[0] != 'w')) {
+        respond("unknown command", 15);
+        return;
+    }
+
+    Endpoint* endpoint = table_.find(path, path_length);
+    if (!endpoint) {
+        respond("invalid property", 16);
+    } else if (command[0] == 'r') {
+        char buffer[ASCII_MAX_VALUE_LENGTH];
+        if (endpoint->get_string(buffer, sizeof(buffer)))
+            respond(buffer, strlen(buffer));
+        else
+            respond("invalid property", 16);
+    } else {
+        // Writes go through the write handoff queue or the transaction
+        // sequence lock like binary writes. Function arguments can't be
+        // deferred and are set directly.
+        PendingWrite write;
+        if (!value_length) {
+            respond("invalid value", 13);
+        } else if (endpoint->prepare_string_write(value, value_length + 1, &write)) {
+            if (!fibre_apply_transaction(&write, 1))
+                respond("write dropped", 13);
+        } else if (!endpoint->set_string(value, value_length + 1)) {
+            respond("invalid value", 13);
+        }
+    }
+}
+
+void AsciiProtocol::respond(const char * str, size_t length) {
+    if (response_length_ + length + 2 > sizeof(response_))
+        flush();
+    memcpy(response_ + response_length_, str, length);
+    memcpy(response_ + response_length_ + length, "\r\n", 2);
+    response_length_ += length + 2;
+}
+
+void AsciiProtocol::flush() {
+    if (response_length_)
+        output_.process_bytes(reinterpret_cast<const uint8_t*>(response_), response_length_, nullptr);
+    response_length_ = 0;
+}
@@ -0,0 +1,84 @@
+#include <fibre/client.hpp>
+
+#include <chrono>
+
+int Client::process_packet(const uint8_t* buffer, size_t length) {
+    if (length < 2)
+        return -1;
+    uint16_t seq_no = read_le<uint16_t>(&buffer, &length);
+    if (!(seq_no & 0x8000))
+        return 0; // requests to the client are not supported
+    seq_no &= 0x7fff;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (PendingRequest* request = pending_; request; request = request->next) {
+        if (request->seq_no == seq_no && !request->done) {
+            if (length > request->output_length)
+                length = request->output_length;
+            if (request->output)
+                memcpy(request->output, buffer, length);
+            request->output_length = length;
+            request->done = true;
+            response_received_.notify_all();
+            return 0;
+        }
+    }
+    LOG_FIBRE("received unexpected response %d\r\n", seq_no);
+    return 0;
+}
+
+int Client::request(uint16_t endpoint_id, const uint8_t* input, size_t input_length,
+        uint8_t* output, size_t* output_length) {
+    uint8_t packet[RX_BUF_SIZE - 1];
+    size_t expected_response_length = output_length ? *output_length : 0;
+    if (8 + input_length > sizeof(packet) || expected_response_length > 0xffff)
+        return -1;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    // Like the Python client, keep bit 7 set to avoid conflicts with the ASCII protocol
+    seq_no_ = (seq_no_ + 1) & 0x3fff;
+    PendingRequest request = { static_cast<uint16_t>(seq_no_ | 0x80), output, expected_response_length, false, pending_ };
+    pending_ = &request;
+
+    size_t length = write_le<uint16_t>(request.seq_no, packet);
+    length += write_le<uint16_t>(endpoint_id | 0x8000, packet + length);
+    length += write_le<uint16_t>(expected_response_length, packet + length);
+    memcpy(packet + length, input, input_length);
+    length += input_length;
+    length += write_le<uint16_t>(endpoint_id ? remote_json_crc_ : PROTOCOL_VERSION, packet + length);
+
+    for (size_t attempt = 0; attempt < send_attempts_ && !request.done; ++attempt) {
+        output_.process_packet(packet, length);
+        response_received_.wait_for(lock, std::chrono::milliseconds(resend_timeout_ms_),
+                [&request]{ return request.done; });
+    }
+
+    for (PendingRequest** it = &pending_; *it; it = &(*it)->next) {
+        if (*it == &request) {
+            *it = request.next;
+            break;
+        }
+    }
+
+    if (!request.done)
+        return -1;
+    if (output_length)
+        *output_length = request.output_length;
+    return 0;
+}
+
+int Client::read_buffer(uint16_t endpoint_id, std::vector<uint8_t>* buffer) {
+    buffer->clear();
+    for (;;) {
+        uint8_t offset[4];
+        write_le<uint32_t>(buffer->size(), offset);
+        uint8_t chunk[RX_BUF_SIZE];
+        size_t chunk_length = sizeof(chunk);
+        if (request(endpoint_id, offset, sizeof(offset), chunk, &chunk_length))
+            return -1;
+        if (!chunk_length)
+            return 0;
+        buffer->insert(buffer->end(), chunk, chunk + chunk_length);
+    }
+}
@@ -0,0 +1,118 @@
+/* Includes ------------------------------------------------------------------*/
+
+#include <algorithm>
+
+#include <fibre/config.hpp>
+#include <fibre/crc.hpp>
+
+/* Function implementations --------------------------------------------------*/
+
+ConfigTable::ConfigTable(EndpointProvider& provider) {
+    provider.register_paths(*this);
+    std::sort(entries_.begin(), entries_.end(), [](const Entry& a, const Entry& b) {
+        return a.path_hash < b.path_hash;
+    });
+
+    // Drop all properties whose path hash isn't unique
+    size_t n_unique = 0;
+    for (size_t i = 0; i < entries_.size(); ) {
+        size_t end = i + 1;
+        while (end < entries_.size() && entries_[end].path_hash == entries_[i].path_hash)
+            end++;
+        if (end == i + 1)
+            entries_[n_unique++] = entries_[i];
+        i = end;
+    }
+    entries_.resize(n_unique);
+}
+
+void ConfigTable::add_path(uint32_t path_hash, const char * name, Endpoint* endpoint) {
+    // Only properties that accept a write of their own value are saved
+    uint8_t value[PENDING_WRITE_MAX_SIZE];
+    size_t length = sizeof(value);
+    PendingWrite write;
+    if (fibre_sample_endpoint(endpoint, value, &length) && length
+            && endpoint->prepare_write(value, length, &write))
+        entries_.push_back({ path_hash, (uint8_t)length, endpoint });
+}
+
+size_t ConfigTable::get_snapshot_size() const {
+    size_t size = CONFIG_HEADER_SIZE;
+    for (const Entry& entry : entries_)
+        size += 5 + entry.length;
+    return size;
+}
+
+size_t ConfigTable::save(uint8_t* buffer, size_t length) const {
+    if (length < get_snapshot_size())
+        return 0;
+
+    uint8_t* entry_buffer = buffer + CONFIG_HEADER_SIZE;
+    uint32_t n_entries = 0;
+    for (const Entry& entry : entries_) {
+        write_le<uint32_t>(entry.path_hash, entry_buffer);
+        size_t length = entry.length;
+        if (!fibre_sample_endpoint(entry.endpoint, entry_buffer + 5, &length) || length != entry.length)
+            continue;
+        entry_buffer[4] = entry.length;
+        entry_buffer += 5 + entry.length;
+        n_entries++;
+    }
+
+    const uint8_t* entries = buffer + CONFIG_HEADER_SIZE;
+    write_le<uint32_t>(CONFIG_MAGIC, buffer);
+    write_le<uint32_t>(CONFIG_VERSION, buffer + 4);
+    write_le<uint32_t>(n_entries, buffer + 8);
+    write_le<uint32_t>(calc_crc32<CONFIG_CRC32_POLYNOMIAL>(CONFIG_CRC32_INIT, entries, entry_buffer - entries), buffer + 12);
+    return entry_buffer - buffer;
+}
+
+int ConfigTable::restore(const uint8_t* buffer, size_t length) const {
+    uint32_t magic, version, n_entries, crc;
+    if (length < CONFIG_HEADER_SIZE)
+        return -1;
+    read_le<uint32_t>(&magic, buffer);
+    read_le<uint32_t>(&version, buffer + 4);
+    read_le<uint32_t>(&n_entries, buffer + 8);
+    read_le<uint32_t>(&crc, buffer + 12);
+    const uint8_t* entries = buffer + CONFIG_HEADER_SIZE;
+    const uint8_t* end = buffer + length;
+    if (magic != CONFIG_MAGIC || version != CONFIG_VERSION
+            || crc != calc_crc32<CONFIG_CRC32_POLYNOMIAL>(CONFIG_CRC32_INIT, entries, end - entries))
+        return -1;
+
+    // Check the entries before writing any of them
+    const uint8_t* entry_buffer = entries;
+    for (uint32_t i = 0; i < n_entries; ++i) {
+        if (end - entry_buffer < 5 || end - entry_buffer - 5 < entry_buffer[4])
+            return -1;
+        entry_buffer += 5 + entry_buffer[4];
+    }
+    if (entry_buffer != end)
+        return -1;
+
+    // Both lists are sorted by path hash, so each lookup continues where the
+    // previous one stopped
+    int n_restored = 0;
+    auto it = entries_.begin();
+    for (entry_buffer = entries; entry_buffer < end; entry_buffer += 5 + entry_buffer[4]) {
+        uint32_t path_hash;
+        read_le<uint32_t>(&path_hash, entry_buffer);
+        uint8_t value_length = entry_buffer[4];
+        if (it != entries_.begin() && path_hash < it[-1].path_hash)
+            it = entries_.begin(); // not sorted, e.g. written by another tool
+        it = std::lower_bound(it, entries_.end(), path_hash, [](const Entry& entry, uint32_t path_hash) {
+            return entry.path_hash < path_hash;
+        });
+        if (it == entries_.end() || it->path_hash != path_hash || it->length != value_length)
+            continue;
+
+        PendingWrite write;
+        if (it->endpoint->prepare_write(entry_buffer + 5, value_length, &write)) {
+            write.apply(write.ctx, write.value);
+            n_restored++;
+        }
+        ++it;
+    }
+    return n_restored;
+}
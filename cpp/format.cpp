@@ -0,0 +1,401 @@
+/* Includes ------------------------------------------------------------------*/
+
+#include <math.h>
+#include <string.h>
+
+#include <fibre/format.hpp>
+
+/* Private defines -----------------------------------------------------------*/
+
+#define FLOAT_MAX_SIGNIFICANT_DIGITS 9 // always enough to round-trip a float
+#define PARSE_MAX_MANTISSA 100000000000000000ULL // 10^17, converts to double with one rounding
+#define PARSE_MAX_EXPONENT 400 // beyond this every mantissa underflows or overflows
+#define PARSE_MAX_DIGITS 120 // halfway points between floats have at most 113 significant digits
+#define PARSE_HALFWAY_TOLERANCE 1e-14 // relative error of the double estimate, with ample margin
+#define BIGNUM_WORDS 20 // PARSE_MAX_DIGITS digits scaled into the float range fit into 640 bits
+
+/* Private constant data -----------------------------------------------------*/
+
+// Powers of ten that are exactly representable as double
+static const double pow10_table[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static const uint32_t pow10_uint_table[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+/* Private functions ---------------------------------------------------------*/
+
+// @brief Returns x * 10^exp.
+// Negative exponents divide by an exact power of ten rather than multiplying
+// by an inexact one, so that for |exp| <= 22 the result is correctly rounded.
+static double scale10(double x, int exp) {
+    for (; exp > 22; exp -= 22)
+        x *= 1e22;
+    for (; exp < -22; exp += 22)
+        x /= 1e22;
+    return exp >= 0 ? x * pow10_table[exp] : x / pow10_table[-exp];
+}
+
+// @brief Unsigned integer with just enough precision to compare a decimal
+// number with the halfway point between two floats, see compare_exact().
+struct BigNum {
+    uint32_t words[BIGNUM_WORDS]; // least significant first
+    size_t n_words;
+};
+
+// @brief Sets x to x * factor + addend.
+// @return false if the result doesn't fit into BIGNUM_WORDS words
+static bool bignum_mul(BigNum* x, uint32_t factor, uint32_t addend) {
+    uint64_t carry = addend;
+    for (size_t i = 0; i < x->n_words; ++i) {
+        carry += (uint64_t)x->words[i] * factor;
+        x->words[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    if (carry) {
+        if (x->n_words == BIGNUM_WORDS)
+            return false;
+        x->words[x->n_words++] = (uint32_t)carry;
+    }
+    return true;
+}
+
+static bool bignum_mul_pow10(BigNum* x, int exp) {
+    for (; exp > 9; exp -= 9) {
+        if (!bignum_mul(x, pow10_uint_table[9], 0))
+            return false;
+    }
+    return bignum_mul(x, pow10_uint_table[exp], 0);
+}
+
+static bool bignum_mul_pow2(BigNum* x, int exp) {
+    for (; exp > 31; exp -= 31) {
+        if (!bignum_mul(x, 1u << 31, 0))
+            return false;
+    }
+    return bignum_mul(x, 1u << exp, 0);
+}
+
+static int bignum_compare(const BigNum& a, const BigNum& b) {
+    if (a.n_words != b.n_words)
+        return a.n_words < b.n_words ? -1 : 1;
+    for (size_t i = a.n_words; i > 0; --i) {
+        if (a.words[i - 1] != b.words[i - 1])
+            return a.words[i - 1] < b.words[i - 1] ? -1 : 1;
+    }
+    return 0;
+}
+
+static bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static size_t skip_whitespace(const char * buffer, size_t length) {
+    size_t pos = 0;
+    while (pos < length && (buffer[pos] == ' ' || buffer[pos] == '\t'))
+        pos++;
+    return pos;
+}
+
+// @brief Returns true if the buffer starts with the specified lowercase word,
+// ignoring case.
+static bool starts_with_word(const char * buffer, size_t length, const char * word) {
+    size_t word_length = strlen(word);
+    if (length < word_length)
+        return false;
+    for (size_t i = 0; i < word_length; ++i) {
+        if ((buffer[i] | 0x20) != word[i])
+            return false;
+    }
+    return true;
+}
+
+static size_t copy_string(const char * str, size_t str_length, char * buffer, size_t length) {
+    if (str_length >= length)
+        return 0;
+    memcpy(buffer, str, str_length);
+    buffer[str_length] = 0;
+    return str_length;
+}
+
+// @brief Compares the decimal number digits * 10^exp10 with
+// mantissa * 2^exp2 exactly.
+// @param digits: decimal digits with at most one decimal point
+// @return -1, 0 or 1 if the decimal number is smaller, equal or larger, or 2
+//         if the numbers are too large to compare
+static int compare_exact(const char * digits, size_t length, int exp10, uint32_t mantissa, int exp2) {
+    BigNum decimal = { { 0 }, 0 };
+    BigNum binary = { { mantissa }, 1 };
+    size_t n_digits = 0;
+    bool fraction = false;
+    bool dropped = false; // nonzero digits beyond PARSE_MAX_DIGITS
+    for (size_t i = 0; i < length; ++i) {
+        if (digits[i] == '.') {
+            fraction = true;
+        } else if (n_digits < PARSE_MAX_DIGITS) {
+            if (n_digits || digits[i] != '0')
+                n_digits++;
+            if (!bignum_mul(&decimal, 10, digits[i] - '0'))
+                return 2;
+            if (fraction)
+                exp10--;
+        } else {
+            dropped = dropped || digits[i] != '0';
+            if (!fraction)
+                exp10++;
+        }
+    }
+
+    if (!(exp10 >= 0 ? bignum_mul_pow10(&decimal, exp10) : bignum_mul_pow10(&binary, -exp10))
+            || !(exp2 >= 0 ? bignum_mul_pow2(&binary, exp2) : bignum_mul_pow2(&decimal, -exp2)))
+        return 2;
+    int result = bignum_compare(decimal, binary);
+    return !result && dropped ? 1 : result;
+}
+
+// @brief Rounds the non-negative decimal number digits * 10^exp10 to float.
+// @param estimate: the decimal number in double precision, as parse_float()
+//        calculates it. This is within a few units in the last place of the
+//        exact value, which is enough unless it is close to halfway between
+//        two floats. Rounding it to float again would then round twice, so
+//        those cases are decided by comparing exactly.
+static float round_to_float(double estimate, const char * digits, size_t length, int exp10) {
+    float rounded = (float)estimate;
+    if (estimate == (double)rounded)
+        return rounded;
+
+    // Find the halfway point between the float below the estimate and the
+    // next float (or 2^128 above the largest float)
+    uint32_t lower;
+    memcpy(&lower, &rounded, sizeof(lower));
+    if (estimate < (double)rounded)
+        lower--;
+    uint32_t exp_field = lower >> 23;
+    uint32_t halfway_mantissa = 2 * (exp_field ? (lower & 0x7fffff) | 0x800000 : lower) + 1;
+    int halfway_exp2 = (exp_field ? (int)exp_field - 150 : -149) - 1;
+    double halfway = ldexp(halfway_mantissa, halfway_exp2);
+    if (fabs(estimate - halfway) > halfway * PARSE_HALFWAY_TOLERANCE)
+        return rounded;
+
+    int comparison = compare_exact(digits, length, exp10, halfway_mantissa, halfway_exp2);
+    if (comparison == 2)
+        return rounded;
+    uint32_t bits = comparison > 0 || (!comparison && (lower & 1)) ? lower + 1 : lower; // ties to even
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+/* Function implementations --------------------------------------------------*/
+
+size_t format_uint(uint32_t value, char * buffer, size_t length) {
+    char digits[10];
+    size_t n_digits = 0;
+    do {
+        digits[n_digits++] = '0' + (value % 10);
+        value /= 10;
+    } while (value);
+    if (n_digits >= length)
+        return 0;
+    for (size_t i = 0; i < n_digits; ++i)
+        buffer[i] = digits[n_digits - 1 - i];
+    buffer[n_digits] = 0;
+    return n_digits;
+}
+
+size_t format_int(int32_t value, char * buffer, size_t length) {
+    if (value >= 0)
+        return format_uint(value, buffer, length);
+    if (length < 1)
+        return 0;
+    buffer[0] = '-';
+    size_t n_chars = format_uint(0u - (uint32_t)value, buffer + 1, length - 1);
+    return n_chars ? n_chars + 1 : 0;
+}
+
+size_t format_float(float value, char * buffer, size_t length) {
+    char str[20]; // longest output is "-1.23456789e-38"
+    size_t pos = 0;
+
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    if (value != value)
+        return copy_string("nan", 3, buffer, length);
+    if (bits >> 31) {
+        str[pos++] = '-';
+        value = -value;
+    }
+    if (value > 3.40282347e+38f) {
+        memcpy(str + pos, "inf", 3);
+        return copy_string(str, pos + 3, buffer, length);
+    }
+    if (value == 0) {
+        str[pos++] = '0';
+        return copy_string(str, pos, buffer, length);
+    }
+
+    // Find the decimal exponent of the first significant digit. The binary
+    // exponent times log10(2) is close, then correct it.
+    double x = value;
+    int exp2 = (int)((bits >> 23) & 0xff) - 127;
+    int exp10 = (exp2 * 78913) >> 18;
+    while (x >= scale10(1.0, exp10 + 1))
+        exp10++;
+    while (x < scale10(1.0, exp10))
+        exp10--;
+
+    // Find the fewest significant digits that parse back to the same value
+    uint32_t n = 0;
+    int n_exp10 = exp10; // decimal exponent of the first digit of n
+    for (int n_significant = 1; n_significant <= FLOAT_MAX_SIGNIFICANT_DIGITS; ++n_significant) {
+        n = (uint32_t)(scale10(x, n_significant - 1 - exp10) + 0.5);
+        n_exp10 = exp10;
+        if (n >= pow10_uint_table[n_significant]) {
+            // Rounded up to the next power of ten
+            n /= 10;
+            n_exp10++;
+        }
+        if ((float)scale10(n, n_exp10 - n_significant + 1) == value)
+            break;
+    }
+    exp10 = n_exp10;
+
+    char digits[11];
+    size_t n_digits = format_uint(n, digits, sizeof(digits));
+    while (n_digits > 1 && digits[n_digits - 1] == '0')
+        n_digits--;
+
+    if (exp10 >= -5 && exp10 < 9) {
+        // Fixed point notation
+        if (exp10 < 0) {
+            str[pos++] = '0';
+            str[pos++] = '.';
+            for (int i = -1; i > exp10; --i)
+                str[pos++] = '0';
+            memcpy(str + pos, digits, n_digits);
+            pos += n_digits;
+        } else {
+            for (int i = 0; i <= exp10; ++i)
+                str[pos++] = (size_t)i < n_digits ? digits[i] : '0';
+            if (n_digits > (size_t)exp10 + 1) {
+                str[pos++] = '.';
+                memcpy(str + pos, digits + exp10 + 1, n_digits - exp10 - 1);
+                pos += n_digits - exp10 - 1;
+            }
+        }
+    } else {
+        // Scientific notation with at least two exponent digits
+        str[pos++] = digits[0];
+        if (n_digits > 1) {
+            str[pos++] = '.';
+            memcpy(str + pos, digits + 1, n_digits - 1);
+            pos += n_digits - 1;
+        }
+        str[pos++] = 'e';
+        str[pos++] = exp10 < 0 ? '-' : '+';
+        uint32_t exp_magnitude = exp10 < 0 ? -exp10 : exp10;
+        if (exp_magnitude < 10)
+            str[pos++] = '0';
+        pos += format_uint(exp_magnitude, str + pos, sizeof(str) - pos);
+    }
+
+    return copy_string(str, pos, buffer, length);
+}
+
+size_t parse_integer(const char * buffer, size_t length, bool* negative, uint32_t* magnitude) {
+    size_t pos = skip_whitespace(buffer, length);
+    *negative = false;
+    if (pos < length && (buffer[pos] == '-' || buffer[pos] == '+'))
+        *negative = buffer[pos++] == '-';
+
+    size_t digits_start = pos;
+    uint32_t result = 0;
+    for (; pos < length && is_digit(buffer[pos]); ++pos) {
+        uint32_t digit = buffer[pos] - '0';
+        if (result > (UINT32_MAX - digit) / 10)
+            return 0; // overflow
+        result = result * 10 + digit;
+    }
+    if (pos == digits_start)
+        return 0;
+    *magnitude = result;
+    return pos;
+}
+
+size_t parse_float(const char * buffer, size_t length, float* value) {
+    size_t pos = skip_whitespace(buffer, length);
+    bool negative = false;
+    if (pos < length && (buffer[pos] == '-' || buffer[pos] == '+'))
+        negative = buffer[pos++] == '-';
+
+    if (starts_with_word(buffer + pos, length - pos, "inf")) {
+        pos += 3;
+        if (starts_with_word(buffer + pos, length - pos, "inity"))
+            pos += 5;
+        *value = negative ? -INFINITY : INFINITY;
+        return pos;
+    }
+    if (starts_with_word(buffer + pos, length - pos, "nan")) {
+        *value = NAN;
+        return pos + 3;
+    }
+
+    // Collect up to 18 significant digits for the double estimate, the rest
+    // only affect the exponent. round_to_float() takes them into account.
+    size_t digits_start = pos;
+    uint64_t mantissa = 0;
+    int exp = 0;
+    bool have_digits = false;
+    for (; pos < length && is_digit(buffer[pos]); ++pos) {
+        have_digits = true;
+        if (mantissa < PARSE_MAX_MANTISSA)
+            mantissa = mantissa * 10 + (buffer[pos] - '0');
+        else if (exp < PARSE_MAX_EXPONENT)
+            exp++;
+    }
+    if (pos < length && buffer[pos] == '.') {
+        for (pos++; pos < length && is_digit(buffer[pos]); ++pos) {
+            have_digits = true;
+            if (mantissa < PARSE_MAX_MANTISSA && exp > -PARSE_MAX_EXPONENT) {
+                mantissa = mantissa * 10 + (buffer[pos] - '0');
+                exp--;
+            }
+        }
+    }
+    if (!have_digits)
+        return 0;
+    size_t digits_end = pos;
+    int exp_value = 0;
+
+    // The exponent is only consumed if it has at least one digit
+    if (pos < length && (buffer[pos] == 'e' || buffer[pos] == 'E')) {
+        size_t exp_pos = pos + 1;
+        bool exp_negative = false;
+        if (exp_pos < length && (buffer[exp_pos] == '-' || buffer[exp_pos] == '+'))
+            exp_negative = buffer[exp_pos++] == '-';
+        if (exp_pos < length && is_digit(buffer[exp_pos])) {
+            for (; exp_pos < length && is_digit(buffer[exp_pos]); ++exp_pos) {
+                if (exp_value < 10 * PARSE_MAX_EXPONENT)
+                    exp_value = exp_value * 10 + (buffer[exp_pos] - '0');
+            }
+            if (exp_negative)
+                exp_value = -exp_value;
+            exp += exp_value;
+            pos = exp_pos;
+        }
+    }
+
+    double result;
+    if (!mantissa || exp < -PARSE_MAX_EXPONENT)
+        result = 0.0;
+    else if (exp > PARSE_MAX_EXPONENT)
+        result = INFINITY;
+    else
+        result = scale10((double)mantissa, exp);
+    float magnitude = round_to_float(result, buffer + digits_start, digits_end - digits_start, exp_value);
+    *value = negative ? -magnitude : magnitude;
+    return pos;
+}
@@ -0,0 +1,78 @@
+#ifndef __FIBRE_ASCII_PROTOCOL_HPP
+#define __FIBRE_ASCII_PROTOCOL_HPP
+
+#include "fibre.hpp"
+
+#include <string>
+#include <vector>
+
+#define ASCII_MAX_LINE_LENGTH 256
+#define ASCII_RESPONSE_BUFFER_SIZE 1024
+#define ASCII_MAX_VALUE_LENGTH 32
+
+// @brief Maps dot-separated paths (e.g. "config.gain") to the properties of an
+// object tree. A lookup hashes the path once instead of walking the tree with
+// string compares like EndpointProvider::get_by_name() does.
+class EndpointPathTable : public EndpointPathSink {
+public:
+    // @brief Fills the table with the properties of the specified object tree,
+    // usually application_endpoints_ (see fibre_publish).
+    explicit EndpointPathTable(EndpointProvider& provider);
+
+    // @brief Returns the property with the specified path or nullptr if there
+    // is no such property.
+    Endpoint* find(const char * path, size_t length) const;
+
+    void add_path(uint32_t path_hash, const char * name, Endpoint* endpoint) final;
+    void enter_object(const char * name) final;
+    void leave_object() final;
+
+private:
+    struct Entry {
+        uint32_t path_hash;
+        std::string path; // full dot-separated path
+        Endpoint* endpoint; // nullptr for unused slots
+    };
+    std::vector<Entry> entries_; // open addressing, the size is a power of 2
+    std::string prefix_; // path of the object whose paths are being added
+};
+
+/* @brief Serves the ASCII line protocol on one stream.
+*
+* Each line holds one command:
+*   r <path>           Responds with the value of the property.
+*   w <path> <value>   Sets the property. There is no response on success.
+* Errors are reported with one line: "invalid property", "invalid value",
+* "write dropped" (the write handoff queue was full), "unknown command" or
+* "line too long". Lines end with "\n" or "\r\n", responses with "\r\n".
+*
+* Writes are applied like binary writes: queued in write handoff mode,
+* otherwise inside the transaction sequence lock (see fibre_read_begin()).
+*
+* Clients may send any number of commands without waiting for responses.
+* Responses to all commands that complete within one process_bytes() call
+* are sent in one piece.
+*/
+class AsciiProtocol : public StreamSink {
+public:
+    AsciiProtocol(const EndpointPathTable& table, StreamSink& output) :
+        table_(table), output_(output) {}
+
+    int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes);
+    size_t get_free_space() { return SIZE_MAX; }
+
+private:
+    void process_line(char * line, size_t length);
+    void respond(const char * str, size_t length);
+    void flush();
+
+    const EndpointPathTable& table_;
+    StreamSink& output_;
+    char line_[ASCII_MAX_LINE_LENGTH];
+    size_t line_length_ = 0;
+    bool line_too_long_ = false;
+    char response_[ASCII_RESPONSE_BUFFER_SIZE];
+    size_t response_length_ = 0;
+};
+
+#endif // __FIBRE_ASCII_PROTOCOL_HPP
@@ -0,0 +1,59 @@
+#ifndef __FIBRE_CLIENT_HPP
+#define __FIBRE_CLIENT_HPP
+
+#include "fibre.hpp"
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+// @brief Issues requests to a remote Fibre node and waits for the responses.
+// Requests are sent on the packet sink that this object was constructed with.
+// Incoming packets from the remote node must be passed to process_packet,
+// usually from a dedicated receive thread. request() may be called from
+// multiple threads concurrently.
+class Client : public PacketSink {
+public:
+    Client(PacketSink& output, uint32_t resend_timeout_ms = 1000, size_t send_attempts = 3) :
+        output_(output),
+        resend_timeout_ms_(resend_timeout_ms),
+        send_attempts_(send_attempts)
+    { }
+
+    int process_packet(const uint8_t* buffer, size_t length);
+
+    // @brief Sends a request and blocks until the response arrives.
+    // @param output: Receives the response. Can be nullptr if no response is expected.
+    // @param output_length: In: the maximum response length to request.
+    //        Out: the actual response length.
+    // @return 0 on success, -1 if no response arrived within the allowed number of attempts.
+    int request(uint16_t endpoint_id, const uint8_t* input, size_t input_length,
+            uint8_t* output, size_t* output_length);
+
+    // @brief Reads a buffer that the remote node serves in chunks addressed by
+    // a 32-bit offset, such as the JSON descriptor on endpoint 0.
+    int read_buffer(uint16_t endpoint_id, std::vector<uint8_t>* buffer);
+
+    // @brief Sets the descriptor CRC that is used as trailer for all endpoints except 0.
+    void set_json_crc(uint16_t json_crc) { remote_json_crc_ = json_crc; }
+
+private:
+    struct PendingRequest {
+        uint16_t seq_no;
+        uint8_t* output;
+        size_t output_length;
+        bool done;
+        PendingRequest* next;
+    };
+
+    PacketSink& output_;
+    uint32_t resend_timeout_ms_;
+    size_t send_attempts_;
+    uint16_t remote_json_crc_ = 0;
+    uint16_t seq_no_ = 0;
+    std::mutex mutex_;
+    std::condition_variable response_received_;
+    PendingRequest* pending_ = nullptr; // linked list of requests that wait for a response
+};
+
+#endif // __FIBRE_CLIENT_HPP
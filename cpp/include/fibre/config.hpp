@@ -0,0 +1,66 @@
+#ifndef __FIBRE_CONFIG_HPP
+#define __FIBRE_CONFIG_HPP
+
+#include "fibre.hpp"
+
+#include <vector>
+
+// A configuration snapshot holds the values of all writable properties,
+// keyed by the hash_path() of their paths rather than by endpoint ID, so that
+// it stays valid when properties are added, removed or reordered. Layout
+// (little endian):
+//
+//   u32 CONFIG_MAGIC, u32 CONFIG_VERSION, u32 n_entries,
+//   u32 CRC32 (see CONFIG_CRC32_POLYNOMIAL) of the entries
+//   n_entries times: u32 path_hash, u8 length, value
+//
+// Entries are sorted by path hash. Values are encoded like the protocol
+// encodes them (see write_le).
+#define CONFIG_MAGIC        0x46434246u // "FBCF"
+#define CONFIG_VERSION      1
+#define CONFIG_HEADER_SIZE  16
+
+constexpr uint32_t CONFIG_CRC32_POLYNOMIAL = 0x04c11db7;
+constexpr uint32_t CONFIG_CRC32_INIT = 0xffffffff;
+
+// @brief The writable properties of an object tree, sorted by path hash.
+// Writable properties are those that support prepare_write(), i.e. rw
+// properties and accessor properties with a setter, but not function
+// arguments. Properties whose path hash collides with another path are
+// left out, since a snapshot couldn't tell them apart.
+class ConfigTable : public EndpointPathSink {
+public:
+    // @brief Fills the table with the writable properties of the specified
+    // object tree, usually application_endpoints_ (see fibre_publish).
+    explicit ConfigTable(EndpointProvider& provider);
+
+    // @brief Returns the number of bytes save() needs.
+    size_t get_snapshot_size() const;
+
+    // @brief Writes the current values of all properties as snapshot.
+    // @return The length of the snapshot or 0 if the buffer is too small.
+    size_t save(uint8_t* buffer, size_t length) const;
+
+    // @brief Writes the values of a snapshot to the properties. Entries of
+    // paths that don't exist (anymore) or whose length changed are skipped.
+    // Writes are applied directly, regardless of write handoff mode, so
+    // restore() should be called before the control loop and the servers
+    // start.
+    // @return The number of properties that were written or -1 if the
+    //         snapshot is invalid, in which case none were written.
+    int restore(const uint8_t* buffer, size_t length) const;
+
+    size_t get_property_count() const { return entries_.size(); }
+
+    void add_path(uint32_t path_hash, const char * name, Endpoint* endpoint) final;
+
+private:
+    struct Entry {
+        uint32_t path_hash;
+        uint8_t length;
+        Endpoint* endpoint;
+    };
+    std::vector<Entry> entries_;
+};
+
+#endif // __FIBRE_CONFIG_HPP
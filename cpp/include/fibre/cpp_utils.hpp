@@ -91,6 +91,23 @@ namespace std {
     // source: http://en.cppreference.com/w/cpp/utility/tuple/tuple_element
     template <std::size_t I, class T>
     using tuple_element_t = typename tuple_element<I, T>::type;
+
+    // source: http://en.cppreference.com/w/cpp/utility/integer_sequence
+    template<std::size_t ... Is>
+    struct index_sequence {
+        static constexpr std::size_t size() { return sizeof...(Is); }
+    };
+
+    template<std::size_t N, std::size_t ... Is>
+    struct make_index_sequence_impl : make_index_sequence_impl<N - 1, N - 1, Is...> {};
+    template<std::size_t ... Is>
+    struct make_index_sequence_impl<0, Is...> { using type = index_sequence<Is...>; };
+
+    template<std::size_t N>
+    using make_index_sequence = typename make_index_sequence_impl<N>::type;
+
+    template<class ... T>
+    using index_sequence_for = make_index_sequence<sizeof...(T)>;
 }
 #endif
 
@@ -117,6 +134,7 @@ public:
             && TypeChecker<Ts...>::template all_are<U>();
     }
     constexpr static const size_t count = TypeChecker<Ts...>::count + 1;
+    constexpr static const size_t total_size = sizeof(T) + TypeChecker<Ts...>::total_size;
 };
 
 template<>
@@ -131,6 +149,7 @@ public:
         return std::true_type::value;
     }
     constexpr static const size_t count = 0;
+    constexpr static const size_t total_size = 0;
 };
 
 template<typename ... Ts>
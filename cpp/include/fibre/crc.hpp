@@ -4,10 +4,10 @@
 #include <stdint.h>
 #include <limits.h>
 
-// Calculates an arbitrary CRC for one byte.
+// Calculates an arbitrary CRC for one byte, one bit at a time.
 // Adapted from https://barrgroup.com/Embedded-Systems/How-To/CRC-Calculation-C-Code
 template<typename T, unsigned POLYNOMIAL>
-static T calc_crc(T remainder, uint8_t value) {
+static T calc_crc_bitwise(T remainder, uint8_t value) {
     constexpr T BIT_WIDTH = (CHAR_BIT * sizeof(T));
     constexpr T TOPBIT = ((T)1 << (BIT_WIDTH - 1));
     
@@ -26,6 +26,54 @@ static T calc_crc(T remainder, uint8_t value) {
     return remainder;
 }
 
+// @brief Performs the last n_bits steps of calc_crc_bitwise(). Written as a
+// recursion because C++11 constexpr functions can't contain loops.
+template<typename T, unsigned POLYNOMIAL>
+constexpr T calc_crc_table_entry(T remainder, unsigned n_bits) {
+    return !n_bits ? remainder : calc_crc_table_entry<T, POLYNOMIAL>(
+            (remainder & ((T)1 << (CHAR_BIT * sizeof(T) - 1)))
+                ? (T)((T)(remainder << 1) ^ POLYNOMIAL)
+                : (T)(remainder << 1),
+            n_bits - 1);
+}
+
+#define FIBRE_CRC_ENTRY(i) calc_crc_table_entry<T, POLYNOMIAL>((T)((T)(i) << (CHAR_BIT * sizeof(T) - 8)), 8)
+#define FIBRE_CRC_ENTRIES_4(i) FIBRE_CRC_ENTRY(i), FIBRE_CRC_ENTRY(i + 1), FIBRE_CRC_ENTRY(i + 2), FIBRE_CRC_ENTRY(i + 3)
+#define FIBRE_CRC_ENTRIES_16(i) FIBRE_CRC_ENTRIES_4(i), FIBRE_CRC_ENTRIES_4(i + 4), FIBRE_CRC_ENTRIES_4(i + 8), FIBRE_CRC_ENTRIES_4(i + 12)
+#define FIBRE_CRC_ENTRIES_64(i) FIBRE_CRC_ENTRIES_16(i), FIBRE_CRC_ENTRIES_16(i + 16), FIBRE_CRC_ENTRIES_16(i + 32), FIBRE_CRC_ENTRIES_16(i + 48)
+
+// @brief Lookup table to calculate a CRC one byte at a time.
+// The table is generated at compile time and lives in flash (256 entries,
+// i.e. 256 bytes for CRC8, 512 for CRC16 and 1 KB for CRC32). Define
+// FIBRE_CRC_BITWISE on targets where that flash is worth more than the
+// speedup.
+template<typename T, unsigned POLYNOMIAL>
+struct CRCTable {
+    static constexpr T entries[256] = {
+        FIBRE_CRC_ENTRIES_64(0), FIBRE_CRC_ENTRIES_64(64), FIBRE_CRC_ENTRIES_64(128), FIBRE_CRC_ENTRIES_64(192)
+    };
+};
+
+template<typename T, unsigned POLYNOMIAL>
+constexpr T CRCTable<T, POLYNOMIAL>::entries[256];
+
+#undef FIBRE_CRC_ENTRY
+#undef FIBRE_CRC_ENTRIES_4
+#undef FIBRE_CRC_ENTRIES_16
+#undef FIBRE_CRC_ENTRIES_64
+
+// Calculates an arbitrary CRC for one byte.
+template<typename T, unsigned POLYNOMIAL>
+static T calc_crc(T remainder, uint8_t value) {
+#ifdef FIBRE_CRC_BITWISE
+    return calc_crc_bitwise<T, POLYNOMIAL>(remainder, value);
+#else
+    constexpr T BIT_WIDTH = (CHAR_BIT * sizeof(T));
+    uint8_t index = (uint8_t)(remainder >> (BIT_WIDTH - 8)) ^ value;
+    return (T)(remainder << 8) ^ CRCTable<T, POLYNOMIAL>::entries[index];
+#endif
+}
+
 template<typename T, unsigned POLYNOMIAL>
 static T calc_crc(T remainder, const uint8_t* buffer, size_t length) {
     while (length--)
@@ -43,6 +91,11 @@ static uint16_t calc_crc16(uint16_t remainder, uint8_t value) {
     return calc_crc<uint16_t, POLYNOMIAL>(remainder, value);
 }
 
+template<unsigned POLYNOMIAL>
+static uint32_t calc_crc32(uint32_t remainder, uint8_t value) {
+    return calc_crc<uint32_t, POLYNOMIAL>(remainder, value);
+}
+
 template<unsigned POLYNOMIAL>
 static uint8_t calc_crc8(uint8_t remainder, const uint8_t* buffer, size_t length) {
     return calc_crc<uint8_t, POLYNOMIAL>(remainder, buffer, length);
@@ -53,4 +106,9 @@ static uint16_t calc_crc16(uint16_t remainder, const uint8_t* buffer, size_t len
     return calc_crc<uint16_t, POLYNOMIAL>(remainder, buffer, length);
 }
 
+template<unsigned POLYNOMIAL>
+static uint32_t calc_crc32(uint32_t remainder, const uint8_t* buffer, size_t length) {
+    return calc_crc<uint32_t, POLYNOMIAL>(remainder, buffer, length);
+}
+
 #endif /* __CRC_HPP */
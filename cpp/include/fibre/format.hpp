@@ -0,0 +1,44 @@
+#ifndef __FIBRE_FORMAT_HPP
+#define __FIBRE_FORMAT_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Number formatting and parsing without printf/scanf. These are small enough
+// for microcontrollers and only use 32 bit integer arithmetic, except for
+// floats, which are scaled in double precision. Parsing values that are close
+// to halfway between two floats takes about 200 bytes of stack.
+
+// @brief Writes the decimal representation of value to buffer, followed by a
+// null terminator.
+// @return The number of characters written, excluding the null terminator,
+//         or 0 if the buffer is too small.
+size_t format_uint(uint32_t value, char * buffer, size_t length);
+size_t format_int(int32_t value, char * buffer, size_t length);
+
+// @brief Writes the shortest decimal representation of value that parses back
+// to exactly the same float, e.g. "0.1" instead of "0.100000001".
+// Values between 1e-5 and 1e9 are written in fixed point notation, others in
+// scientific notation ("1.5e-07"). Non-finite values are written as "inf",
+// "-inf" and "nan".
+// @return The number of characters written, excluding the null terminator,
+//         or 0 if the buffer is too small.
+size_t format_float(float value, char * buffer, size_t length);
+
+// @brief Parses an optionally signed decimal integer. Leading whitespace is
+// skipped and parsing stops at the first character that is not a digit or at
+// the end of the buffer, whichever comes first.
+// @return The number of characters consumed or 0 if the buffer doesn't start
+//         with an integer or the magnitude doesn't fit into 32 bits.
+size_t parse_integer(const char * buffer, size_t length, bool* negative, uint32_t* magnitude);
+
+// @brief Parses a decimal floating point number with optional fraction and
+// exponent, or "inf"/"nan". Leading whitespace is skipped and parsing stops
+// at the first character that can't continue the number or at the end of the
+// buffer, whichever comes first. The result is correctly rounded like
+// strtof() does, also for inputs with more digits than a double holds.
+// @return The number of characters consumed or 0 if the buffer doesn't start
+//         with a number.
+size_t parse_float(const char * buffer, size_t length, float* value);
+
+#endif // __FIBRE_FORMAT_HPP
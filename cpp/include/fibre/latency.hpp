@@ -0,0 +1,108 @@
+#ifndef __FIBRE_LATENCY_HPP
+#define __FIBRE_LATENCY_HPP
+
+#include "fibre.hpp"
+
+#include <atomic>
+
+// Values below 2^LATENCY_HISTOGRAM_SUB_BITS ns are exact, above that each
+// power of two is split into 2^(LATENCY_HISTOGRAM_SUB_BITS-1) buckets, so
+// quantiles are at most 12.5% too high.
+#define LATENCY_HISTOGRAM_SUB_BITS 4
+#define LATENCY_HISTOGRAM_BUCKETS ((64 - LATENCY_HISTOGRAM_SUB_BITS + 1) << (LATENCY_HISTOGRAM_SUB_BITS - 1))
+
+// @brief The stages of a request, each measured between two of the
+// RequestTimestamps.
+enum LatencyStage {
+    LATENCY_STAGE_KERNEL = 0, // kernel_rx_ns to user_rx_ns: socket receive queue
+    LATENCY_STAGE_SEGMENTER, // user_rx_ns to segmented_ns: framing until the packet is complete
+    LATENCY_STAGE_QUEUE, // segmented_ns to handler_ns: flow control and priority lane queues
+    LATENCY_STAGE_HANDLER, // handler_ns to handled_ns: the endpoint handler
+    LATENCY_STAGE_SEND, // handled_ns to sent_ns: framing and sending the response
+    LATENCY_STAGE_TOTAL, // the earliest known timestamp to the last one
+    N_LATENCY_STAGES
+};
+
+// @brief Counts durations in logarithmic buckets. record() may be called from
+// several threads concurrently.
+class LatencyHistogram {
+public:
+    void record(uint64_t duration_ns);
+    void reset();
+
+    // @brief Returns the duration below which the fraction q of all recorded
+    // durations lie, in microseconds, or 0 if nothing was recorded.
+    float get_quantile_us(float q);
+
+    float get_p50_us() { return get_quantile_us(0.5f); }
+    float get_p99_us() { return get_quantile_us(0.99f); }
+    float get_p999_us() { return get_quantile_us(0.999f); }
+    uint32_t get_count() { return count_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint32_t> buckets_[LATENCY_HISTOGRAM_BUCKETS] = {};
+    std::atomic<uint32_t> count_{0};
+};
+
+typedef void (*LatencyTraceCallback)(uint16_t endpoint_id, uint16_t seq_no, const RequestTimestamps& timestamps);
+
+// @brief The latency statistics of all channels, usually published with
+// make_fibre_latency_object().
+class LatencyMetrics {
+public:
+    bool get_enabled() { return fibre_get_latency_breakdown(); }
+    void set_enabled(bool enable) { fibre_set_latency_breakdown(enable); }
+
+    // @brief Every trace_interval-th request is passed to the trace callback
+    // (see set_trace_callback()). 0 disables tracing.
+    uint32_t get_trace_interval() { return trace_interval_.load(std::memory_order_relaxed); }
+    void set_trace_interval(uint32_t interval) { trace_interval_.store(interval, std::memory_order_relaxed); }
+    void set_trace_callback(LatencyTraceCallback callback) { trace_callback_.store(callback); }
+
+    void record(uint16_t endpoint_id, uint16_t seq_no, const RequestTimestamps& timestamps);
+    void reset();
+
+    LatencyHistogram stages_[N_LATENCY_STAGES];
+
+private:
+    std::atomic<uint32_t> trace_interval_{0};
+    std::atomic<LatencyTraceCallback> trace_callback_{nullptr};
+    std::atomic<uint32_t> n_recorded_{0};
+};
+
+// defined in latency.cpp
+extern LatencyMetrics latency_metrics_;
+
+// The member lists are macros because C++11 needs them twice, once in the
+// trailing return type and once in the body
+#define FIBRE_LATENCY_STAGE_MEMBERS(histogram) \
+    make_fibre_ro_accessor_property("p50_us", histogram, &LatencyHistogram::get_p50_us), \
+    make_fibre_ro_accessor_property("p99_us", histogram, &LatencyHistogram::get_p99_us), \
+    make_fibre_ro_accessor_property("p999_us", histogram, &LatencyHistogram::get_p999_us), \
+    make_fibre_ro_accessor_property("count", histogram, &LatencyHistogram::get_count)
+
+inline auto make_fibre_latency_stage_object(const char * name, LatencyHistogram& histogram)
+        -> decltype(make_fibre_object(name, FIBRE_LATENCY_STAGE_MEMBERS(histogram))) {
+    return make_fibre_object(name, FIBRE_LATENCY_STAGE_MEMBERS(histogram));
+}
+
+#define FIBRE_LATENCY_MEMBERS(metrics) \
+    make_fibre_accessor_property("enabled", metrics, &LatencyMetrics::get_enabled, &LatencyMetrics::set_enabled), \
+    make_fibre_accessor_property("trace_interval", metrics, &LatencyMetrics::get_trace_interval, &LatencyMetrics::set_trace_interval), \
+    make_fibre_function("reset", metrics, &LatencyMetrics::reset), \
+    make_fibre_latency_stage_object("kernel", metrics.stages_[LATENCY_STAGE_KERNEL]), \
+    make_fibre_latency_stage_object("segmenter", metrics.stages_[LATENCY_STAGE_SEGMENTER]), \
+    make_fibre_latency_stage_object("queue", metrics.stages_[LATENCY_STAGE_QUEUE]), \
+    make_fibre_latency_stage_object("handler", metrics.stages_[LATENCY_STAGE_HANDLER]), \
+    make_fibre_latency_stage_object("send", metrics.stages_[LATENCY_STAGE_SEND]), \
+    make_fibre_latency_stage_object("total", metrics.stages_[LATENCY_STAGE_TOTAL])
+
+// @brief Returns an object that exposes latency_metrics_ over Fibre: the
+// enabled flag, the trace interval, a reset function and p50/p99/p999 of
+// each stage, e.g. "latency.handler.p99_us".
+inline auto make_fibre_latency_object(const char * name)
+        -> decltype(make_fibre_object(name, FIBRE_LATENCY_MEMBERS(latency_metrics_))) {
+    return make_fibre_object(name, FIBRE_LATENCY_MEMBERS(latency_metrics_));
+}
+
+#endif // __FIBRE_LATENCY_HPP
@@ -0,0 +1,25 @@
+#include "config.hpp"
+
+// @brief Saves the values of all writable properties of the published object
+// tree to a configuration snapshot file (see config.hpp). The file is written
+// to "<path>.part" and renamed to path once it is complete, so that a crash
+// while saving leaves the previous file intact.
+// @return 0 on success, -1 on error
+int fibre_save_config_file(const char * path);
+
+// @brief Restores the writable properties of the published object tree from a
+// configuration snapshot file. The file is memory-mapped rather than read.
+// @return The number of properties that were written or -1 if the file
+//         doesn't exist or is invalid, in which case none were written.
+int fibre_load_config_file(const char * path);
+
+// @brief Publishes the application objects like fibre_publish() and restores
+// their writable properties from the specified configuration snapshot file
+// in one pass.
+// @return The result of fibre_load_config_file(). A missing file (e.g. on the
+//         first start) leaves the properties at their defaults.
+template<typename T>
+int fibre_publish(T& application_objects, const char * config_path) {
+    fibre_publish(application_objects);
+    return fibre_load_config_file(config_path);
+}
@@ -0,0 +1,14 @@
+#include "ascii_protocol.hpp"
+
+// @brief Serves the ASCII line protocol (see AsciiProtocol) on a file
+// descriptor, such as a serial port or a connected socket, until the peer
+// closes it or an error occurs. The descriptor is not closed.
+// @return 0 if the peer closed the connection, -1 on error.
+int serve_ascii_on_fd(int fd);
+
+// @brief Opens the serial port in raw mode with 8N1 framing and serves the
+// ASCII line protocol on it.
+// @param baudrate: One of the standard baudrates, e.g. 115200.
+// @return -1 if the port could not be opened or configured, otherwise see
+//         serve_ascii_on_fd().
+int serve_ascii_on_serial(const char* device, unsigned int baudrate);
@@ -0,0 +1,127 @@
+#ifndef __FIBRE_POSIX_SHM_HPP
+#define __FIBRE_POSIX_SHM_HPP
+
+#include "protocol.hpp"
+
+#include <atomic>
+#include <vector>
+
+// A snapshot segment mirrors the values of selected endpoints into POSIX
+// shared memory (shm_open), so that local processes read them without going
+// through a socket and without loading the Fibre server. Layout:
+//
+//   SnapshotHeader
+//   SnapshotEntry[n_entries]
+//   paths of the entries, each null-terminated
+//   JSON descriptor (json_offset, json_length), the same as endpoint 0 returns
+//   values (values_offset), each 8-byte aligned at the offset of its entry
+//
+// All fields are little endian. The values and timestamp_ns are protected by
+// a sequence lock: the exporter makes seq odd while it writes them and even
+// once it is done, so readers copy them and retry if seq was odd or changed
+// in the meantime. Readers never write to the segment and never block the
+// exporter.
+#define SNAPSHOT_MAGIC      0x50534246u // "FBSP"
+#define SNAPSHOT_VERSION    2
+
+struct SnapshotHeader {
+    std::atomic<uint32_t> magic; // SNAPSHOT_MAGIC once the segment is initialized
+    uint16_t version; // SNAPSHOT_VERSION
+    uint16_t json_crc; // fibre_get_json_crc() of the descriptor
+    std::atomic<uint32_t> seq;
+    uint32_t n_entries;
+    uint32_t json_offset;
+    uint32_t json_length;
+    uint32_t values_offset;
+    uint32_t values_length;
+    uint64_t timestamp_ns; // fibre_get_time_ns() at which the values were sampled
+};
+
+struct SnapshotEntry {
+    uint32_t path_hash; // hash_path() of the dot-separated path, 0 if unknown
+    uint16_t endpoint_id;
+    uint16_t length; // value length in bytes
+    uint32_t offset; // value offset relative to values_offset
+    uint32_t path_offset; // offset of the path in the segment, 0 if unknown
+};
+
+static_assert(sizeof(SnapshotHeader) == 40 && sizeof(SnapshotEntry) == 16, "unexpected snapshot layout");
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "the sequence lock must work across processes");
+
+// @brief Creates a snapshot segment and writes the values of the specified
+// endpoints into it on each update(). Endpoints are sampled like
+// make_telemetry_frame() does, functions are left out.
+class SnapshotExporter {
+public:
+    ~SnapshotExporter() { close(); }
+
+    // @brief Creates the segment "name" (e.g. "/fibre") and writes the layout
+    // and the first values. The layout is fixed until the segment is closed.
+    // An existing segment with this name is unlinked rather than overwritten,
+    // so readers that mapped it keep its last values.
+    // @return 0 on success, -1 on error
+    int open(const char* name, const uint16_t* endpoint_ids, size_t n_endpoint_ids);
+
+    // @brief Samples all endpoints into the segment. Must only be called
+    // from one thread at a time.
+    void update();
+
+    // @brief Unmaps and unlinks the segment. Readers that already mapped it
+    // keep the last values.
+    void close();
+
+private:
+    std::vector<SnapshotEntry> entries_;
+    std::vector<Endpoint*> endpoints_;
+    SnapshotHeader* header_ = nullptr;
+    uint8_t* values_ = nullptr;
+    size_t size_ = 0;
+    char name_[64] = { 0 };
+};
+
+// @brief Creates the snapshot segment "name" and updates it every interval_ms
+// milliseconds, like publish_telemetry_on_udp().
+// @param n_snapshots: Number of updates after which the segment is unlinked
+//        and the function returns, or 0 to update forever.
+// @return 0 on success, -1 if the segment could not be created
+int publish_snapshot_on_shm(const char* name, const uint16_t* endpoint_ids, size_t n_endpoint_ids,
+        unsigned int interval_ms, size_t n_snapshots = 0);
+
+// @brief Reads a snapshot segment of another process. Lock-free and without
+// system calls once the segment is open.
+class SnapshotReader {
+public:
+    ~SnapshotReader() { close(); }
+
+    // @return 0 on success, -1 if the segment doesn't exist, isn't
+    //         initialized yet or its layout doesn't fit into the segment
+    int open(const char* name);
+    void close();
+
+    // @brief Returns the index of the entry with the specified path (e.g.
+    // "config.gain"), or -1 if the path isn't exported.
+    int find(const char* path);
+
+    // @brief Copies the value of the entry with the specified index.
+    // @param timestamp_ns: If not null, set to the time at which the value
+    //        was sampled (fibre_get_time_ns() of the exporter).
+    // @return false if the index is invalid or length doesn't match the value
+    bool read(int index, void* buffer, size_t length, uint64_t* timestamp_ns = nullptr);
+
+    // @brief Copies all values at once, such that they come from the same update.
+    // @return false if length doesn't match the length of the values
+    bool read_all(uint8_t* buffer, size_t length, uint64_t* timestamp_ns = nullptr);
+
+    const SnapshotHeader* get_header() { return header_; }
+    const SnapshotEntry* get_entries() { return reinterpret_cast<const SnapshotEntry*>(header_ + 1); }
+    const char* get_json() { return reinterpret_cast<const char*>(header_) + header_->json_offset; }
+
+private:
+    bool check_layout();
+    void copy(size_t offset, void* buffer, size_t length, uint64_t* timestamp_ns);
+
+    SnapshotHeader* header_ = nullptr;
+    size_t size_ = 0;
+};
+
+#endif // __FIBRE_POSIX_SHM_HPP
@@ -2,3 +2,27 @@
 #include "protocol.hpp"
 
 int serve_on_tcp(unsigned int port);
+
+// @brief Serves Fibre on TCP with one shard per core instead of one thread
+// per client. Each shard is a thread pinned to its own core with its own
+// listening socket (SO_REUSEPORT), epoll loop and connections, so shards
+// share no state on the hot path. In call handoff mode (see
+// fibre_set_call_handoff()), function calls are passed to the application
+// thread through a CallQueue per shard and answered once they returned.
+// Shards never block on a client: responses that a client doesn't read right
+// away are buffered, and clients that fall more than 64 KiB behind are
+// disconnected.
+// @param n_shards: Number of shards, or 0 for one per online CPU.
+// @return -1 once all shards failed, e.g. because the port is taken by a
+//         socket without SO_REUSEPORT. Doesn't return otherwise.
+int serve_on_tcp_sharded(unsigned int port, size_t n_shards);
+
+// @brief Serves the ASCII line protocol (see AsciiProtocol) to TCP clients.
+int serve_ascii_on_tcp(unsigned int port);
+
+// @brief Streams replication frames (see replication.hpp) of the published
+// object tree to replicas that connect to the specified port, for instance
+// fibre_proxy -r. The properties are sampled every interval_ms milliseconds
+// (at least 1). Frames that a replica doesn't take right away wait in a
+// backlog, and replicas that fall more than 256 KiB behind are disconnected.
+int serve_replication_on_tcp(unsigned int port, unsigned int interval_ms);
@@ -0,0 +1,16 @@
+#include "protocol.hpp"
+
+#include <sys/socket.h>
+
+// @brief Receives from a socket like recvfrom() and reports when the data was
+// received (see BidirectionalPacketBasedChannel::set_rx_timestamps()).
+// While the latency breakdown is enabled, kernel receive timestamps
+// (SO_TIMESTAMPING) are requested on the socket on first use. For TCP the
+// kernel reports the time of the last segment that was read.
+// @param timestamping_enabled: Per-socket state, must initially be false.
+// @param kernel_rx_ns: Set to 0 if the kernel provided no timestamp.
+// @param user_rx_ns: Set to the time at which recvmsg() returned.
+//        Both timestamps are 0 while the latency breakdown is disabled.
+ssize_t recv_with_timestamps(int fd, uint8_t* buffer, size_t length,
+        struct sockaddr* address, socklen_t* address_length, bool* timestamping_enabled,
+        uint64_t* kernel_rx_ns, uint64_t* user_rx_ns);
@@ -2,3 +2,12 @@
 #include "protocol.hpp"
 
 int serve_on_udp(unsigned int port);
+
+// @brief Sends telemetry frames (see make_telemetry_frame) to an IPv4 multicast group.
+// The endpoints are sampled every interval_ms milliseconds. Frame sequence
+// numbers increase by one so that receivers can detect lost frames.
+// @param interface_address: Local IPv4 address of the interface to send on,
+//        or nullptr to let the system choose.
+// @param n_frames: Number of frames after which the function returns, or 0 to publish forever.
+int publish_telemetry_on_udp(const char* group_address, unsigned int port, const char* interface_address,
+        const uint16_t* endpoint_ids, size_t n_endpoint_ids, unsigned int interval_ms, size_t n_frames = 0);
@@ -0,0 +1,20 @@
+#include "upload.hpp"
+
+#include <string>
+
+// @brief Stores an uploaded image in a file. The data is written to
+// "<path>.part", which is renamed to path once the upload is committed, so
+// that readers of path never see a partial or corrupted image.
+class FileUploadSink : public UploadSink {
+public:
+    FileUploadSink(const char * path) : path_(path), part_path_(path_ + ".part") {}
+
+    bool begin(uint32_t size) final;
+    bool write(uint32_t offset, const uint8_t* buffer, size_t length) final;
+    bool finish(bool commit) final;
+
+private:
+    std::string path_;
+    std::string part_path_;
+    int fd_ = -1;
+};
@@ -12,13 +12,17 @@ see protocol.md for the protocol specification
 // TODO: resolve assert
 #define assert(expr)
 
+#include <array>
+#include <atomic>
 #include <functional>
 #include <limits>
 #include <vector>
 //#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include "stream.hpp"
 #include "crc.hpp"
+#include "format.hpp"
 #include "cpp_utils.hpp"
 
 
@@ -68,6 +72,121 @@ constexpr uint16_t PROTOCOL_VERSION = 1;
 // Maximum time we allocate for processing and responding to a request
 constexpr uint32_t PROTOCOL_SERVER_TIMEOUT_MS = 10;
 
+// Reserved endpoint ID that addresses the channel itself rather than an
+// application endpoint. Like endpoint 0 it uses the protocol version as
+// trailer so that it can be used before the JSON descriptor is known.
+// The first payload byte selects the operation (see SESSION_OP_*).
+constexpr uint16_t SESSION_CONTROL_ENDPOINT_ID = 0x7fff;
+
+// Requests a change of the stream framing. Payload: 1 byte StreamFraming.
+// Response: 1 byte StreamFraming that is in effect after the response.
+// The response itself is still sent using the old framing.
+constexpr uint8_t SESSION_OP_SET_FRAMING = 0x01;
+
+// Requests a change of the request header format.
+// Payload: 1 byte RequestHeaderMode, 2 bytes JSON descriptor CRC.
+// Response: 1 byte RequestHeaderMode that is in effect for subsequent requests.
+// The compact mode is only granted if the CRC matches the current descriptor,
+// in which case the session also becomes verified (see below).
+constexpr uint8_t SESSION_OP_SET_HEADER_MODE = 0x02;
+
+// Proves the JSON descriptor CRC once for the lifetime of the session (the
+// TCP connection or the UDP peer address). Payload: 2 bytes CRC. Response:
+// 1 byte, 1 if the session is now verified, 0 otherwise. Subsequent requests
+// of a verified session carry no trailer. Once the descriptor is republished
+// with a different CRC, all requests of the session are rejected until the
+// client verifies again.
+constexpr uint8_t SESSION_OP_VERIFY_DESCRIPTOR = 0x03;
+
+// Enables credit based flow control in both directions.
+// Payload: 2 bytes, the number of response bytes the client can buffer.
+// Response: 1 byte, the number of requests the client may have outstanding.
+// All subsequent responses carry an additional byte after the seq_no: the
+// number of requests the server completed so far (modulo 256), including
+// requests without response but not counting session control requests.
+// The client may send a request if fewer than the granted number of requests
+// are outstanding. Session control requests are not subject to flow control.
+// In turn the server only sends a response if the client can take it, i.e.
+// if the response bytes sent so far minus the consumed bytes last reported
+// by the client (SESSION_OP_GRANT_CREDIT) leave enough room. Otherwise
+// requests are buffered until the client grants more credit.
+// Both counters are cumulative so that a lost response or grant does not leak credit.
+constexpr uint8_t SESSION_OP_SET_FLOW_CONTROL = 0x04;
+
+// Reports how many response bytes the client consumed so far.
+// Payload: 4 bytes cumulative byte count (modulo 2^32). Counted are the
+// response packets as passed to the client's packet sink (seq_no included,
+// framing excluded). Usually sent without requesting a response.
+constexpr uint8_t SESSION_OP_GRANT_CREDIT = 0x05;
+
+// Enables priority lanes. Payload: 1 byte, 1 to enable, 0 to disable.
+// Response: 1 byte, 1 if priority lanes are enabled after the request. Only
+// transports that serve the bulk lane grant them, others always respond 0.
+// Once enabled, requests with BULK_SEQ_NO_FLAG set in their seq_no go to the
+// bulk lane: they are queued and only served while no other input is waiting,
+// so that control requests overtake bulk transfers such as descriptor
+// downloads. Responses echo the seq_no including the flag.
+constexpr uint8_t SESSION_OP_SET_PRIORITY_LANES = 0x06;
+
+// Writes several properties at once. The application sees either none or all
+// of the writes (see fibre_apply_transaction()).
+// Payload: 2 bytes JSON descriptor CRC, followed by up to TRANSACTION_MAX_WRITES
+// writes of 2 bytes endpoint ID, 1 byte value length and the value.
+// Response: 1 byte, the number of writes that were accepted. This is either
+// all of them or none, e.g. if the CRC doesn't match or one of the endpoints
+// is not a writable property.
+constexpr uint8_t SESSION_OP_TRANSACTION = 0x07;
+
+constexpr size_t TRANSACTION_MAX_WRITES = 16;
+
+// Queries the CRC of the JSON descriptor, so that clients which cached the
+// descriptor of this node can skip downloading it. No payload.
+// Response: 2 bytes JSON descriptor CRC.
+constexpr uint8_t SESSION_OP_GET_DESCRIPTOR_CRC = 0x08;
+
+// Reads the server clock (fibre_get_time_ns()) for clock synchronization.
+// No payload. Response: u64 time at which the request was received, u64 time
+// at which the response was composed, both in ns. The receive time is the
+// transport's receive timestamp if there is one (see set_rx_timestamps()),
+// otherwise the time at which the request was handled. With its own send
+// time t1 and receive time t4, the client estimates the offset of the server
+// clock as ((t2 - t1) + (t3 - t4)) / 2 and the round trip delay as
+// (t4 - t1) - (t3 - t2), like NTP.
+constexpr uint8_t SESSION_OP_GET_TIME = 0x09;
+
+// Enables server timestamps in responses. Payload: 1 byte, 1 to enable, 0 to
+// disable. Response: 1 byte, 1 if timestamps are enabled after the request.
+// All subsequent responses carry 8 additional bytes after the seq_no (and
+// after the flow control byte, if enabled): the time (fibre_get_time_ns()) at
+// which the request was handled, e.g. when the property was read. Together
+// with SESSION_OP_GET_TIME this lets clients align readings from several
+// nodes. The response that enables timestamps doesn't carry one yet, the
+// response that disables them still does.
+constexpr uint8_t SESSION_OP_SET_TIMESTAMPS = 0x0a;
+
+// Sent by the server, not by the client: tells the client that the server
+// lost the state of its session, e.g. because the UDP session was evicted to
+// make room for another peer. The packet is laid out like a canonical request
+// to the session control endpoint without response, with the seq_no of the
+// client request that was dropped in its place and no further payload. The
+// client should negotiate the session again (header mode, flow control, ...)
+// and then resend the request.
+constexpr uint8_t SESSION_OP_SESSION_LOST = 0x0b;
+
+constexpr uint16_t BULK_SEQ_NO_FLAG = 0x4000;
+
+// @brief Selects the layout of incoming request headers on a channel.
+// Responses always consist of the 16-bit sequence number (with the MSB set)
+// followed by the response payload.
+enum RequestHeaderMode : uint8_t {
+    // u16 seq_no, u16 endpoint_id | expect_response << 15, u16 response length,
+    // payload, u16 trailer (the trailer is omitted in verified sessions)
+    HEADER_MODE_CANONICAL = 0,
+    // u16 seq_no, varint endpoint_id << 1 | expect_response, varint response
+    // length, payload. Only available in verified sessions, hence no trailer.
+    HEADER_MODE_COMPACT = 1,
+};
+
 template<typename T>
 inline size_t write_le(T value, uint8_t* buffer);
 
@@ -189,6 +308,42 @@ inline size_t read_le<float>(float* value, const uint8_t* buffer) {
     return read_le(reinterpret_cast<uint32_t*>(value), buffer);
 }
 
+// @brief Reads an unsigned LEB128 varint from the buffer.
+// @param buffer    Pointer to the buffer to be read. The pointer is advanced past the varint on success.
+// @param length    The number of available bytes in buffer. Reduced by the varint length on success.
+// @return 0 on success, -1 if the buffer ends within the varint or the value does not fit into T.
+template<typename T>
+static inline int read_varint(const uint8_t** buffer, size_t* length, T* value) {
+    T result = 0;
+    for (size_t i = 0; i < *length; ++i) {
+        size_t bit_pos = 7 * i;
+        T chunk = (*buffer)[i] & 0x7f;
+        if (bit_pos >= CHAR_BIT * sizeof(T) || static_cast<T>(chunk << bit_pos) >> bit_pos != chunk)
+            return -1; // overflow
+        result |= static_cast<T>(chunk << bit_pos);
+        if (!((*buffer)[i] & 0x80)) {
+            *buffer += i + 1;
+            *length -= i + 1;
+            *value = result;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// @brief Writes an unsigned LEB128 varint to the buffer.
+// @return The number of bytes written (at most 5 for 32-bit values) or 0 if the buffer is too small.
+static inline size_t write_varint(uint32_t value, uint8_t* buffer, size_t length) {
+    size_t i = 0;
+    do {
+        if (i >= length)
+            return 0;
+        buffer[i++] = (value & 0x7f) | (value > 0x7f ? 0x80 : 0);
+        value >>= 7;
+    } while (value);
+    return i;
+}
+
 // @brief Reads a value of type T from the buffer.
 // @param buffer    Pointer to the buffer to be read. The pointer is updated by the number of bytes that were read.
 // @param length    The number of available bytes in buffer. This value is updated to subtract the bytes that were read.
@@ -224,6 +379,188 @@ private:
 };
 
 
+// @brief Returns a monotonic time in milliseconds (wraps around after 2^32 ms).
+// The default implementation in protocol.cpp uses std::chrono::steady_clock
+// and is a weak symbol, so that platforms without it can provide their own.
+uint32_t fibre_get_time_ms();
+
+// @brief Returns a monotonic time in nanoseconds. Only used while the latency
+// breakdown is enabled. Like fibre_get_time_ms() this is a weak symbol.
+uint64_t fibre_get_time_ns();
+
+// @brief Timestamps (fibre_get_time_ns()) of one request on its way through a
+// channel, see fibre_set_latency_breakdown(). Timestamps that are not known
+// are 0.
+struct RequestTimestamps {
+    uint64_t kernel_rx_ns; // the kernel received the request
+    uint64_t user_rx_ns; // the transport read the request from the kernel
+    uint64_t segmented_ns; // the channel got the complete packet
+    uint64_t handler_ns; // the handler was started, possibly after queueing
+    uint64_t handled_ns; // the handler returned
+    uint64_t sent_ns; // the response was passed to the transport
+};
+
+// @brief Enables or disables the latency breakdown (disabled by default).
+// While enabled, channels take timestamps at each stage of each request and
+// pass them to fibre_record_latency(). See latency.hpp for the results.
+void fibre_set_latency_breakdown(bool enable);
+bool fibre_get_latency_breakdown();
+
+// @brief Adds the timestamps of a completed request to the latency statistics.
+// Defined in latency.cpp.
+void fibre_record_latency(uint16_t endpoint_id, uint16_t seq_no, const RequestTimestamps& timestamps);
+
+constexpr size_t PENDING_WRITE_MAX_SIZE = 8; // largest value that can be deferred (uint64_t)
+
+// @brief A decoded write that is applied later, see Endpoint::prepare_write()
+struct PendingWrite {
+    void (*apply)(void* ctx, const uint8_t* value);
+    void* ctx; // identifies the written property
+    uint8_t value[PENDING_WRITE_MAX_SIZE]; // the new value in little endian encoding
+};
+
+// @brief Enables or disables the write handoff mode (disabled by default).
+// Normally, remote writes are applied to application memory directly by the
+// thread that handles the request. In handoff mode, writes to properties are
+// queued instead and take effect when the application calls
+// fibre_apply_pending(), e.g. at the start of a control loop tick. This way
+// the control loop doesn't need to lock and never sees a value change mid-tick.
+// Reads and function calls are not affected. The ASCII protocol queues its
+// writes too (see Endpoint::prepare_string_write()), only direct calls of
+// set_string() are always applied directly.
+void fibre_set_write_handoff(bool enable);
+bool fibre_get_write_handoff();
+
+// @brief Queues writes for fibre_apply_pending(). The writes are applied in
+// the same fibre_apply_pending() call. Lock-free, can be called from any
+// number of threads.
+// @return false if the queue was full and the writes were dropped.
+bool fibre_enqueue_writes(const PendingWrite* writes, size_t n_writes);
+
+// @brief Returns the number of writes that fibre_enqueue_writes() dropped
+// because the queue was full, since the start of the program.
+uint32_t fibre_get_dropped_writes();
+
+// @brief Applies the queued writes in the order in which they were received.
+// Lock-free, but must only be called from one thread at a time. Applies at
+// most WRITE_QUEUE_SIZE writes per call so that its runtime is bounded.
+// @return the number of writes applied
+size_t fibre_apply_pending();
+
+// @brief Applies the writes of a transaction (see SESSION_OP_TRANSACTION)
+// such that the application either sees none or all of them: In write handoff
+// mode they are queued as a group, otherwise they are applied inside a
+// sequence lock which the application can check with fibre_read_begin() and
+// fibre_read_retry().
+// @return false if the writes were dropped because the queue was full.
+bool fibre_apply_transaction(const PendingWrite* writes, size_t n_writes);
+
+// @brief Lets the application read properties that are updated by transactions
+// without locking, for use outside of write handoff mode:
+//
+//     uint32_t seq;
+//     do {
+//         seq = fibre_read_begin();
+//         kp = config.kp;
+//         ki = config.ki;
+//     } while (fibre_read_retry(seq));
+//
+// Writes that are not part of a transaction don't take the sequence lock.
+// fibre_read_begin() spins while a transaction is applied, so a control loop
+// that preempts the network thread on a single core must use write handoff
+// mode instead.
+uint32_t fibre_read_begin();
+bool fibre_read_retry(uint32_t seq);
+
+class BidirectionalPacketBasedChannel;
+
+constexpr size_t PENDING_CALL_MAX_ARGS_SIZE = 32; // largest total size of the inputs of a function that can be handed off
+
+// @brief A decoded function call that runs later, see Endpoint::prepare_call()
+struct PendingCall {
+    void (*invoke)(void* ctx, const uint8_t* args);
+    void* ctx; // identifies the function
+    uint8_t args[PENDING_CALL_MAX_ARGS_SIZE]; // the input arguments in little endian encoding
+};
+
+// @brief Enables or disables the call handoff mode (disabled by default).
+// Normally, remote function calls run on the thread that handles the request.
+// In handoff mode, channels that have a CallQueue (see
+// BidirectionalPacketBasedChannel::set_call_queue(), e.g. the shards of
+// serve_on_tcp_sharded()) queue calls instead, and the calls run when the
+// application calls fibre_run_pending_calls(). The response is sent once the
+// call returned. Channels without a CallQueue still run calls directly.
+void fibre_set_call_handoff(bool enable);
+bool fibre_get_call_handoff();
+
+// @brief Lock-free message queues between one server thread and the
+// application thread for call handoff mode. The server thread pushes calls,
+// fibre_run_pending_calls() runs them and pushes them back as completions, and
+// the server thread passes the completions on to their channels with
+// complete_calls(). Each direction is a single-producer single-consumer ring,
+// so neither thread ever waits for the other.
+class CallQueue {
+public:
+    // @param notify: Called on the application thread after it pushed
+    //        completions, e.g. to wake the server thread. Can be null.
+    CallQueue(void (*notify)(void* ctx), void* ctx) : notify_(notify), notify_ctx_(ctx) {}
+
+    // @brief Queues a call of the specified channel. Server thread only.
+    // @return false if CALL_QUEUE_SIZE calls are already in flight.
+    bool push_call(const PendingCall& call, BidirectionalPacketBasedChannel* channel);
+
+    // @brief Completes the calls that returned in the meantime on their
+    // channels (see BidirectionalPacketBasedChannel::complete_call()).
+    // Server thread only.
+    // @return the number of completed calls
+    size_t complete_calls();
+
+    // @brief Runs the queued calls. Application thread only, see
+    // fibre_run_pending_calls().
+    size_t run_calls();
+
+private:
+    struct Message {
+        PendingCall call;
+        BidirectionalPacketBasedChannel* channel;
+    };
+
+    // Single-producer single-consumer ring. The indices run freely and are
+    // only taken modulo CALL_QUEUE_SIZE when a slot is accessed.
+    struct Ring {
+        bool push(const Message& message);
+        bool pop(Message* message);
+
+        Message slots[CALL_QUEUE_SIZE];
+        std::atomic<size_t> head{0}; // written by the producer
+        uint8_t padding[64 - sizeof(std::atomic<size_t>)]; // keeps head and tail on separate cache lines
+        std::atomic<size_t> tail{0}; // written by the consumer
+    };
+    static_assert((CALL_QUEUE_SIZE & (CALL_QUEUE_SIZE - 1)) == 0, "CALL_QUEUE_SIZE must be a power of 2 so that the slot index survives wraparound");
+
+    Ring calls_; // server thread -> application thread
+    Ring completions_; // application thread -> server thread
+    size_t n_in_flight_ = 0; // pushed but not completed calls, server thread only
+    void (*notify_)(void* ctx);
+    void* notify_ctx_;
+};
+
+// @brief Makes the calls of a queue visible to fibre_run_pending_calls().
+// @return false if MAX_CALL_QUEUES queues are already registered.
+bool fibre_register_call_queue(CallQueue* queue);
+
+// @brief Removes a queue that was registered with fibre_register_call_queue().
+// Returns once fibre_run_pending_calls() no longer uses the queue, so the
+// caller can free it afterwards. Queued calls that didn't run yet are
+// discarded.
+void fibre_unregister_call_queue(CallQueue* queue);
+
+// @brief Runs the function calls that were queued in call handoff mode, in
+// the order in which they were received per queue. Lock-free, but must only
+// be called from one thread at a time, usually the control loop.
+// @return the number of calls that ran
+size_t fibre_run_pending_calls();
+
 // @brief Endpoint request handler
 //
 // When passed a valid endpoint context, implementing functions shall handle an
@@ -262,6 +599,27 @@ void default_readwrite_endpoint_handler(T* value, const uint8_t* input, size_t i
         read_le<T>(value, input);
 }
 
+// @brief Decodes the write contained in a request without applying it
+// @return false if the request contains no write
+template<typename T>
+bool default_prepare_write(T* value, const uint8_t* input, size_t input_length, PendingWrite* write) {
+    static_assert(sizeof(T) <= PENDING_WRITE_MAX_SIZE, "type too large for deferred writes");
+    if (input_length < sizeof(T))
+        return false;
+    write->apply = [](void* ctx, const uint8_t* buffer) {
+        read_le<T>(reinterpret_cast<T*>(ctx), buffer);
+    };
+    write->ctx = value;
+    memcpy(write->value, input, sizeof(T));
+    return true;
+}
+
+// Read-only values can't be written
+template<typename T>
+bool default_prepare_write(const T* value, const uint8_t* input, size_t input_length, PendingWrite* write) {
+    return false;
+}
+
 
 
 template<typename T>
@@ -330,6 +688,43 @@ public:
     virtual void handle(const uint8_t* input, size_t input_length, StreamSink* output) = 0;
     virtual bool get_string(char * output, size_t length) { return false; };
     virtual bool set_string(char * buffer, size_t length) { return false; }
+    // @brief Decodes a write request into a PendingWrite instead of applying it.
+    // Used for write handoff mode and transactions.
+    // @return false if the endpoint doesn't support deferred writes
+    virtual bool prepare_write(const uint8_t* input, size_t input_length, PendingWrite* write) { return false; }
+    // @brief Like prepare_write() but decodes the value from a string like set_string().
+    // @return false if the string is invalid or the endpoint doesn't support deferred writes
+    virtual bool prepare_string_write(const char * buffer, size_t length, PendingWrite* write) { return false; }
+    // @brief Prepares a function call that runs later on another thread,
+    // with the input arguments as they are now. Used for call handoff mode.
+    // @return false if the endpoint is not a function
+    virtual bool prepare_call(PendingCall* call) { return false; }
+};
+
+#define PATH_HASH_INIT 2166136261u
+
+// @brief Continues a 32-bit FNV-1a hash of a dot-separated endpoint path
+// (e.g. "config.gain") with the specified characters.
+// Start with PATH_HASH_INIT.
+static inline uint32_t hash_path(uint32_t hash, const char * str, size_t length) {
+    for (size_t i = 0; i < length; ++i)
+        hash = (hash ^ (uint8_t)str[i]) * 16777619u;
+    return hash;
+}
+
+// @brief Receives the paths of the named endpoints of an object tree, see
+// register_paths().
+class EndpointPathSink {
+public:
+    // @param path_hash: hash_path() of the full dot-separated path
+    // @param name: the last segment of the path
+    virtual void add_path(uint32_t path_hash, const char * name, Endpoint* endpoint) = 0;
+
+    // @brief Called before and after the paths of a sub-object are added.
+    // Sinks that need the full path and not just its hash keep track of the
+    // object names with these.
+    virtual void enter_object(const char * name) {}
+    virtual void leave_object() {}
 };
 
 static inline int write_string(const char* str, StreamSink* output) {
@@ -354,9 +749,128 @@ public:
     //    return SIZE_MAX;
     //}
     int process_packet(const uint8_t* buffer, size_t length);
+
+    // @brief Tells the channel when the data of the following process_packet()
+    // calls was received, for the latency breakdown. Transports that know
+    // call this before passing on received data.
+    void set_rx_timestamps(uint64_t kernel_rx_ns, uint64_t user_rx_ns) {
+        rx_timestamps_.kernel_rx_ns = kernel_rx_ns;
+        rx_timestamps_.user_rx_ns = user_rx_ns;
+    }
+
+    // @brief Allows the remote peer to switch this channel to FRAMING_LEAN.
+    // Only use this if the underlying stream guarantees integrity and ordering
+    // (e.g. TCP). Channels on UART or USB must keep the canonical framing.
+    // @param input: The segmenter that feeds this channel.
+    // @param output: The packet sink that this channel was constructed with.
+    void enable_lean_framing(StreamToPacketSegmenter& input, StreamBasedPacketSink& output) {
+        framing_input_ = &input;
+        framing_output_ = &output;
+    }
+
+    // @brief Allows the remote peer to enable priority lanes. Only use this if
+    // the transport serves the bulk lane, i.e. calls process_bulk_request()
+    // while bulk_request_ready() returns true. Otherwise bulk requests would
+    // never be answered.
+    void enable_priority_lanes() {
+        priority_lanes_allowed_ = true;
+    }
+
+    // @brief Returns true if the peer negotiated state for this session that
+    // a new channel wouldn't have, e.g. a header mode or flow control.
+    bool has_session_state() {
+        return framing_ != FRAMING_CANONICAL || pending_framing_ != FRAMING_CANONICAL
+            || header_mode_ != HEADER_MODE_CANONICAL || session_verified_
+            || response_timestamps_ || flow_control_ || priority_lanes_;
+    }
+
+    // @brief Tells the peer that the state of its session was lost, instead
+    // of handling the specified request (see SESSION_OP_SESSION_LOST).
+    void send_session_lost(const uint8_t* request, size_t length);
+
+    // @brief Returns true if a queued bulk request can be served now.
+    // Transports should call process_bulk_request() while this returns true
+    // and no new input is waiting.
+    bool bulk_request_ready() {
+        return n_bulk_ && !call_in_flight_ && (!flow_control_ || (!n_deferred_ && can_send_response()));
+    }
+
+    // @brief Serves the oldest request in the bulk lane.
+    void process_bulk_request();
+
+    // @brief Hands function calls off to the application thread through the
+    // specified queue while call handoff mode is enabled. The channel and the
+    // queue must be used by the same thread.
+    void set_call_queue(CallQueue* queue) { call_queue_ = queue; }
+
+    // @brief Returns true while a handed off call didn't complete yet. The
+    // channel must not be destroyed before the call completed.
+    bool call_in_flight() { return call_in_flight_; }
+
+    // @brief Sends the response to the handed off call and serves the
+    // requests that arrived in the meantime. Called by CallQueue::complete_calls().
+    void complete_call();
+
 private:
+    struct RequestHeader {
+        uint16_t seq_no;
+        uint16_t endpoint_id;
+        bool expect_response;
+        uint16_t expected_response_length;
+        Endpoint* endpoint; // nullptr for the session control endpoint
+    };
+
+    int decode_request(const uint8_t** buffer, size_t* length, RequestHeader* header);
+    int dispatch_request(const uint8_t* buffer, size_t length, const RequestHeader& header,
+            const uint8_t* input, size_t input_length, const RequestTimestamps& timestamps);
+    void handle_request(const RequestHeader& header, const uint8_t* input, size_t input_length,
+            RequestTimestamps timestamps);
+    void handle_session_control(const uint8_t* input, size_t input_length, StreamSink* output,
+            const RequestTimestamps& timestamps);
+    void send_response(const RequestHeader& header, size_t length, RequestTimestamps& timestamps,
+            bool with_credit, bool with_timestamp);
+    bool verify_session(uint16_t client_json_crc);
+    bool can_send_response();
+    void process_deferred_requests();
+
     PacketSink& output_;
     uint8_t tx_buf_[TX_BUF_SIZE];
+    StreamToPacketSegmenter* framing_input_ = nullptr;
+    StreamBasedPacketSink* framing_output_ = nullptr;
+    StreamFraming framing_ = FRAMING_CANONICAL;
+    StreamFraming pending_framing_ = FRAMING_CANONICAL;
+    RequestHeaderMode header_mode_ = HEADER_MODE_CANONICAL;
+    bool session_verified_ = false; // true if the peer proved the descriptor CRC for this session
+    uint16_t session_json_crc_ = 0; // the descriptor CRC that the peer proved
+    RequestTimestamps rx_timestamps_ = {}; // see set_rx_timestamps()
+    bool response_timestamps_ = false; // see SESSION_OP_SET_TIMESTAMPS
+
+    // Flow control state (see SESSION_OP_SET_FLOW_CONTROL)
+    bool flow_control_ = false;
+    uint8_t completed_requests_ = 0; // cumulative, modulo 256
+    uint32_t sent_bytes_ = 0; // cumulative response bytes, modulo 2^32
+    uint32_t consumed_bytes_ = 0; // cumulative response bytes that the peer consumed, modulo 2^32
+    uint16_t peer_window_ = 0; // number of response bytes the peer can buffer
+    uint8_t deferred_requests_[RX_WINDOW_SIZE][RX_BUF_SIZE];
+    size_t deferred_lengths_[RX_WINDOW_SIZE];
+    RequestTimestamps deferred_timestamps_[RX_WINDOW_SIZE];
+    size_t deferred_head_ = 0;
+    size_t n_deferred_ = 0;
+
+    // Priority lane state (see SESSION_OP_SET_PRIORITY_LANES)
+    bool priority_lanes_allowed_ = false; // see enable_priority_lanes()
+    bool priority_lanes_ = false;
+    uint8_t bulk_requests_[BULK_QUEUE_SIZE][RX_BUF_SIZE];
+    size_t bulk_lengths_[BULK_QUEUE_SIZE];
+    RequestTimestamps bulk_timestamps_[BULK_QUEUE_SIZE];
+    size_t bulk_head_ = 0;
+    size_t n_bulk_ = 0;
+
+    // Call handoff state, requests are deferred while a call is in flight
+    CallQueue* call_queue_ = nullptr;
+    bool call_in_flight_ = false;
+    RequestHeader call_header_;
+    RequestTimestamps call_timestamps_;
 };
 
 
@@ -364,73 +878,67 @@ private:
 /*
 * These functions are currently not used by Fibre and only here to
 * support the ODrive ASCII protocol.
+* Numbers are converted with format.hpp rather than printf/scanf.
 * TODO: find a general way for client code to augment endpoints with custom
 * functions
 */
 
 template<typename T>
-struct format_traits_t;
-
-template<> struct format_traits_t<float> { using type = void;
-    static constexpr const char * fmt = "%f";
-    static constexpr const char * fmtp = "%f";
-};
-template<> struct format_traits_t<int32_t> { using type = void;
-    static constexpr const char * fmt = "%ld";
-    static constexpr const char * fmtp = "%ld";
-};
-template<> struct format_traits_t<uint32_t> { using type = void;
-    static constexpr const char * fmt = "%lu";
-    static constexpr const char * fmtp = "%lu";
-};
-template<> struct format_traits_t<int16_t> { using type = void;
-    static constexpr const char * fmt = "%hd";
-    static constexpr const char * fmtp = "%hd";
-};
-template<> struct format_traits_t<uint16_t> { using type = void;
-    static constexpr const char * fmt = "%hu";
-    static constexpr const char * fmtp = "%hu";
-};
-template<> struct format_traits_t<int8_t> { using type = void;
-    static constexpr const char * fmt = "%hhd";
-    static constexpr const char * fmtp = "%d";
-};
-template<> struct format_traits_t<uint8_t> { using type = void;
-    static constexpr const char * fmt = "%hhu";
-    static constexpr const char * fmtp = "%u";
-};
-
-template<typename T, typename = typename format_traits_t<T>::type>
-static bool to_string(const T& value, char * buffer, size_t length, int) {
-    snprintf(buffer, length, format_traits_t<T>::fmtp, value);
-    return true;
+static std::enable_if_t<std::is_integral<T>::value && std::is_signed<T>::value && sizeof(T) <= 4, bool>
+to_string(const T& value, char * buffer, size_t length, int) {
+    return format_int(value, buffer, length);
 }
 template<typename T>
-//__attribute__((__unused__))
-static bool to_string(const bool& value, char * buffer, size_t length, int) {
-    buffer[0] = value ? '1' : '0';
-    buffer[1] = 0;
-    return true;
+static std::enable_if_t<std::is_integral<T>::value && std::is_unsigned<T>::value && sizeof(T) <= 4
+        && !std::is_same<T, bool>::value, bool>
+to_string(const T& value, char * buffer, size_t length, int) {
+    return format_uint(value, buffer, length);
+}
+template<typename T>
+static std::enable_if_t<std::is_same<T, bool>::value, bool>
+to_string(const T& value, char * buffer, size_t length, int) {
+    return format_uint(value ? 1 : 0, buffer, length);
+}
+template<typename T>
+static std::enable_if_t<std::is_same<T, float>::value, bool>
+to_string(const T& value, char * buffer, size_t length, int) {
+    return format_float(value, buffer, length);
 }
 template<typename T>
 static bool to_string(const T& value, char * buffer, size_t length, ...) {
     return false;
 }
 
-template<typename T, typename = typename format_traits_t<T>::type>
-static bool from_string(const char * buffer, size_t length, T* property, int) {
-    return sscanf(buffer, format_traits_t<T>::fmt, property) == 1;
+template<typename T>
+static std::enable_if_t<std::is_integral<T>::value && !std::is_const<T>::value && sizeof(T) <= 4
+        && !std::is_same<T, bool>::value, bool>
+from_string(const char * buffer, size_t length, T* property, int) {
+    bool negative;
+    uint32_t magnitude;
+    if (!parse_integer(buffer, length, &negative, &magnitude))
+        return false;
+    int64_t value = negative ? -(int64_t)magnitude : (int64_t)magnitude;
+    if (value < std::numeric_limits<T>::min() || value > std::numeric_limits<T>::max())
+        return false;
+    *property = (T)value;
+    return true;
 }
-//__attribute__((__unused__))
 template<typename T>
-static bool from_string(const char * buffer, size_t length, bool* property, int) {
-    int val;
-    if (sscanf(buffer, "%d", &val) != 1)
+static std::enable_if_t<std::is_same<T, bool>::value, bool>
+from_string(const char * buffer, size_t length, T* property, int) {
+    bool negative;
+    uint32_t magnitude;
+    if (!parse_integer(buffer, length, &negative, &magnitude))
         return false;
-    *property = val;
+    *property = magnitude != 0;
     return true;
 }
 template<typename T>
+static std::enable_if_t<std::is_same<T, float>::value, bool>
+from_string(const char * buffer, size_t length, T* property, int) {
+    return parse_float(buffer, length, property);
+}
+template<typename T>
 static bool from_string(const char * buffer, size_t length, T* property, ...) {
     return false;
 }
@@ -449,9 +957,18 @@ public:
     void write_json(size_t id, StreamSink* output) {
         // no action
     }
+    void write_stub_json(size_t id, StreamSink* output) {
+        // no action
+    }
+    bool write_subtree_json(size_t id, const char * path, size_t path_length, StreamSink* output) {
+        return false;
+    }
     void register_endpoints(Endpoint** list, size_t id, size_t length) {
         // no action
     }
+    void register_paths(EndpointPathSink& sink, uint32_t path_hash) {
+        // no action
+    }
     Endpoint* get_by_name(const char * name, size_t length) {
         return nullptr;
     }
@@ -484,6 +1001,22 @@ public:
         subsequent_members_.write_json(id + TMember::endpoint_count, output);
     }
 
+    // @brief Like write_json() but child objects are written as stubs without members
+    void write_stub_json(size_t id, StreamSink* output) {
+        this_member_.write_stub_json(id, output);
+        if (!MemberList<TMembers...>::is_empty)
+            write_string(",", output);
+        subsequent_members_.write_stub_json(id + TMember::endpoint_count, output);
+    }
+
+    // @brief Finds the object with the specified dot-separated path and writes
+    // its members with write_stub_json().
+    // @return false if there is no object with this path
+    bool write_subtree_json(size_t id, const char * path, size_t path_length, StreamSink* output) {
+        return this_member_.write_subtree_json(id, path, path_length, output)
+            || subsequent_members_.write_subtree_json(id + TMember::endpoint_count, path, path_length, output);
+    }
+
     Endpoint* get_by_name(const char * name, size_t length) {
         Endpoint* result = this_member_.get_by_name(name, length);
         if (result) return result;
@@ -495,6 +1028,14 @@ public:
         subsequent_members_.register_endpoints(list, id + TMember::endpoint_count, length);
     }
 
+    // @brief Reports the paths of all properties in this list to the sink.
+    // @param path_hash: hash_path() of the parent object's path including the
+    //        trailing dot or PATH_HASH_INIT for the root.
+    void register_paths(EndpointPathSink& sink, uint32_t path_hash) {
+        this_member_.register_paths(sink, path_hash);
+        subsequent_members_.register_paths(sink, path_hash);
+    }
+
     TMember this_member_;
     MemberList<TMembers...> subsequent_members_;
 };
@@ -521,6 +1062,25 @@ public:
         write_string("]}", output);
     }
 
+    void write_stub_json(size_t id, StreamSink* output) {
+        write_string("{\"name\":\"", output);
+        write_string(name_, output);
+        write_string("\",\"type\":\"object\"}", output);
+    }
+
+    bool write_subtree_json(size_t id, const char * path, size_t path_length, StreamSink* output) {
+        size_t segment_length = 0;
+        while (segment_length < path_length && path[segment_length] != '.')
+            segment_length++;
+        if (segment_length != strlen(name_) || strncmp(path, name_, segment_length))
+            return false;
+        if (segment_length == path_length) {
+            member_list_.write_stub_json(id, output);
+            return true;
+        }
+        return member_list_.write_subtree_json(id, path + segment_length + 1, path_length - segment_length - 1, output);
+    }
+
     Endpoint* get_by_name(const char * name, size_t length) {
         size_t segment_length = strlen(name);
         if (!strncmp(name, name_, length))
@@ -532,6 +1092,13 @@ public:
     void register_endpoints(Endpoint** list, size_t id, size_t length) {
         member_list_.register_endpoints(list, id, length);
     }
+
+    void register_paths(EndpointPathSink& sink, uint32_t path_hash) {
+        path_hash = hash_path(path_hash, name_, strlen(name_));
+        sink.enter_object(name_);
+        member_list_.register_paths(sink, hash_path(path_hash, ".", 1));
+        sink.leave_object();
+    }
     
     const char * name_;
     MemberList<TMembers...> member_list_;
@@ -542,7 +1109,10 @@ FibreObject<TMembers...> make_fibre_object(const char * name, TMembers&&... memb
     return FibreObject<TMembers...>(name, std::forward<TMembers>(member_list)...);
 }
 
-template<typename TProperty>
+// @brief Exposes a variable as property.
+// IAllowHandoff is false for function arguments: they must be set before the
+// function is invoked and are therefore never deferred by write handoff mode.
+template<typename TProperty, bool IAllowHandoff = true>
 class FibreProperty : public Endpoint {
 public:
     static constexpr const char * json_modifier = get_default_json_modifier<TProperty>();
@@ -585,8 +1155,8 @@ public:
 
         // write endpoint ID
         write_string("\",\"id\":", output);
-        char id_buf[10];
-        snprintf(id_buf, sizeof(id_buf), "%u", (unsigned)id); // TODO: get rid of printf
+        char id_buf[11];
+        format_uint(id, id_buf, sizeof(id_buf));
         write_string(id_buf, output);
 
         // write additional JSON data
@@ -606,6 +1176,13 @@ public:
             return nullptr;
     }
 
+    void write_stub_json(size_t id, StreamSink* output) {
+        write_json(id, output);
+    }
+    bool write_subtree_json(size_t id, const char * path, size_t path_length, StreamSink* output) {
+        return false; // not an object
+    }
+
     // special-purpose function - to be moved
     bool get_string(char * buffer, size_t length) final {
         return to_string(*property_, buffer, length, 0);
@@ -620,12 +1197,37 @@ public:
         if (id < length)
             list[id] = this;
     }
+
+    void register_paths(EndpointPathSink& sink, uint32_t path_hash) {
+        sink.add_path(hash_path(path_hash, name_, strlen(name_)), name_, this);
+    }
     void handle(const uint8_t* input, size_t input_length, StreamSink* output) final {
-        default_readwrite_endpoint_handler(property_, input, input_length, output);
+        if (IAllowHandoff && fibre_get_write_handoff()) {
+            // Report the current value, the write takes effect in fibre_apply_pending().
+            // The response is empty if the write queue was full and the write was dropped.
+            PendingWrite write;
+            if (prepare_write(input, input_length, &write) && !fibre_enqueue_writes(&write, 1))
+                return;
+            default_readwrite_endpoint_handler(const_cast<const TProperty*>(property_), input, input_length, output);
+        } else {
+            default_readwrite_endpoint_handler(property_, input, input_length, output);
+        }
     }
     /*void handle(const uint8_t* input, size_t input_length, StreamSink* output) {
         handle(input, input_length, output);
     }*/
+    bool prepare_write(const uint8_t* input, size_t input_length, PendingWrite* write) final {
+        return IAllowHandoff && default_prepare_write(property_, input, input_length, write);
+    }
+
+    bool prepare_string_write(const char * buffer, size_t length, PendingWrite* write) final {
+        typename std::remove_const<TProperty>::type value;
+        uint8_t encoded[sizeof(value)];
+        if (!from_string(buffer, length, &value, 0))
+            return false;
+        write_le(value, encoded);
+        return prepare_write(encoded, sizeof(encoded), write);
+    }
 
     const char * name_;
     TProperty* property_;
@@ -656,27 +1258,275 @@ FibreProperty<const std::underlying_type_t<TProperty>> make_fibre_ro_property(co
 };
 
 
-template<typename ... TArgs>
-struct PropertyListFactory;
+// @brief A property that is backed by a getter and an optional setter member function.
+//
+// With a memoization TTL > 0 the getter is invoked at most once per TTL:
+// reads within the TTL return the memoized value. If the value expired, one
+// reader invokes the getter while concurrent readers get the previous value.
+// This keeps expensive getters that are polled by many clients from running
+// more than once per interval.
+// Writing the property invalidates the memoized value. Concurrent readers
+// that have no valid value (before the first value or after a write) invoke
+// the getter themselves rather than wait.
+// TProperty is const for read-only properties.
+template<typename TObj, typename TProperty, typename TGetter>
+class FibreAccessorProperty : public Endpoint {
+public:
+    using TValue = typename std::remove_const<TProperty>::type;
+    using TSetter = void (TObj::*)(TValue);
+
+    static constexpr const char * json_modifier = get_default_json_modifier<TProperty>();
+    static constexpr size_t endpoint_count = 1;
 
-template<>
-struct PropertyListFactory<> {
-    template<unsigned IPos, typename ... TAllProperties>
-    static MemberList<> make_property_list(std::array<const char *, sizeof...(TAllProperties)> names, std::tuple<TAllProperties...>& values) {
-        return MemberList<>();
+    FibreAccessorProperty(const char * name, TObj& obj, TGetter getter, TSetter setter, uint32_t memo_ttl_ms)
+        : name_(name), obj_(&obj), getter_(getter), setter_(setter), memo_ttl_ms_(memo_ttl_ms)
+    {}
+
+    // The memoization state is not copied
+    FibreAccessorProperty(const FibreAccessorProperty& other)
+        : FibreAccessorProperty(other.name_, *other.obj_, other.getter_, other.setter_, other.memo_ttl_ms_)
+    {}
+
+    void write_json(size_t id, StreamSink* output) {
+        // write name
+        write_string("{\"name\":\"", output);
+        write_string(name_, output);
+
+        // write endpoint ID
+        write_string("\",\"id\":", output);
+        char id_buf[11];
+        format_uint(id, id_buf, sizeof(id_buf));
+        write_string(id_buf, output);
+
+        // write additional JSON data
+        if (json_modifier && json_modifier[0]) {
+            write_string(",", output);
+            write_string(json_modifier, output);
+        }
+
+        write_string("}", output);
     }
+
+    // special-purpose function - to be moved
+    Endpoint* get_by_name(const char * name, size_t length) {
+        if (!strncmp(name, name_, length))
+            return this;
+        else
+            return nullptr;
+    }
+
+    void write_stub_json(size_t id, StreamSink* output) {
+        write_json(id, output);
+    }
+    bool write_subtree_json(size_t id, const char * path, size_t path_length, StreamSink* output) {
+        return false; // not an object
+    }
+
+    // special-purpose function - to be moved
+    bool get_string(char * buffer, size_t length) final {
+        TValue value = get();
+        return to_string(value, buffer, length, 0);
+    }
+
+    // special-purpose function - to be moved
+    bool set_string(char * buffer, size_t length) final {
+        TValue value;
+        if (!setter_ || !from_string(buffer, length, &value, 0))
+            return false;
+        set(value);
+        return true;
+    }
+
+    void register_endpoints(Endpoint** list, size_t id, size_t length) {
+        if (id < length)
+            list[id] = this;
+    }
+
+    void register_paths(EndpointPathSink& sink, uint32_t path_hash) {
+        sink.add_path(hash_path(path_hash, name_, strlen(name_)), name_, this);
+    }
+
+    void handle(const uint8_t* input, size_t input_length, StreamSink* output) final {
+        // In handoff mode the setter runs in fibre_apply_pending(), so the
+        // write can be queued before the getter runs. The response is empty
+        // if the write queue was full and the write was dropped.
+        bool handoff = setter_ && input_length >= sizeof(TValue) && fibre_get_write_handoff();
+        if (handoff) {
+            PendingWrite write;
+            if (prepare_write(input, input_length, &write) && !fibre_enqueue_writes(&write, 1))
+                return;
+        }
+        // Only invoke the getter if the value was requested
+        if (output && output->get_free_space() >= sizeof(TValue)) {
+            const TValue value = get();
+            default_readwrite_endpoint_handler(&value, input, input_length, output);
+        }
+        if (setter_ && input_length >= sizeof(TValue) && !handoff) {
+            TValue value;
+            read_le<TValue>(&value, input);
+            set(value);
+        }
+    }
+
+    bool prepare_write(const uint8_t* input, size_t input_length, PendingWrite* write) final {
+        static_assert(sizeof(TValue) <= PENDING_WRITE_MAX_SIZE, "type too large for deferred writes");
+        if (!setter_ || input_length < sizeof(TValue))
+            return false;
+        write->apply = [](void* ctx, const uint8_t* buffer) {
+            TValue value;
+            read_le<TValue>(&value, buffer);
+            reinterpret_cast<FibreAccessorProperty*>(ctx)->set(value);
+        };
+        write->ctx = this;
+        memcpy(write->value, input, sizeof(TValue));
+        return true;
+    }
+
+    bool prepare_string_write(const char * buffer, size_t length, PendingWrite* write) final {
+        TValue value;
+        uint8_t encoded[sizeof(TValue)];
+        if (!from_string(buffer, length, &value, 0))
+            return false;
+        write_le<TValue>(value, encoded);
+        return prepare_write(encoded, sizeof(encoded), write);
+    }
+
+    TValue get() {
+        if (!memo_ttl_ms_)
+            return (obj_->*getter_)();
+
+        TValue value;
+        uint32_t timestamp, generation;
+        bool valid = read_memo(&value, &timestamp, &generation)
+                && generation == generation_.load(std::memory_order_acquire);
+        if (valid && fibre_get_time_ms() - timestamp < memo_ttl_ms_)
+            return value;
+
+        if (computing_.exchange(true, std::memory_order_acquire)) {
+            // Another reader is invoking the getter right now. Without a
+            // valid value, waiting for it could take as long as the getter,
+            // so invoke it directly and leave the memo to that reader.
+            return valid ? value : (obj_->*getter_)();
+        }
+        // A write during the getter call invalidates the result
+        generation = generation_.load(std::memory_order_acquire);
+        timestamp = fibre_get_time_ms();
+        value = (obj_->*getter_)();
+        write_memo(value, timestamp, generation);
+        computing_.store(false, std::memory_order_release);
+        return value;
+    }
+
+    void set(TValue value) {
+        (obj_->*setter_)(value);
+        generation_.fetch_add(1, std::memory_order_acq_rel);
+    }
+
+    const char * name_;
+    TObj* obj_;
+    TGetter getter_;
+    TSetter setter_;
+    uint32_t memo_ttl_ms_;
+
+private:
+    // The memoized value is protected by a sequence lock so that readers
+    // never block and never see a torn value. The only writer is the reader
+    // that holds computing_.
+    // @return false if no value was memoized yet.
+    bool read_memo(TValue* value, uint32_t* timestamp, uint32_t* generation) {
+        for (;;) {
+            uint32_t seq = memo_seq_.load(std::memory_order_acquire);
+            if (seq & 1)
+                continue; // write in progress
+            TValue memo_value = memo_value_;
+            uint32_t memo_timestamp = memo_timestamp_;
+            uint32_t memo_generation = memo_generation_;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (memo_seq_.load(std::memory_order_relaxed) == seq) {
+                *value = memo_value;
+                *timestamp = memo_timestamp;
+                *generation = memo_generation;
+                return seq != 0;
+            }
+        }
+    }
+
+    void write_memo(TValue value, uint32_t timestamp, uint32_t generation) {
+        uint32_t seq = memo_seq_.load(std::memory_order_relaxed);
+        memo_seq_.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        memo_value_ = value;
+        memo_timestamp_ = timestamp;
+        memo_generation_ = generation;
+        memo_seq_.store(seq + 2 ? seq + 2 : 2, std::memory_order_release); // 0 means "never written"
+    }
+
+    std::atomic<bool> computing_{false};
+    std::atomic<uint32_t> generation_{0}; // incremented by each write
+    std::atomic<uint32_t> memo_seq_{0};
+    TValue memo_value_ = TValue();
+    uint32_t memo_timestamp_ = 0;
+    uint32_t memo_generation_ = 0;
 };
 
-template<typename TProperty, typename ... TProperties>
-struct PropertyListFactory<TProperty, TProperties...> {
-    template<unsigned IPos, typename ... TAllProperties>
-    static MemberList<FibreProperty<TProperty>, FibreProperty<TProperties>...>
-    make_property_list(std::array<const char *, sizeof...(TAllProperties)> names, std::tuple<TAllProperties...>& values) {
-        return MemberList<FibreProperty<TProperty>, FibreProperty<TProperties>...>(
-            make_fibre_property(std::get<IPos>(names), &std::get<IPos>(values)),
-            PropertyListFactory<TProperties...>::template make_property_list<IPos+1>(names, values)
-        );
+// Read/write property backed by a getter and a setter
+template<typename TObj, typename TGetter, typename TProperty = decltype((std::declval<TObj>().*std::declval<TGetter>())())>
+FibreAccessorProperty<TObj, TProperty, TGetter> make_fibre_accessor_property(const char * name, TObj& obj,
+        TGetter getter, void (TObj::*setter)(TProperty), uint32_t memo_ttl_ms = 0) {
+    return FibreAccessorProperty<TObj, TProperty, TGetter>(name, obj, getter, setter, memo_ttl_ms);
+}
+
+// Read-only property backed by a getter
+template<typename TObj, typename TGetter, typename TProperty = decltype((std::declval<TObj>().*std::declval<TGetter>())())>
+FibreAccessorProperty<TObj, const TProperty, TGetter> make_fibre_ro_accessor_property(const char * name, TObj& obj,
+        TGetter getter, uint32_t memo_ttl_ms = 0) {
+    return FibreAccessorProperty<TObj, const TProperty, TGetter>(name, obj, getter, nullptr, memo_ttl_ms);
+}
+
+// @brief An input or output argument of a FibreFunction.
+// The argument holds its own value, its name is stored by the function.
+template<typename TArg>
+class FibreArgument : public Endpoint {
+public:
+    static constexpr const char * json_modifier = get_default_json_modifier<TArg>();
+
+    void write_json(const char * name, size_t id, StreamSink* output) {
+        // write name
+        write_string("{\"name\":\"", output);
+        write_string(name, output);
+
+        // write endpoint ID
+        write_string("\",\"id\":", output);
+        char id_buf[11];
+        format_uint(id, id_buf, sizeof(id_buf));
+        write_string(id_buf, output);
+
+        // write additional JSON data
+        if (json_modifier && json_modifier[0]) {
+            write_string(",", output);
+            write_string(json_modifier, output);
+        }
+
+        write_string("}", output);
+    }
+
+    // special-purpose function - to be moved
+    bool get_string(char * buffer, size_t length) final {
+        return to_string(value_, buffer, length, 0);
+    }
+
+    // special-purpose function - to be moved
+    bool set_string(char * buffer, size_t length) final {
+        return from_string(buffer, length, &value_, 0);
+    }
+
+    // Arguments are consumed when the function is invoked, so writes are
+    // never deferred by write handoff mode.
+    void handle(const uint8_t* input, size_t input_length, StreamSink* output) final {
+        default_readwrite_endpoint_handler(&value_, input, input_length, output);
     }
+
+    TArg value_ = TArg();
 };
 
 /* @brief return_type<TypeList>::type represents the true return type
@@ -706,30 +1556,15 @@ public:
     // @brief The return type of the function as written by a C++ programmer
     using TRet = typename return_type<TOutputs...>::type;
 
-    static constexpr size_t endpoint_count = 1 + MemberList<FibreProperty<TInputs>...>::endpoint_count + MemberList<FibreProperty<TOutputs>...>::endpoint_count;
+    static constexpr size_t endpoint_count = 1 + sizeof...(TInputs) + sizeof...(TOutputs);
+
+    // The return value is the only output and is not named by the application
+    static constexpr const char * output_name = "result";
 
     FibreFunction(const char * name, TObj& obj, TRet(TObj::*func_ptr)(TInputs...),
-            std::array<const char *, sizeof...(TInputs)> input_names,
-            std::array<const char *, sizeof...(TOutputs)> output_names) :
-        name_(name), obj_(&obj), func_ptr_(func_ptr),
-        input_names_{input_names}, output_names_{output_names},
-        input_properties_(PropertyListFactory<TInputs...>::template make_property_list<0>(input_names_, in_args_)),
-        output_properties_(PropertyListFactory<TOutputs...>::template make_property_list<0>(output_names_, out_args_))
-    {
-        LOG_FIBRE("my tuple is at %x and of size %u\r\n", (uintptr_t)&in_args_, sizeof(in_args_));
-    }
-
-    // The custom copy constructor is needed because otherwise the
-    // input_properties_ and output_properties_ would point to memory
-    // locations of the old object.
-    FibreFunction(const FibreFunction& other) :
-        name_(other.name_), obj_(other.obj_), func_ptr_(other.func_ptr_),
-        input_names_{other.input_names_}, output_names_{other.output_names_},
-        input_properties_(PropertyListFactory<TInputs...>::template make_property_list<0>(input_names_, in_args_)),
-        output_properties_(PropertyListFactory<TOutputs...>::template make_property_list<0>(output_names_, out_args_))
-    {
-        LOG_FIBRE("COPIED! my tuple is at %x and of size %u\r\n", (uintptr_t)&in_args_, sizeof(in_args_));
-    }
+            std::array<const char *, sizeof...(TInputs)> input_names) :
+        name_(name), obj_(&obj), func_ptr_(func_ptr), input_names_(input_names)
+    {}
 
     void write_json(size_t id, StreamSink* output) {
         // write name
@@ -738,15 +1573,15 @@ public:
 
         // write endpoint ID
         write_string("\",\"id\":", output);
-        char id_buf[10];
-        snprintf(id_buf, sizeof(id_buf), "%u", (unsigned)id); // TODO: get rid of printf
+        char id_buf[11];
+        format_uint(id, id_buf, sizeof(id_buf));
         write_string(id_buf, output);
         
         // write arguments
         write_string(",\"type\":\"function\",\"inputs\":[", output);
-        input_properties_.write_json(id + 1, output),
+        write_inputs_json(id + 1, output, std::index_sequence_for<TInputs...>());
         write_string("],\"outputs\":[", output);
-        output_properties_.write_json(id + 1 + decltype(input_properties_)::endpoint_count, output),
+        write_outputs_json(id + 1 + sizeof...(TInputs), output, std::index_sequence_for<TOutputs...>());
         write_string("]}", output);
     }
 
@@ -755,58 +1590,116 @@ public:
         return nullptr; // can't address functions by name
     }
 
+    void write_stub_json(size_t id, StreamSink* output) {
+        write_json(id, output);
+    }
+    bool write_subtree_json(size_t id, const char * path, size_t path_length, StreamSink* output) {
+        return false; // not an object
+    }
+
     void register_endpoints(Endpoint** list, size_t id, size_t length) {
         if (id < length)
             list[id] = this;
-        input_properties_.register_endpoints(list, id + 1, length);
-        output_properties_.register_endpoints(list, id + 1 + decltype(input_properties_)::endpoint_count, length);
+        register_arguments(list, id + 1, length, inputs_, std::index_sequence_for<TInputs...>());
+        register_arguments(list, id + 1 + sizeof...(TInputs), length, outputs_, std::index_sequence_for<TOutputs...>());
     }
 
-    template<typename> std::enable_if_t<sizeof...(TOutputs) == 0>
-    handle_ex() {
-        invoke_function_with_tuple(*obj_, func_ptr_, in_args_);
-    }
-
-    template<typename> std::enable_if_t<sizeof...(TOutputs) == 1>
-    handle_ex() {
-        std::get<0>(out_args_) = invoke_function_with_tuple(*obj_, func_ptr_, in_args_);
-    }
-    
-    template<typename> std::enable_if_t<sizeof...(TOutputs) >= 2>
-    handle_ex() {
-        out_args_ = invoke_function_with_tuple(*obj_, func_ptr_, in_args_);
+    void register_paths(EndpointPathSink& sink, uint32_t path_hash) {
+        // can't address functions by name
     }
 
     void handle(const uint8_t* input, size_t input_length, StreamSink* output) final {
         (void) input;
         (void) input_length;
         (void) output;
-        LOG_FIBRE("tuple still at %x and of size %u\r\n", (uintptr_t)&in_args_, sizeof(in_args_));
-        LOG_FIBRE("invoke function using %d and %.3f\r\n", std::get<0>(in_args_), std::get<1>(in_args_));
-        handle_ex<void>();
+        invoke(load_inputs(std::index_sequence_for<TInputs...>()),
+                std::index_sequence_for<TInputs...>(), std::index_sequence_for<TOutputs...>());
+    }
+
+    // The arguments are copied into the call because requests of other
+    // connections may overwrite them before the call runs
+    bool prepare_call(PendingCall* call) final {
+        static_assert(TypeChecker<TInputs...>::total_size <= PENDING_CALL_MAX_ARGS_SIZE, "arguments too large for call handoff");
+        store_inputs(call->args, std::index_sequence_for<TInputs...>());
+        call->invoke = [](void* ctx, const uint8_t* args) {
+            size_t length = PENDING_CALL_MAX_ARGS_SIZE;
+            (void) length; // unused if the function has no inputs
+            // Braced initializers are evaluated in order
+            std::tuple<TInputs...> inputs{ read_le<TInputs>(&args, &length)... };
+            static_cast<FibreFunction*>(ctx)->invoke(inputs, std::index_sequence_for<TInputs...>(), std::index_sequence_for<TOutputs...>());
+        };
+        call->ctx = this;
+        return true;
+    }
+
+private:
+    template<size_t ... IInputs>
+    void write_inputs_json(size_t id, StreamSink* output, std::index_sequence<IInputs...>) {
+        int dummy[] = { 0, (write_string(IInputs ? "," : "", output),
+                std::get<IInputs>(inputs_).write_json(input_names_[IInputs], id + IInputs, output), 0)... };
+        (void) dummy;
+    }
+
+    template<size_t ... IOutputs>
+    void write_outputs_json(size_t id, StreamSink* output, std::index_sequence<IOutputs...>) {
+        int dummy[] = { 0, (write_string(IOutputs ? "," : "", output),
+                std::get<IOutputs>(outputs_).write_json(output_name, id + IOutputs, output), 0)... };
+        (void) dummy;
+    }
+
+    template<typename TArgs, size_t ... IArgs>
+    static void register_arguments(Endpoint** list, size_t id, size_t length, TArgs& args, std::index_sequence<IArgs...>) {
+        int dummy[] = { 0, (id + IArgs < length ? (list[id + IArgs] = &std::get<IArgs>(args), 0) : 0)... };
+        (void) dummy;
+    }
+
+    template<size_t ... IInputs>
+    std::tuple<TInputs...> load_inputs(std::index_sequence<IInputs...>) {
+        return std::tuple<TInputs...>(std::get<IInputs>(inputs_).value_...);
+    }
+
+    template<size_t ... IInputs>
+    void store_inputs(uint8_t* buffer, std::index_sequence<IInputs...>) {
+        int dummy[] = { 0, (buffer += write_le(std::get<IInputs>(inputs_).value_, buffer), 0)... };
+        (void) dummy;
+    }
+
+    // @brief Invokes a function without return value
+    template<size_t ... IInputs>
+    void invoke(const std::tuple<TInputs...>& inputs, std::index_sequence<IInputs...>, std::index_sequence<>) {
+        (obj_->*func_ptr_)(std::get<IInputs>(inputs)...);
+    }
+
+    // @brief Invokes a function with one return value
+    template<size_t ... IInputs>
+    void invoke(const std::tuple<TInputs...>& inputs, std::index_sequence<IInputs...>, std::index_sequence<0>) {
+        std::get<0>(outputs_).value_ = (obj_->*func_ptr_)(std::get<IInputs>(inputs)...);
+    }
+
+    // @brief Invokes a function that returns a tuple
+    template<size_t ... IInputs, size_t ... IOutputs>
+    void invoke(const std::tuple<TInputs...>& inputs, std::index_sequence<IInputs...>, std::index_sequence<IOutputs...>) {
+        std::tie(std::get<IOutputs>(outputs_).value_...) = (obj_->*func_ptr_)(std::get<IInputs>(inputs)...);
     }
 
     const char * name_;
     TObj* obj_;
     TRet(TObj::*func_ptr_)(TInputs...);
-    std::array<const char *, sizeof...(TInputs)> input_names_; // TODO: remove
-    std::array<const char *, sizeof...(TOutputs)> output_names_; // TODO: remove
-    std::tuple<TInputs...> in_args_;
-    std::tuple<TOutputs...> out_args_;
-    MemberList<FibreProperty<TInputs>...> input_properties_;
-    MemberList<FibreProperty<TOutputs>...> output_properties_;
+    std::array<const char *, sizeof...(TInputs)> input_names_;
+    std::tuple<FibreArgument<TInputs>...> inputs_;
+    std::tuple<FibreArgument<TOutputs>...> outputs_;
 };
 
 template<typename TObj, typename ... TArgs, typename ... TNames,
         typename = std::enable_if_t<sizeof...(TArgs) == sizeof...(TNames)>>
 FibreFunction<TObj, std::tuple<TArgs...>, std::tuple<>> make_fibre_function(const char * name, TObj& obj, void(TObj::*func_ptr)(TArgs...), TNames ... names) {
-    return FibreFunction<TObj, std::tuple<TArgs...>, std::tuple<>>(name, obj, func_ptr, {names...}, {});
+    return FibreFunction<TObj, std::tuple<TArgs...>, std::tuple<>>(name, obj, func_ptr, {names...});
 }
 
 template<typename TObj, typename TRet, typename ... TArgs, typename ... TNames,
         typename = std::enable_if_t<sizeof...(TArgs) == sizeof...(TNames) && !std::is_void<TRet>::value>>
 FibreFunction<TObj, std::tuple<TArgs...>, std::tuple<TRet>> make_fibre_function(const char * name, TObj& obj, TRet(TObj::*func_ptr)(TArgs...), TNames ... names) {
-    return FibreFunction<TObj, std::tuple<TArgs...>, std::tuple<TRet>>(name, obj, func_ptr, {names...}, {"result"});
+    return FibreFunction<TObj, std::tuple<TArgs...>, std::tuple<TRet>>(name, obj, func_ptr, {names...});
 }
 
 
@@ -817,6 +1710,7 @@ FibreFunction<TObj, std::tuple<TArgs...>, std::tuple<TRet>> make_fibre_function(
     }; \
     typename fibre_export_t::type make_fibre_definitions() { \
         CLASS* obj = this; \
+        (void) obj; /* unused if no member takes the object */ \
         return make_fibre_member_list(__VA_ARGS__); \
     } \
     typename fibre_export_t::type fibre_definitions = make_fibre_definitions()
@@ -829,8 +1723,13 @@ class EndpointProvider {
 public:
     virtual size_t get_endpoint_count() = 0;
     virtual void write_json(size_t id, StreamSink* output) = 0;
+    // @brief Writes the members of the object with the specified path as JSON
+    // array content, with child objects as stubs. An empty path selects the root.
+    // @return false if there is no object with this path
+    virtual bool write_subtree_json(size_t id, const char * path, size_t path_length, StreamSink* output) = 0;
     virtual Endpoint* get_by_name(char * name, size_t length) = 0;
     virtual void register_endpoints(Endpoint** list, size_t id, size_t length) = 0;
+    virtual void register_paths(EndpointPathSink& sink) = 0;
 };
 
 template<typename T>
@@ -843,9 +1742,19 @@ public:
     void write_json(size_t id, StreamSink* output) final {
         return member_list_.write_json(id, output);
     }
+    bool write_subtree_json(size_t id, const char * path, size_t path_length, StreamSink* output) final {
+        if (!path_length) {
+            member_list_.write_stub_json(id, output);
+            return true;
+        }
+        return member_list_.write_subtree_json(id, path, path_length, output);
+    }
     void register_endpoints(Endpoint** list, size_t id, size_t length) final {
         return member_list_.register_endpoints(list, id, length);
     }
+    void register_paths(EndpointPathSink& sink) final {
+        member_list_.register_paths(sink, PATH_HASH_INIT);
+    }
     Endpoint* get_by_name(char * name, size_t length) final {
         for (size_t i = 0; i < length; i++) {
             if (name[i] == '.')
@@ -872,10 +1781,38 @@ public:
 // defined in protocol.cpp
 extern Endpoint** endpoint_list_;
 extern size_t n_endpoints_;
-extern uint16_t json_crc_;
 extern JSONDescriptorEndpoint json_file_endpoint_;
 extern EndpointProvider* application_endpoints_;
 
+// @brief Returns the CRC16 of the JSON descriptor, which requests to
+// application endpoints must carry. The CRC is calculated on first use rather
+// than in fibre_publish() so that publishing a large object tree doesn't
+// delay startup.
+uint16_t fibre_get_json_crc();
+
+// @brief Sets the JSON descriptor CRC directly, for instance if the descriptor
+// isn't served by json_file_endpoint_ (see Proxy).
+void fibre_set_json_crc(uint16_t json_crc);
+
+// @brief Makes the next call to fibre_get_json_crc() recalculate the CRC.
+void fibre_invalidate_json_crc();
+
+// @brief Reads the current value of a property endpoint, like a read request
+// without payload does. Functions are not sampled because such a request
+// would call them.
+// @param length: The size of the buffer. Set to the length of the value.
+// @return false if the endpoint is a function
+bool fibre_sample_endpoint(Endpoint* endpoint, uint8_t* buffer, size_t* length);
+
+// @brief Samples the specified endpoints into one telemetry frame.
+// Frame layout: u32 seq_no, u16 JSON descriptor CRC, followed by one entry per
+// endpoint: varint endpoint ID, varint value length, value. Endpoints are
+// sampled with fibre_sample_endpoint(). Functions and entries that don't fit
+// into the buffer are omitted.
+// @return The length of the frame.
+size_t make_telemetry_frame(uint32_t seq_no, const uint16_t* endpoint_ids, size_t n_endpoint_ids,
+        uint8_t* buffer, size_t length);
+
 // @brief Registers the specified application object list using the provided endpoint table.
 // This function should only be called once during the lifetime of the application. TODO: fix this.
 // @param application_objects The application objects to be registred.
@@ -892,13 +1829,7 @@ int fibre_publish(T& application_objects) {
     endpoint_list_ = endpoint_list;
     n_endpoints_ = endpoint_list_size;
     application_endpoints_ = &endpoint_provider;
-    
-    // Calculate the CRC16 of the JSON file.
-    // The init value is the protocol version.
-    CRC16Calculator crc16_calculator(PROTOCOL_VERSION);
-    uint8_t offset[4] = { 0 };
-    json_file_endpoint_.handle(offset, sizeof(offset), &crc16_calculator);
-    json_crc_ = crc16_calculator.get_crc16();
+    fibre_invalidate_json_crc();
 
     return 0;
 }
@@ -0,0 +1,115 @@
+#ifndef __FIBRE_PROXY_HPP
+#define __FIBRE_PROXY_HPP
+
+#include "client.hpp"
+
+#include <chrono>
+#include <memory>
+
+// @brief Serves the endpoints of one upstream node to any number of local
+// channels (e.g. serve_on_tcp and serve_on_udp).
+//
+// The descriptor is fetched once and served locally. Reads of readable
+// properties are coalesced: if a read of the same property is already
+// waiting for the upstream node, later readers get the same response instead
+// of sending their own request. With a cache TTL > 0, property values are
+// additionally served from a cache until they are older than the TTL.
+// Writing a property invalidates its cached value and calling a function
+// invalidates all cached values.
+// All other requests are forwarded unchanged.
+//
+// A proxy can also run as replica of a primary node that streams its property
+// values (see replication.hpp and apply_replication_frame). Reads of
+// replicated properties are then served locally, whatever the cache TTL, and
+// only writes and function calls reach the primary. After a write or function
+// call through this proxy, the affected values are read from the primary
+// until two more frames arrived, so that clients read their own writes as
+// long as frames aren't delayed by more than one interval.
+class Proxy {
+public:
+    Proxy(Client& upstream, uint32_t cache_ttl_ms = 0) :
+        upstream_(upstream),
+        cache_ttl_(cache_ttl_ms)
+    { }
+
+    // @brief Fetches the descriptor from the upstream node and publishes
+    // forwarding endpoints. Use this instead of fibre_publish().
+    // @return 0 on success, -1 if the upstream node did not respond.
+    int publish();
+
+    // @brief Applies a replication frame from the primary node, which must be
+    // the upstream node. The first frame after publish() or
+    // reset_replication() must hold all properties (see ReplicationSource).
+    // @return 0 on success, -1 if the frame is malformed, belongs to a
+    //         different descriptor or doesn't follow the previous frame. Call
+    //         reset_replication() and resynchronize in that case.
+    int apply_replication_frame(const uint8_t* frame, size_t length);
+
+    // @brief Stops serving replicated values until the next full frame, e.g.
+    // because the replication stream was interrupted. Reads are forwarded to
+    // the upstream node in the meantime.
+    void reset_replication();
+
+    size_t get_downstream_requests() { return downstream_requests_; }
+    size_t get_upstream_requests() { return upstream_requests_; }
+
+private:
+    class DescriptorEndpoint : public Endpoint {
+    public:
+        DescriptorEndpoint(Proxy& proxy) : proxy_(proxy) {}
+        void handle(const uint8_t* input, size_t input_length, StreamSink* output) final;
+    private:
+        Proxy& proxy_;
+    };
+
+    class ForwardingEndpoint : public Endpoint {
+    public:
+        ForwardingEndpoint(Proxy& proxy, uint16_t endpoint_id) :
+            proxy_(proxy), endpoint_id_(endpoint_id) {}
+        void handle(const uint8_t* input, size_t input_length, StreamSink* output) final {
+            proxy_.forward(endpoint_id_, input, input_length, output);
+        }
+    private:
+        Proxy& proxy_;
+        uint16_t endpoint_id_;
+    };
+
+    enum EndpointKind : uint8_t {
+        ENDPOINT_OTHER, // forwarded unchanged
+        ENDPOINT_PROPERTY, // readable property, reads are coalesced and cached
+        ENDPOINT_FUNCTION, // function trigger, invalidates the cache
+    };
+
+    struct CachedValue {
+        EndpointKind kind = ENDPOINT_OTHER;
+        uint8_t value[TX_BUF_SIZE];
+        size_t length = 0;
+        std::chrono::steady_clock::time_point timestamp;
+        bool valid = false; // the value may be served from cache
+        bool fetch_ok = false; // the last fetch produced a value
+        bool in_flight = false; // a fetch is waiting for the upstream node
+        uint32_t generation = 0; // incremented on each invalidation
+        bool replicated = false; // the value is kept up to date by replication frames
+        uint32_t stale_until_seq_no = 0; // replicated value is stale before this frame
+    };
+
+    void forward(uint16_t endpoint_id, const uint8_t* input, size_t input_length, StreamSink* output);
+    void read_property(uint16_t endpoint_id, StreamSink* output);
+    void invalidate(uint16_t endpoint_id);
+
+    Client& upstream_;
+    std::chrono::milliseconds cache_ttl_;
+    std::vector<uint8_t> descriptor_;
+    std::vector<std::unique_ptr<Endpoint>> endpoints_;
+    std::vector<Endpoint*> endpoint_table_;
+    std::vector<CachedValue> cache_; // indexed by endpoint ID
+    std::mutex mutex_;
+    std::condition_variable fetch_done_;
+    bool replicating_ = false; // a full replication frame was applied
+    bool has_stale_values_ = false;
+    uint32_t replication_seq_no_ = 0; // of the last replication frame
+    size_t downstream_requests_ = 0;
+    size_t upstream_requests_ = 0;
+};
+
+#endif // __FIBRE_PROXY_HPP
@@ -0,0 +1,60 @@
+#ifndef __FIBRE_REPLICATION_HPP
+#define __FIBRE_REPLICATION_HPP
+
+#include "fibre.hpp"
+
+#include <vector>
+
+// Replication keeps the property values of replica nodes (see
+// Proxy::apply_replication_frame) in sync with a primary node, so that the
+// replicas can serve reads without asking the primary.
+//
+// The primary samples all named properties at a fixed interval and sends one
+// replication frame per sample. A frame has the layout of a telemetry frame
+// (see make_telemetry_frame) and holds the properties whose value changed
+// since the previous frame. Frames without changes are sent as well, so that
+// replicas can tell how far they are. On a stream, each frame is preceded by
+// its length (u32).
+//
+// The first frame on a new stream holds all properties. Since the following
+// frames only hold changes, replicas must receive all of them in order: a
+// replica that falls behind is disconnected and resynchronizes by
+// reconnecting.
+
+// @brief Produces the replication frames of the published object tree.
+class ReplicationSource {
+public:
+    // @brief Collects the named properties of application_endpoints_ (see
+    // fibre_publish) and samples them once.
+    ReplicationSource();
+
+    // @brief Samples all properties.
+    // @return A frame with the properties that changed since the previous
+    //         sample. The frame is valid until the next call.
+    const std::vector<uint8_t>& sample();
+
+    // @brief Returns a frame with all properties as of the last sample. A new
+    // replica needs it before the frame of the next sample.
+    const std::vector<uint8_t>& get_full_frame();
+
+    size_t get_property_count() { return properties_.size(); }
+
+private:
+    struct Property {
+        uint16_t endpoint_id;
+        Endpoint* endpoint;
+        size_t offset; // of the last value in values_
+        size_t length;
+    };
+
+    void begin_frame(std::vector<uint8_t>& frame);
+    void add_entry(std::vector<uint8_t>& frame, uint16_t endpoint_id, const uint8_t* value, size_t length);
+
+    std::vector<Property> properties_;
+    std::vector<uint8_t> values_;
+    std::vector<uint8_t> frame_;
+    std::vector<uint8_t> full_frame_;
+    uint32_t seq_no_ = 0;
+};
+
+#endif // __FIBRE_REPLICATION_HPP
@@ -8,7 +8,28 @@
 // This value must not be larger than USB_TX_DATA_SIZE defined in usbd_cdc_if.h
 constexpr uint16_t TX_BUF_SIZE = 32; // does not work with 64 for some reason
 constexpr uint16_t RX_BUF_SIZE = 128; // larger values than 128 have currently no effect because of protocol limitations
-
+// Each slot of the following two queues takes RX_BUF_SIZE bytes in every
+// channel. Targets with little RAM can shrink them at build time.
+#ifndef FIBRE_RX_WINDOW_SIZE
+#define FIBRE_RX_WINDOW_SIZE 4
+#endif
+#ifndef FIBRE_BULK_QUEUE_SIZE
+#define FIBRE_BULK_QUEUE_SIZE 4
+#endif
+constexpr uint8_t RX_WINDOW_SIZE = FIBRE_RX_WINDOW_SIZE; // number of requests a channel can buffer while it waits for TX credit or a handed off function call
+constexpr uint8_t BULK_QUEUE_SIZE = FIBRE_BULK_QUEUE_SIZE; // number of bulk lane requests a channel can buffer
+static_assert(RX_WINDOW_SIZE >= 1 && BULK_QUEUE_SIZE >= 1, "flow control, call handoff and priority lanes need at least one queue slot");
+constexpr uint8_t WRITE_QUEUE_SIZE = 32; // number of remote writes that can wait for fibre_apply_pending() in write handoff mode
+constexpr uint16_t CALL_QUEUE_SIZE = 256; // number of function calls per server thread that can wait for fibre_run_pending_calls() in call handoff mode
+constexpr uint8_t MAX_CALL_QUEUES = 64; // number of server threads that can hand off function calls at the same time
+
+// @brief Selects how packets are delimited on a byte stream.
+// Both ends of a stream must use the same framing. The canonical framing is
+// the default and the only one that can recover from corrupted or lost bytes.
+enum StreamFraming : uint8_t {
+    FRAMING_CANONICAL = 0, // sync byte, length, CRC8 header check and CRC16 payload check
+    FRAMING_LEAN = 1, // 16-bit little endian length prefix only, for reliable streams such as TCP
+};
 
 class PacketSink {
 public:
@@ -70,7 +91,19 @@ public:
     
     size_t get_free_space() { return SIZE_MAX; }
 
+    // @brief Switches the framing that is expected on the input stream.
+    // Must only be called on a packet boundary, e.g. from within the
+    // process_packet call of the output packet sink.
+    void set_framing(StreamFraming framing) {
+        framing_ = framing;
+        header_index_ = packet_index_ = packet_length_ = 0;
+    }
+
 private:
+    int process_bytes_canonical(const uint8_t *buffer, size_t length, size_t* processed_bytes);
+    int process_bytes_lean(const uint8_t *buffer, size_t length, size_t* processed_bytes);
+
+    StreamFraming framing_ = FRAMING_CANONICAL;
     uint8_t header_buffer_[3];
     size_t header_index_ = 0;
     uint8_t packet_buffer_[RX_BUF_SIZE];
@@ -90,7 +123,11 @@ public:
     size_t get_mtu() { return SIZE_MAX; }
     int process_packet(const uint8_t *buffer, size_t length);
 
+    // @brief Switches the framing that is used for subsequent packets.
+    void set_framing(StreamFraming framing) { framing_ = framing; }
+
 private:
+    StreamFraming framing_ = FRAMING_CANONICAL;
     StreamSink& output_;
 };
 
@@ -0,0 +1,162 @@
+#ifndef __FIBRE_UPLOAD_HPP
+#define __FIBRE_UPLOAD_HPP
+
+#include "fibre.hpp"
+
+#include <mutex>
+
+// CRC-32 (MPEG-2 variant: not reflected, no final XOR) over the whole image.
+constexpr uint32_t UPLOAD_CRC32_POLYNOMIAL = 0x04c11db7;
+constexpr uint32_t UPLOAD_CRC32_INIT = 0xffffffff;
+
+// An upload endpoint receives an image of known size in offset-tagged chunks.
+// The first request byte selects the operation. Every operation responds with
+// 4 bytes received offset (all bytes below it were written to the sink) and
+// 1 byte UploadStatus.
+//
+// Starts a new upload and aborts the one in progress, if any.
+// Payload: 4 bytes image size.
+#define UPLOAD_OP_BEGIN     0x00
+// Payload: 4 bytes offset, followed by the data. Chunks must be written in
+// order: data below the received offset is ignored and chunks beyond it are
+// dropped, so that the sink only ever sees consecutive writes. The client can
+// therefore pipeline chunks and request a response only for some of them
+// (cumulative acknowledgement). If the received offset falls behind, the
+// client resends from there (go-back-N).
+#define UPLOAD_OP_DATA      0x01
+// Completes the upload once all bytes were received. Payload: 4 bytes CRC32
+// (see UPLOAD_CRC32_POLYNOMIAL) of the whole image. Repeating it after the
+// upload completed reports UPLOAD_STATUS_COMPLETE again.
+#define UPLOAD_OP_FINISH    0x02
+// Queries the state, e.g. to resume an upload after reconnecting. No payload.
+#define UPLOAD_OP_STATUS    0x03
+
+enum UploadStatus : uint8_t {
+    UPLOAD_STATUS_IDLE = 0, // no upload was started
+    UPLOAD_STATUS_RECEIVING = 1, // waiting for data or UPLOAD_OP_FINISH
+    UPLOAD_STATUS_COMPLETE = 2, // the CRC matched and the sink committed the image
+    UPLOAD_STATUS_CRC_MISMATCH = 3, // the image was discarded
+    UPLOAD_STATUS_SINK_ERROR = 4, // the sink rejected the image or a write
+};
+
+// @brief Stores the image of an upload endpoint, e.g. in a file, an mmap'ed
+// region or a flash partition.
+class UploadSink {
+public:
+    // @brief Prepares for an image of the specified size, e.g. by erasing flash.
+    // @return false if the image can't be stored
+    virtual bool begin(uint32_t size) = 0;
+
+    // @brief Stores data. Offsets are consecutive, starting at 0.
+    virtual bool write(uint32_t offset, const uint8_t* buffer, size_t length) = 0;
+
+    // @brief Called with commit = true once all data was written and the CRC
+    // matched, or with commit = false if the upload is aborted.
+    // @return false if the image could not be committed
+    virtual bool finish(bool commit) = 0;
+};
+
+// @brief Stores the image in a fixed buffer, e.g. RAM or memory mapped flash.
+class MemoryUploadSink : public UploadSink {
+public:
+    MemoryUploadSink(uint8_t* buffer, size_t capacity) : buffer_(buffer), capacity_(capacity) {}
+
+    bool begin(uint32_t size) final {
+        size_ = 0;
+        pending_size_ = size;
+        return size <= capacity_;
+    }
+    bool write(uint32_t offset, const uint8_t* buffer, size_t length) final {
+        memcpy(buffer_ + offset, buffer, length);
+        return true;
+    }
+    bool finish(bool commit) final {
+        size_ = commit ? pending_size_ : 0;
+        return true;
+    }
+
+    // @brief The size of the last committed image, 0 if there is none.
+    size_t get_size() { return size_; }
+
+    uint8_t* buffer_;
+    size_t capacity_;
+    size_t size_ = 0;
+    size_t pending_size_ = 0;
+};
+
+// @brief The state of one upload endpoint. Owned by the application, which
+// exposes it with make_fibre_upload(). Requests from several channels are
+// serialized.
+class UploadReceiver {
+public:
+    UploadReceiver(UploadSink& sink) : sink_(sink) {}
+
+    void handle(const uint8_t* input, size_t input_length, StreamSink* output);
+
+    UploadStatus get_status() { return status_; }
+    uint32_t get_received() { return received_; }
+
+private:
+    void handle_data(uint32_t offset, const uint8_t* buffer, size_t length);
+    void handle_finish(uint32_t crc);
+
+    UploadSink& sink_;
+    std::mutex mutex_;
+    UploadStatus status_ = UPLOAD_STATUS_IDLE;
+    uint32_t size_ = 0;
+    uint32_t received_ = 0;
+    uint32_t crc_ = UPLOAD_CRC32_INIT;
+};
+
+// @brief Exposes an UploadReceiver as endpoint of type "upload".
+class FibreUpload : public Endpoint {
+public:
+    static constexpr size_t endpoint_count = 1;
+
+    FibreUpload(const char * name, UploadReceiver& receiver)
+        : name_(name), receiver_(&receiver)
+    {}
+
+    void write_json(size_t id, StreamSink* output) {
+        write_string("{\"name\":\"", output);
+        write_string(name_, output);
+        write_string("\",\"id\":", output);
+        char id_buf[11];
+        format_uint(id, id_buf, sizeof(id_buf));
+        write_string(id_buf, output);
+        write_string(",\"type\":\"upload\"}", output);
+    }
+
+    Endpoint* get_by_name(const char * name, size_t length) {
+        return nullptr; // can't be accessed as a value
+    }
+
+    void write_stub_json(size_t id, StreamSink* output) {
+        write_json(id, output);
+    }
+    bool write_subtree_json(size_t id, const char * path, size_t path_length, StreamSink* output) {
+        return false; // not an object
+    }
+
+    void register_endpoints(Endpoint** list, size_t id, size_t length) {
+        if (id < length)
+            list[id] = this;
+    }
+
+    void register_paths(EndpointPathSink& sink, uint32_t path_hash) {
+        // can't be accessed as a value
+    }
+
+    void handle(const uint8_t* input, size_t input_length, StreamSink* output) final {
+        receiver_->handle(input, input_length, output);
+    }
+
+    const char * name_;
+    UploadReceiver* receiver_;
+};
+
+inline FibreUpload make_fibre_upload(const char * name, UploadReceiver& receiver) {
+    return FibreUpload(name, receiver);
+}
+
+#endif // __FIBRE_UPLOAD_HPP
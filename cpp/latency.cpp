@@ -0,0 +1,103 @@
+/* Includes ------------------------------------------------------------------*/
+
+#include <array>
+
+#include <fibre/latency.hpp>
+
+/* Global variables ----------------------------------------------------------*/
+
+LatencyMetrics latency_metrics_;
+
+/* Private variables ---------------------------------------------------------*/
+
+static std::atomic<bool> latency_breakdown_enabled_{false};
+
+/* Private functions ---------------------------------------------------------*/
+
+static size_t get_bucket(uint64_t value) {
+    if (value < (1u << LATENCY_HISTOGRAM_SUB_BITS))
+        return value;
+    unsigned shift = 63 - __builtin_clzll(value) - (LATENCY_HISTOGRAM_SUB_BITS - 1);
+    return ((shift + 1) << (LATENCY_HISTOGRAM_SUB_BITS - 1)) + (value >> shift)
+            - (1u << (LATENCY_HISTOGRAM_SUB_BITS - 1));
+}
+
+// @brief Returns the largest value that falls into the bucket.
+static uint64_t get_bucket_limit(size_t bucket) {
+    if (bucket < (1u << LATENCY_HISTOGRAM_SUB_BITS))
+        return bucket;
+    unsigned shift = (bucket >> (LATENCY_HISTOGRAM_SUB_BITS - 1)) - 1;
+    uint64_t sub_bucket = (bucket & ((1u << (LATENCY_HISTOGRAM_SUB_BITS - 1)) - 1))
+            + (1u << (LATENCY_HISTOGRAM_SUB_BITS - 1));
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+/* Function implementations --------------------------------------------------*/
+
+void fibre_set_latency_breakdown(bool enable) {
+    latency_breakdown_enabled_.store(enable, std::memory_order_relaxed);
+}
+
+bool fibre_get_latency_breakdown() {
+    return latency_breakdown_enabled_.load(std::memory_order_relaxed);
+}
+
+void fibre_record_latency(uint16_t endpoint_id, uint16_t seq_no, const RequestTimestamps& timestamps) {
+    latency_metrics_.record(endpoint_id, seq_no, timestamps);
+}
+
+void LatencyHistogram::record(uint64_t duration_ns) {
+    buckets_[get_bucket(duration_ns)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::reset() {
+    for (auto& bucket : buckets_)
+        bucket.store(0, std::memory_order_relaxed);
+    count_.store(0, std::memory_order_relaxed);
+}
+
+float LatencyHistogram::get_quantile_us(float q) {
+    uint32_t rank = (uint32_t)(q * get_count());
+    uint32_t seen = 0;
+    for (size_t i = 0; i < LATENCY_HISTOGRAM_BUCKETS; ++i) {
+        seen += buckets_[i].load(std::memory_order_relaxed);
+        if (seen > rank)
+            return get_bucket_limit(i) / 1000.0f;
+    }
+    return 0.0f;
+}
+
+void LatencyMetrics::record(uint16_t endpoint_id, uint16_t seq_no, const RequestTimestamps& timestamps) {
+    // The stages in the order of LatencyStage. Requests without response end
+    // when the handler returns.
+    uint64_t stamps[] = {
+        timestamps.kernel_rx_ns, timestamps.user_rx_ns, timestamps.segmented_ns,
+        timestamps.handler_ns, timestamps.handled_ns,
+        timestamps.sent_ns ? timestamps.sent_ns : timestamps.handled_ns
+    };
+
+    // Skip stages with an unknown timestamp, e.g. the kernel stage on
+    // transports that don't support kernel timestamps
+    uint64_t first = 0;
+    for (size_t i = 0; i < LATENCY_STAGE_TOTAL; ++i) {
+        if (!stamps[i] || stamps[i + 1] < stamps[i])
+            continue;
+        stages_[i].record(stamps[i + 1] - stamps[i]);
+        if (!first)
+            first = stamps[i];
+    }
+    uint64_t last = stamps[LATENCY_STAGE_TOTAL];
+    if (first && last >= first)
+        stages_[LATENCY_STAGE_TOTAL].record(last - first);
+
+    uint32_t interval = get_trace_interval();
+    LatencyTraceCallback callback = trace_callback_.load();
+    if (interval && callback && !(n_recorded_.fetch_add(1, std::memory_order_relaxed) % interval))
+        callback(endpoint_id, seq_no, timestamps);
+}
+
+void LatencyMetrics::reset() {
+    for (auto& stage : stages_)
+        stage.reset();
+}
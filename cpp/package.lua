@@ -2,7 +2,7 @@
 tup.include('../tupfiles/build.lua')
 
 fibre_package = define_package{
-    sources={'protocol.cpp', 'posix_tcp.cpp', 'posix_udp.cpp'},
-    libs={'pthread'},
+    sources={'protocol.cpp', 'posix_tcp.cpp', 'posix_udp.cpp', 'client.cpp', 'proxy.cpp', 'format.cpp', 'ascii_protocol.cpp', 'posix_serial.cpp', 'latency.cpp', 'posix_timestamps.cpp', 'upload.cpp', 'posix_upload.cpp', 'posix_shm.cpp', 'config.cpp', 'posix_config.cpp', 'replication.cpp'},
+    libs={'pthread', 'rt'},
     headers={'include'}
 }
@@ -0,0 +1,55 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <string>
+
+#include <fibre/posix_config.hpp>
+
+int fibre_save_config_file(const char * path) {
+    if (!application_endpoints_)
+        return -1;
+    ConfigTable table(*application_endpoints_);
+    std::vector<uint8_t> buffer(table.get_snapshot_size());
+    size_t length = table.save(buffer.data(), buffer.size());
+
+    std::string part_path = std::string(path) + ".part";
+    int fd = open(part_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    bool ok = true;
+    for (size_t offset = 0; ok && offset < length; ) {
+        ssize_t written = write(fd, buffer.data() + offset, length - offset);
+        ok = written > 0;
+        offset += ok ? written : 0;
+    }
+    ok = ok && !fsync(fd);
+    close(fd);
+    if (ok)
+        ok = !rename(part_path.c_str(), path);
+    if (!ok)
+        unlink(part_path.c_str());
+    return ok ? 0 : -1;
+}
+
+int fibre_load_config_file(const char * path) {
+    if (!application_endpoints_)
+        return -1;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    void* file = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size > 0)
+        file = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED)
+        return -1;
+
+    ConfigTable table(*application_endpoints_);
+    int n_restored = table.restore(reinterpret_cast<const uint8_t*>(file), st.st_size);
+    munmap(file, st.st_size);
+    return n_restored;
+}
@@ -0,0 +1,105 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <fibre/fibre.hpp>
+#include <fibre/posix_serial.hpp>
+
+
+#define ASCII_RX_BUF_LEN	512
+
+class FileStreamSink : public StreamSink {
+public:
+    FileStreamSink(int fd) :
+        fd_(fd)
+    {}
+
+    int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) {
+        size_t written = 0;
+        while (written < length) {
+            ssize_t n = write(fd_, buffer + written, length - written);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            written += n;
+        }
+        if (processed_bytes)
+            *processed_bytes += written;
+        return written == length ? 0 : -1;
+    }
+
+    size_t get_free_space() { return SIZE_MAX; }
+
+private:
+    int fd_;
+};
+
+
+int serve_ascii_on_fd(int fd) {
+    if (!application_endpoints_)
+        return -1;
+
+    uint8_t buf[ASCII_RX_BUF_LEN];
+    EndpointPathTable table(*application_endpoints_);
+    FileStreamSink output(fd);
+    AsciiProtocol protocol(table, output);
+
+    for (;;) {
+        // returns as soon as there is some data
+        ssize_t n_received = read(fd, buf, sizeof(buf));
+        if (n_received == -1 && errno == EINTR)
+            continue;
+
+        // -1 indicates error and 0 means that the peer closed the connection
+        if (n_received == -1 || n_received == 0)
+            return n_received;
+
+        protocol.process_bytes(buf, n_received, nullptr);
+    }
+}
+
+static speed_t to_speed(unsigned int baudrate) {
+    switch (baudrate) {
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+        default: return B0;
+    }
+}
+
+int serve_ascii_on_serial(const char* device, unsigned int baudrate) {
+    speed_t speed = to_speed(baudrate);
+    if (speed == B0)
+        return -1;
+
+    int fd = open(device, O_RDWR | O_NOCTTY);
+    if (fd == -1)
+        return -1;
+
+    struct termios tty;
+    if (tcgetattr(fd, &tty) != 0) {
+        close(fd);
+        return -1;
+    }
+    cfmakeraw(&tty);
+    tty.c_cflag |= CLOCAL | CREAD;
+    tty.c_cflag &= ~(CSTOPB | PARENB);
+    tty.c_cc[VMIN] = 1;
+    tty.c_cc[VTIME] = 0;
+    cfsetispeed(&tty, speed);
+    cfsetospeed(&tty, speed);
+    if (tcsetattr(fd, TCSANOW, &tty) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    int result = serve_ascii_on_fd(fd);
+    close(fd);
+    return result;
+}
@@ -0,0 +1,272 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <fibre/fibre.hpp>
+#include <fibre/posix_shm.hpp>
+
+// @brief Collects the JSON descriptor into a vector.
+class VectorStreamSink : public StreamSink {
+public:
+    int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) {
+        data_.insert(data_.end(), buffer, buffer + length);
+        if (processed_bytes)
+            *processed_bytes += length;
+        return 0;
+    }
+    size_t get_free_space() { return SIZE_MAX; }
+    std::vector<uint8_t> data_;
+};
+
+// @brief Finds the paths and path hashes of the exported endpoints.
+class EndpointPathFinder : public EndpointPathSink {
+public:
+    EndpointPathFinder(std::vector<Endpoint*>& endpoints, std::vector<SnapshotEntry>& entries)
+        : endpoints_(endpoints), entries_(entries), paths_(endpoints.size()) {}
+
+    void add_path(uint32_t path_hash, const char * name, Endpoint* endpoint) final {
+        for (size_t i = 0; i < endpoints_.size(); ++i) {
+            if (endpoints_[i] == endpoint) {
+                entries_[i].path_hash = path_hash;
+                paths_[i] = prefix_ + name;
+            }
+        }
+    }
+    void enter_object(const char * name) final {
+        prefix_ += name;
+        prefix_ += '.';
+    }
+    void leave_object() final {
+        prefix_.pop_back();
+        prefix_.erase(prefix_.rfind('.') + 1); // npos + 1 clears the whole prefix
+    }
+
+    std::vector<Endpoint*>& endpoints_;
+    std::vector<SnapshotEntry>& entries_;
+    std::vector<std::string> paths_; // empty if unknown
+    std::string prefix_;
+};
+
+static size_t align8(size_t offset) {
+    return (offset + 7) & ~(size_t)7;
+}
+
+int SnapshotExporter::open(const char* name, const uint16_t* endpoint_ids, size_t n_endpoint_ids) {
+    close();
+
+    // Determine the value lengths by sampling each endpoint once
+    uint32_t values_length = 0;
+    for (size_t i = 0; i < n_endpoint_ids; ++i) {
+        uint16_t endpoint_id = endpoint_ids[i];
+        Endpoint* endpoint = endpoint_id < n_endpoints_ ? endpoint_list_[endpoint_id] : nullptr;
+        if (!endpoint_id || !endpoint)
+            continue;
+        uint8_t value[TX_BUF_SIZE];
+        size_t length = sizeof(value);
+        if (!fibre_sample_endpoint(endpoint, value, &length))
+            continue;
+        entries_.push_back({ 0, endpoint_id, (uint16_t)length, values_length, 0 });
+        endpoints_.push_back(endpoint);
+        values_length = align8(values_length + length);
+    }
+    // The paths follow the entry table
+    EndpointPathFinder finder(endpoints_, entries_);
+    if (application_endpoints_)
+        application_endpoints_->register_paths(finder);
+    std::string paths;
+    uint32_t paths_offset = sizeof(SnapshotHeader) + entries_.size() * sizeof(SnapshotEntry);
+    for (size_t i = 0; i < entries_.size(); ++i) {
+        if (finder.paths_[i].empty())
+            continue;
+        entries_[i].path_offset = paths_offset + paths.size();
+        paths += finder.paths_[i];
+        paths += '\0';
+    }
+
+    VectorStreamSink json;
+    if (application_endpoints_) {
+        uint8_t offset[4] = { 0 };
+        json_file_endpoint_.handle(offset, sizeof(offset), &json);
+    }
+
+    uint32_t json_offset = paths_offset + paths.size();
+    uint32_t values_offset = align8(json_offset + json.data_.size());
+    size_ = values_offset + values_length;
+
+    // Readers of a previous segment with this name keep their mapping of it.
+    // Truncating it instead would make their next access fault.
+    strncpy(name_, name, sizeof(name_) - 1);
+    shm_unlink(name_);
+    int fd = shm_open(name_, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        name_[0] = 0;
+        return -1;
+    }
+    void* segment = MAP_FAILED;
+    if (!ftruncate(fd, size_))
+        segment = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (segment == MAP_FAILED) {
+        shm_unlink(name_);
+        name_[0] = 0;
+        return -1;
+    }
+
+    // The segment is zero-filled, so readers see no magic until it is complete
+    header_ = reinterpret_cast<SnapshotHeader*>(segment);
+    header_->version = SNAPSHOT_VERSION;
+    header_->json_crc = fibre_get_json_crc();
+    header_->n_entries = entries_.size();
+    header_->json_offset = json_offset;
+    header_->json_length = json.data_.size();
+    header_->values_offset = values_offset;
+    header_->values_length = values_length;
+    uint8_t* base = reinterpret_cast<uint8_t*>(segment);
+    memcpy(base + sizeof(SnapshotHeader), entries_.data(), entries_.size() * sizeof(SnapshotEntry));
+    memcpy(base + paths_offset, paths.data(), paths.size());
+    memcpy(base + json_offset, json.data_.data(), json.data_.size());
+    values_ = base + values_offset;
+    update();
+    header_->magic.store(SNAPSHOT_MAGIC, std::memory_order_release);
+    return 0;
+}
+
+void SnapshotExporter::update() {
+    if (!header_)
+        return;
+    uint32_t seq = header_->seq.load(std::memory_order_relaxed);
+    header_->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    header_->timestamp_ns = fibre_get_time_ns();
+    for (size_t i = 0; i < entries_.size(); ++i) {
+        size_t length = entries_[i].length;
+        fibre_sample_endpoint(endpoints_[i], values_ + entries_[i].offset, &length);
+    }
+
+    header_->seq.store(seq + 2, std::memory_order_release);
+}
+
+void SnapshotExporter::close() {
+    if (header_)
+        munmap(header_, size_);
+    if (name_[0])
+        shm_unlink(name_);
+    header_ = nullptr;
+    values_ = nullptr;
+    name_[0] = 0;
+    entries_.clear();
+    endpoints_.clear();
+}
+
+int publish_snapshot_on_shm(const char* name, const uint16_t* endpoint_ids, size_t n_endpoint_ids,
+        unsigned int interval_ms, size_t n_snapshots) {
+    SnapshotExporter exporter;
+    if (exporter.open(name, endpoint_ids, n_endpoint_ids))
+        return -1;
+
+    auto next_sample = std::chrono::steady_clock::now();
+    for (size_t i = 1; !n_snapshots || i < n_snapshots; ++i) {
+        // Keep a fixed rate even if sampling takes a while
+        next_sample += std::chrono::milliseconds(interval_ms);
+        std::this_thread::sleep_until(next_sample);
+        exporter.update();
+    }
+    return 0;
+}
+
+int SnapshotReader::open(const char* name) {
+    close();
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    void* segment = MAP_FAILED;
+    if (!fstat(fd, &st) && (size_t)st.st_size >= sizeof(SnapshotHeader))
+        segment = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (segment == MAP_FAILED)
+        return -1;
+
+    header_ = reinterpret_cast<SnapshotHeader*>(segment);
+    size_ = st.st_size;
+    if (header_->magic.load(std::memory_order_acquire) != SNAPSHOT_MAGIC
+            || header_->version != SNAPSHOT_VERSION
+            || !check_layout()) {
+        close();
+        return -1;
+    }
+    return 0;
+}
+
+// The segment belongs to another process, so all offsets are checked before
+// they are used. The exporter doesn't change them once the magic is set.
+bool SnapshotReader::check_layout() {
+    uint64_t entries_end = sizeof(SnapshotHeader) + (uint64_t)header_->n_entries * sizeof(SnapshotEntry);
+    if (entries_end > size_
+            || (uint64_t)header_->json_offset + header_->json_length > size_
+            || (uint64_t)header_->values_offset + header_->values_length > size_)
+        return false;
+    const char* segment = reinterpret_cast<const char*>(header_);
+    for (uint32_t i = 0; i < header_->n_entries; ++i) {
+        const SnapshotEntry& entry = get_entries()[i];
+        if ((uint64_t)entry.offset + entry.length > header_->values_length)
+            return false;
+        // A path must end before the end of the segment
+        if (entry.path_offset && (entry.path_offset < entries_end || entry.path_offset >= size_
+                || !memchr(segment + entry.path_offset, 0, size_ - entry.path_offset)))
+            return false;
+    }
+    return true;
+}
+
+void SnapshotReader::close() {
+    if (header_)
+        munmap(header_, size_);
+    header_ = nullptr;
+}
+
+int SnapshotReader::find(const char* path) {
+    uint32_t path_hash = hash_path(PATH_HASH_INIT, path, strlen(path));
+    const char* segment = reinterpret_cast<const char*>(header_);
+    for (uint32_t i = 0; header_ && i < header_->n_entries; ++i) {
+        // The hash alone could match a different path, so also compare the path
+        const SnapshotEntry& entry = get_entries()[i];
+        if (entry.path_hash == path_hash && entry.path_offset && !strcmp(segment + entry.path_offset, path))
+            return i;
+    }
+    return -1;
+}
+
+bool SnapshotReader::read(int index, void* buffer, size_t length, uint64_t* timestamp_ns) {
+    if (!header_ || index < 0 || (uint32_t)index >= header_->n_entries || get_entries()[index].length != length)
+        return false;
+    copy(get_entries()[index].offset, buffer, length, timestamp_ns);
+    return true;
+}
+
+bool SnapshotReader::read_all(uint8_t* buffer, size_t length, uint64_t* timestamp_ns) {
+    if (!header_ || header_->values_length != length)
+        return false;
+    copy(0, buffer, length, timestamp_ns);
+    return true;
+}
+
+void SnapshotReader::copy(size_t offset, void* buffer, size_t length, uint64_t* timestamp_ns) {
+    const uint8_t* values = reinterpret_cast<const uint8_t*>(header_) + header_->values_offset;
+    uint32_t seq;
+    do {
+        seq = header_->seq.load(std::memory_order_acquire);
+        memcpy(buffer, values + offset, length);
+        if (timestamp_ns)
+            *timestamp_ns = header_->timestamp_ns;
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((seq & 1) || seq != header_->seq.load(std::memory_order_relaxed));
+}
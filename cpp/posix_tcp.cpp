@@ -1,14 +1,25 @@
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <algorithm>
+#include <chrono>
 #include <thread>
 #include <future>
 #include <vector>
 
 #include <fibre/fibre.hpp>
+#include <fibre/posix_serial.hpp>
+#include <fibre/posix_timestamps.hpp>
+#include <fibre/replication.hpp>
 
 
 #define TCP_RX_BUF_LEN	512
@@ -20,7 +31,7 @@ public:
     {}
 
     int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) {
-        int bytes_sent = send(socket_fd_, buffer, length, 0);
+        int bytes_sent = send(socket_fd_, buffer, length, MSG_NOSIGNAL);
         if (processed_bytes)
             *processed_bytes = (bytes_sent == -1) ? 0 : bytes_sent;
         return (bytes_sent == -1) ? -1 : 0;
@@ -28,6 +39,9 @@ public:
 
     size_t get_free_space() { return SIZE_MAX; }
 
+    // @brief Makes further sends fail, for a socket that was closed
+    void disconnect() { socket_fd_ = -1; }
+
 private:
     int socket_fd_;
 };
@@ -43,11 +57,34 @@ int serve_client(int sock_fd) {
 
     StreamToPacketSegmenter stream2packet(channel);
 
+    // Packets are sent in several pieces (header, payload, CRC). Without this
+    // the last piece of each response waits for the client's delayed ACK.
+    int nodelay = 1;
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    // TCP guarantees integrity so the client may drop the CRCs
+    channel.enable_lean_framing(stream2packet, packet2stream);
+    // The loop below serves the bulk lane
+    channel.enable_priority_lanes();
+
+    bool timestamping_enabled = false;
+
     // now listen for it
     for (;;) {
+        // Serve the bulk lane only while no new input is waiting, so that
+        // control requests overtake queued bulk requests
+        while (channel.bulk_request_ready()) {
+            struct pollfd pfd = { sock_fd, POLLIN, 0 };
+            if (poll(&pfd, 1, 0) != 0)
+                break;
+            channel.process_bulk_request();
+        }
+
         memset(buf, 0, sizeof(buf));
         // returns as soon as there is some data
-        ssize_t n_received = recv(sock_fd, buf, sizeof(buf), 0);
+        uint64_t kernel_rx_ns, user_rx_ns;
+        ssize_t n_received = recv_with_timestamps(sock_fd, buf, sizeof(buf), nullptr, nullptr,
+                &timestamping_enabled, &kernel_rx_ns, &user_rx_ns);
 
         // -1 indicates error and 0 means that the client gracefully terminated
         if (n_received == -1 || n_received == 0) {
@@ -56,6 +93,7 @@ int serve_client(int sock_fd) {
         }
 
         // input processing stack
+        channel.set_rx_timestamps(kernel_rx_ns, user_rx_ns);
         size_t processed = 0;
         stream2packet.process_bytes(buf, n_received, &processed);
     }
@@ -67,7 +105,18 @@ bool future_is_ready(std::future<T>& t){
     return t.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
 }
 
-int serve_on_tcp(unsigned int port) {
+int serve_ascii_client(int sock_fd) {
+    // Responses are sent once per received chunk, don't delay them further
+    int nodelay = 1;
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    int result = serve_ascii_on_fd(sock_fd);
+    close(sock_fd);
+    return result;
+}
+
+// @brief Accepts connections on the specified port and serves each client on
+// its own thread.
+static int serve_clients_on_tcp(unsigned int port, int (*serve)(int)) {
     struct sockaddr_in6 si_me, si_other;
     int s;
 
@@ -93,7 +142,7 @@ int serve_on_tcp(unsigned int port) {
         socklen_t silen = sizeof(si_other);
         // TODO: Add a limit on accepting connections
         int client_portal_fd = accept(s, reinterpret_cast<sockaddr *>(&si_other), &silen); // blocking call
-        serv_pool.push_back(std::async(std::launch::async, serve_client, client_portal_fd));
+        serv_pool.push_back(std::async(std::launch::async, serve, client_portal_fd));
         // do a little clean up on the pool
         for (std::vector<std::future<int>>::iterator it = serv_pool.end()-1; it >= serv_pool.begin(); --it) {
             if (future_is_ready(*it)) {
@@ -106,3 +155,418 @@ int serve_on_tcp(unsigned int port) {
     close(s);
 }
 
+int serve_on_tcp(unsigned int port) {
+    return serve_clients_on_tcp(port, serve_client);
+}
+
+int serve_ascii_on_tcp(unsigned int port) {
+    return serve_clients_on_tcp(port, serve_ascii_client);
+}
+
+// @brief Sends as much of a backlog as the socket takes without blocking.
+// The backlog is cleared once it was sent completely.
+// @param offset: Bytes of the backlog that were already sent.
+// @return false if the connection failed
+static bool send_backlog(int sock_fd, std::vector<uint8_t>& backlog, size_t* offset) {
+    while (*offset < backlog.size()) {
+        ssize_t n_sent = send(sock_fd, backlog.data() + *offset, backlog.size() - *offset, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n_sent == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            // Drop the sent part once it's the larger one, so that a peer
+            // that never quite catches up doesn't grow the backlog forever
+            if (*offset > backlog.size() / 2) {
+                backlog.erase(backlog.begin(), backlog.begin() + *offset);
+                *offset = 0;
+            }
+            return true;
+        }
+        *offset += n_sent;
+    }
+    backlog.clear();
+    *offset = 0;
+    return true;
+}
+
+#define SHARD_MAX_OUTPUT (64 * 1024) // bytes of responses that may wait for a client that doesn't read
+
+// @brief Output of a connection of serve_on_tcp_sharded(). Never blocks the
+// shard: what the socket doesn't take right away is kept and sent once epoll
+// reports EPOLLOUT. Responses are always taken whole, so lean-framed streams
+// stay intact. A client that falls more than SHARD_MAX_OUTPUT bytes behind
+// is shut down, which the shard then sees as a closed connection.
+class ShardStreamSink : public StreamSink {
+public:
+    ShardStreamSink(int sock_fd, int epoll_fd, void* epoll_data) :
+        sock_fd_(sock_fd), epoll_fd_(epoll_fd), epoll_data_(epoll_data)
+    {}
+
+    int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) {
+        if (processed_bytes)
+            *processed_bytes = 0;
+        if (sock_fd_ == -1)
+            return -1;
+        size_t total_length = length;
+        if (backlog_.empty()) {
+            ssize_t n_sent = send(sock_fd_, buffer, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n_sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                fail();
+                return -1;
+            }
+            if (n_sent > 0) {
+                buffer += n_sent;
+                length -= n_sent;
+            }
+            if (length)
+                watch_output(true);
+        }
+        if (length) {
+            if (backlog_.size() - backlog_offset_ + length > SHARD_MAX_OUTPUT) {
+                fail();
+                return -1;
+            }
+            backlog_.insert(backlog_.end(), buffer, buffer + length);
+        }
+        if (processed_bytes)
+            *processed_bytes = total_length;
+        return 0;
+    }
+
+    size_t get_free_space() { return SIZE_MAX; }
+
+    // @brief Sends the backlog, to be called when epoll reports EPOLLOUT
+    void flush() {
+        if (sock_fd_ == -1)
+            return;
+        if (!send_backlog(sock_fd_, backlog_, &backlog_offset_))
+            fail();
+        else if (backlog_.empty())
+            watch_output(false);
+    }
+
+    // @brief Makes further sends fail, for a socket that was closed
+    void disconnect() {
+        sock_fd_ = -1;
+        backlog_.clear();
+        backlog_offset_ = 0;
+    }
+
+private:
+    void watch_output(bool enable) {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | (enable ? EPOLLOUT : 0);
+        ev.data.ptr = epoll_data_;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, sock_fd_, &ev);
+    }
+
+    // The shard closes the connection once it reads the end of the stream
+    void fail() {
+        shutdown(sock_fd_, SHUT_RDWR);
+        disconnect();
+    }
+
+    int sock_fd_;
+    int epoll_fd_;
+    void* epoll_data_; // identifies the connection in epoll events
+    std::vector<uint8_t> backlog_;
+    size_t backlog_offset_ = 0; // bytes of backlog that were already sent
+};
+
+// @brief The state of one client of serve_on_tcp_sharded(). Owned and only
+// accessed by the shard that accepted the connection.
+struct ShardConnection {
+    ShardConnection(int fd, int epoll_fd) :
+        sock_fd(fd), tcp_output(fd, epoll_fd, this), packet2stream(tcp_output),
+        channel(packet2stream), stream2packet(channel)
+    {}
+
+    int sock_fd;
+    bool timestamping_enabled = false;
+    bool closed = false;
+    bool bulk_listed = false; // true while the connection is in the shard's bulk list
+    ShardStreamSink tcp_output;
+    StreamBasedPacketSink packet2stream;
+    BidirectionalPacketBasedChannel channel;
+    StreamToPacketSegmenter stream2packet;
+};
+
+// @brief Wakes a shard after the application thread completed calls
+static void notify_shard(void* ctx) {
+    uint64_t one = 1;
+    ssize_t n_written = write((int)(intptr_t)ctx, &one, sizeof(one));
+    (void) n_written; // the counter only overflows if the shard doesn't run at all
+}
+
+// @brief Runs one shard of serve_on_tcp_sharded(). Only returns on error,
+// after closing its connections and unregistering its CallQueue.
+static int serve_shard(unsigned int port, size_t shard_index) {
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(shard_index % (n_cpus > 0 ? n_cpus : 1), &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    // Each shard has its own listening socket on the same port, the kernel
+    // distributes new connections among them
+    struct sockaddr_in6 si_me;
+    int s = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    if (s == -1)
+        return -1;
+    int reuse = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    memset((char *) &si_me, 0, sizeof(si_me));
+    si_me.sin6_family = AF_INET6;
+    si_me.sin6_port = htons(port);
+    si_me.sin6_addr = in6addr_any;
+    int epoll_fd = -1, event_fd = -1;
+    if (bind(s, reinterpret_cast<struct sockaddr *>(&si_me), sizeof(si_me)) == -1
+            || listen(s, 128) == -1
+            || (epoll_fd = epoll_create1(0)) == -1
+            || (event_fd = eventfd(0, EFD_NONBLOCK)) == -1) {
+        if (epoll_fd != -1)
+            close(epoll_fd);
+        close(s);
+        return -1;
+    }
+
+    // The listener and the eventfd are told apart from connections by their data pointer
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &s;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s, &ev);
+    ev.data.ptr = &event_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev);
+
+    CallQueue* call_queue = new CallQueue(notify_shard, (void*)(intptr_t)event_fd);
+    bool call_handoff = fibre_register_call_queue(call_queue);
+
+    std::vector<ShardConnection*> connections;
+    std::vector<ShardConnection*> bulk_list; // connections whose bulk lane may be ready
+    std::vector<ShardConnection*> closed_connections; // freed once their call completed
+    struct epoll_event events[64];
+    uint8_t buf[TCP_RX_BUF_LEN];
+    for (;;) {
+        int n_events = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), bulk_list.empty() ? -1 : 0);
+        if (n_events == -1 && errno != EINTR)
+            break;
+        bool calls_completed = false;
+        for (int i = 0; i < n_events; ++i) {
+            if (events[i].data.ptr == &s) {
+                int client_fd;
+                while ((client_fd = accept4(s, nullptr, nullptr, SOCK_NONBLOCK)) != -1) {
+                    int nodelay = 1;
+                    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+                    ShardConnection* connection = new ShardConnection(client_fd, epoll_fd);
+                    connection->channel.enable_lean_framing(connection->stream2packet, connection->packet2stream);
+                    connection->channel.enable_priority_lanes();
+                    if (call_handoff)
+                        connection->channel.set_call_queue(call_queue);
+                    ev.data.ptr = connection;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev);
+                    connections.push_back(connection);
+                }
+            } else if (events[i].data.ptr == &event_fd) {
+                uint64_t count;
+                ssize_t n_read = read(event_fd, &count, sizeof(count));
+                (void) n_read;
+                call_queue->complete_calls();
+                calls_completed = true;
+            } else {
+                ShardConnection* connection = static_cast<ShardConnection*>(events[i].data.ptr);
+                if (connection->closed)
+                    continue;
+                if (events[i].events & EPOLLOUT)
+                    connection->tcp_output.flush();
+                if (!(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+                    continue;
+                uint64_t kernel_rx_ns, user_rx_ns;
+                ssize_t n_received = recv_with_timestamps(connection->sock_fd, buf, sizeof(buf), nullptr, nullptr,
+                        &connection->timestamping_enabled, &kernel_rx_ns, &user_rx_ns);
+                if (n_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    continue;
+                if (n_received <= 0) {
+                    close(connection->sock_fd);
+                    connection->tcp_output.disconnect();
+                    connection->closed = true;
+                    closed_connections.push_back(connection);
+                    continue;
+                }
+                connection->channel.set_rx_timestamps(kernel_rx_ns, user_rx_ns);
+                size_t processed = 0;
+                connection->stream2packet.process_bytes(buf, n_received, &processed);
+                if (!connection->bulk_listed && connection->channel.bulk_request_ready()) {
+                    connection->bulk_listed = true;
+                    bulk_list.push_back(connection);
+                }
+            }
+        }
+
+        // A completed call may have unblocked a bulk lane
+        if (calls_completed) {
+            for (ShardConnection* connection : connections) {
+                if (!connection->bulk_listed && !connection->closed && connection->channel.bulk_request_ready()) {
+                    connection->bulk_listed = true;
+                    bulk_list.push_back(connection);
+                }
+            }
+        }
+
+        // Serve one bulk request per connection between rounds of input, so
+        // that control requests overtake queued bulk requests
+        for (auto it = bulk_list.begin(); it != bulk_list.end(); ) {
+            ShardConnection* connection = *it;
+            if (!connection->closed && connection->channel.bulk_request_ready())
+                connection->channel.process_bulk_request();
+            if (connection->closed || !connection->channel.bulk_request_ready()) {
+                connection->bulk_listed = false;
+                it = bulk_list.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        // Free closed connections once they are no longer referenced by the
+        // bulk list or the call queue
+        for (auto it = closed_connections.begin(); it != closed_connections.end(); ) {
+            ShardConnection* connection = *it;
+            if (connection->bulk_listed || connection->channel.call_in_flight()) {
+                ++it;
+                continue;
+            }
+            connections.erase(std::find(connections.begin(), connections.end(), connection));
+            delete connection;
+            it = closed_connections.erase(it);
+        }
+    }
+
+    // Calls that are still queued never complete, so the connections can go
+    // once the application thread let go of the queue
+    if (call_handoff)
+        fibre_unregister_call_queue(call_queue);
+    delete call_queue;
+    for (ShardConnection* connection : connections) {
+        if (!connection->closed)
+            close(connection->sock_fd);
+        delete connection;
+    }
+    close(event_fd);
+    close(epoll_fd);
+    close(s);
+    return -1;
+}
+
+int serve_on_tcp_sharded(unsigned int port, size_t n_shards) {
+    if (!n_shards) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_shards = n_cpus > 0 ? n_cpus : 1;
+    }
+    std::vector<std::future<int>> shards;
+    for (size_t i = 0; i < n_shards; ++i)
+        shards.push_back(std::async(std::launch::async, serve_shard, port, i));
+    int result = 0;
+    for (std::future<int>& shard : shards)
+        result = shard.get() ? -1 : result;
+    return result;
+}
+
+#define REPLICA_MAX_BACKLOG (256 * 1024) // bytes of frames that may wait for a slow replica
+
+// @brief A connected replica and the part of its stream that the socket
+// didn't take yet.
+struct Replica {
+    int sock_fd;
+    std::vector<uint8_t> backlog;
+    size_t backlog_offset; // bytes of backlog that were already sent
+};
+
+// @brief Queues a length-prefixed replication frame and sends as much as
+// possible without blocking. Frames are never sent partially interleaved, so
+// the stream stays intact however slowly the replica reads.
+// @return false if the connection failed or the replica fell more than
+//         REPLICA_MAX_BACKLOG bytes behind, in which case it must be
+//         disconnected.
+static bool send_replication_frame(Replica& replica, const std::vector<uint8_t>& frame) {
+    if (replica.backlog.size() - replica.backlog_offset > REPLICA_MAX_BACKLOG)
+        return false;
+    uint8_t length[4];
+    write_le<uint32_t>(frame.size(), length);
+    replica.backlog.insert(replica.backlog.end(), length, length + sizeof(length));
+    replica.backlog.insert(replica.backlog.end(), frame.begin(), frame.end());
+    return send_backlog(replica.sock_fd, replica.backlog, &replica.backlog_offset);
+}
+
+int serve_replication_on_tcp(unsigned int port, unsigned int interval_ms) {
+    struct sockaddr_in6 si_me;
+    int s;
+
+    if ((s=socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP)) == -1) {
+        return -1;
+    }
+
+    memset((char *) &si_me, 0, sizeof(si_me));
+    si_me.sin6_family = AF_INET6;
+    si_me.sin6_port = htons(port);
+    si_me.sin6_addr = in6addr_any;
+    if (bind(s, reinterpret_cast<struct sockaddr *>(&si_me), sizeof(si_me)) == -1
+            || listen(s, 16) == -1) {
+        close(s);
+        return -1;
+    }
+
+    // One thread samples and serves all replicas, so that the properties are
+    // sampled once per interval no matter how many replicas there are
+    ReplicationSource source;
+    std::vector<Replica> replicas;
+    std::vector<struct pollfd> pfds;
+    auto interval = std::chrono::milliseconds(std::max(interval_ms, 1u));
+    auto next_sample = std::chrono::steady_clock::now();
+    for (;;) {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= next_sample) {
+            const std::vector<uint8_t>& frame = source.sample();
+            for (auto it = replicas.begin(); it != replicas.end(); ) {
+                if (send_replication_frame(*it, frame)) {
+                    ++it;
+                } else {
+                    close(it->sock_fd);
+                    it = replicas.erase(it);
+                }
+            }
+            // Keep a fixed rate even if sampling takes a while
+            next_sample += interval;
+        }
+
+        // Until the next sample is due, accept new replicas and send the
+        // backlog of slow ones. This runs on every iteration, even if
+        // sampling fell behind, so that new replicas are never starved.
+        pfds.assign(1, { s, POLLIN, 0 });
+        for (Replica& replica : replicas)
+            pfds.push_back({ replica.sock_fd, (short)(replica.backlog.empty() ? 0 : POLLOUT), 0 });
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next_sample - std::chrono::steady_clock::now());
+        int timeout_ms = wait.count() > 0 ? wait.count() + 1 : 0;
+        if (poll(pfds.data(), pfds.size(), timeout_ms) <= 0)
+            continue;
+
+        for (size_t i = replicas.size(); i-- > 0; ) {
+            short revents = pfds[i + 1].revents;
+            if ((revents & (POLLERR | POLLHUP)) || ((revents & POLLOUT) && !send_backlog(replicas[i].sock_fd, replicas[i].backlog, &replicas[i].backlog_offset))) {
+                close(replicas[i].sock_fd);
+                replicas.erase(replicas.begin() + i);
+            }
+        }
+
+        if (!(pfds[0].revents & POLLIN))
+            continue;
+        int replica_fd = accept4(s, nullptr, nullptr, SOCK_NONBLOCK);
+        if (replica_fd == -1)
+            continue;
+        int nodelay = 1;
+        setsockopt(replica_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        Replica replica = { replica_fd, {}, 0 };
+        if (send_replication_frame(replica, source.get_full_frame()))
+            replicas.push_back(std::move(replica));
+        else
+            close(replica_fd);
+    }
+}
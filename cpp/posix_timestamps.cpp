@@ -0,0 +1,70 @@
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#endif
+
+#include <fibre/fibre.hpp>
+#include <fibre/posix_timestamps.hpp>
+
+ssize_t recv_with_timestamps(int fd, uint8_t* buffer, size_t length,
+        struct sockaddr* address, socklen_t* address_length, bool* timestamping_enabled,
+        uint64_t* kernel_rx_ns, uint64_t* user_rx_ns) {
+    bool breakdown = fibre_get_latency_breakdown();
+#ifdef __linux__
+    if (breakdown && !*timestamping_enabled) {
+        int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+        setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+        *timestamping_enabled = true;
+    }
+    union {
+        char buffer[CMSG_SPACE(sizeof(struct scm_timestamping))];
+        struct cmsghdr align;
+    } control;
+#else
+    (void) timestamping_enabled;
+#endif
+
+    struct iovec iov = { buffer, length };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = address;
+    msg.msg_namelen = address_length ? *address_length : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+#ifdef __linux__
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+#endif
+
+    ssize_t n_received = recvmsg(fd, &msg, 0);
+    if (address_length)
+        *address_length = msg.msg_namelen;
+    *kernel_rx_ns = 0;
+    *user_rx_ns = 0;
+    if (n_received <= 0 || !breakdown)
+        return n_received;
+    *user_rx_ns = fibre_get_time_ns();
+
+#ifdef __linux__
+    // The kernel timestamp is in CLOCK_REALTIME, convert it by its age
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPING)
+            continue;
+        struct scm_timestamping timestamping;
+        memcpy(&timestamping, CMSG_DATA(cmsg), sizeof(timestamping));
+        const struct timespec& kernel_time = timestamping.ts[0]; // software timestamp
+        if (!kernel_time.tv_sec && !kernel_time.tv_nsec)
+            continue;
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        int64_t age_ns = (int64_t)(now.tv_sec - kernel_time.tv_sec) * 1000000000
+                + (now.tv_nsec - kernel_time.tv_nsec);
+        if (age_ns >= 0 && (uint64_t)age_ns < *user_rx_ns)
+            *kernel_rx_ns = *user_rx_ns - age_ns;
+    }
+#endif
+    return n_received;
+}
@@ -1,14 +1,23 @@
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #include <fibre/fibre.hpp>
+#include <fibre/posix_timestamps.hpp>
+
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
 
 #define UDP_RX_BUF_LEN	512
 #define UDP_TX_BUF_LEN	512
+#define UDP_MAX_SESSIONS	64
+#define UDP_MAX_LOST_SESSIONS	64
 
 
 class UDPPacketSender : public PacketSink {
@@ -34,6 +43,80 @@ private:
     struct sockaddr_in6 *_si_other;
 };
 
+static bool is_same_peer(const struct sockaddr_in6& a, const struct sockaddr_in6& b) {
+    return a.sin6_port == b.sin6_port
+        && !memcmp(&a.sin6_addr, &b.sin6_addr, sizeof(a.sin6_addr));
+}
+
+// @brief Channel state for one remote UDP peer.
+// The peer's address and port serve as session ID, so that session state
+// such as a verified descriptor CRC survives across datagrams.
+class UDPSession {
+public:
+    UDPSession(int socket_fd, const struct sockaddr_in6& si_other) :
+        si_other_(si_other),
+        output_(socket_fd, &si_other_),
+        channel_(output_)
+    {
+        // serve_on_udp() serves the bulk lanes
+        channel_.enable_priority_lanes();
+    }
+
+    struct sockaddr_in6 si_other_;
+    UDPPacketSender output_;
+    BidirectionalPacketBasedChannel channel_;
+    uint64_t last_used_ = 0;
+};
+
+// @brief Returns the session for the given peer. If there is none, a new
+// session is created, evicting the least recently used one if necessary.
+// The peers of evicted sessions with negotiated state are remembered in
+// lost_peers, so that the peer can be told when it returns.
+// @param state_lost: Set to true if the peer's previous session was evicted
+//        with negotiated state. The new session must not handle the peer's
+//        requests before it negotiated again.
+static UDPSession& get_session(std::vector<std::unique_ptr<UDPSession>>& sessions,
+        std::vector<struct sockaddr_in6>& lost_peers, int socket_fd,
+        const struct sockaddr_in6& si_other, uint64_t now, bool* state_lost) {
+    *state_lost = false;
+    UDPSession* lru = nullptr;
+    for (auto& session : sessions) {
+        if (is_same_peer(session->si_other_, si_other)) {
+            session->last_used_ = now;
+            return *session;
+        }
+        if (!lru || session->last_used_ < lru->last_used_)
+            lru = session.get();
+    }
+
+    for (auto it = lost_peers.begin(); it != lost_peers.end(); ++it) {
+        if (is_same_peer(*it, si_other)) {
+            lost_peers.erase(it);
+            *state_lost = true;
+            break;
+        }
+    }
+
+    std::unique_ptr<UDPSession> new_session(new UDPSession(socket_fd, si_other));
+    new_session->last_used_ = now;
+    if (sessions.size() < UDP_MAX_SESSIONS) {
+        sessions.push_back(std::move(new_session));
+        return *sessions.back();
+    }
+    for (auto& session : sessions) {
+        if (session.get() == lru) {
+            if (session->channel_.has_session_state()) {
+                if (lost_peers.size() >= UDP_MAX_LOST_SESSIONS)
+                    lost_peers.erase(lost_peers.begin()); // forget the oldest one
+                lost_peers.push_back(session->si_other_);
+            }
+            session = std::move(new_session);
+            return *session;
+        }
+    }
+    return *sessions.front(); // unreachable
+}
+
 
 
 int serve_on_udp(unsigned int port) {
@@ -53,18 +136,83 @@ int serve_on_udp(unsigned int port) {
     if (bind(s, reinterpret_cast<struct sockaddr *>(&si_me), sizeof(si_me)) == -1) 
         return -1;
 
+    std::vector<std::unique_ptr<UDPSession>> sessions;
+    std::vector<struct sockaddr_in6> lost_peers;
+    uint64_t n_packets = 0;
+    bool timestamping_enabled = false;
+
     for (;;) {
-        ssize_t n_received = recvfrom(s, buf, sizeof(buf), 0, reinterpret_cast<struct sockaddr *>(&si_other), &slen);
+        slen = sizeof(si_other);
+        uint64_t kernel_rx_ns, user_rx_ns;
+        ssize_t n_received = recv_with_timestamps(s, buf, sizeof(buf), reinterpret_cast<struct sockaddr *>(&si_other), &slen,
+                &timestamping_enabled, &kernel_rx_ns, &user_rx_ns);
         if (n_received == -1)
             return -1;
         //printf("Received packet from %s:%d\nData: %s\n\n",
         //    inet_ntoa(si_other.sin_addr), ntohs(si_other.sin_port), buf);
 
-        UDPPacketSender udp_packet_output(s, &si_other);
-        BidirectionalPacketBasedChannel udp_channel(udp_packet_output);
-        udp_channel.process_packet(buf, n_received);
+        bool state_lost;
+        UDPSession& session = get_session(sessions, lost_peers, s, si_other, ++n_packets, &state_lost);
+        if (state_lost) {
+            // The request may rely on the lost state, e.g. omit the trailer
+            session.channel_.send_session_lost(buf, n_received);
+        } else {
+            session.channel_.set_rx_timestamps(kernel_rx_ns, user_rx_ns);
+            session.channel_.process_packet(buf, n_received);
+        }
+
+        // Serve the bulk lanes of all sessions only while no datagram is
+        // waiting, so that control requests overtake queued bulk requests
+        for (bool served = true; served; ) {
+            served = false;
+            for (auto& session : sessions) {
+                struct pollfd pfd = { s, POLLIN, 0 };
+                if (!session->channel_.bulk_request_ready() || poll(&pfd, 1, 0) != 0)
+                    continue;
+                session->channel_.process_bulk_request();
+                served = true;
+            }
+        }
     }
 
     close(s);
 }
 
+int publish_telemetry_on_udp(const char* group_address, unsigned int port, const char* interface_address,
+        const uint16_t* endpoint_ids, size_t n_endpoint_ids, unsigned int interval_ms, size_t n_frames) {
+    struct sockaddr_in si_group;
+    int s;
+    uint8_t buf[UDP_TX_BUF_LEN];
+
+    memset((char *) &si_group, 0, sizeof(si_group));
+    si_group.sin_family = AF_INET;
+    si_group.sin_port = htons(port);
+    if (inet_pton(AF_INET, group_address, &si_group.sin_addr) != 1)
+        return -1;
+
+    if ((s=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+        return -1;
+
+    if (interface_address) {
+        struct in_addr interface_addr;
+        if (inet_pton(AF_INET, interface_address, &interface_addr) != 1
+                || setsockopt(s, IPPROTO_IP, IP_MULTICAST_IF, &interface_addr, sizeof(interface_addr)) == -1) {
+            close(s);
+            return -1;
+        }
+    }
+
+    auto next_sample = std::chrono::steady_clock::now();
+    for (uint32_t seq_no = 0; !n_frames || seq_no < n_frames; ++seq_no) {
+        size_t length = make_telemetry_frame(seq_no, endpoint_ids, n_endpoint_ids, buf, sizeof(buf));
+        // Lost frames are detected by the receivers, so send errors are not fatal
+        sendto(s, buf, length, 0, reinterpret_cast<struct sockaddr*>(&si_group), sizeof(si_group));
+
+        // Keep a fixed rate even if sampling takes a while
+        next_sample += std::chrono::milliseconds(interval_ms);
+        std::this_thread::sleep_until(next_sample);
+    }
+
+    close(s);
+    return 0;
+}
@@ -0,0 +1,43 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <fibre/posix_upload.hpp>
+
+bool FileUploadSink::begin(uint32_t size) {
+    if (fd_ >= 0)
+        close(fd_);
+    fd_ = open(part_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0)
+        return false;
+    if (ftruncate(fd_, size)) {
+        finish(false);
+        return false;
+    }
+    return true;
+}
+
+bool FileUploadSink::write(uint32_t offset, const uint8_t* buffer, size_t length) {
+    while (length) {
+        ssize_t written = pwrite(fd_, buffer, length, offset);
+        if (written <= 0)
+            return false;
+        buffer += written;
+        offset += written;
+        length -= written;
+    }
+    return true;
+}
+
+bool FileUploadSink::finish(bool commit) {
+    if (fd_ < 0)
+        return false;
+    bool ok = !commit || !fsync(fd_);
+    close(fd_);
+    fd_ = -1;
+    if (commit && ok)
+        ok = !rename(part_path_.c_str(), path_.c_str());
+    if (!commit || !ok)
+        unlink(part_path_.c_str());
+    return ok;
+}
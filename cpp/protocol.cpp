@@ -1,7 +1,10 @@
 
 /* Includes ------------------------------------------------------------------*/
 
+#include <algorithm>
+#include <chrono>
 #include <memory>
+#include <thread>
 #include <stdlib.h>
 
 #include <fibre/fibre.hpp>
@@ -14,12 +17,51 @@
 
 Endpoint** endpoint_list_ = nullptr; // initialized by calling fibre_publish
 size_t n_endpoints_ = 0; // initialized by calling fibre_publish
-uint16_t json_crc_; // initialized by calling fibre_publish
 JSONDescriptorEndpoint json_file_endpoint_ = JSONDescriptorEndpoint();
 EndpointProvider* application_endpoints_;
 
 /* Private constant data -----------------------------------------------------*/
 /* Private variables ---------------------------------------------------------*/
+
+// The JSON descriptor CRC is only valid if json_crc_state_ is JSON_CRC_VALID
+enum { JSON_CRC_INVALID, JSON_CRC_CALCULATING, JSON_CRC_VALID };
+static uint16_t json_crc_;
+static std::atomic<uint8_t> json_crc_state_{JSON_CRC_INVALID};
+
+// @brief Bounded lock-free multi-producer single-consumer queue of writes for
+// fibre_apply_pending(). Each slot carries a sequence number that tells
+// producers and the consumer whose turn it is (see D. Vyukov's bounded MPMC
+// queue, of which this is the single consumer variant). Producers claim
+// consecutive slots for a group of writes, which the consumer applies together.
+static struct PendingWriteQueue {
+    struct Slot {
+        std::atomic<size_t> seq;
+        size_t group_size; // number of slots in the group that starts at this slot
+        PendingWrite write;
+    };
+
+    PendingWriteQueue() {
+        for (size_t i = 0; i < WRITE_QUEUE_SIZE; ++i)
+            slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    Slot slots[WRITE_QUEUE_SIZE];
+    std::atomic<size_t> head{0}; // next slot to be claimed by a producer
+    size_t tail = 0; // next slot to be applied, only accessed by the consumer
+} pending_writes_;
+static_assert((WRITE_QUEUE_SIZE & (WRITE_QUEUE_SIZE - 1)) == 0, "WRITE_QUEUE_SIZE must be a power of 2 so that the slot index survives wraparound");
+
+static std::atomic<bool> write_handoff_enabled_{false};
+static std::atomic<uint32_t> dropped_writes_{0};
+static std::atomic<bool> call_handoff_enabled_{false};
+
+// Registered by the server threads, read by fibre_run_pending_calls()
+static std::atomic<CallQueue*> call_queues_[MAX_CALL_QUEUES];
+static std::atomic<size_t> n_call_queues_{0}; // number of slots that were ever used
+static std::atomic<CallQueue*> running_call_queue_{nullptr}; // queue that fibre_run_pending_calls() is working on
+
+// Sequence lock around transactions outside of write handoff mode, odd while a transaction is applied
+static std::atomic<uint32_t> transaction_seq_{0};
 /* Private function prototypes -----------------------------------------------*/
 
 static void hexdump(const uint8_t* buf, size_t len);
@@ -45,7 +87,226 @@ void hexdump(const uint8_t* buf, size_t len) {
 
 
 
+__attribute__((weak)) uint32_t fibre_get_time_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+__attribute__((weak)) uint64_t fibre_get_time_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void fibre_set_write_handoff(bool enable) {
+    write_handoff_enabled_.store(enable, std::memory_order_relaxed);
+}
+
+bool fibre_get_write_handoff() {
+    return write_handoff_enabled_.load(std::memory_order_relaxed);
+}
+
+bool fibre_enqueue_writes(const PendingWrite* writes, size_t n_writes) {
+    if (!n_writes)
+        return true;
+    if (n_writes > WRITE_QUEUE_SIZE) {
+        dropped_writes_.fetch_add(n_writes, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Claim n_writes consecutive slots. The consumer frees slots in order, so
+    // if the last one is free, all of them are.
+    size_t pos = pending_writes_.head.load(std::memory_order_relaxed);
+    for (;;) {
+        size_t last = pos + n_writes - 1;
+        PendingWriteQueue::Slot* slot = &pending_writes_.slots[last % WRITE_QUEUE_SIZE];
+        intptr_t diff = (intptr_t)slot->seq.load(std::memory_order_acquire) - (intptr_t)last; // wraparound safe
+        if (diff == 0) {
+            if (pending_writes_.head.compare_exchange_weak(pos, pos + n_writes, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            LOG_FIBRE("write queue full, dropping %u writes\r\n", (unsigned)n_writes);
+            dropped_writes_.fetch_add(n_writes, std::memory_order_relaxed);
+            return false; // the consumer didn't free this slot yet
+        } else {
+            pos = pending_writes_.head.load(std::memory_order_relaxed); // another producer was faster
+        }
+    }
+
+    // Hand the slots to the consumer, the first one last so that the
+    // consumer sees the group only when it's complete
+    for (size_t i = n_writes; i-- > 0; ) {
+        PendingWriteQueue::Slot* slot = &pending_writes_.slots[(pos + i) % WRITE_QUEUE_SIZE];
+        slot->group_size = i ? 0 : n_writes;
+        slot->write = writes[i];
+        slot->seq.store(pos + i + 1, std::memory_order_release);
+    }
+    return true;
+}
+
+uint32_t fibre_get_dropped_writes() {
+    return dropped_writes_.load(std::memory_order_relaxed);
+}
+
+size_t fibre_apply_pending() {
+    size_t n_applied = 0;
+    for (;;) {
+        size_t pos = pending_writes_.tail;
+        PendingWriteQueue::Slot* slot = &pending_writes_.slots[pos % WRITE_QUEUE_SIZE];
+        if (slot->seq.load(std::memory_order_acquire) != pos + 1)
+            break; // empty, or the producer is still filling in the group
+        size_t group_size = slot->group_size;
+        if (n_applied + group_size > WRITE_QUEUE_SIZE)
+            break; // keep the runtime bounded, the group is applied in the next call
+
+        for (size_t i = 0; i < group_size; ++i) {
+            slot = &pending_writes_.slots[(pos + i) % WRITE_QUEUE_SIZE];
+            slot->write.apply(slot->write.ctx, slot->write.value);
+            slot->seq.store(pos + i + WRITE_QUEUE_SIZE, std::memory_order_release); // hand the slot back to the producers
+        }
+        pending_writes_.tail = pos + group_size;
+        n_applied += group_size;
+    }
+    return n_applied;
+}
+
+void fibre_set_call_handoff(bool enable) {
+    call_handoff_enabled_.store(enable, std::memory_order_relaxed);
+}
+
+bool fibre_get_call_handoff() {
+    return call_handoff_enabled_.load(std::memory_order_relaxed);
+}
+
+bool CallQueue::Ring::push(const Message& message) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    if (pos - tail.load(std::memory_order_acquire) >= CALL_QUEUE_SIZE)
+        return false;
+    slots[pos % CALL_QUEUE_SIZE] = message;
+    head.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool CallQueue::Ring::pop(Message* message) {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    if (pos == head.load(std::memory_order_acquire))
+        return false;
+    *message = slots[pos % CALL_QUEUE_SIZE];
+    tail.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool CallQueue::push_call(const PendingCall& call, BidirectionalPacketBasedChannel* channel) {
+    // Limiting the calls in flight guarantees that run_calls() always finds
+    // room for the completions
+    if (n_in_flight_ >= CALL_QUEUE_SIZE || !calls_.push({ call, channel }))
+        return false;
+    n_in_flight_++;
+    return true;
+}
+
+size_t CallQueue::complete_calls() {
+    size_t n_completed = 0;
+    Message message;
+    while (completions_.pop(&message)) {
+        n_in_flight_--;
+        message.channel->complete_call();
+        n_completed++;
+    }
+    return n_completed;
+}
+
+size_t CallQueue::run_calls() {
+    size_t n_run = 0;
+    Message message;
+    while (n_run < CALL_QUEUE_SIZE && calls_.pop(&message)) {
+        message.call.invoke(message.call.ctx, message.call.args);
+        completions_.push(message);
+        n_run++;
+    }
+    if (n_run && notify_)
+        notify_(notify_ctx_);
+    return n_run;
+}
+
+bool fibre_register_call_queue(CallQueue* queue) {
+    for (size_t i = 0; i < MAX_CALL_QUEUES; ++i) {
+        CallQueue* free_slot = nullptr;
+        if (!call_queues_[i].compare_exchange_strong(free_slot, queue))
+            continue;
+        size_t n_queues = n_call_queues_.load();
+        while (n_queues < i + 1 && !n_call_queues_.compare_exchange_weak(n_queues, i + 1))
+            ;
+        return true;
+    }
+    return false;
+}
+
+void fibre_unregister_call_queue(CallQueue* queue) {
+    for (size_t i = 0; i < MAX_CALL_QUEUES; ++i) {
+        CallQueue* registered = queue;
+        if (call_queues_[i].compare_exchange_strong(registered, nullptr))
+            break;
+    }
+    // Wait until fibre_run_pending_calls() no longer uses the queue
+    while (running_call_queue_.load() == queue)
+        std::this_thread::yield();
+}
+
+size_t fibre_run_pending_calls() {
+    size_t n_run = 0;
+    size_t n_queues = n_call_queues_.load();
+    for (size_t i = 0; i < n_queues; ++i) {
+        CallQueue* queue = call_queues_[i].load();
+        if (!queue)
+            continue;
+        // Announce the queue before using it, then make sure it wasn't
+        // unregistered in the meantime
+        running_call_queue_.store(queue);
+        if (call_queues_[i].load() == queue)
+            n_run += queue->run_calls();
+        running_call_queue_.store(nullptr);
+    }
+    return n_run;
+}
+
+bool fibre_apply_transaction(const PendingWrite* writes, size_t n_writes) {
+    if (fibre_get_write_handoff())
+        return fibre_enqueue_writes(writes, n_writes);
+
+    // Transactions from different channels take turns
+    uint32_t seq = transaction_seq_.load(std::memory_order_relaxed);
+    while ((seq & 1) || !transaction_seq_.compare_exchange_weak(seq, seq + 1, std::memory_order_acquire))
+        seq = transaction_seq_.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    for (size_t i = 0; i < n_writes; ++i)
+        writes[i].apply(writes[i].ctx, writes[i].value);
+
+    transaction_seq_.store(seq + 2, std::memory_order_release);
+    return true;
+}
+
+uint32_t fibre_read_begin() {
+    for (;;) {
+        uint32_t seq = transaction_seq_.load(std::memory_order_acquire);
+        if (!(seq & 1))
+            return seq;
+    }
+}
+
+bool fibre_read_retry(uint32_t seq) {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return transaction_seq_.load(std::memory_order_relaxed) != seq;
+}
+
 int StreamToPacketSegmenter::process_bytes(const uint8_t *buffer, size_t length, size_t* processed_bytes) {
+    if (framing_ == FRAMING_LEAN)
+        return process_bytes_lean(buffer, length, processed_bytes);
+    else
+        return process_bytes_canonical(buffer, length, processed_bytes);
+}
+
+int StreamToPacketSegmenter::process_bytes_canonical(const uint8_t *buffer, size_t length, size_t* processed_bytes) {
     int result = 0;
 
     while (length--) {
@@ -61,14 +322,18 @@ int StreamToPacketSegmenter::process_bytes(const uint8_t *buffer, size_t length,
             } else if (header_index_ == 3) {
                 packet_length_ = header_buffer_[1] + 2;
             }
-        } else if (packet_index_ < sizeof(packet_buffer_)) {
-            // Process payload byte
-            packet_buffer_[packet_index_++] = *buffer;
+        } else {
+            // Process payload byte. Packets whose CRC doesn't fit into the
+            // buffer are dropped but still counted so that we stay in sync.
+            if (packet_index_ < sizeof(packet_buffer_))
+                packet_buffer_[packet_index_] = *buffer;
+            packet_index_++;
         }
 
         // If both header and packet are fully received, hand it on to the packet processor
         if (header_index_ == 3 && packet_index_ == packet_length_) {
-            if (calc_crc16<CANONICAL_CRC16_POLYNOMIAL>(CANONICAL_CRC16_INIT, packet_buffer_, packet_length_) == 0) {
+            if (packet_length_ <= sizeof(packet_buffer_)
+                    && calc_crc16<CANONICAL_CRC16_POLYNOMIAL>(CANONICAL_CRC16_INIT, packet_buffer_, packet_length_) == 0) {
                 result |= output_.process_packet(packet_buffer_, packet_length_ - 2);
             }
             header_index_ = packet_index_ = packet_length_ = 0;
@@ -76,12 +341,67 @@ int StreamToPacketSegmenter::process_bytes(const uint8_t *buffer, size_t length,
         buffer++;
         if (processed_bytes)
             (*processed_bytes)++;
+
+        // The packet we just handed on may have switched the framing
+        if (framing_ != FRAMING_CANONICAL)
+            return result | process_bytes(buffer, length, processed_bytes);
+    }
+
+    return result;
+}
+
+int StreamToPacketSegmenter::process_bytes_lean(const uint8_t *buffer, size_t length, size_t* processed_bytes) {
+    int result = 0;
+
+    while (length) {
+        size_t chunk = 1;
+        if (header_index_ < 2) {
+            // Process length prefix byte
+            header_buffer_[header_index_++] = *buffer;
+            if (header_index_ == 2)
+                packet_length_ = header_buffer_[0] | (header_buffer_[1] << 8);
+        } else {
+            // Process as many payload bytes as possible. Payload bytes that
+            // don't fit into the buffer are dropped but still counted so that
+            // we stay in sync with the stream.
+            chunk = std::min(length, packet_length_ - packet_index_);
+            if (packet_index_ < sizeof(packet_buffer_))
+                memcpy(packet_buffer_ + packet_index_, buffer, std::min(chunk, sizeof(packet_buffer_) - packet_index_));
+            packet_index_ += chunk;
+        }
+        buffer += chunk;
+        length -= chunk;
+        if (processed_bytes)
+            (*processed_bytes) += chunk;
+
+        // If both header and packet are fully received, hand it on to the packet processor
+        if (header_index_ == 2 && packet_index_ == packet_length_) {
+            if (packet_length_ <= sizeof(packet_buffer_))
+                result |= output_.process_packet(packet_buffer_, packet_length_);
+            header_index_ = packet_index_ = packet_length_ = 0;
+
+            // The packet we just handed on may have switched the framing
+            if (framing_ != FRAMING_LEAN)
+                return result | process_bytes(buffer, length, processed_bytes);
+        }
     }
 
     return result;
 }
 
 int StreamBasedPacketSink::process_packet(const uint8_t *buffer, size_t length) {
+    if (framing_ == FRAMING_LEAN) {
+        if (length > 0xffff)
+            return -1;
+        uint8_t header[2];
+        write_le<uint16_t>(length, header);
+        if (output_.process_bytes(header, sizeof(header), nullptr))
+            return -1;
+        if (output_.process_bytes(buffer, length, nullptr))
+            return -1;
+        return 0;
+    }
+
     // TODO: support buffer size >= 128
     if (length >= 128)
         return -1;
@@ -120,8 +440,8 @@ void JSONDescriptorEndpoint::write_json(size_t id, StreamSink* output) {
 
     // write endpoint ID
     write_string("\"id\":", output);
-    char id_buf[10];
-    snprintf(id_buf, sizeof(id_buf), "%u", (unsigned)id); // TODO: get rid of printf
+    char id_buf[11];
+    format_uint(id, id_buf, sizeof(id_buf));
     write_string(id_buf, output);
 
     write_string(",\"type\":\"json\",\"access\":\"r\"}", output);
@@ -133,19 +453,50 @@ void JSONDescriptorEndpoint::register_endpoints(Endpoint** list, size_t id, size
 }
 
 // Returns part of the JSON interface definition.
+// Input: u32 offset, optionally followed by a NUL-terminated dot-separated
+// object path. Without a path the complete descriptor is returned as JSON
+// array. With a path, only the members of this object are returned as
+// {"members":[...]}, where child objects are stubs without "members" that
+// can be fetched the same way. An empty path selects the root object.
+// The response is empty if there is no object with the specified path.
 void JSONDescriptorEndpoint::handle(const uint8_t* input, size_t input_length, StreamSink* output) {
     // The request must contain a 32 bit integer to specify an offset
     if (input_length < 4)
         return;
+    // There is no descriptor before fibre_publish(), e.g. if a session
+    // control request asks for the CRC early
+    if (!application_endpoints_)
+        return;
     uint32_t offset = 0;
     read_le<uint32_t>(&offset, input);
     NullStreamSink output_with_offset = NullStreamSink(offset, *output);
+    bool has_application_endpoints = application_endpoints_->get_endpoint_count() > 0;
+    size_t id = decltype(json_file_endpoint_)::endpoint_count;
+
+    if (input_length > 4) {
+        const char* path = reinterpret_cast<const char*>(input + 4);
+        size_t path_length = strnlen(path, input_length - 4);
+        if (path_length) {
+            // Look the path up before anything is written
+            NullStreamSink discard(SIZE_MAX, *output);
+            if (!application_endpoints_->write_subtree_json(id, path, path_length, &discard))
+                return;
+        }
+        write_string("{\"members\":[", &output_with_offset);
+        if (!path_length) {
+            json_file_endpoint_.write_json(0, &output_with_offset);
+            if (has_application_endpoints)
+                write_string(",", &output_with_offset);
+        }
+        application_endpoints_->write_subtree_json(id, path, path_length, &output_with_offset);
+        write_string("]}", &output_with_offset);
+        return;
+    }
 
-    size_t id = 0;
     write_string("[", &output_with_offset);
-    json_file_endpoint_.write_json(id, &output_with_offset);
-    id += decltype(json_file_endpoint_)::endpoint_count;
-    write_string(",", &output_with_offset);
+    json_file_endpoint_.write_json(0, &output_with_offset);
+    if (has_application_endpoints)
+        write_string(",", &output_with_offset);
     application_endpoints_->write_json(id, &output_with_offset);
     write_string("]", &output_with_offset);
 }
@@ -156,59 +507,497 @@ int BidirectionalPacketBasedChannel::process_packet(const uint8_t* buffer, size_
     if (length < 4)
         return -1;
 
-    uint16_t seq_no = read_le<uint16_t>(&buffer, &length);
-
-    if (seq_no & 0x8000) {
+    if (buffer[1] & 0x80) {
         // TODO: ack handling
-    } else {
-        // TODO: think about some kind of ordering guarantees
-        // currently the seq_no is just used to associate a response with a request
+        return 0;
+    }
+
+    // TODO: think about some kind of ordering guarantees
+    // currently the seq_no is just used to associate a response with a request
+
+    RequestTimestamps timestamps = rx_timestamps_;
+    if (fibre_get_latency_breakdown())
+        timestamps.segmented_ns = fibre_get_time_ns();
+
+    RequestHeader header;
+    const uint8_t* payload = buffer;
+    size_t payload_length = length;
+    if (decode_request(&payload, &payload_length, &header))
+        return -1;
+
+    if (priority_lanes_ && header.endpoint && (header.seq_no & BULK_SEQ_NO_FLAG)) {
+        if (length > RX_BUF_SIZE) {
+            // Doesn't fit into a bulk lane slot
+            LOG_FIBRE("bulk lane: dropping oversized request\r\n");
+            completed_requests_++;
+            return -1;
+        }
+        if (n_bulk_ >= BULK_QUEUE_SIZE) {
+            if (!bulk_request_ready()) {
+                // The peer ignored the granted window
+                LOG_FIBRE("bulk lane full: dropping request\r\n");
+                completed_requests_++;
+                return -1;
+            }
+            process_bulk_request();
+        }
+        size_t slot = (bulk_head_ + n_bulk_++) % BULK_QUEUE_SIZE;
+        memcpy(bulk_requests_[slot], buffer, length);
+        bulk_lengths_[slot] = length;
+        bulk_timestamps_[slot] = timestamps;
+        return 0;
+    }
+
+    return dispatch_request(buffer, length, header, payload, payload_length, timestamps);
+}
+
+void BidirectionalPacketBasedChannel::process_bulk_request() {
+    if (!n_bulk_)
+        return;
+    const uint8_t* buffer = bulk_requests_[bulk_head_];
+    size_t length = bulk_lengths_[bulk_head_];
+    RequestTimestamps timestamps = bulk_timestamps_[bulk_head_];
+    bulk_head_ = (bulk_head_ + 1) % BULK_QUEUE_SIZE;
+    n_bulk_--;
+
+    // Decode again because the session state may have changed in the meantime
+    RequestHeader header;
+    const uint8_t* payload = buffer;
+    size_t payload_length = length;
+    if (decode_request(&payload, &payload_length, &header)) {
+        completed_requests_++;
+        return;
+    }
+    dispatch_request(buffer, length, header, payload, payload_length, timestamps);
+}
+
+int BidirectionalPacketBasedChannel::dispatch_request(const uint8_t* buffer, size_t length,
+        const RequestHeader& header, const uint8_t* payload, size_t payload_length,
+        const RequestTimestamps& timestamps) {
+    // Session control requests bypass flow control so that credit grants
+    // can't get stuck behind the requests that wait for them.
+    // While a function call is handed off, later requests wait for it.
+    if (header.endpoint && (call_in_flight_ || flow_control_)) {
+        if (call_in_flight_ || n_deferred_ || !can_send_response()) {
+            if (n_deferred_ >= RX_WINDOW_SIZE || length > RX_BUF_SIZE) {
+                // The peer ignored the granted window or pipelined too
+                // many requests behind a function call
+                LOG_FIBRE("deferred request queue full: dropping request\r\n");
+                completed_requests_++;
+                return -1;
+            }
+            size_t slot = (deferred_head_ + n_deferred_++) % RX_WINDOW_SIZE;
+            memcpy(deferred_requests_[slot], buffer, length);
+            deferred_lengths_[slot] = length;
+            deferred_timestamps_[slot] = timestamps;
+            return 0;
+        }
+    }
+
+    handle_request(header, payload, payload_length, timestamps);
+    if (!header.endpoint)
+        process_deferred_requests(); // the request may have granted new credit
+    return 0;
+}
 
-        uint16_t endpoint_id = read_le<uint16_t>(&buffer, &length);
-        bool expect_response = endpoint_id & 0x8000;
-        endpoint_id &= 0x7fff;
+int BidirectionalPacketBasedChannel::decode_request(const uint8_t** buffer, size_t* length, RequestHeader* header) {
+    header->seq_no = read_le<uint16_t>(buffer, length);
+
+    if (header_mode_ == HEADER_MODE_COMPACT) {
+        uint32_t endpoint_id_and_flags, response_length;
+        if (read_varint(buffer, length, &endpoint_id_and_flags)
+                || read_varint(buffer, length, &response_length))
+            return -1;
+        header->expect_response = endpoint_id_and_flags & 1;
+        endpoint_id_and_flags >>= 1;
+        if (endpoint_id_and_flags > 0x7fff)
+            return -1;
+        header->endpoint_id = endpoint_id_and_flags;
+        header->expected_response_length = std::min(response_length, static_cast<uint32_t>(0xffff));
+    } else {
+        if (*length < (session_verified_ ? 4 : 6))
+            return -1;
+        header->endpoint_id = read_le<uint16_t>(buffer, length);
+        header->expect_response = header->endpoint_id & 0x8000;
+        header->endpoint_id &= 0x7fff;
+        header->expected_response_length = read_le<uint16_t>(buffer, length);
+    }
 
+    uint16_t endpoint_id = header->endpoint_id;
+    header->endpoint = nullptr;
+    if (endpoint_id != SESSION_CONTROL_ENDPOINT_ID) {
         if (endpoint_id >= n_endpoints_)
             return -1;
 
-        Endpoint* endpoint = endpoint_list_[endpoint_id];
-        if (!endpoint) {
+        header->endpoint = endpoint_list_[endpoint_id];
+        if (!header->endpoint) {
             LOG_FIBRE("critical: no endpoint at %d", endpoint_id);
             return -1;
         }
+    }
 
+    if (session_verified_) {
+        // The peer proved its descriptor CRC for this session so requests
+        // carry no trailer. A republished descriptor invalidates the proof
+        // for all endpoints that depend on the descriptor.
+        if (endpoint_id && header->endpoint && session_json_crc_ != fibre_get_json_crc()) {
+            LOG_FIBRE("stale session: descriptor changed since verification\r\n");
+            return -1;
+        }
+    } else {
         // Verify packet trailer. The expected trailer value depends on the selected endpoint.
-        // For endpoint 0 this is just the protocol version, for all other endpoints it's a
-        // CRC over the entire JSON descriptor tree (this may change in future versions).
-        uint16_t expected_trailer = endpoint_id ? json_crc_ : PROTOCOL_VERSION;
-        uint16_t actual_trailer = buffer[length - 2] | (buffer[length - 1] << 8);
+        // For endpoint 0 and the session control endpoint this is just the protocol version,
+        // for all other endpoints it's a CRC over the entire JSON descriptor tree (this may
+        // change in future versions).
+        uint16_t expected_trailer = (endpoint_id && header->endpoint) ? fibre_get_json_crc() : PROTOCOL_VERSION;
+        uint16_t actual_trailer = (*buffer)[*length - 2] | ((*buffer)[*length - 1] << 8);
         if (expected_trailer != actual_trailer) {
             LOG_FIBRE("trailer mismatch for endpoint %d: expected %04x, got %04x\r\n", endpoint_id, expected_trailer, actual_trailer);
             return -1;
         }
         LOG_FIBRE("trailer ok for endpoint %d\r\n", endpoint_id);
+        *length -= 2;
+    }
 
-        // TODO: if more bytes than the MTU were requested, should we abort or just return as much as possible?
+    return 0;
+}
+
+void BidirectionalPacketBasedChannel::handle_request(const RequestHeader& header, const uint8_t* input, size_t input_length,
+        RequestTimestamps timestamps) {
+    // The response to the request that enables flow control is still sent
+    // without credit field, likewise for timestamps
+    bool with_credit = flow_control_;
+    bool with_timestamp = response_timestamps_;
+    size_t header_length = 2 + (with_credit ? 1 : 0) + (with_timestamp ? 8 : 0);
+
+    // The handler time is also the response timestamp and is needed by SESSION_OP_GET_TIME
+    bool timed = fibre_get_latency_breakdown();
+    if (timed || with_timestamp || !header.endpoint)
+        timestamps.handler_ns = fibre_get_time_ns();
+
+    // In call handoff mode the response is sent by complete_call()
+    PendingCall call;
+    if (header.endpoint && call_queue_ && fibre_get_call_handoff() && header.endpoint->prepare_call(&call)) {
+        if (!call_queue_->push_call(call, this)) {
+            LOG_FIBRE("call queue full: dropping request\r\n");
+            completed_requests_++;
+            return;
+        }
+        call_in_flight_ = true;
+        call_header_ = header;
+        call_timestamps_ = timestamps;
+        return;
+    }
 
-        uint16_t expected_response_length = read_le<uint16_t>(&buffer, &length);
+    // TODO: if more bytes than the MTU were requested, should we abort or just return as much as possible?
 
-        // Limit response length according to our local TX buffer size
-        if (expected_response_length > sizeof(tx_buf_) - 2)
-            expected_response_length = sizeof(tx_buf_) - 2;
+    // Limit response length according to our local TX buffer size
+    uint16_t expected_response_length = header.expected_response_length;
+    if (expected_response_length > sizeof(tx_buf_) - header_length)
+        expected_response_length = sizeof(tx_buf_) - header_length;
 
-        MemoryStreamSink output(tx_buf_ + 2, expected_response_length);
-        endpoint->handle(buffer, length - 2, &output);
+    MemoryStreamSink output(tx_buf_ + header_length, expected_response_length);
+    if (header.endpoint)
+        header.endpoint->handle(input, input_length, &output);
+    else
+        handle_session_control(input, input_length, &output, timestamps);
 
-        // Send response
-        if (expect_response) {
-            size_t actual_response_length = expected_response_length - output.get_free_space() + 2;
-            write_le<uint16_t>(seq_no | 0x8000, tx_buf_);
+    if (header.endpoint)
+        completed_requests_++;
+    if (timed)
+        timestamps.handled_ns = fibre_get_time_ns();
 
-            LOG_FIBRE("send packet:\r\n");
-            hexdump(tx_buf_, actual_response_length);
-            output_.process_packet(tx_buf_, actual_response_length);
+    send_response(header, expected_response_length - output.get_free_space() + header_length,
+            timestamps, with_credit, with_timestamp);
+}
+
+void BidirectionalPacketBasedChannel::complete_call() {
+    if (!call_in_flight_)
+        return;
+    call_in_flight_ = false;
+    completed_requests_++;
+
+    // A function call has no response payload, its outputs are read with
+    // separate requests
+    bool with_credit = flow_control_;
+    bool with_timestamp = response_timestamps_;
+    if (fibre_get_latency_breakdown())
+        call_timestamps_.handled_ns = fibre_get_time_ns();
+    send_response(call_header_, 2 + (with_credit ? 1 : 0) + (with_timestamp ? 8 : 0),
+            call_timestamps_, with_credit, with_timestamp);
+    process_deferred_requests();
+}
+
+// @brief Fills in the response header in tx_buf_ and sends the response.
+// @param length: The length of the response including the header.
+void BidirectionalPacketBasedChannel::send_response(const RequestHeader& header, size_t length,
+        RequestTimestamps& timestamps, bool with_credit, bool with_timestamp) {
+    bool timed = fibre_get_latency_breakdown();
+    if (header.expect_response) {
+        write_le<uint16_t>(header.seq_no | 0x8000, tx_buf_);
+        if (with_credit)
+            tx_buf_[2] = completed_requests_;
+        if (with_timestamp)
+            write_le<uint64_t>(timestamps.handler_ns, tx_buf_ + (with_credit ? 3 : 2));
+
+        LOG_FIBRE("send packet:\r\n");
+        hexdump(tx_buf_, length);
+        output_.process_packet(tx_buf_, length);
+        if (with_credit)
+            sent_bytes_ += length; // the peer only counts responses that carry credit
+        if (timed)
+            timestamps.sent_ns = fibre_get_time_ns();
+    }
+    if (timed)
+        fibre_record_latency(header.endpoint_id, header.seq_no, timestamps);
+
+    // A framing change takes effect after the response was sent
+    if (pending_framing_ != framing_) {
+        framing_ = pending_framing_;
+        framing_input_->set_framing(framing_);
+        framing_output_->set_framing(framing_);
+    }
+}
+
+void BidirectionalPacketBasedChannel::send_session_lost(const uint8_t* request, size_t length) {
+    if (length < 2)
+        return;
+    // The seq_no comes first in all header modes
+    uint8_t packet[9];
+    write_le<uint16_t>(read_le<uint16_t>(&request, &length) & 0x7fff, packet);
+    write_le<uint16_t>(SESSION_CONTROL_ENDPOINT_ID, packet + 2);
+    write_le<uint16_t>(0, packet + 4);
+    packet[6] = SESSION_OP_SESSION_LOST;
+    write_le<uint16_t>(PROTOCOL_VERSION, packet + 7);
+    output_.process_packet(packet, sizeof(packet));
+}
+
+// @brief Returns true if the peer has room for a response of maximum size
+bool BidirectionalPacketBasedChannel::can_send_response() {
+    uint32_t in_flight = sent_bytes_ - consumed_bytes_;
+    return in_flight + sizeof(tx_buf_) <= peer_window_;
+}
+
+void BidirectionalPacketBasedChannel::process_deferred_requests() {
+    while (n_deferred_ && !call_in_flight_ && (!flow_control_ || can_send_response())) {
+        const uint8_t* buffer = deferred_requests_[deferred_head_];
+        size_t length = deferred_lengths_[deferred_head_];
+        const RequestTimestamps& timestamps = deferred_timestamps_[deferred_head_];
+        deferred_head_ = (deferred_head_ + 1) % RX_WINDOW_SIZE;
+        n_deferred_--;
+
+        // Decode again because the session state may have changed in the meantime
+        RequestHeader header;
+        if (decode_request(&buffer, &length, &header)) {
+            completed_requests_++;
+            continue;
         }
+        handle_request(header, buffer, length, timestamps);
     }
+}
 
-    return 0;
+bool BidirectionalPacketBasedChannel::verify_session(uint16_t client_json_crc) {
+    session_verified_ = (client_json_crc == fibre_get_json_crc());
+    session_json_crc_ = client_json_crc;
+    if (!session_verified_)
+        header_mode_ = HEADER_MODE_CANONICAL; // the compact mode requires a verified session
+    return session_verified_;
+}
+
+void BidirectionalPacketBasedChannel::handle_session_control(const uint8_t* input, size_t input_length, StreamSink* output,
+        const RequestTimestamps& timestamps) {
+    if (input_length < 1)
+        return;
+    uint8_t opcode = read_le<uint8_t>(&input, &input_length);
+
+    switch (opcode) {
+        case SESSION_OP_SET_FRAMING: {
+            if (input_length < 1)
+                return;
+            uint8_t requested = read_le<uint8_t>(&input, &input_length);
+            // Lean framing is only granted if the transport declared itself reliable
+            if (requested == FRAMING_CANONICAL || (requested == FRAMING_LEAN && framing_input_ && framing_output_))
+                pending_framing_ = static_cast<StreamFraming>(requested);
+            uint8_t response = pending_framing_;
+            output->process_bytes(&response, 1, nullptr);
+            break;
+        }
+        case SESSION_OP_SET_HEADER_MODE: {
+            if (input_length < 3)
+                return;
+            uint8_t requested = read_le<uint8_t>(&input, &input_length);
+            uint16_t client_json_crc = read_le<uint16_t>(&input, &input_length);
+            // The compact header mode has no trailer, so it implies a verified session
+            if (requested == HEADER_MODE_CANONICAL) {
+                header_mode_ = HEADER_MODE_CANONICAL;
+            } else if (requested == HEADER_MODE_COMPACT && verify_session(client_json_crc)) {
+                header_mode_ = HEADER_MODE_COMPACT;
+            }
+            uint8_t response = header_mode_;
+            output->process_bytes(&response, 1, nullptr);
+            break;
+        }
+        case SESSION_OP_VERIFY_DESCRIPTOR: {
+            if (input_length < 2)
+                return;
+            uint16_t client_json_crc = read_le<uint16_t>(&input, &input_length);
+            uint8_t response = verify_session(client_json_crc) ? 1 : 0;
+            output->process_bytes(&response, 1, nullptr);
+            break;
+        }
+        case SESSION_OP_SET_FLOW_CONTROL: {
+            if (input_length < 2)
+                return;
+            uint16_t peer_window = read_le<uint16_t>(&input, &input_length);
+            // A window smaller than one response would stall the channel forever
+            peer_window_ = std::max(peer_window, static_cast<uint16_t>(sizeof(tx_buf_)));
+            sent_bytes_ = consumed_bytes_ = 0;
+            completed_requests_ = 0;
+            flow_control_ = true;
+            uint8_t response = RX_WINDOW_SIZE;
+            output->process_bytes(&response, 1, nullptr);
+            break;
+        }
+        case SESSION_OP_GRANT_CREDIT: {
+            if (input_length < 4)
+                return;
+            uint32_t consumed_bytes = read_le<uint32_t>(&input, &input_length);
+            // Ignore reports that are older than what we already know
+            if (consumed_bytes - consumed_bytes_ <= sent_bytes_ - consumed_bytes_)
+                consumed_bytes_ = consumed_bytes;
+            break;
+        }
+        case SESSION_OP_SET_PRIORITY_LANES: {
+            if (input_length < 1)
+                return;
+            // Priority lanes are only granted if the transport serves the bulk lane
+            priority_lanes_ = input[0] && priority_lanes_allowed_;
+            // Requests that are already queued are still served
+            uint8_t response = priority_lanes_ ? 1 : 0;
+            output->process_bytes(&response, 1, nullptr);
+            break;
+        }
+        case SESSION_OP_TRANSACTION: {
+            if (input_length < 2)
+                return;
+            uint16_t client_json_crc = read_le<uint16_t>(&input, &input_length);
+            uint8_t response = 0;
+            if (client_json_crc == fibre_get_json_crc()) {
+                // Decode all writes before applying any of them
+                PendingWrite writes[TRANSACTION_MAX_WRITES];
+                size_t n_writes = 0;
+                while (input_length >= 3 && n_writes < TRANSACTION_MAX_WRITES) {
+                    uint16_t endpoint_id = read_le<uint16_t>(&input, &input_length);
+                    uint8_t value_length = read_le<uint8_t>(&input, &input_length);
+                    Endpoint* endpoint = (endpoint_id && endpoint_id < n_endpoints_) ? endpoint_list_[endpoint_id] : nullptr;
+                    if (value_length > input_length || !endpoint
+                            || !endpoint->prepare_write(input, value_length, &writes[n_writes]))
+                        break;
+                    input += value_length;
+                    input_length -= value_length;
+                    n_writes++;
+                }
+                // Reject the transaction if any write is invalid or doesn't fit
+                if (!input_length && fibre_apply_transaction(writes, n_writes))
+                    response = n_writes;
+            }
+            output->process_bytes(&response, 1, nullptr);
+            break;
+        }
+        case SESSION_OP_GET_DESCRIPTOR_CRC: {
+            uint8_t response[2];
+            write_le<uint16_t>(fibre_get_json_crc(), response);
+            output->process_bytes(response, sizeof(response), nullptr);
+            break;
+        }
+        case SESSION_OP_GET_TIME: {
+            uint64_t rx_ns = timestamps.kernel_rx_ns ? timestamps.kernel_rx_ns
+                    : timestamps.user_rx_ns ? timestamps.user_rx_ns : timestamps.handler_ns;
+            uint8_t response[16];
+            write_le<uint64_t>(rx_ns, response);
+            write_le<uint64_t>(fibre_get_time_ns(), response + 8);
+            output->process_bytes(response, sizeof(response), nullptr);
+            break;
+        }
+        case SESSION_OP_SET_TIMESTAMPS: {
+            if (input_length < 1)
+                return;
+            response_timestamps_ = input[0];
+            uint8_t response = response_timestamps_ ? 1 : 0;
+            output->process_bytes(&response, 1, nullptr);
+            break;
+        }
+        default:
+            LOG_FIBRE("unknown session control opcode %d\r\n", opcode);
+            break;
+    }
+}
+
+uint16_t fibre_get_json_crc() {
+    uint8_t state = json_crc_state_.load(std::memory_order_acquire);
+    while (state != JSON_CRC_VALID) {
+        if (state == JSON_CRC_INVALID && json_crc_state_.compare_exchange_weak(state, JSON_CRC_CALCULATING,
+                std::memory_order_acquire)) {
+            // Calculate the CRC16 of the JSON file.
+            // The init value is the protocol version.
+            CRC16Calculator crc16_calculator(PROTOCOL_VERSION);
+            uint8_t offset[4] = { 0 };
+            json_file_endpoint_.handle(offset, sizeof(offset), &crc16_calculator);
+            json_crc_ = crc16_calculator.get_crc16();
+            json_crc_state_.store(JSON_CRC_VALID, std::memory_order_release);
+            break;
+        }
+        // Another thread is calculating the CRC
+        state = json_crc_state_.load(std::memory_order_acquire);
+    }
+    return json_crc_;
+}
+
+void fibre_set_json_crc(uint16_t json_crc) {
+    json_crc_ = json_crc;
+    json_crc_state_.store(JSON_CRC_VALID, std::memory_order_release);
+}
+
+void fibre_invalidate_json_crc() {
+    json_crc_state_.store(JSON_CRC_INVALID, std::memory_order_release);
+}
+
+bool fibre_sample_endpoint(Endpoint* endpoint, uint8_t* buffer, size_t* length) {
+    PendingCall call;
+    if (endpoint->prepare_call(&call))
+        return false;
+    MemoryStreamSink output(buffer, *length);
+    endpoint->handle(nullptr, 0, &output);
+    *length -= output.get_free_space();
+    return true;
+}
+
+size_t make_telemetry_frame(uint32_t seq_no, const uint16_t* endpoint_ids, size_t n_endpoint_ids,
+        uint8_t* buffer, size_t length) {
+    if (length < 6)
+        return 0;
+    size_t pos = write_le<uint32_t>(seq_no, buffer);
+    pos += write_le<uint16_t>(fibre_get_json_crc(), buffer + pos);
+
+    for (size_t i = 0; i < n_endpoint_ids; ++i) {
+        uint16_t endpoint_id = endpoint_ids[i];
+        Endpoint* endpoint = endpoint_id < n_endpoints_ ? endpoint_list_[endpoint_id] : nullptr;
+        if (!endpoint_id || !endpoint)
+            continue;
+
+        uint8_t value[TX_BUF_SIZE];
+        size_t value_length = sizeof(value);
+        if (!fibre_sample_endpoint(endpoint, value, &value_length))
+            continue;
+
+        uint8_t entry_header[10];
+        size_t header_length = write_varint(endpoint_id, entry_header, sizeof(entry_header));
+        header_length += write_varint(value_length, entry_header + header_length, sizeof(entry_header) - header_length);
+        if (pos + header_length + value_length > length)
+            continue;
+        memcpy(buffer + pos, entry_header, header_length);
+        memcpy(buffer + pos + header_length, value, value_length);
+        pos += header_length + value_length;
+    }
+    return pos;
 }
@@ -0,0 +1,225 @@
+#include <fibre/proxy.hpp>
+
+#include <string>
+
+// @brief Returns the value of a string member (e.g. "type") of the JSON object
+// that starts at pos, or an empty string if the object has no such member.
+// Only understands the flat layout that JSONDescriptorEndpoint generates.
+static std::string get_json_member(const std::string& json, size_t pos, const char* name) {
+    std::string key = std::string("\"") + name + "\":\"";
+    size_t object_end = json.find_first_of("{}", pos);
+    size_t key_pos = json.find(key, pos);
+    if (key_pos == std::string::npos || key_pos > object_end)
+        return "";
+    size_t value_pos = key_pos + key.size();
+    size_t value_end = json.find('"', value_pos);
+    return json.substr(value_pos, value_end - value_pos);
+}
+
+// @brief Compares sequence numbers that may wrap around.
+static bool seq_no_reached(uint32_t seq_no, uint32_t target) {
+    return (int32_t)(seq_no - target) >= 0;
+}
+
+int Proxy::publish() {
+    if (upstream_.read_buffer(0, &descriptor_))
+        return -1;
+    uint16_t json_crc = calc_crc16<CANONICAL_CRC16_POLYNOMIAL>(PROTOCOL_VERSION, descriptor_.data(), descriptor_.size());
+    upstream_.set_json_crc(json_crc);
+
+    // Find all endpoint IDs and their kind
+    std::string json(descriptor_.begin(), descriptor_.end());
+    std::vector<EndpointKind> kinds;
+    const std::string id_key = "\"id\":";
+    for (size_t pos = json.find(id_key); pos != std::string::npos; pos = json.find(id_key, pos + 1)) {
+        size_t endpoint_id = strtoul(json.c_str() + pos + id_key.size(), nullptr, 10);
+        if (endpoint_id >= SESSION_CONTROL_ENDPOINT_ID)
+            continue;
+        if (endpoint_id >= kinds.size())
+            kinds.resize(endpoint_id + 1, ENDPOINT_OTHER);
+        std::string type = get_json_member(json, pos, "type");
+        std::string access = get_json_member(json, pos, "access");
+        if (type == "function")
+            kinds[endpoint_id] = ENDPOINT_FUNCTION;
+        else if (type != "json" && type != "object" && access.find('r') != std::string::npos)
+            kinds[endpoint_id] = ENDPOINT_PROPERTY;
+    }
+    if (kinds.empty())
+        return -1;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    endpoints_.clear();
+    endpoints_.emplace_back(new DescriptorEndpoint(*this));
+    for (size_t i = 1; i < kinds.size(); ++i)
+        endpoints_.emplace_back(new ForwardingEndpoint(*this, i));
+    endpoint_table_.clear();
+    for (auto& endpoint : endpoints_)
+        endpoint_table_.push_back(endpoint.get());
+    cache_ = std::vector<CachedValue>(kinds.size());
+    for (size_t i = 0; i < kinds.size(); ++i)
+        cache_[i].kind = kinds[i];
+    replicating_ = false;
+    has_stale_values_ = false;
+
+    // Update the global endpoint table (see fibre_publish)
+    ::endpoint_list_ = endpoint_table_.data();
+    ::n_endpoints_ = endpoint_table_.size();
+    fibre_set_json_crc(json_crc);
+    return 0;
+}
+
+void Proxy::DescriptorEndpoint::handle(const uint8_t* input, size_t input_length, StreamSink* output) {
+    // The request must contain a 32 bit integer to specify an offset
+    if (input_length < 4)
+        return;
+    uint32_t offset = 0;
+    read_le<uint32_t>(&offset, input);
+    if (offset < proxy_.descriptor_.size())
+        output->process_bytes(proxy_.descriptor_.data() + offset, proxy_.descriptor_.size() - offset, nullptr);
+}
+
+void Proxy::forward(uint16_t endpoint_id, const uint8_t* input, size_t input_length, StreamSink* output) {
+    EndpointKind kind;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        downstream_requests_++;
+        kind = cache_[endpoint_id].kind;
+    }
+
+    if (kind == ENDPOINT_PROPERTY && !input_length) {
+        read_property(endpoint_id, output);
+        return;
+    }
+
+    uint8_t response[TX_BUF_SIZE];
+    size_t response_length = std::min(output->get_free_space(), sizeof(response));
+    int status = upstream_.request(endpoint_id, input, input_length, response, &response_length);
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        upstream_requests_++;
+        if (kind == ENDPOINT_FUNCTION) {
+            for (size_t i = 0; i < cache_.size(); ++i)
+                invalidate(i);
+        } else {
+            invalidate(endpoint_id);
+        }
+    }
+    if (!status)
+        output->process_bytes(response, response_length, nullptr);
+}
+
+void Proxy::read_property(uint16_t endpoint_id, StreamSink* output) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    CachedValue& entry = cache_[endpoint_id];
+
+    if (entry.valid && ((replicating_ && entry.replicated)
+            || std::chrono::steady_clock::now() - entry.timestamp < cache_ttl_)) {
+        output->process_bytes(entry.value, entry.length, nullptr);
+        return;
+    }
+
+    if (entry.in_flight) {
+        // Coalesce with the read that is already waiting for the upstream node
+        fetch_done_.wait(lock, [&entry]{ return !entry.in_flight; });
+    } else {
+        entry.in_flight = true;
+        uint32_t generation = entry.generation;
+        lock.unlock();
+        uint8_t value[TX_BUF_SIZE];
+        size_t length = sizeof(value);
+        int status = upstream_.request(endpoint_id, nullptr, 0, value, &length);
+        lock.lock();
+
+        upstream_requests_++;
+        entry.fetch_ok = !status;
+        if (!status) {
+            memcpy(entry.value, value, length);
+            entry.length = length;
+            entry.timestamp = std::chrono::steady_clock::now();
+            // Don't cache a value that a concurrent write may have changed.
+            // Replicated values only become valid with a replication frame.
+            if (!(replicating_ && entry.replicated))
+                entry.valid = (generation == entry.generation);
+        }
+        entry.in_flight = false;
+        fetch_done_.notify_all();
+    }
+
+    if (entry.fetch_ok)
+        output->process_bytes(entry.value, entry.length, nullptr);
+}
+
+void Proxy::invalidate(uint16_t endpoint_id) {
+    cache_[endpoint_id].valid = false;
+    cache_[endpoint_id].generation++;
+    // The next frame may have been sampled before the upstream node applied
+    // the request, the one after that was not
+    if (replicating_ && cache_[endpoint_id].replicated) {
+        cache_[endpoint_id].stale_until_seq_no = replication_seq_no_ + 2;
+        has_stale_values_ = true;
+    }
+}
+
+int Proxy::apply_replication_frame(const uint8_t* frame, size_t length) {
+    if (length < 6)
+        return -1;
+    uint32_t seq_no = read_le<uint32_t>(&frame, &length);
+    uint16_t json_crc = read_le<uint16_t>(&frame, &length);
+    if (json_crc != fibre_get_json_crc())
+        return -1;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    bool full_frame = !replicating_;
+    if (!full_frame && seq_no != replication_seq_no_ + 1)
+        return -1;
+
+    auto now = std::chrono::steady_clock::now();
+    while (length) {
+        uint16_t endpoint_id;
+        size_t value_length;
+        if (read_varint(&frame, &length, &endpoint_id) || read_varint(&frame, &length, &value_length)
+                || value_length > length || value_length > TX_BUF_SIZE)
+            return -1;
+        if (endpoint_id < cache_.size() && cache_[endpoint_id].kind == ENDPOINT_PROPERTY) {
+            CachedValue& entry = cache_[endpoint_id];
+            memcpy(entry.value, frame, value_length);
+            entry.length = value_length;
+            entry.timestamp = now;
+            entry.fetch_ok = true;
+            entry.replicated = true;
+            if (full_frame)
+                entry.stale_until_seq_no = seq_no;
+            entry.valid = seq_no_reached(seq_no, entry.stale_until_seq_no);
+        }
+        frame += value_length;
+        length -= value_length;
+    }
+
+    // Values that didn't change since a write through this proxy are valid
+    // again once the write is certainly reflected in the frames
+    if (has_stale_values_) {
+        has_stale_values_ = false;
+        for (CachedValue& entry : cache_) {
+            if (!entry.replicated || entry.valid)
+                continue;
+            if (seq_no_reached(seq_no, entry.stale_until_seq_no))
+                entry.valid = true;
+            else
+                has_stale_values_ = true;
+        }
+    }
+
+    replicating_ = true;
+    replication_seq_no_ = seq_no;
+    return 0;
+}
+
+void Proxy::reset_replication() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    replicating_ = false;
+    has_stale_values_ = false;
+    for (size_t i = 0; i < cache_.size(); ++i) {
+        invalidate(i);
+        cache_[i].replicated = false;
+    }
+}
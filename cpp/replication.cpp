@@ -0,0 +1,69 @@
+/* Includes ------------------------------------------------------------------*/
+
+#include <unordered_set>
+
+#include <fibre/replication.hpp>
+
+/* Function implementations --------------------------------------------------*/
+
+ReplicationSource::ReplicationSource() {
+    // Named endpoints are properties: objects have no endpoint of their own
+    // and functions aren't addressable by name.
+    struct NamedEndpoints : EndpointPathSink {
+        std::unordered_set<Endpoint*> endpoints;
+        void add_path(uint32_t path_hash, const char * name, Endpoint* endpoint) final {
+            endpoints.insert(endpoint);
+        }
+    } named;
+    if (application_endpoints_)
+        application_endpoints_->register_paths(named);
+
+    for (size_t endpoint_id = 1; endpoint_id < n_endpoints_; ++endpoint_id) {
+        Endpoint* endpoint = endpoint_list_[endpoint_id];
+        if (!named.endpoints.count(endpoint))
+            continue;
+        uint8_t value[TX_BUF_SIZE];
+        size_t length = sizeof(value);
+        if (!fibre_sample_endpoint(endpoint, value, &length))
+            continue;
+        properties_.push_back({ (uint16_t)endpoint_id, endpoint, values_.size(), length });
+        values_.insert(values_.end(), value, value + length);
+    }
+}
+
+const std::vector<uint8_t>& ReplicationSource::sample() {
+    seq_no_++;
+    begin_frame(frame_);
+    for (Property& property : properties_) {
+        uint8_t value[TX_BUF_SIZE];
+        size_t length = sizeof(value);
+        if (!fibre_sample_endpoint(property.endpoint, value, &length)
+                || (length == property.length && !memcmp(value, values_.data() + property.offset, length)))
+            continue;
+        add_entry(frame_, property.endpoint_id, value, length);
+        // Values have a fixed length, so only the stored part can change
+        memcpy(values_.data() + property.offset, value, std::min(length, property.length));
+    }
+    return frame_;
+}
+
+const std::vector<uint8_t>& ReplicationSource::get_full_frame() {
+    begin_frame(full_frame_);
+    for (Property& property : properties_)
+        add_entry(full_frame_, property.endpoint_id, values_.data() + property.offset, property.length);
+    return full_frame_;
+}
+
+void ReplicationSource::begin_frame(std::vector<uint8_t>& frame) {
+    frame.resize(6);
+    write_le<uint32_t>(seq_no_, frame.data());
+    write_le<uint16_t>(fibre_get_json_crc(), frame.data() + 4);
+}
+
+void ReplicationSource::add_entry(std::vector<uint8_t>& frame, uint16_t endpoint_id, const uint8_t* value, size_t length) {
+    uint8_t entry_header[10];
+    size_t header_length = write_varint(endpoint_id, entry_header, sizeof(entry_header));
+    header_length += write_varint(length, entry_header + header_length, sizeof(entry_header) - header_length);
+    frame.insert(frame.end(), entry_header, entry_header + header_length);
+    frame.insert(frame.end(), value, value + length);
+}
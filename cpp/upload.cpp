@@ -0,0 +1,73 @@
+/* Includes ------------------------------------------------------------------*/
+
+#include <fibre/upload.hpp>
+
+/* Function implementations --------------------------------------------------*/
+
+void UploadReceiver::handle(const uint8_t* input, size_t input_length, StreamSink* output) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (input_length >= 1) {
+        uint8_t op = *input;
+        input++;
+        input_length--;
+        uint32_t value = 0;
+        bool has_value = input_length >= 4;
+        if (has_value) {
+            read_le<uint32_t>(&value, input);
+            input += 4;
+            input_length -= 4;
+        }
+
+        if (op == UPLOAD_OP_BEGIN && has_value) {
+            if (status_ == UPLOAD_STATUS_RECEIVING)
+                sink_.finish(false);
+            size_ = value;
+            received_ = 0;
+            crc_ = UPLOAD_CRC32_INIT;
+            status_ = sink_.begin(size_) ? UPLOAD_STATUS_RECEIVING : UPLOAD_STATUS_SINK_ERROR;
+        } else if (op == UPLOAD_OP_DATA && has_value) {
+            handle_data(value, input, input_length);
+        } else if (op == UPLOAD_OP_FINISH && has_value) {
+            handle_finish(value);
+        }
+    }
+
+    if (output) {
+        uint8_t buffer[5];
+        write_le<uint32_t>(received_, buffer);
+        write_le<uint8_t>(status_, buffer + 4);
+        if (sizeof(buffer) <= output->get_free_space())
+            output->process_bytes(buffer, sizeof(buffer), nullptr);
+    }
+}
+
+void UploadReceiver::handle_data(uint32_t offset, const uint8_t* buffer, size_t length) {
+    if (status_ != UPLOAD_STATUS_RECEIVING)
+        return;
+    // Drop chunks beyond the received offset and skip the part that was
+    // already received, e.g. if the client resent after a lost acknowledgement.
+    if (offset > received_ || offset + length <= received_ || offset + length > size_)
+        return;
+    buffer += received_ - offset;
+    length -= received_ - offset;
+
+    if (!sink_.write(received_, buffer, length)) {
+        sink_.finish(false);
+        status_ = UPLOAD_STATUS_SINK_ERROR;
+        return;
+    }
+    crc_ = calc_crc32<UPLOAD_CRC32_POLYNOMIAL>(crc_, buffer, length);
+    received_ += length;
+}
+
+void UploadReceiver::handle_finish(uint32_t crc) {
+    if (status_ != UPLOAD_STATUS_RECEIVING || received_ != size_)
+        return;
+    if (crc != crc_) {
+        sink_.finish(false);
+        status_ = UPLOAD_STATUS_CRC_MISMATCH;
+    } else {
+        status_ = sink_.finish(true) ? UPLOAD_STATUS_COMPLETE : UPLOAD_STATUS_SINK_ERROR;
+    }
+}
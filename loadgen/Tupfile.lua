@@ -0,0 +1,13 @@
+tup.include('../tupfiles/build.lua')
+tup.include('../cpp/package.lua')
+
+fibre_loadgen = define_package{
+    packages={fibre_package},
+    sources={'fibre_loadgen.cpp'}
+}
+
+toolchain=GCCToolchain('', 'build', {'-O3', '-g', '-Wall'}, {})
+
+if tup.getconfig("BUILD_FIBRE_TOOLS") == "true" then
+	build_executable('fibre_loadgen', fibre_loadgen, toolchain)
+end
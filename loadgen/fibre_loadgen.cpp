@@ -0,0 +1,535 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fibre/fibre.hpp>
+
+#define LOADGEN_RX_BUF_LEN 4096
+#define LOADGEN_WINDOW 1024 // maximum number of outstanding requests per client, must divide 0x4000
+#define LOADGEN_DRAIN_MS 1000 // how long to wait for outstanding responses at the end
+#define LOADGEN_SETUP_TIMEOUT_MS 5000
+
+// Latency histogram: values below 2^HISTOGRAM_SUB_BITS ns are exact, above
+// that each power of two is split into 2^(HISTOGRAM_SUB_BITS-1) buckets,
+// which keeps the error below 2^-(HISTOGRAM_SUB_BITS-1).
+#define HISTOGRAM_SUB_BITS 6
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << (HISTOGRAM_SUB_BITS - 1))
+
+using loadgen_clock = std::chrono::steady_clock;
+
+enum RequestKind : uint8_t {
+    REQUEST_READ = 0,
+    REQUEST_WRITE = 1,
+    REQUEST_CALL = 2,
+    N_REQUEST_KINDS
+};
+
+static const char* request_kind_names[N_REQUEST_KINDS] = { "read", "write", "call" };
+
+struct Options {
+    const char* host = "localhost";
+    const char* port = "9910";
+    bool udp = false;
+    size_t n_clients = 100;
+    size_t n_threads = 0; // 0: one per CPU
+    double rate = 10000; // requests per second, all clients together
+    double duration_s = 10;
+    double warmup_s = 1;
+    unsigned int mix[N_REQUEST_KINDS] = { 80, 15, 5 };
+    uint16_t endpoints[N_REQUEST_KINDS] = { 1, 2, 3 }; // property1, property2 and set_both of test_server
+};
+
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(loadgen_clock::now().time_since_epoch()).count();
+}
+
+class Histogram {
+public:
+    void record(int64_t value_ns) {
+        uint64_t value = value_ns < 0 ? 0 : value_ns;
+        counts_[index(value)]++;
+        n_++;
+        max_ = std::max(max_, value);
+    }
+
+    void add(const Histogram& other) {
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+            counts_[i] += other.counts_[i];
+        n_ += other.n_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    // @brief Returns the value below which the fraction q of all values lie.
+    uint64_t quantile(double q) const {
+        uint64_t rank = (uint64_t)(q * n_);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+            seen += counts_[i];
+            if (seen > rank)
+                return std::min(upper_bound(i), max_);
+        }
+        return max_;
+    }
+
+    uint64_t count() const { return n_; }
+    uint64_t max() const { return max_; }
+
+private:
+    static size_t index(uint64_t value) {
+        if (value < (1u << HISTOGRAM_SUB_BITS))
+            return value;
+        unsigned shift = 63 - __builtin_clzll(value) - (HISTOGRAM_SUB_BITS - 1);
+        return ((shift + 1) << (HISTOGRAM_SUB_BITS - 1)) + (value >> shift) - (1u << (HISTOGRAM_SUB_BITS - 1));
+    }
+
+    static uint64_t upper_bound(size_t index) {
+        if (index < (1u << HISTOGRAM_SUB_BITS))
+            return index;
+        unsigned shift = (index >> (HISTOGRAM_SUB_BITS - 1)) - 1;
+        uint64_t sub = (index & ((1u << (HISTOGRAM_SUB_BITS - 1)) - 1)) + (1u << (HISTOGRAM_SUB_BITS - 1));
+        return ((sub + 1) << shift) - 1;
+    }
+
+    uint64_t counts_[HISTOGRAM_BUCKETS] = { 0 };
+    uint64_t n_ = 0;
+    uint64_t max_ = 0;
+};
+
+struct Stats {
+    Histogram latency[N_REQUEST_KINDS];
+    uint64_t sent[N_REQUEST_KINDS] = { 0 };
+    uint64_t lost[N_REQUEST_KINDS] = { 0 }; // no response before the slot was reused or the run ended
+    uint64_t late_sends = 0; // requests sent more than 1 ms after their scheduled time
+
+    void add(const Stats& other) {
+        for (size_t i = 0; i < N_REQUEST_KINDS; ++i) {
+            latency[i].add(other.latency[i]);
+            sent[i] += other.sent[i];
+            lost[i] += other.lost[i];
+        }
+        late_sends += other.late_sends;
+    }
+};
+
+// @brief Appends everything to a buffer that is flushed to the socket once
+// per event loop iteration, so that a framed packet needs only one send().
+class BufferStreamSink : public StreamSink {
+public:
+    int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) {
+        buffer_.insert(buffer_.end(), buffer, buffer + length);
+        if (processed_bytes)
+            *processed_bytes += length;
+        return 0;
+    }
+    size_t get_free_space() { return SIZE_MAX; }
+    std::vector<uint8_t> buffer_;
+};
+
+/* @brief One simulated client with its own TCP connection or UDP socket.
+*
+* Requests are scheduled open-loop: the n-th request is due at
+* start + phase + n * interval, no matter how long earlier responses took.
+* Latency is measured from the scheduled time rather than from the actual
+* send time, so that a server (or load generator) that falls behind shows up
+* in the latency instead of silently lowering the request rate.
+*/
+class LoadClient : public PacketSink {
+public:
+    LoadClient(const Options& options, int fd, uint16_t json_crc, Stats& stats) :
+        options_(options), fd_(fd), json_crc_(json_crc), stats_(stats),
+        packet2stream_(tx_), stream2packet_(*this) {}
+
+    ~LoadClient() { close(fd_); }
+
+    int process_packet(const uint8_t* buffer, size_t length) {
+        if (length < 2)
+            return -1;
+        uint16_t seq_no = read_le<uint16_t>(&buffer, &length);
+        if (!(seq_no & 0x8000))
+            return 0;
+        Slot& slot = slots_[seq_no & (LOADGEN_WINDOW - 1)];
+        if (!slot.pending || slot.seq_no != (seq_no & 0x7fff))
+            return 0; // response to a request that was already counted as lost
+        slot.pending = false;
+        n_pending_--;
+        if (slot.measured)
+            stats_.latency[slot.kind].record(now_ns() - slot.scheduled_ns);
+        return 0;
+    }
+
+    // @brief Sends all requests that are due. Returns the time at which the
+    // next request is due.
+    int64_t send_due_requests(int64_t now, int64_t measure_from_ns, int64_t stop_ns) {
+        while (next_ns_ <= now && next_ns_ < stop_ns) {
+            if (now - next_ns_ > 1000000)
+                stats_.late_sends++;
+            send_request(next_ns_, next_ns_ >= measure_from_ns);
+            next_ns_ += interval_ns_;
+        }
+        return next_ns_;
+    }
+
+    // @brief Writes the buffered requests to the socket.
+    void flush() {
+        if (options_.udp || tx_.buffer_.empty())
+            return;
+        ssize_t n_sent = send(fd_, tx_.buffer_.data(), tx_.buffer_.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n_sent > 0)
+            tx_.buffer_.erase(tx_.buffer_.begin(), tx_.buffer_.begin() + n_sent);
+    }
+
+    // @brief Reads all available responses.
+    void receive() {
+        uint8_t buf[LOADGEN_RX_BUF_LEN];
+        for (;;) {
+            ssize_t n_received = recv(fd_, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n_received <= 0)
+                return;
+            if (options_.udp) {
+                process_packet(buf, n_received);
+            } else {
+                size_t processed = 0;
+                stream2packet_.process_bytes(buf, n_received, &processed);
+            }
+        }
+    }
+
+    // @brief Counts the requests that are still outstanding as lost.
+    void finish() {
+        for (Slot& slot : slots_) {
+            if (slot.pending && slot.measured)
+                stats_.lost[slot.kind]++;
+            slot.pending = false;
+        }
+        n_pending_ = 0;
+    }
+
+    void schedule(int64_t first_ns, int64_t interval_ns) {
+        next_ns_ = first_ns;
+        interval_ns_ = interval_ns;
+    }
+
+    int fd() { return fd_; }
+    size_t n_pending() { return n_pending_; }
+
+private:
+    struct Slot {
+        int64_t scheduled_ns;
+        uint16_t seq_no;
+        RequestKind kind;
+        bool pending;
+        bool measured;
+    };
+
+    RequestKind next_kind() {
+        // Weighted round robin over the request mix, offset per client by its fd
+        unsigned int total = 0;
+        for (size_t i = 0; i < N_REQUEST_KINDS; ++i)
+            total += options_.mix[i];
+        unsigned int pick = (n_sent_ * 7919 + fd_) % total;
+        for (size_t i = 0; i < N_REQUEST_KINDS; ++i) {
+            if (pick < options_.mix[i])
+                return static_cast<RequestKind>(i);
+            pick -= options_.mix[i];
+        }
+        return REQUEST_READ;
+    }
+
+    void send_request(int64_t scheduled_ns, bool measured) {
+        RequestKind kind = next_kind();
+        uint16_t seq_no = n_sent_++ & 0x3fff; // keep clear of BULK_SEQ_NO_FLAG
+        Slot& slot = slots_[seq_no & (LOADGEN_WINDOW - 1)];
+        if (slot.pending) {
+            // More than LOADGEN_WINDOW requests outstanding, give up on the oldest
+            if (slot.measured)
+                stats_.lost[slot.kind]++;
+            n_pending_--;
+        }
+        slot = { scheduled_ns, seq_no, kind, true, measured };
+        n_pending_++;
+        if (measured)
+            stats_.sent[kind]++;
+
+        // seq_no, endpoint ID (bit 15: expect response), response length, payload, trailer
+        uint8_t packet[12];
+        size_t length = write_le<uint16_t>(seq_no, packet);
+        length += write_le<uint16_t>(options_.endpoints[kind] | 0x8000, packet + length);
+        length += write_le<uint16_t>(kind == REQUEST_READ ? 4 : 0, packet + length);
+        if (kind == REQUEST_WRITE)
+            length += write_le<float>((float)(n_sent_ & 0xff), packet + length);
+        length += write_le<uint16_t>(json_crc_, packet + length);
+
+        if (options_.udp)
+            send(fd_, packet, length, MSG_DONTWAIT);
+        else
+            packet2stream_.process_packet(packet, length);
+    }
+
+    const Options& options_;
+    int fd_;
+    uint16_t json_crc_;
+    Stats& stats_;
+    BufferStreamSink tx_;
+    StreamBasedPacketSink packet2stream_;
+    StreamToPacketSegmenter stream2packet_;
+    Slot slots_[LOADGEN_WINDOW] = {}; // all not pending
+    size_t n_pending_ = 0;
+    uint32_t n_sent_ = 0;
+    int64_t next_ns_ = 0;
+    int64_t interval_ns_ = 0;
+};
+
+// @brief Runs the event loop for one share of the clients.
+static void run_worker(std::vector<std::unique_ptr<LoadClient>>& clients,
+        int64_t measure_from_ns, int64_t stop_ns) {
+    int epoll_fd = epoll_create1(0);
+    for (size_t i = 0; i < clients.size(); ++i) {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, clients[i]->fd(), &event);
+    }
+
+    struct epoll_event events[64];
+    int64_t drain_until_ns = stop_ns + (int64_t)LOADGEN_DRAIN_MS * 1000000;
+    for (;;) {
+        int64_t now = now_ns();
+        int64_t next_due = INT64_MAX;
+        size_t n_pending = 0;
+        for (auto& client : clients) {
+            next_due = std::min(next_due, client->send_due_requests(now, measure_from_ns, stop_ns));
+            client->flush();
+            n_pending += client->n_pending();
+        }
+        if (now >= stop_ns && (!n_pending || now >= drain_until_ns))
+            break;
+
+        // epoll only has millisecond resolution, spin for the last millisecond
+        int64_t wait_until = now < stop_ns ? std::min(next_due, stop_ns) : drain_until_ns;
+        int timeout_ms = std::max<int64_t>(0, (wait_until - now) / 1000000 - 1);
+        int n_events = epoll_wait(epoll_fd, events, 64, timeout_ms);
+        for (int i = 0; i < n_events; ++i)
+            clients[events[i].data.u64]->receive();
+    }
+
+    for (auto& client : clients)
+        client->finish();
+    close(epoll_fd);
+}
+
+static int connect_to(const Options& options) {
+    struct addrinfo hints;
+    struct addrinfo* result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = options.udp ? SOCK_DGRAM : SOCK_STREAM;
+    if (getaddrinfo(options.host, options.port, &hints, &result))
+        return -1;
+    int fd = -1;
+    for (struct addrinfo* it = result; it && fd == -1; it = it->ai_next) {
+        fd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+        if (fd != -1 && connect(fd, it->ai_addr, it->ai_addrlen)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(result);
+
+    int nodelay = 1;
+    if (fd != -1 && !options.udp)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return fd;
+}
+
+// @brief Receives the first response packet on a blocking socket.
+class FirstPacketSink : public PacketSink {
+public:
+    int process_packet(const uint8_t* buffer, size_t length) {
+        if (!received_) {
+            packet_.assign(buffer, buffer + length);
+            received_ = true;
+        }
+        return 0;
+    }
+    std::vector<uint8_t> packet_;
+    bool received_ = false;
+};
+
+// @brief Queries the JSON descriptor CRC (SESSION_OP_GET_DESCRIPTOR_CRC),
+// which all requests must carry as trailer.
+static int get_json_crc(const Options& options, uint16_t* json_crc) {
+    int fd = connect_to(options);
+    if (fd == -1)
+        return -1;
+
+    uint8_t packet[9];
+    size_t length = write_le<uint16_t>(0, packet);
+    length += write_le<uint16_t>(SESSION_CONTROL_ENDPOINT_ID | 0x8000, packet + length);
+    length += write_le<uint16_t>(2, packet + length);
+    packet[length++] = SESSION_OP_GET_DESCRIPTOR_CRC;
+    length += write_le<uint16_t>(PROTOCOL_VERSION, packet + length);
+
+    BufferStreamSink tx;
+    StreamBasedPacketSink packet2stream(tx);
+    if (options.udp) {
+        send(fd, packet, length, 0);
+    } else {
+        packet2stream.process_packet(packet, length);
+        send(fd, tx.buffer_.data(), tx.buffer_.size(), MSG_NOSIGNAL);
+    }
+
+    FirstPacketSink response;
+    StreamToPacketSegmenter stream2packet(response);
+    uint8_t buf[LOADGEN_RX_BUF_LEN];
+    while (!response.received_) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, LOADGEN_SETUP_TIMEOUT_MS) <= 0)
+            break;
+        ssize_t n_received = recv(fd, buf, sizeof(buf), 0);
+        if (n_received <= 0)
+            break;
+        if (options.udp) {
+            response.process_packet(buf, n_received);
+        } else {
+            size_t processed = 0;
+            stream2packet.process_bytes(buf, n_received, &processed);
+        }
+    }
+    close(fd);
+
+    if (response.packet_.size() != 4)
+        return -1;
+    read_le<uint16_t>(json_crc, response.packet_.data() + 2);
+    return 0;
+}
+
+static void print_usage(const char* name) {
+    printf("Usage: %s [-u] [-c CLIENTS] [-j THREADS] [-r RATE] [-d SECONDS] [-w SECONDS] [-m READ:WRITE:CALL] [-e READ_ID,WRITE_ID,CALL_ID] [HOST [PORT]]\n", name);
+    printf("Loads the Fibre node at HOST:PORT (default localhost:9910, e.g. test_server) with\n");
+    printf("CLIENTS connections (default 100, -u: UDP instead of TCP) that together send RATE\n");
+    printf("requests per second (default 10000) for the given duration (default 10 s) and\n");
+    printf("reports throughput and latency percentiles. The first -w seconds (default 1) are\n");
+    printf("not measured. The request mix (default 80:15:5) is a weighted mix of property\n");
+    printf("reads, property writes and function calls on the given float property and\n");
+    printf("function endpoints (default 1,2,3). Requests are sent at fixed times regardless\n");
+    printf("of outstanding responses and latencies are measured from those times.\n");
+}
+
+static void print_row(const char* name, const Histogram& latency, uint64_t sent, uint64_t lost, double measured_s) {
+    printf("%-6s %10llu %10llu %8llu %12.0f %10.1f %10.1f %10.1f %10.1f\n", name,
+            (unsigned long long)sent, (unsigned long long)latency.count(), (unsigned long long)lost,
+            latency.count() / measured_s,
+            latency.quantile(0.5) / 1e3, latency.quantile(0.99) / 1e3,
+            latency.quantile(0.999) / 1e3, latency.max() / 1e3);
+}
+
+int main(int argc, char** argv) {
+    Options options;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "uc:j:r:d:w:m:e:h")) != -1) {
+        switch (opt) {
+            case 'u': options.udp = true; break;
+            case 'c': options.n_clients = atoi(optarg); break;
+            case 'j': options.n_threads = atoi(optarg); break;
+            case 'r': options.rate = atof(optarg); break;
+            case 'd': options.duration_s = atof(optarg); break;
+            case 'w': options.warmup_s = atof(optarg); break;
+            case 'm':
+                if (sscanf(optarg, "%u:%u:%u", &options.mix[0], &options.mix[1], &options.mix[2]) != 3
+                        || !(options.mix[0] + options.mix[1] + options.mix[2])) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'e':
+                if (sscanf(optarg, "%hu,%hu,%hu", &options.endpoints[0], &options.endpoints[1], &options.endpoints[2]) != 3) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default: print_usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind < argc)
+        options.host = argv[optind++];
+    if (optind < argc)
+        options.port = argv[optind++];
+    if (optind < argc || !options.n_clients || options.rate <= 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (!options.n_threads)
+        options.n_threads = std::max(1u, std::thread::hardware_concurrency());
+    options.n_threads = std::min(options.n_threads, options.n_clients);
+
+    uint16_t json_crc = 0;
+    if (get_json_crc(options, &json_crc)) {
+        fprintf(stderr, "no response from %s:%s\n", options.host, options.port);
+        return 1;
+    }
+
+    // Connect all clients before the clock starts
+    std::vector<Stats> stats(options.n_threads);
+    std::vector<std::vector<std::unique_ptr<LoadClient>>> workers(options.n_threads);
+    for (size_t i = 0; i < options.n_clients; ++i) {
+        int fd = connect_to(options);
+        if (fd == -1) {
+            fprintf(stderr, "could not connect client %zu (check ulimit -n)\n", i);
+            return 1;
+        }
+        size_t worker = i % options.n_threads;
+        workers[worker].emplace_back(new LoadClient(options, fd, json_crc, stats[worker]));
+    }
+
+    // Spread the clients evenly over one request interval
+    int64_t interval_ns = (int64_t)(1e9 * options.n_clients / options.rate);
+    int64_t start_ns = now_ns() + 100000000;
+    for (size_t i = 0; i < options.n_clients; ++i)
+        workers[i % options.n_threads][i / options.n_threads]->schedule(
+                start_ns + interval_ns * i / options.n_clients, interval_ns);
+    int64_t measure_from_ns = start_ns + (int64_t)(options.warmup_s * 1e9);
+    int64_t stop_ns = measure_from_ns + (int64_t)(options.duration_s * 1e9);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < options.n_threads; ++i)
+        threads.emplace_back(run_worker, std::ref(workers[i]), measure_from_ns, stop_ns);
+    for (auto& thread : threads)
+        thread.join();
+
+    Stats total;
+    for (const Stats& worker_stats : stats)
+        total.add(worker_stats);
+
+    printf("%zu %s clients on %zu threads, %.0f requests/s target, %.1f s measured\n",
+            options.n_clients, options.udp ? "UDP" : "TCP", options.n_threads, options.rate, options.duration_s);
+    printf("%-6s %10s %10s %8s %12s %10s %10s %10s %10s\n",
+            "", "sent", "answered", "lost", "answered/s", "p50 us", "p99 us", "p999 us", "max us");
+    Histogram all;
+    uint64_t all_sent = 0, all_lost = 0;
+    for (size_t i = 0; i < N_REQUEST_KINDS; ++i) {
+        if (!total.sent[i])
+            continue;
+        print_row(request_kind_names[i], total.latency[i], total.sent[i], total.lost[i], options.duration_s);
+        all.add(total.latency[i]);
+        all_sent += total.sent[i];
+        all_lost += total.lost[i];
+    }
+    print_row("all", all, all_sent, all_lost, options.duration_s);
+    if (total.late_sends)
+        printf("%llu requests were sent more than 1 ms late, the load generator is overloaded\n",
+                (unsigned long long)total.late_sends);
+    return 0;
+}
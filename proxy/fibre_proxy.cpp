@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <termios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <thread>
+
+#include <fibre/fibre.hpp>
+#include <fibre/client.hpp>
+#include <fibre/proxy.hpp>
+#include <fibre/posix_tcp.hpp>
+#include <fibre/posix_udp.hpp>
+
+#define UPSTREAM_RX_BUF_LEN 512
+
+class FileStreamSink : public StreamSink {
+public:
+    FileStreamSink(int fd) : fd_(fd) {}
+
+    int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) {
+        while (length) {
+            ssize_t n_written = write(fd_, buffer, length);
+            if (n_written <= 0)
+                return -1;
+            buffer += n_written;
+            length -= n_written;
+            if (processed_bytes)
+                *processed_bytes += n_written;
+        }
+        return 0;
+    }
+
+    size_t get_free_space() { return SIZE_MAX; }
+
+private:
+    int fd_;
+};
+
+// @brief Opens a serial port in raw mode
+static int open_serial(const char* path, unsigned int baudrate) {
+    int fd = open(path, O_RDWR | O_NOCTTY);
+    if (fd == -1)
+        return -1;
+
+    struct termios tty;
+    if (tcgetattr(fd, &tty)) {
+        close(fd);
+        return -1;
+    }
+    cfmakeraw(&tty);
+    tty.c_cflag |= CLOCAL | CREAD;
+    tty.c_cc[VMIN] = 1;
+    tty.c_cc[VTIME] = 0;
+    speed_t speed = B115200;
+    switch (baudrate) {
+        case 9600: speed = B9600; break;
+        case 19200: speed = B19200; break;
+        case 38400: speed = B38400; break;
+        case 57600: speed = B57600; break;
+        case 115200: speed = B115200; break;
+        case 230400: speed = B230400; break;
+        case 460800: speed = B460800; break;
+        case 921600: speed = B921600; break;
+        default: fprintf(stderr, "unsupported baudrate %u, using 115200\n", baudrate); break;
+    }
+    cfsetispeed(&tty, speed);
+    cfsetospeed(&tty, speed);
+    if (tcsetattr(fd, TCSANOW, &tty)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// @brief Connects to a Fibre node on TCP. The link uses the canonical framing
+// like a serial port would, which makes this useful for testing the proxy
+// against test_server.
+static int open_tcp(const char* host, const char* port) {
+    struct addrinfo hints;
+    struct addrinfo* result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &result))
+        return -1;
+    int fd = -1;
+    for (struct addrinfo* it = result; it && fd == -1; it = it->ai_next) {
+        fd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+        if (fd != -1 && connect(fd, it->ai_addr, it->ai_addrlen)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(result);
+
+    // Packets are written in several pieces, don't wait for more data
+    int nodelay = 1;
+    if (fd != -1)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return fd;
+}
+
+// @brief Reads exactly length bytes.
+// @return false if the connection was closed or failed
+static bool read_exactly(int fd, uint8_t* buffer, size_t length) {
+    while (length) {
+        ssize_t n_received = read(fd, buffer, length);
+        if (n_received <= 0)
+            return false;
+        buffer += n_received;
+        length -= n_received;
+    }
+    return true;
+}
+
+// @brief Keeps the proxy in sync with the replication stream of the upstream
+// node (see serve_replication_on_tcp) and reconnects if the stream breaks.
+static void replicate(Proxy& proxy, std::string host, std::string port) {
+    std::vector<uint8_t> frame;
+    for (;;) {
+        int fd = open_tcp(host.c_str(), port.c_str());
+        if (fd == -1) {
+            fprintf(stderr, "could not connect to the replication stream on %s:%s\n", host.c_str(), port.c_str());
+        } else {
+            uint8_t length[4];
+            while (read_exactly(fd, length, sizeof(length))) {
+                uint32_t frame_length;
+                read_le<uint32_t>(&frame_length, length);
+                frame.resize(frame_length);
+                if (!read_exactly(fd, frame.data(), frame.size())
+                        || proxy.apply_replication_frame(frame.data(), frame.size()))
+                    break;
+            }
+            close(fd);
+            proxy.reset_replication();
+            fprintf(stderr, "replication stream interrupted\n");
+        }
+        sleep(1);
+    }
+}
+
+static void print_usage(const char* name) {
+    printf("Usage: %s [-b BAUDRATE] [-p PORT] [-t TTL_MS] [-r REPLICATION_PORT] DEVICE\n", name);
+    printf("Serves the Fibre node on DEVICE to many clients on TCP and UDP port PORT (default 9910).\n");
+    printf("DEVICE is a serial port (e.g. /dev/ttyACM0) or tcp:HOST:PORT.\n");
+    printf("Property values are served from a cache for TTL_MS milliseconds (default 0: only coalesce concurrent reads).\n");
+    printf("With -r, DEVICE must be tcp:HOST:PORT and property values are replicated from the node's replication\n");
+    printf("stream on HOST:REPLICATION_PORT, so that reads are served locally and only writes and calls are forwarded.\n");
+}
+
+int main(int argc, char** argv) {
+    unsigned int baudrate = 115200;
+    unsigned int port = 9910;
+    unsigned int cache_ttl_ms = 0;
+    const char* replication_port = nullptr;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:p:t:r:h")) != -1) {
+        switch (opt) {
+            case 'b': baudrate = atoi(optarg); break;
+            case 'p': port = atoi(optarg); break;
+            case 't': cache_ttl_ms = atoi(optarg); break;
+            case 'r': replication_port = optarg; break;
+            default: print_usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc - 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    const char* device = argv[optind];
+    std::string host;
+    int fd;
+    if (!strncmp(device, "tcp:", 4)) {
+        std::string host_and_port(device + 4);
+        size_t colon = host_and_port.rfind(':');
+        if (colon == std::string::npos) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        host = host_and_port.substr(0, colon);
+        fd = open_tcp(host.c_str(), host_and_port.substr(colon + 1).c_str());
+    } else if (replication_port) {
+        print_usage(argv[0]);
+        return 1;
+    } else {
+        fd = open_serial(device, baudrate);
+    }
+    if (fd == -1) {
+        fprintf(stderr, "could not open %s\n", device);
+        return 1;
+    }
+
+    // Upstream protocol stack
+    FileStreamSink upstream_output(fd);
+    StreamBasedPacketSink packet2stream(upstream_output);
+    Client upstream(packet2stream);
+    StreamToPacketSegmenter stream2packet(upstream);
+    std::thread upstream_receiver([&]{
+        uint8_t buf[UPSTREAM_RX_BUF_LEN];
+        for (;;) {
+            ssize_t n_received = read(fd, buf, sizeof(buf));
+            if (n_received <= 0) {
+                fprintf(stderr, "upstream link closed\n");
+                exit(1);
+            }
+            size_t processed = 0;
+            stream2packet.process_bytes(buf, n_received, &processed);
+        }
+    });
+
+    Proxy proxy(upstream, cache_ttl_ms);
+    if (proxy.publish()) {
+        fprintf(stderr, "no response from the Fibre node on %s\n", device);
+        return 1;
+    }
+    printf("Serving %s on port %u\n", device, port);
+
+    if (replication_port)
+        std::thread(replicate, std::ref(proxy), host, std::string(replication_port)).detach();
+
+    std::thread server_thread_tcp(serve_on_tcp, port);
+    std::thread server_thread_udp(serve_on_udp, port);
+
+    // Report how much traffic the proxy saves
+    for (;;) {
+        sleep(10);
+        printf("downstream requests: %zu, upstream requests: %zu\n",
+                proxy.get_downstream_requests(), proxy.get_upstream_requests());
+    }
+
+    return 0;
+}
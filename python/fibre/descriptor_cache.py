@@ -0,0 +1,52 @@
+"""
+Caches the JSON descriptors of Fibre nodes on disk, keyed by their CRC, so
+that reconnecting to a known node doesn't need to download the descriptor
+(see Channel.get_descriptor_crc)
+"""
+
+import os
+import tempfile
+import fibre.protocol
+
+def get_cache_dir():
+    """
+    Returns the directory where descriptors are cached. Can be overridden
+    with the FIBRE_CACHE_DIR environment variable.
+    """
+    if 'FIBRE_CACHE_DIR' in os.environ:
+        return os.environ['FIBRE_CACHE_DIR']
+    base = os.environ.get('XDG_CACHE_HOME', os.path.join(os.path.expanduser('~'), '.cache'))
+    return os.path.join(base, 'fibre', 'descriptors')
+
+def _get_path(json_crc):
+    return os.path.join(get_cache_dir(), '{:04x}.json'.format(json_crc))
+
+def load(json_crc):
+    """
+    Returns the cached descriptor with the specified CRC or None if there is none.
+    """
+    try:
+        with open(_get_path(json_crc), 'rb') as f:
+            json_bytes = f.read()
+    except OSError:
+        return None
+    # Ignore files that were corrupted or edited
+    if fibre.protocol.calc_crc16(fibre.protocol.PROTOCOL_VERSION, json_bytes) != json_crc:
+        return None
+    return json_bytes
+
+def store(json_crc, json_bytes):
+    """
+    Adds a descriptor to the cache. Errors are ignored because the cache is
+    only an optimization.
+    """
+    try:
+        os.makedirs(get_cache_dir(), exist_ok=True)
+        # Write to a temporary file first so that concurrent clients never
+        # read a partially written descriptor
+        fd, tmp_path = tempfile.mkstemp(dir=get_cache_dir())
+        with os.fdopen(fd, 'wb') as f:
+            f.write(json_bytes)
+        os.replace(tmp_path, _get_path(json_crc))
+    except OSError:
+        pass
@@ -10,6 +10,7 @@ import traceback
 import fibre.protocol
 import fibre.utils
 import fibre.remote_object
+import fibre.descriptor_cache
 from fibre.utils import Event, Logger
 from fibre.protocol import ChannelBrokenException
 
@@ -48,11 +49,14 @@ def find_all(path, serial_number,
          did_discover_object_callback,
          search_cancellation_token,
          channel_termination_token,
-         logger):
+         logger, lazy=False):
     """
     Starts scanning for Fibre nodes that match the specified path spec and calls
     the callback for each Fibre node that is found.
     This function is non-blocking.
+    lazy: If True and the descriptor is not cached, only the top level of the
+          object tree is downloaded. Sub-objects fetch their members on first
+          access. This shortens the time to the first read on large trees.
     """
 
     def did_discover_channel(channel):
@@ -64,13 +68,25 @@ def find_all(path, serial_number,
         """
         try:
             logger.debug("Connecting to device on " + channel._name)
-            try:
-                json_bytes = channel.remote_endpoint_read_buffer(0)
-            except (TimeoutError, ChannelBrokenException):
-                logger.debug("no response - probably incompatible")
-                return
-            json_crc16 = fibre.protocol.calc_crc16(fibre.protocol.PROTOCOL_VERSION, json_bytes)
+            # Skip the download if the descriptor is known from an earlier connection
+            json_crc16 = channel.get_descriptor_crc()
+            json_bytes = None if json_crc16 is None else fibre.descriptor_cache.load(json_crc16)
+            if json_bytes is None:
+                try:
+                    # Nodes that don't know subtree descriptors return the complete descriptor
+                    json_bytes = channel.remote_endpoint_read_buffer(0, b'\0' if lazy and json_crc16 is not None else b'')
+                except (TimeoutError, ChannelBrokenException):
+                    logger.debug("no response - probably incompatible")
+                    return
+                if not json_bytes.startswith(b'{'):
+                    json_crc16 = fibre.protocol.calc_crc16(fibre.protocol.PROTOCOL_VERSION, json_bytes)
+                    fibre.descriptor_cache.store(json_crc16, json_bytes)
+            else:
+                logger.debug("using cached JSON descriptor")
             channel._interface_definition_crc = json_crc16
+            if channel.verify_descriptor():
+                channel.set_header_mode(fibre.protocol.HEADER_MODE_COMPACT)
+                channel.set_priority_lanes(True)
             try:
                 json_string = json_bytes.decode("ascii")
             except UnicodeDecodeError:
@@ -83,8 +99,10 @@ def find_all(path, serial_number,
             except json.decoder.JSONDecodeError as error:
                 logger.debug("device responded on endpoint 0 with something that is not JSON: " + str(error))
                 return
+            if isinstance(json_data, dict):
+                json_data = json_data.get("members", []) # top level of a subtree descriptor
             json_data = {"name": "fibre_node", "members": json_data}
-            obj = fibre.remote_object.RemoteObject(json_data, None, channel, logger)
+            obj = fibre.remote_object.RemoteObject(json_data, None, channel, logger.debug)
 
             obj.__dict__['_json_data'] = json_data['members']
             obj.__dict__['_json_crc'] = json_crc16
@@ -110,7 +128,7 @@ def find_all(path, serial_number,
 
 def find_any(path="usb", serial_number=None,
         search_cancellation_token=None, channel_termination_token=None,
-        timeout=None, logger=Logger(verbose=False)):
+        timeout=None, logger=Logger(verbose=False), lazy=False):
     """
     Blocks until the first matching Fibre node is connected and then returns that node
     """
@@ -119,7 +137,7 @@ def find_any(path="usb", serial_number=None,
     def did_discover_object(obj):
         result[0] = obj
         done_signal.set("search succeeded")
-    find_all(path, serial_number, did_discover_object, done_signal, channel_termination_token, logger)
+    find_all(path, serial_number, did_discover_object, done_signal, channel_termination_token, logger, lazy)
     try:
         done_signal.wait(timeout=timeout)
     finally:
@@ -9,6 +9,7 @@ import traceback
 from fibre.utils import Event, wait_any
 
 import abc
+import binascii
 if sys.version_info >= (3, 4):
     ABC = abc.ABC
 else:
@@ -28,6 +29,42 @@ CRC16_DEFAULT = 0x3d65 # this must match the polynomial in the C++ implementatio
 
 MAX_PACKET_SIZE = 128
 
+# Reserved endpoint that addresses the channel itself (see protocol.hpp)
+SESSION_CONTROL_ENDPOINT_ID = 0x7fff
+SESSION_OP_SET_FRAMING = 0x01
+SESSION_OP_SET_HEADER_MODE = 0x02
+SESSION_OP_VERIFY_DESCRIPTOR = 0x03
+SESSION_OP_SET_FLOW_CONTROL = 0x04
+SESSION_OP_GRANT_CREDIT = 0x05
+SESSION_OP_SET_PRIORITY_LANES = 0x06
+SESSION_OP_TRANSACTION = 0x07
+SESSION_OP_GET_DESCRIPTOR_CRC = 0x08
+SESSION_OP_GET_TIME = 0x09
+SESSION_OP_SET_TIMESTAMPS = 0x0a
+SESSION_OP_SESSION_LOST = 0x0b
+
+# Marks a request for the bulk lane once priority lanes are enabled
+BULK_SEQ_NO_FLAG = 0x4000
+
+# Stream framings (see StreamFraming in stream.hpp)
+FRAMING_CANONICAL = 0
+FRAMING_LEAN = 1
+
+# Request header modes (see RequestHeaderMode in protocol.hpp)
+HEADER_MODE_CANONICAL = 0
+HEADER_MODE_COMPACT = 1
+
+# Upload endpoint operations and states (see upload.hpp)
+UPLOAD_OP_BEGIN = 0x00
+UPLOAD_OP_DATA = 0x01
+UPLOAD_OP_FINISH = 0x02
+UPLOAD_OP_STATUS = 0x03
+UPLOAD_STATUS_IDLE = 0
+UPLOAD_STATUS_RECEIVING = 1
+UPLOAD_STATUS_COMPLETE = 2
+UPLOAD_STATUS_CRC_MISMATCH = 3
+UPLOAD_STATUS_SINK_ERROR = 4
+
 def calc_crc(remainder, value, polynomial, bitwidth):
     topbit = (1 << (bitwidth - 1))
 
@@ -61,6 +98,31 @@ def calc_crc16(remainder, value):
         remainder = calc_crc(remainder, value, CRC16_DEFAULT, 16)
     return remainder
 
+_BIT_REVERSED_BYTES = bytes(int('{:08b}'.format(i)[::-1], 2) for i in range(256))
+
+def calc_crc32(data):
+    """
+    Calculates the CRC32 of an upload image (see UPLOAD_CRC32_POLYNOMIAL in
+    upload.hpp). This is the non-reflected variant of the zlib CRC32, so it is
+    calculated with binascii.crc32 on bit-reversed input.
+    """
+    crc = binascii.crc32(bytes(data).translate(_BIT_REVERSED_BYTES)) ^ 0xffffffff
+    return int('{:032b}'.format(crc)[::-1], 2)
+
+def encode_varint(value):
+    """
+    Encodes an unsigned integer as LEB128 varint
+    """
+    result = bytearray()
+    while True:
+        byte = value & 0x7f
+        value >>= 7
+        if value:
+            result.append(byte | 0x80)
+        else:
+            result.append(byte)
+            return bytes(result)
+
 # Can be verified with http://www.sunshine2k.de/coding/javascript/crc/crc_js.html:
 #print(hex(calc_crc8(0x12, [1, 2, 3, 4, 5, 0x10, 0x13, 0x37])))
 #print(hex(calc_crc16(0xfeef, [1, 2, 3, 4, 5, 0x10, 0x13, 0x37])))
@@ -146,8 +208,16 @@ class StreamToPacketSegmenter(StreamSink):
 class StreamBasedPacketSink(PacketSink):
     def __init__(self, output):
         self._output = output
+        self._framing = FRAMING_CANONICAL
+
+    def set_framing(self, framing):
+        self._framing = framing
 
     def process_packet(self, packet):
+        if self._framing == FRAMING_LEAN:
+            self._output.process_bytes(struct.pack('<H', len(packet)) + bytes(packet))
+            return
+
         if (len(packet) >= MAX_PACKET_SIZE):
             raise NotImplementedError("packet larger than 127 currently not supported")
 
@@ -166,6 +236,14 @@ class StreamBasedPacketSink(PacketSink):
 class PacketFromStreamConverter(PacketSource):
     def __init__(self, input):
         self._input = input
+        self._framing = FRAMING_CANONICAL
+
+    def set_framing(self, framing):
+        """
+        Switches the framing that is expected on the input stream. Must only
+        be called between two get_packet calls.
+        """
+        self._framing = framing
     
     def get_packet(self, deadline):
         """
@@ -173,6 +251,13 @@ class PacketFromStreamConverter(PacketSource):
         received or the deadline is reached, in which case None is returned. A
         deadline before the current time corresponds to non-blocking mode.
         """
+        if self._framing == FRAMING_LEAN:
+            header = self._input.get_bytes_or_fail(2, deadline)
+            packet_length = struct.unpack('<H', header)[0]
+            if packet_length == 0:
+                return bytes()
+            return self._input.get_bytes_or_fail(packet_length, deadline)
+
         while True:
             header = bytes()
 
@@ -220,9 +305,30 @@ class Channel(PacketSink):
         self._logger = logger
         self._outbound_seq_no = 0
         self._interface_definition_crc = 0
+        self._header_mode = HEADER_MODE_CANONICAL
+        self._session_verified = False
+        self._priority_lanes = False
         self._expected_acks = {}
         self._responses = {}
+        self._response_hooks = {}
         self._my_lock = threading.Lock()
+        # Flow control state (see SESSION_OP_SET_FLOW_CONTROL in protocol.hpp)
+        self._flow_control = False
+        self._request_window = 0
+        self._sent_requests = 0
+        self._completed_requests = 0
+        self._response_window = 0
+        self._consumed_bytes = 0
+        self._granted_bytes = 0
+        self._credit_available = threading.Condition()
+        # Clock synchronization state (see SESSION_OP_GET_TIME in protocol.hpp)
+        self._response_timestamps = False
+        self._response_times = {}
+        self._clock_offset_ns = None # remote clock minus time.monotonic_ns()
+        # Session recovery state (see SESSION_OP_SESSION_LOST in protocol.hpp)
+        self._session_generation = 0
+        self._lost_state = None
+        self._restore_lock = threading.RLock()
         self._channel_broken = Event(cancellation_token)
         self.start_receiver_thread(Event(self._channel_broken))
 
@@ -259,41 +365,59 @@ class Channel(PacketSink):
                 self._channel_broken.set("recv thread died")
         threading.Thread(name='fibre-receiver', target=receiver_thread).start()
 
-    def remote_endpoint_operation(self, endpoint_id, input, expect_ack, output_length):
-        if input is None:
-            input = bytearray(0)
-        if (len(input) >= 128):
-            raise Exception("packet larger than 127 currently not supported")
-
-        if (expect_ack):
-            endpoint_id |= 0x8000
-
-        self._my_lock.acquire()
-        try:
-            self._outbound_seq_no = ((self._outbound_seq_no + 1) & 0x7fff)
-            seq_no = self._outbound_seq_no
-        finally:
-            self._my_lock.release()
-        seq_no |= 0x80 # FIXME: we hardwire one bit of the seq-no to 1 to avoid conflicts with the ascii protocol
-        packet = struct.pack('<HHH', seq_no, endpoint_id, output_length)
-        packet = packet + input
+    def remote_endpoint_operation(self, endpoint_id, input, expect_ack, output_length,
+                                  send_attempts=None, resend_timeout=None, on_response=None,
+                                  bulk=False, with_time=False):
+        """
+        on_response: If not None, this function is called with the response
+                     payload on the receiver thread before the response is
+                     handed to the caller and before the next packet is received.
+        bulk: If True and priority lanes are enabled, the remote node serves
+              this request only when no control requests are waiting.
+        with_time: If True, returns a tuple (response, time) where time is the
+                   time.monotonic() at which the remote node handled the
+                   request. This is exact to the synchronization error if
+                   timestamps are enabled and the clocks are synchronized (see
+                   enable_timestamps and sync_time), otherwise it is the
+                   middle between sending the request and receiving the response.
+        """
+        if send_attempts is None:
+            send_attempts = self._send_attempts
+        if resend_timeout is None:
+            resend_timeout = self._resend_timeout
+        seq_no, packet = self._build_request(endpoint_id, input, expect_ack, output_length, bulk)
+        session_generation = self._session_generation
 
-        crc16 = calc_crc16(CRC16_INIT, packet)
-        if (endpoint_id & 0x7fff == 0):
-            trailer = PROTOCOL_VERSION
-        else:
-            trailer = self._interface_definition_crc
-        #print("append trailer " + trailer)
-        packet = packet + struct.pack('<H', trailer)
+        if self._flow_control and endpoint_id != SESSION_CONTROL_ENDPOINT_ID:
+            self._wait_for_credit()
 
         if (expect_ack):
             ack_event = Event()
+            if on_response is not None:
+                self._response_hooks[seq_no] = on_response
             self._expected_acks[seq_no] = ack_event
             try:
                 attempt = 0
-                while (attempt < self._send_attempts):
+                while (attempt < send_attempts):
+                    if session_generation != self._session_generation:
+                        # The remote node lost the session that the request was built for
+                        self._restore_session()
+                        session_generation = self._session_generation
+                        self._expected_acks.pop(seq_no)
+                        self._responses.pop(seq_no, None)
+                        self._response_hooks.pop(seq_no, None)
+                        seq_no, packet = self._build_request(endpoint_id, input, expect_ack, output_length, bulk)
+                        ack_event = Event()
+                        if on_response is not None:
+                            self._response_hooks[seq_no] = on_response
+                        self._expected_acks[seq_no] = ack_event
+                        if self._flow_control and endpoint_id != SESSION_CONTROL_ENDPOINT_ID:
+                            self._wait_for_credit()
                     self._my_lock.acquire()
                     try:
+                        if attempt > 0:
+                            self._count_request(endpoint_id) # the remote node counts resends too
+                        sent_time_ns = time.monotonic_ns()
                         self._output.process_packet(packet)
                     except ChannelDamagedException:
                         attempt += 1
@@ -302,36 +426,383 @@ class Channel(PacketSink):
                         self._my_lock.release()
                     # Wait for ACK until the resend timeout is exceeded
                     try:
-                        if wait_any(self._resend_timeout, ack_event, self._channel_broken) != 0:
+                        if wait_any(resend_timeout, ack_event, self._channel_broken) != 0:
                             raise ChannelBrokenException()
                     except TimeoutError:
                         attempt += 1
                         continue # resend
-                    return self._responses.pop(seq_no)
+                    response = self._responses.pop(seq_no)
+                    if response is None:
+                        continue # dropped because the remote node lost the session, resend
+                    if not with_time:
+                        return response
+                    remote_time_ns = self._response_times.pop(seq_no, None)
+                    if remote_time_ns is not None and self._clock_offset_ns is not None:
+                        return response, (remote_time_ns - self._clock_offset_ns) / 1e9
+                    return response, (sent_time_ns + time.monotonic_ns()) / 2e9
                     # TODO: record channel statistics
                 raise ChannelBrokenException() # Too many resend attempts
             finally:
                 self._expected_acks.pop(seq_no)
                 self._responses.pop(seq_no, None)
+                self._response_times.pop(seq_no, None)
+                self._response_hooks.pop(seq_no, None)
         else:
             # fire and forget
-            self._output.process_packet(packet)
+            self._my_lock.acquire()
+            try:
+                self._output.process_packet(packet)
+            finally:
+                self._my_lock.release()
             return None
+
+    def _build_request(self, endpoint_id, input, expect_ack, output_length, bulk):
+        """
+        Allocates a sequence number and returns it together with the request packet
+        """
+        if input is None:
+            input = bytearray(0)
+        if (len(input) >= 128):
+            raise Exception("packet larger than 127 currently not supported")
+
+        self._my_lock.acquire()
+        try:
+            # The MSB is the response flag and the next bit selects the lane
+            self._outbound_seq_no = ((self._outbound_seq_no + 1) & 0x3fff)
+            seq_no = self._outbound_seq_no
+        finally:
+            self._my_lock.release()
+        seq_no |= 0x80 # FIXME: we hardwire one bit of the seq-no to 1 to avoid conflicts with the ascii protocol
+        if bulk and self._priority_lanes:
+            seq_no |= BULK_SEQ_NO_FLAG
+
+        if self._header_mode == HEADER_MODE_COMPACT:
+            # The remote node verified our descriptor CRC once, no trailer needed
+            packet = (struct.pack('<H', seq_no) +
+                      encode_varint((endpoint_id << 1) | (1 if expect_ack else 0)) +
+                      encode_varint(output_length) + input)
+        else:
+            packet = struct.pack('<HHH', seq_no, endpoint_id | (0x8000 if expect_ack else 0), output_length)
+            packet = packet + input
+
+            # Verified sessions don't need a trailer
+            if not self._session_verified:
+                if (endpoint_id == 0) or (endpoint_id == SESSION_CONTROL_ENDPOINT_ID):
+                    trailer = PROTOCOL_VERSION
+                else:
+                    trailer = self._interface_definition_crc
+                #print("append trailer " + trailer)
+                packet = packet + struct.pack('<H', trailer)
+        return seq_no, packet
+
+    def remote_endpoint_operation_async(self, endpoint_id, input, output_length, on_response, bulk=False):
+        """
+        Sends a request that expects a response without waiting for it, so that
+        several requests can be in flight. on_response is called with the
+        response payload on the receiver thread. Lost requests or responses are
+        not resent: the caller detects them by a timeout and then discards the
+        request with cancel_request().
+        Returns the sequence number of the request.
+        """
+        seq_no, packet = self._build_request(endpoint_id, input, True, output_length, bulk)
+        if self._flow_control and endpoint_id != SESSION_CONTROL_ENDPOINT_ID:
+            self._wait_for_credit()
+        def handle_response(payload):
+            self._expected_acks.pop(seq_no, None)
+            on_response(payload)
+        self._response_hooks[seq_no] = handle_response
+        self._expected_acks[seq_no] = Event()
+        with self._my_lock:
+            self._output.process_packet(packet)
+        return seq_no
+
+    def cancel_request(self, seq_no):
+        """
+        Discards a request sent by remote_endpoint_operation_async() whose
+        response is still outstanding.
+        """
+        self._response_hooks.pop(seq_no, None)
+        self._expected_acks.pop(seq_no, None)
+
+    def _count_request(self, endpoint_id):
+        if self._flow_control and endpoint_id != SESSION_CONTROL_ENDPOINT_ID:
+            with self._credit_available:
+                self._sent_requests = (self._sent_requests + 1) & 0xff
+
+    def _wait_for_credit(self):
+        """
+        Blocks until fewer requests are outstanding than the remote node granted
+        and then accounts for one more outstanding request.
+        """
+        with self._credit_available:
+            # Flow control is disabled if the remote node lost the session
+            while self._flow_control and ((self._sent_requests - self._completed_requests) & 0xff) >= self._request_window:
+                if self._channel_broken.is_set():
+                    raise ChannelBrokenException()
+                self._credit_available.wait(1.0)
+            self._sent_requests = (self._sent_requests + 1) & 0xff
     
-    def remote_endpoint_read_buffer(self, endpoint_id):
+    def remote_endpoint_read_buffer(self, endpoint_id, trailing_input=b''):
         """
         Handles reads from long endpoints
+        trailing_input: Sent after the offset in each request, e.g. the
+                        object path of a subtree descriptor.
         """
         # TODO: handle device that could (maliciously) send infinite stream
         buffer = bytes()
         while True:
             chunk_length = 512
-            chunk = self.remote_endpoint_operation(endpoint_id, struct.pack("<I", len(buffer)), True, chunk_length)
+            chunk = self.remote_endpoint_operation(endpoint_id, struct.pack("<I", len(buffer)) + trailing_input, True, chunk_length, bulk=True)
             if (len(chunk) == 0):
                 break
             buffer += chunk
         return buffer
 
+    def set_framing(self, framing):
+        """
+        Asks the remote node to switch the stream framing of this channel and
+        returns the framing that is in effect afterwards.
+        Only request FRAMING_LEAN on transports that guarantee integrity (TCP).
+        Nodes that don't implement the session control endpoint don't respond,
+        in which case the canonical framing is kept.
+        """
+        def switch_framing(response):
+            if len(response) < 1 or response[0] != framing:
+                return
+            self._my_lock.acquire()
+            try:
+                self._input.set_framing(framing)
+                self._output.set_framing(framing)
+            finally:
+                self._my_lock.release()
+        try:
+            response = self.remote_endpoint_operation(SESSION_CONTROL_ENDPOINT_ID,
+                    struct.pack('<BB', SESSION_OP_SET_FRAMING, framing), True, 1,
+                    send_attempts=1, resend_timeout=1.0, on_response=switch_framing)
+        except ChannelBrokenException:
+            return FRAMING_CANONICAL
+        return response[0] if len(response) >= 1 else FRAMING_CANONICAL
+
+    def set_header_mode(self, header_mode):
+        """
+        Asks the remote node to accept the specified request header mode and
+        returns the mode that is in effect afterwards. The compact mode is only
+        granted if _interface_definition_crc matches the remote descriptor.
+        Nodes that don't implement the session control endpoint don't respond,
+        in which case the canonical header mode is kept.
+        """
+        try:
+            response = self.remote_endpoint_operation(SESSION_CONTROL_ENDPOINT_ID,
+                    struct.pack('<BBH', SESSION_OP_SET_HEADER_MODE, header_mode, self._interface_definition_crc),
+                    True, 1, send_attempts=1, resend_timeout=1.0)
+        except ChannelBrokenException:
+            return self._header_mode
+        if len(response) >= 1:
+            self._header_mode = response[0]
+            if self._header_mode == HEADER_MODE_COMPACT:
+                self._session_verified = True
+        return self._header_mode
+
+    def verify_descriptor(self):
+        """
+        Proves _interface_definition_crc to the remote node once for this
+        session so that subsequent requests can omit the per-request trailer.
+        Returns True if the remote node accepted the CRC.
+        If the remote node republishes its descriptor, requests on a verified
+        session are rejected until the session is verified again.
+        """
+        try:
+            response = self.remote_endpoint_operation(SESSION_CONTROL_ENDPOINT_ID,
+                    struct.pack('<BH', SESSION_OP_VERIFY_DESCRIPTOR, self._interface_definition_crc),
+                    True, 1, send_attempts=1, resend_timeout=1.0)
+        except ChannelBrokenException:
+            return False
+        self._session_verified = len(response) >= 1 and response[0] == 1
+        if not self._session_verified:
+            self._header_mode = HEADER_MODE_CANONICAL
+        return self._session_verified
+
+    def get_descriptor_crc(self):
+        """
+        Returns the CRC of the remote node's JSON descriptor without
+        downloading the descriptor, or None if the remote node doesn't
+        implement this query.
+        """
+        try:
+            response = self.remote_endpoint_operation(SESSION_CONTROL_ENDPOINT_ID,
+                    struct.pack('<B', SESSION_OP_GET_DESCRIPTOR_CRC), True, 2,
+                    send_attempts=1, resend_timeout=1.0)
+        except ChannelBrokenException:
+            return None
+        if len(response) < 2:
+            return None
+        return struct.unpack('<H', response[:2])[0]
+
+    def set_priority_lanes(self, enable):
+        """
+        Asks the remote node to serve bulk requests (see remote_endpoint_operation)
+        in a separate lane so that they don't delay other requests.
+        Returns True if priority lanes are enabled afterwards. Nodes that
+        don't implement the session control endpoint don't respond, in which
+        case all requests share one lane.
+        """
+        try:
+            response = self.remote_endpoint_operation(SESSION_CONTROL_ENDPOINT_ID,
+                    struct.pack('<BB', SESSION_OP_SET_PRIORITY_LANES, 1 if enable else 0), True, 1,
+                    send_attempts=1, resend_timeout=1.0)
+        except ChannelBrokenException:
+            return self._priority_lanes
+        self._priority_lanes = len(response) >= 1 and response[0] == 1
+        return self._priority_lanes
+
+    def sync_time(self, samples=8):
+        """
+        Estimates the offset of the remote node's clock from time.monotonic()
+        with several NTP-style exchanges and keeps the estimate of the exchange
+        with the shortest round trip, which has the smallest error bound.
+        Returns (offset, delay) in seconds, where the error of the offset is at
+        most delay / 2, or None if the remote node doesn't implement this query.
+        """
+        best = None
+        for _ in range(samples):
+            t1 = time.monotonic_ns()
+            try:
+                response = self.remote_endpoint_operation(SESSION_CONTROL_ENDPOINT_ID,
+                        struct.pack('<B', SESSION_OP_GET_TIME), True, 16,
+                        send_attempts=1, resend_timeout=1.0)
+            except ChannelBrokenException:
+                return None
+            t4 = time.monotonic_ns()
+            if len(response) < 16:
+                return None
+            t2, t3 = struct.unpack('<QQ', response[:16])
+            offset = ((t2 - t1) + (t3 - t4)) // 2
+            delay = (t4 - t1) - (t3 - t2)
+            if best is None or delay < best[1]:
+                best = (offset, delay)
+        self._clock_offset_ns = best[0]
+        return best[0] / 1e9, best[1] / 1e9
+
+    def enable_timestamps(self, enable=True):
+        """
+        Asks the remote node to attach the time at which it handled a request
+        to each response (see with_time in remote_endpoint_operation).
+        Returns True if timestamps are enabled afterwards.
+        """
+        def switch_timestamps(response):
+            # Responses after this one carry a timestamp if enabled
+            self._response_timestamps = len(response) >= 1 and response[0] == 1
+        try:
+            self.remote_endpoint_operation(SESSION_CONTROL_ENDPOINT_ID,
+                    struct.pack('<BB', SESSION_OP_SET_TIMESTAMPS, 1 if enable else 0), True, 1,
+                    send_attempts=1, resend_timeout=1.0, on_response=switch_timestamps)
+        except ChannelBrokenException:
+            pass
+        return self._response_timestamps
+
+    def write_transaction(self, writes):
+        """
+        Writes several endpoints in one request. The remote node applies
+        either all of the writes or none of them, and the application never
+        observes only some of them.
+        writes: A list of (endpoint_id, value) tuples where value is the
+                serialized value.
+        Returns True if the remote node applied the writes.
+        """
+        payload = struct.pack('<BH', SESSION_OP_TRANSACTION, self._interface_definition_crc)
+        for endpoint_id, value in writes:
+            payload += struct.pack('<HB', endpoint_id, len(value)) + value
+        response = self.remote_endpoint_operation(SESSION_CONTROL_ENDPOINT_ID, payload, True, 1)
+        return len(response) >= 1 and response[0] == len(writes)
+
+    def enable_flow_control(self, window=4096):
+        """
+        Enables credit based flow control on this channel so that neither side
+        sends more than the other can buffer.
+        window: The number of response bytes this channel can buffer.
+        Returns True if the remote node enabled flow control. Nodes that don't
+        implement the session control endpoint don't respond, in which case
+        the channel continues without flow control.
+        """
+        def enable(response):
+            if len(response) < 1 or response[0] == 0:
+                return
+            with self._credit_available:
+                self._request_window = response[0]
+                self._sent_requests = self._completed_requests = 0
+                self._response_window = window
+                self._consumed_bytes = self._granted_bytes = 0
+                self._flow_control = True
+        try:
+            self.remote_endpoint_operation(SESSION_CONTROL_ENDPOINT_ID,
+                    struct.pack('<BH', SESSION_OP_SET_FLOW_CONTROL, window), True, 1,
+                    send_attempts=1, resend_timeout=1.0, on_response=enable)
+        except ChannelBrokenException:
+            return False
+        return self._flow_control
+
+    def _lose_session(self, seq_no):
+        """
+        Falls back to the state of a new session after the remote node
+        reported that it lost this session and dropped the request with the
+        specified seq_no. Requests that are waiting for a response negotiate
+        the session again (see _restore_session) and are then resent.
+        """
+        if self._lost_state is None:
+            self._lost_state = (self._session_verified, self._header_mode, self._priority_lanes,
+                                self._flow_control, self._response_timestamps)
+        self._session_generation += 1
+        self._header_mode = HEADER_MODE_CANONICAL
+        self._session_verified = False
+        self._priority_lanes = False
+        self._response_timestamps = False
+        with self._credit_available:
+            self._flow_control = False
+            self._credit_available.notify_all()
+        ack_signal = self._expected_acks.get(seq_no, None)
+        if ack_signal:
+            self._responses[seq_no] = None
+            ack_signal.set("session lost")
+
+    def _restore_session(self):
+        """
+        Negotiates the session state that the remote node lost again. Only
+        the first caller negotiates, the others wait for it.
+        """
+        with self._restore_lock:
+            if self._lost_state is None:
+                return
+            session_verified, header_mode, priority_lanes, flow_control, response_timestamps = self._lost_state
+            if session_verified:
+                self.verify_descriptor()
+            if header_mode != HEADER_MODE_CANONICAL:
+                self.set_header_mode(header_mode)
+            if priority_lanes:
+                self.set_priority_lanes(True)
+            if flow_control:
+                self.enable_flow_control(self._response_window)
+            if response_timestamps:
+                self.enable_timestamps()
+            self._lost_state = None
+
+    def _consume_response(self, packet):
+        """
+        Updates the flow control state for a response that was received while
+        flow control is enabled and returns the response payload.
+        Grants new credit to the remote node once half of the window is consumed.
+        """
+        with self._credit_available:
+            self._completed_requests = packet[2]
+            self._consumed_bytes = (self._consumed_bytes + len(packet)) & 0xffffffff
+            grant = ((self._consumed_bytes - self._granted_bytes) & 0xffffffff) >= self._response_window // 2
+            if grant:
+                self._granted_bytes = self._consumed_bytes
+            self._credit_available.notify_all()
+        if grant:
+            self.remote_endpoint_operation(SESSION_CONTROL_ENDPOINT_ID,
+                    struct.pack('<BI', SESSION_OP_GRANT_CREDIT, self._granted_bytes), False, 0)
+        return packet[3:]
+
     def process_packet(self, packet):
         #print("process packet")
         packet = bytes(packet)
@@ -342,15 +813,39 @@ class Channel(PacketSink):
 
         if (seq_no & 0x8000):
             seq_no &= 0x7fff
+            if self._flow_control:
+                if len(packet) < 3:
+                    raise Exception("packet too short")
+                payload = self._consume_response(packet)
+            else:
+                payload = packet[2:]
+            remote_time_ns = None
+            if self._response_timestamps:
+                if len(payload) < 8:
+                    raise Exception("packet too short")
+                remote_time_ns = struct.unpack('<Q', payload[:8])[0]
+                payload = payload[8:]
             ack_signal = self._expected_acks.get(seq_no, None)
             if (ack_signal):
-                self._responses[seq_no] = packet[2:]
+                hook = self._response_hooks.pop(seq_no, None)
+                if hook is not None:
+                    hook(payload)
+                # Asynchronous requests are complete once the hook returns
+                if seq_no in self._expected_acks:
+                    if remote_time_ns is not None:
+                        self._response_times[seq_no] = remote_time_ns
+                    self._responses[seq_no] = payload
                 ack_signal.set("ack")
                 #print("received ack for packet " + str(seq_no))
             else:
                 print("received unexpected ACK: " + str(seq_no))
 
         else:
+            # The only request that remote nodes send is the notice that they lost this session
+            if (len(packet) >= 7 and struct.unpack('<H', packet[2:4])[0] == SESSION_CONTROL_ENDPOINT_ID
+                    and packet[6] == SESSION_OP_SESSION_LOST):
+                self._lose_session(seq_no)
+                return
             #if (calc_crc16(CRC16_INIT, struct.pack('<HBB', PROTOCOL_VERSION, packet[-2], packet[-1]))):
             #     raise Exception("CRC16 mismatch")
             print("endpoint requested")
@@ -12,6 +12,12 @@ import fibre.protocol
 class ObjectDefinitionError(Exception):
     pass
 
+class UploadError(Exception):
+    pass
+
+class WriteDroppedError(Exception):
+    pass
+
 codecs = {}
 
 class StructCodec():
@@ -73,10 +79,20 @@ class RemoteProperty():
         buffer = self._parent.__channel__.remote_endpoint_operation(self._id, None, True, self._codec.get_length())
         return self._codec.deserialize(buffer)
 
+    def get_value_and_time(self):
+        buffer, read_time = self._parent.__channel__.remote_endpoint_operation(self._id, None, True,
+                self._codec.get_length(), with_time=True)
+        return self._codec.deserialize(buffer), read_time
+
     def set_value(self, value):
         buffer = self._codec.serialize(value)
         # TODO: Currenly we wait for an ack here. Settle on the default guarantee.
-        self._parent.__channel__.remote_endpoint_operation(self._id, buffer, True, 0)
+        # The response holds the old value. It's empty if the remote node
+        # dropped the write because its write handoff queue was full.
+        response_length = self._codec.get_length() if self._can_read else 0
+        response = self._parent.__channel__.remote_endpoint_operation(self._id, buffer, True, response_length)
+        if len(response) < response_length:
+            raise WriteDroppedError("the remote node dropped the write to {}".format(self._name))
 
     def dump(self):
         if self._name == "serial_number":
@@ -167,6 +183,118 @@ class RemoteFunction(object):
     def dump(self):
         return "{}({})".format(self._name, ", ".join("{}: {}".format(x._name, x._property_type.__name__) for x in self._inputs))
 
+class RemoteUpload(object):
+    """
+    Uploads an image, e.g. a firmware, to an upload endpoint (see upload.hpp).
+    """
+    # The canonical framing fits packets of up to MAX_PACKET_SIZE - 2 bytes
+    # (the 2 byte CRC is buffered with the packet). The request overhead in
+    # the default header mode is 6 bytes header, 2 bytes trailer, 1 byte
+    # operation and 4 bytes offset.
+    max_chunk_size = fibre.protocol.MAX_PACKET_SIZE - 2 - 13
+
+    def __init__(self, json_data, parent):
+        self._parent = parent
+        id_str = json_data.get("id", None)
+        if id_str is None:
+            raise ObjectDefinitionError("unspecified endpoint ID")
+        self._id = int(id_str)
+
+        self._name = json_data.get("name", None)
+        if self._name is None:
+            self._name = "[anonymous]"
+
+    def _operation(self, op, payload=b''):
+        response = self._parent.__channel__.remote_endpoint_operation(self._id,
+                struct.pack('<B', op) + payload, True, 5)
+        if len(response) < 5:
+            raise UploadError("invalid response from the upload endpoint")
+        return struct.unpack('<IB', response[:5])
+
+    def get_status(self):
+        """
+        Returns (received, status): the number of bytes received so far and the
+        UPLOAD_STATUS_* of the upload endpoint.
+        """
+        return self._operation(fibre.protocol.UPLOAD_OP_STATUS)
+
+    def upload(self, data, window=32, chunk_size=None, timeout=1.0):
+        """
+        Uploads data and raises UploadError unless the remote node verified and
+        committed it.
+        window: The number of chunks that may be in flight. Only some of them
+                request an acknowledgement, which covers all data received
+                before it. Chunks after a lost one are sent again once no
+                acknowledgement arrived for timeout seconds.
+        """
+        channel = self._parent.__channel__
+        chunk_size = chunk_size or self.max_chunk_size
+        window_bytes = window * chunk_size
+        ack_interval = max(1, window // 4)
+        size = len(data)
+        data = memoryview(bytes(data))
+
+        received, status = self._operation(fibre.protocol.UPLOAD_OP_BEGIN, struct.pack('<I', size))
+        if status != fibre.protocol.UPLOAD_STATUS_RECEIVING:
+            raise UploadError("the remote node rejected the upload (status {})".format(status))
+
+        state = {'received': 0, 'status': status}
+        acknowledged = threading.Condition()
+        def on_ack(payload):
+            if len(payload) < 5:
+                return
+            received, status = struct.unpack('<IB', payload[:5])
+            with acknowledged:
+                state['received'] = max(state['received'], received)
+                state['status'] = status
+                acknowledged.notify()
+
+        # Requests whose acknowledgement may still be outstanding
+        ack_requests = []
+        def cancel_ack_requests():
+            for seq_no in ack_requests:
+                channel.cancel_request(seq_no)
+            del ack_requests[:]
+
+        sent = 0
+        n_chunks = 0
+        try:
+            while True:
+                with acknowledged:
+                    received = state['received']
+                    if received >= size or state['status'] != fibre.protocol.UPLOAD_STATUS_RECEIVING:
+                        break
+                    if sent >= size or sent - received >= window_bytes:
+                        if not acknowledged.wait_for(lambda: state['received'] > received
+                                or state['status'] != fibre.protocol.UPLOAD_STATUS_RECEIVING, timeout):
+                            # A chunk or acknowledgement was lost, go back to
+                            # the first byte that was not acknowledged
+                            cancel_ack_requests()
+                            sent = received
+                        continue
+                    sent = max(sent, received)
+
+                end = min(sent + chunk_size, size)
+                payload = struct.pack('<BI', fibre.protocol.UPLOAD_OP_DATA, sent) + data[sent:end]
+                n_chunks += 1
+                if n_chunks % ack_interval == 0 or end == size or end - received >= window_bytes:
+                    ack_requests.append(channel.remote_endpoint_operation_async(self._id, payload, 5, on_ack))
+                else:
+                    channel.remote_endpoint_operation(self._id, payload, False, 0)
+                sent = end
+        finally:
+            cancel_ack_requests()
+
+        if state['status'] == fibre.protocol.UPLOAD_STATUS_RECEIVING:
+            received, status = self._operation(fibre.protocol.UPLOAD_OP_FINISH,
+                    struct.pack('<I', fibre.protocol.calc_crc32(data)))
+            state['status'] = status
+        if state['status'] != fibre.protocol.UPLOAD_STATUS_COMPLETE:
+            raise UploadError("upload failed (status {})".format(state['status']))
+
+    def dump(self):
+        return "{} (upload)".format(self._name)
+
 class RemoteObject(object):
     """
     Object with functions and properties that map to remote endpoints
@@ -185,9 +313,33 @@ class RemoteObject(object):
 
         self.__channel__ = channel
         self.__parent__ = parent
+        self._printer = printer
+
+        # The dot-separated path of this object, the root object has an empty path
+        if parent is None:
+            self._path = ""
+        elif parent._path:
+            self._path = parent._path + "." + json_data.get("name", "")
+        else:
+            self._path = json_data.get("name", "")
+
+        # Objects without members are stubs from a subtree descriptor. Their
+        # members are fetched when they are first accessed (see _materialize).
+        self._is_stub = "members" not in json_data
+        if not self._is_stub:
+            self._add_members(json_data["members"])
+
+        # Ensure that from here on out assignments to undefined attributes
+        # raise an exception
+        self.__sealed__ = True
+        channel._channel_broken.subscribe(self._tear_down)
+
+    def _add_members(self, members_json):
+        channel = self.__channel__
+        printer = self._printer
 
         # Build attribute list from JSON
-        for member_json in json_data.get("members", []):
+        for member_json in members_json:
             member_name = member_json.get("name", None)
             if member_name is None:
                 printer("ignoring unnamed attribute")
@@ -199,6 +351,8 @@ class RemoteObject(object):
                     attribute = RemoteObject(member_json, self, channel, printer)
                 elif type_str == "function":
                     attribute = RemoteFunction(member_json, self)
+                elif type_str == "upload":
+                    attribute = RemoteUpload(member_json, self)
                 elif type_str != None:
                     attribute = RemoteProperty(member_json, self)
                 else:
@@ -210,10 +364,18 @@ class RemoteObject(object):
             self._remote_attributes[member_name] = attribute
             self.__dict__[member_name] = attribute
 
-        # Ensure that from here on out assignments to undefined attributes
-        # raise an exception
-        self.__sealed__ = True
-        channel._channel_broken.subscribe(self._tear_down)
+    def _materialize(self):
+        """
+        Fetches the members of a stub object from the remote node
+        """
+        if not object.__getattribute__(self, "_is_stub"):
+            return
+        json_bytes = self.__channel__.remote_endpoint_read_buffer(0, self._path.encode('ascii') + b'\0')
+        if not json_bytes:
+            raise ObjectDefinitionError("the remote node has no object at {}".format(self._path))
+        json_data = json.loads(json_bytes.decode('ascii'))
+        self._is_stub = False
+        self._add_members(json_data["members"])
 
     def dump(self, indent, depth):
         if depth <= 0:
@@ -234,6 +396,8 @@ class RemoteObject(object):
         return self.__str__()
 
     def __getattribute__(self, name):
+        if not name.startswith('_'):
+            object.__getattribute__(self, "_materialize")()
         attr = object.__getattribute__(self, "_remote_attributes").get(name, None)
         if isinstance(attr, RemoteProperty):
             if attr._can_read:
@@ -247,6 +411,8 @@ class RemoteObject(object):
             #raise AttributeError("Attribute {} not found".format(name))
 
     def __setattr__(self, name, value):
+        if not name.startswith('_'):
+            object.__getattribute__(self, "_materialize")()
         attr = object.__getattribute__(self, "_remote_attributes").get(name, None)
         if isinstance(attr, RemoteProperty):
             if attr._can_write:
@@ -258,6 +424,32 @@ class RemoteObject(object):
         else:
             raise AttributeError("Attribute {} not found".format(name))
 
+    def get_with_time(self, name):
+        """
+        Reads a property and returns (value, time) where time is the
+        time.monotonic() at which the remote node read the property. See
+        with_time in Channel.remote_endpoint_operation for the accuracy.
+        """
+        attr = self._remote_attributes.get(name, None)
+        if not isinstance(attr, RemoteProperty) or not attr._can_read:
+            raise Exception("Cannot read from property {}".format(name))
+        return attr.get_value_and_time()
+
+    def set_atomically(self, **values):
+        """
+        Writes several properties of this object in one request, for example
+        set_atomically(kp=1.0, ki=0.1). The remote node applies all of the
+        writes together, so that it never works with only some of them.
+        """
+        writes = []
+        for name, value in values.items():
+            attr = self._remote_attributes.get(name, None)
+            if not isinstance(attr, RemoteProperty) or not attr._can_write:
+                raise Exception("Cannot write to property {}".format(name))
+            writes.append((attr._id, attr._codec.serialize(value)))
+        if not self.__channel__.write_transaction(writes):
+            raise Exception("The remote node rejected the transaction")
+
     def _tear_down(self):
         # Clear all remote members
         for k in self._remote_attributes.keys():
@@ -0,0 +1,94 @@
+"""
+Reads the shared memory snapshot that a Fibre node on the same machine
+exports (see SnapshotExporter in posix_shm.hpp). Reads are lock-free and
+don't involve the Fibre server.
+"""
+
+import json
+import mmap
+import os
+import struct
+import fibre.remote_object
+
+SNAPSHOT_MAGIC = 0x50534246
+SNAPSHOT_VERSION = 2
+
+_HEADER = struct.Struct('<IHHIIIIIIQ') # see SnapshotHeader
+_ENTRY = struct.Struct('<IHHII') # see SnapshotEntry
+_SEQ_OFFSET = 8
+_TIMESTAMP_OFFSET = 32
+
+class SnapshotReader():
+    """
+    Maps a snapshot segment (e.g. "/fibre_test_server") read-only.
+    Values are decoded with the types from the JSON descriptor in the segment.
+    """
+    def __init__(self, name):
+        fd = os.open("/dev/shm/" + name.lstrip("/"), os.O_RDONLY)
+        try:
+            self._mm = mmap.mmap(fd, 0, mmap.MAP_SHARED, mmap.PROT_READ)
+        finally:
+            os.close(fd)
+        (magic, version, self.json_crc, _, n_entries, json_offset, json_length,
+         self._values_offset, self._values_length, _) = _HEADER.unpack_from(self._mm, 0)
+        if magic != SNAPSHOT_MAGIC or version != SNAPSHOT_VERSION:
+            raise ValueError("{} is not an initialized Fibre snapshot".format(name))
+        descriptor = json.loads(self._mm[json_offset:json_offset + json_length].decode('ascii'))
+
+        # Maps each exported path to (offset, codec)
+        codecs_by_id = {}
+        paths_by_id = {}
+        def add_members(members, prefix):
+            for member in members:
+                path = prefix + member.get("name", "")
+                if member.get("type") == "object":
+                    add_members(member.get("members", []), path + ".")
+                elif "id" in member:
+                    paths_by_id[member["id"]] = path
+                    codecs_by_id[member["id"]] = next((types[member["type"]]
+                            for types in fibre.remote_object.codecs.values()
+                            if member.get("type") in types), None)
+        add_members(descriptor, "")
+        self._entries = {}
+        for i in range(n_entries):
+            _, endpoint_id, length, offset, _ = _ENTRY.unpack_from(self._mm, _HEADER.size + i * _ENTRY.size)
+            codec = codecs_by_id.get(endpoint_id)
+            if endpoint_id in paths_by_id and codec is not None and codec.get_length() == length:
+                self._entries[paths_by_id[endpoint_id]] = (self._values_offset + offset, codec)
+
+    def get_paths(self):
+        return list(self._entries.keys())
+
+    def _copy(self, offset, length):
+        """
+        Returns (bytes, timestamp_ns) of one consistent update
+        """
+        while True:
+            seq = struct.unpack_from('<I', self._mm, _SEQ_OFFSET)[0]
+            data = self._mm[offset:offset + length]
+            timestamp_ns = struct.unpack_from('<Q', self._mm, _TIMESTAMP_OFFSET)[0]
+            if not (seq & 1) and seq == struct.unpack_from('<I', self._mm, _SEQ_OFFSET)[0]:
+                return data, timestamp_ns
+
+    def read(self, path):
+        """
+        Returns the value of the exported property with the specified path,
+        e.g. "config.gain". Raises KeyError if the path isn't exported.
+        """
+        offset, codec = self._entries[path]
+        return codec.deserialize(self._copy(offset, codec.get_length())[0])
+
+    def read_all(self):
+        """
+        Returns (values, timestamp_ns) where values maps all exported paths to
+        their values, all from the same update. timestamp_ns is the exporter's
+        monotonic clock (time.monotonic_ns() on the same machine) at which the
+        values were sampled.
+        """
+        data, timestamp_ns = self._copy(self._values_offset, self._values_length)
+        values = {path: codec.deserialize(data[offset - self._values_offset:offset - self._values_offset + codec.get_length()])
+                  for path, (offset, codec) in self._entries.items()}
+        return values, timestamp_ns
+
+    def close(self):
+        self._mm.close()
@@ -52,6 +52,9 @@ class TCPTransport(fibre.protocol.StreamSource, fibre.protocol.StreamSink):
     # TODO: this blocks until a connection is established, or the system cancels it
     self.sock.connect(self.target)
     set_keepalive(self.sock)
+    # Requests that don't wait for a response (e.g. pipelined upload chunks)
+    # would otherwise be delayed until the previous segment is acknowledged
+    self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
 
   def process_bytes(self, buffer):
     self.sock.send(buffer)
@@ -63,20 +66,23 @@ class TCPTransport(fibre.protocol.StreamSource, fibre.protocol.StreamSink):
     function blocks forever. A deadline before the current time corresponds
     to non-blocking mode.
     """
-    # convert deadline to seconds (floating point)
-    timeout = None if deadline is None else max(deadline - time.monotonic(), 0)
-    self.sock.settimeout(timeout)
-    try:
-      data = self.sock.recv(n_bytes, socket.MSG_WAITALL) # receive n_bytes
-      return data
-    except socket.timeout:
-      # if we got a timeout data will still be none, so we call recv again
-      # this time in non blocking state and see if we can get some data
-      #return self.sock.recv(n_bytes, socket.MSG_DONTWAIT)
-      #try:
-      #  return self.sock.recv(n_bytes, socket.MSG_DONTWAIT)
-      #except socket.timeout:
-      raise TimeoutError
+    data = bytes()
+    while len(data) < n_bytes:
+      # convert deadline to seconds (floating point)
+      timeout = None if deadline is None else max(deadline - time.monotonic(), 0)
+      self.sock.settimeout(timeout)
+      try:
+        # With a timeout, the socket is non-blocking internally, so recv
+        # returns whatever already arrived even with MSG_WAITALL.
+        chunk = self.sock.recv(n_bytes - len(data), socket.MSG_WAITALL)
+      except socket.timeout:
+        if not data:
+          raise TimeoutError
+        break
+      if not chunk:
+        break # connection closed
+      data += chunk
+    return data
 
   def get_bytes_or_fail(self, n_bytes, deadline):
     result = self.get_bytes(n_bytes, deadline)
@@ -108,6 +114,8 @@ def discover_channels(path, serial_number, callback, cancellation_token, channel
               "TCP device {}:{}".format(dest_addr, dest_port),
               stream2packet_input, packet2stream_output,
               channel_termination_token, logger)
+      # TCP guarantees integrity, so there's no need for per-packet CRCs
+      channel.set_framing(fibre.protocol.FRAMING_LEAN)
     except:
       #logger.debug("TCP channel init failed. More info: " + traceback.format_exc())
       pass
@@ -0,0 +1,85 @@
+"""
+Receives telemetry frames that a Fibre node publishes to a multicast group
+(see publish_telemetry_on_udp in posix_udp.hpp)
+"""
+
+import socket
+import struct
+
+def decode_varint(buffer, pos):
+    """
+    Decodes an unsigned LEB128 varint starting at buffer[pos].
+    Returns the value and the position after the varint.
+    """
+    value = 0
+    shift = 0
+    while True:
+        if pos >= len(buffer):
+            raise ValueError("truncated varint")
+        byte = buffer[pos]
+        pos += 1
+        value |= (byte & 0x7f) << shift
+        shift += 7
+        if not (byte & 0x80):
+            return value, pos
+
+def parse_telemetry_frame(frame):
+    """
+    Returns (seq_no, json_crc, values) where values maps endpoint IDs to the
+    raw value bytes. Decode the values with the codecs that the descriptor
+    with the CRC json_crc specifies.
+    """
+    if len(frame) < 6:
+        raise ValueError("frame too short")
+    seq_no, json_crc = struct.unpack('<IH', frame[:6])
+    values = {}
+    pos = 6
+    while pos < len(frame):
+        endpoint_id, pos = decode_varint(frame, pos)
+        length, pos = decode_varint(frame, pos)
+        if pos + length > len(frame):
+            raise ValueError("truncated entry")
+        values[endpoint_id] = frame[pos:pos+length]
+        pos += length
+    return seq_no, json_crc, values
+
+class TelemetryReceiver():
+    """
+    Joins a multicast group and receives telemetry frames.
+    lost_frames counts the frames that were skipped in the sequence.
+    """
+    def __init__(self, group_address, port, interface_address='0.0.0.0'):
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.sock.bind(('', port))
+        membership = socket.inet_aton(group_address) + socket.inet_aton(interface_address)
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, membership)
+        self.lost_frames = 0
+        self._next_seq_no = None
+
+    def receive(self, timeout=None):
+        """
+        Blocks until the next valid frame arrives and returns it as
+        (seq_no, json_crc, values) (see parse_telemetry_frame).
+        Raises TimeoutError if no frame arrives within the timeout.
+        """
+        self.sock.settimeout(timeout)
+        while True:
+            try:
+                frame = self.sock.recv(65536)
+            except socket.timeout:
+                raise TimeoutError
+            try:
+                seq_no, json_crc, values = parse_telemetry_frame(frame)
+            except ValueError:
+                continue
+            if self._next_seq_no is not None:
+                skipped = (seq_no - self._next_seq_no) & 0xffffffff
+                if skipped >= 0x80000000:
+                    continue # late or duplicate frame
+                self.lost_frames += skipped
+            self._next_seq_no = (seq_no + 1) & 0xffffffff
+            return seq_no, json_crc, values
+
+    def close(self):
+        self.sock.close()
@@ -13,6 +13,11 @@ unit_tests = define_package{
     sources={'run_tests.cpp'}
 }
 
+benchmarks = define_package{
+    packages={fibre_package},
+    sources={'run_benchmarks.cpp'}
+}
+
 
 toolchain=GCCToolchain('', 'build', {'-O3', '-fvisibility=hidden', '-frename-registers', '-funroll-loops'}, {})
 toolchain=GCCToolchain('', 'build', {'-O3', '-g', '-Wall'}, {})
@@ -23,5 +28,6 @@ toolchain=GCCToolchain('', 'build', {'-O3', '-g', '-Wall'}, {})
 
 if tup.getconfig("BUILD_FIBRE_TESTS") == "true" then
 	build_executable('test_server', test_server, toolchain)
-	--build_executable('run_tests', unit_tests, toolchain)
+	build_executable('run_tests', unit_tests, toolchain)
+	build_executable('run_benchmarks', benchmarks, toolchain)
 end
@@ -0,0 +1,791 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fibre/fibre.hpp>
+#include <fibre/ascii_protocol.hpp>
+#include <fibre/posix_shm.hpp>
+#include <fibre/posix_config.hpp>
+
+using bench_clock = std::chrono::steady_clock;
+
+static bool json_output = false;
+static volatile uint32_t bench_sink; // keeps the compiler from optimizing benchmarked code away
+
+static double elapsed_us(bench_clock::time_point start) {
+    return std::chrono::duration<double, std::micro>(bench_clock::now() - start).count();
+}
+
+static void busy_wait_us(double us) {
+    auto start = bench_clock::now();
+    while (elapsed_us(start) < us) {}
+}
+
+// @brief Reports one result. Results are printed as aligned text or, with
+// --json, as one JSON object per line (see tools/compare-benchmarks).
+// Lower values must always be better.
+static void report(const std::string& name, double value, const char* unit) {
+    if (json_output)
+        printf("{\"name\":\"%s\",\"value\":%.6g,\"unit\":\"%s\"}\n", name.c_str(), value, unit);
+    else
+        printf("%-64s %12.3f %s\n", name.c_str(), value, unit);
+    fflush(stdout);
+}
+
+#define MICRO_REPEATS 5
+
+// @brief Calls fn(i) for i in [0, n_iterations) MICRO_REPEATS times over
+// and returns the time per call of the fastest round in ns.
+template<typename TFn>
+static double ns_per_call(size_t n_iterations, TFn fn) {
+    double best_us = std::numeric_limits<double>::max();
+    for (size_t round = 0; round < MICRO_REPEATS; ++round) {
+        auto start = bench_clock::now();
+        for (size_t i = 0; i < n_iterations; ++i)
+            fn(i);
+        best_us = std::min(best_us, elapsed_us(start));
+    }
+    return best_us * 1000 / n_iterations;
+}
+
+// @brief Discards the data and only counts it.
+class ByteCounter : public StreamSink {
+public:
+    int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) {
+        n_bytes_ += length;
+        if (processed_bytes)
+            *processed_bytes += length;
+        return 0;
+    }
+    size_t get_free_space() { return SIZE_MAX; }
+    size_t n_bytes_ = 0;
+};
+
+// @brief Discards packets and only counts them.
+class PacketCounter : public PacketSink {
+public:
+    int process_packet(const uint8_t* buffer, size_t length) {
+        n_packets_++;
+        return 0;
+    }
+    size_t n_packets_ = 0;
+};
+
+
+/* Protocol core -------------------------------------------------------------*/
+
+#define MICRO_ITERATIONS 100000
+
+void benchmark_crc() {
+    uint8_t buffer[1024];
+    for (size_t i = 0; i < sizeof(buffer); ++i)
+        buffer[i] = i * 31 + 7;
+    report("crc/crc8", ns_per_call(MICRO_ITERATIONS / 100, [&](size_t i) {
+        bench_sink = calc_crc8<CANONICAL_CRC8_POLYNOMIAL>(CANONICAL_CRC8_INIT, buffer, sizeof(buffer));
+    }) / sizeof(buffer), "ns/byte");
+    report("crc/crc16", ns_per_call(MICRO_ITERATIONS / 100, [&](size_t i) {
+        bench_sink = calc_crc16<CANONICAL_CRC16_POLYNOMIAL>(CANONICAL_CRC16_INIT, buffer, sizeof(buffer));
+    }) / sizeof(buffer), "ns/byte");
+}
+
+void benchmark_varint() {
+    // Values of all encoded lengths from 1 to 5 bytes
+    std::vector<uint32_t> values;
+    for (size_t i = 0; i < 1000; ++i)
+        values.push_back((uint32_t)(i * 2654435761u) >> (i % 5 * 7));
+    std::vector<std::vector<uint8_t>> encoded;
+    for (uint32_t value : values) {
+        uint8_t buffer[5];
+        encoded.push_back(std::vector<uint8_t>(buffer, buffer + write_varint(value, buffer, sizeof(buffer))));
+    }
+
+    report("varint/write_varint", ns_per_call(MICRO_ITERATIONS, [&](size_t i) {
+        uint8_t buffer[5];
+        bench_sink = write_varint(values[i % values.size()], buffer, sizeof(buffer));
+    }), "ns/value");
+    report("varint/read_varint", ns_per_call(MICRO_ITERATIONS, [&](size_t i) {
+        const std::vector<uint8_t>& bytes = encoded[i % encoded.size()];
+        const uint8_t* buffer = bytes.data();
+        size_t length = bytes.size();
+        uint32_t value = 0;
+        read_varint(&buffer, &length, &value);
+        bench_sink = value;
+    }), "ns/value");
+    report("varint/VarintStreamEncoder", ns_per_call(MICRO_ITERATIONS, [&](size_t i) {
+        uint8_t buffer[5];
+        size_t generated_bytes = 0;
+        make_varint_encoder(values[i % values.size()]).get_bytes(buffer, sizeof(buffer), &generated_bytes);
+        bench_sink = generated_bytes;
+    }), "ns/value");
+    report("varint/VarintStreamDecoder", ns_per_call(MICRO_ITERATIONS, [&](size_t i) {
+        const std::vector<uint8_t>& bytes = encoded[i % encoded.size()];
+        uint32_t value = 0;
+        make_varint_decoder(value).process_bytes(bytes.data(), bytes.size(), nullptr);
+        bench_sink = value;
+    }), "ns/value");
+}
+
+// @brief Encodes and decodes a CRC8 protected header with two varints, like
+// the decoder/encoder demo in run_tests.
+void benchmark_coder_chains() {
+    ReceiverState request;
+    request.endpoint_id = 300;
+    request.length = 444;
+    uint8_t encoded[20];
+    size_t encoded_length = 0;
+
+    report("chain/EncoderChain (crc8, 2 varints)", ns_per_call(MICRO_ITERATIONS, [&](size_t i) {
+        auto encoder = make_crc8_encoder<CANONICAL_CRC8_INIT, CANONICAL_CRC8_POLYNOMIAL>(
+            make_encoder_chain(
+                make_varint_encoder(request.length),
+                make_varint_encoder(request.endpoint_id)
+            )
+        );
+        encoded_length = 0;
+        encoder.get_bytes(encoded, sizeof(encoded), &encoded_length);
+    }), "ns/header");
+
+    ReceiverState state;
+    report("chain/DecoderChain (crc8, 2 varints)", ns_per_call(MICRO_ITERATIONS, [&](size_t i) {
+        auto decoder = make_crc8_decoder<CANONICAL_CRC8_INIT, CANONICAL_CRC8_POLYNOMIAL>(
+            make_decoder_chain(
+                make_length_decoder(state),
+                make_endpoint_id_decoder(state)
+            )
+        );
+        decoder.process_bytes(encoded, encoded_length, nullptr);
+        bench_sink = state.endpoint_id;
+    }), "ns/header");
+}
+
+#define FRAMING_PAYLOAD_SIZE 64
+#define FRAMING_PACKETS 64
+
+void benchmark_framing(StreamFraming framing, const char* framing_name) {
+    uint8_t payload[FRAMING_PAYLOAD_SIZE];
+    for (size_t i = 0; i < sizeof(payload); ++i)
+        payload[i] = i;
+
+    ByteCounter counter;
+    StreamBasedPacketSink packet2stream(counter);
+    packet2stream.set_framing(framing);
+    report(std::string("framing/StreamBasedPacketSink, ") + framing_name + ", 64 byte packets",
+            ns_per_call(MICRO_ITERATIONS, [&](size_t i) {
+        packet2stream.process_packet(payload, sizeof(payload));
+    }), "ns/packet");
+
+    // Frame a batch of packets and feed it through the segmenter in
+    // TCP-sized chunks
+    static uint8_t stream[FRAMING_PACKETS * (FRAMING_PAYLOAD_SIZE + 8)];
+    MemoryStreamSink memory_sink(stream, sizeof(stream));
+    StreamBasedPacketSink framer(memory_sink);
+    framer.set_framing(framing);
+    for (size_t i = 0; i < FRAMING_PACKETS; ++i)
+        framer.process_packet(payload, sizeof(payload));
+    size_t stream_length = sizeof(stream) - memory_sink.get_free_space();
+
+    PacketCounter packet_counter;
+    StreamToPacketSegmenter stream2packet(packet_counter);
+    stream2packet.set_framing(framing);
+    double ns_per_batch = ns_per_call(MICRO_ITERATIONS / FRAMING_PACKETS, [&](size_t i) {
+        for (size_t pos = 0; pos < stream_length; pos += 512)
+            stream2packet.process_bytes(stream + pos, std::min<size_t>(512, stream_length - pos), nullptr);
+    });
+    if (packet_counter.n_packets_ != MICRO_REPEATS * (MICRO_ITERATIONS / FRAMING_PACKETS) * FRAMING_PACKETS)
+        printf("framing: the segmenter lost packets\n");
+    report(std::string("framing/StreamToPacketSegmenter, ") + framing_name + ", 64 byte packets",
+            ns_per_batch / FRAMING_PACKETS, "ns/packet");
+}
+
+class ChannelBenchmarkClass {
+public:
+    float setpoint = 1.0f;
+
+    FIBRE_EXPORTS(ChannelBenchmarkClass,
+        make_fibre_property("setpoint", &setpoint)
+    );
+};
+
+// Shared by the channel benchmarks, because fibre_publish() keeps the first
+// object tree of each type for path lookups
+static ChannelBenchmarkClass channel_benchmark_object;
+
+// @brief Measures BidirectionalPacketBasedChannel::process_packet() for
+// property reads and writes on a channel with canonical headers.
+void benchmark_channel() {
+    ChannelBenchmarkClass& obj = channel_benchmark_object;
+    fibre_publish(obj.fibre_definitions);
+    uint16_t json_crc = fibre_get_json_crc();
+
+    PacketCounter output;
+    BidirectionalPacketBasedChannel channel(output);
+
+    // seq_no, endpoint ID (bit 15: expect response), response length, payload, trailer
+    uint8_t read_request[8];
+    write_le<uint16_t>(1 | 0x8000, read_request + 2);
+    write_le<uint16_t>(4, read_request + 4);
+    write_le<uint16_t>(json_crc, read_request + 6);
+    report("channel/process_packet, property read", ns_per_call(MICRO_ITERATIONS, [&](size_t i) {
+        write_le<uint16_t>(i & 0x3fff, read_request);
+        channel.process_packet(read_request, sizeof(read_request));
+    }), "ns/request");
+
+    fibre_set_latency_breakdown(true);
+    report("channel/process_packet, property read, latency breakdown", ns_per_call(MICRO_ITERATIONS, [&](size_t i) {
+        write_le<uint16_t>(i & 0x3fff, read_request);
+        channel.process_packet(read_request, sizeof(read_request));
+    }), "ns/request");
+    fibre_set_latency_breakdown(false);
+
+    uint8_t write_request[12];
+    write_le<uint16_t>(1, write_request + 2);
+    write_le<uint16_t>(0, write_request + 4);
+    write_le<float>(2.0f, write_request + 6);
+    write_le<uint16_t>(json_crc, write_request + 10);
+    report("channel/process_packet, property write", ns_per_call(MICRO_ITERATIONS, [&](size_t i) {
+        write_le<uint16_t>(i & 0x3fff, write_request);
+        channel.process_packet(write_request, sizeof(write_request));
+    }), "ns/request");
+    if (output.n_packets_ != 2 * MICRO_REPEATS * MICRO_ITERATIONS)
+        printf("channel: some read requests were not answered\n");
+    if (obj.setpoint != 2.0f)
+        printf("channel: the write request was not applied\n");
+}
+
+
+/* Flow control --------------------------------------------------------------*/
+
+#define SLOW_CONSUMER_REQUESTS 2000
+#define SLOW_CONSUMER_INTERVAL_US 20 // time the consumer needs per response
+#define SLOW_CONSUMER_WINDOW 64 // response bytes the consumer can buffer
+
+// @brief Keeps the responses of a channel until the consumer takes them.
+class ResponseBuffer : public PacketSink {
+public:
+    int process_packet(const uint8_t* buffer, size_t length) {
+        responses_.emplace_back(buffer, buffer + length);
+        n_bytes_ += length;
+        max_bytes_ = std::max(max_bytes_, n_bytes_);
+        return 0;
+    }
+    std::deque<std::vector<uint8_t>> responses_;
+    size_t n_bytes_ = 0;
+    size_t max_bytes_ = 0;
+};
+
+// @brief Measures a flow controlled channel whose consumer takes
+// SLOW_CONSUMER_INTERVAL_US per response. The client keeps as many reads
+// outstanding as the channel grants and grants credit like the Python client
+// once half of the window is consumed. Reports the time from sending a
+// request to consuming its response, the most response bytes that were
+// waiting for the consumer and the size of the channel.
+void benchmark_slow_consumer() {
+    fibre_publish(channel_benchmark_object.fibre_definitions);
+    uint16_t json_crc = fibre_get_json_crc();
+
+    ResponseBuffer output;
+    BidirectionalPacketBasedChannel channel(output);
+
+    // seq_no, session control endpoint, response length, opcode, window, trailer
+    uint8_t enable_request[] = { 0x00, 0x00, 0xff, 0xff, 0x01, 0x00, 0x04, SLOW_CONSUMER_WINDOW, 0x00, 0x01, 0x00 };
+    channel.process_packet(enable_request, sizeof(enable_request));
+    size_t request_window = output.responses_.front()[2];
+    output.responses_.clear();
+    output.n_bytes_ = output.max_bytes_ = 0;
+
+    uint8_t read_request[8];
+    write_le<uint16_t>(1 | 0x8000, read_request + 2);
+    write_le<uint16_t>(4, read_request + 4);
+    write_le<uint16_t>(json_crc, read_request + 6);
+    uint8_t grant_request[] = { 0x00, 0x00, 0xff, 0x7f, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00 };
+
+    std::vector<bench_clock::time_point> send_times(SLOW_CONSUMER_REQUESTS);
+    std::vector<double> latencies;
+    size_t n_sent = 0;
+    uint8_t n_completed = 0;
+    uint32_t consumed_bytes = 0, granted_bytes = 0;
+    while (latencies.size() < SLOW_CONSUMER_REQUESTS) {
+        while (n_sent < SLOW_CONSUMER_REQUESTS && (uint8_t)(n_sent - n_completed) < request_window) {
+            write_le<uint16_t>(n_sent & 0x3fff, read_request);
+            send_times[n_sent++] = bench_clock::now();
+            channel.process_packet(read_request, sizeof(read_request));
+        }
+
+        busy_wait_us(SLOW_CONSUMER_INTERVAL_US);
+        if (output.responses_.empty())
+            continue;
+        std::vector<uint8_t> response = std::move(output.responses_.front());
+        output.responses_.pop_front();
+        output.n_bytes_ -= response.size();
+        latencies.push_back(elapsed_us(send_times[latencies.size()]));
+        n_completed = response[2];
+        consumed_bytes += response.size();
+        if (consumed_bytes - granted_bytes >= SLOW_CONSUMER_WINDOW / 2) {
+            granted_bytes = consumed_bytes;
+            write_le<uint32_t>(granted_bytes, grant_request + 7);
+            channel.process_packet(grant_request, sizeof(grant_request));
+        }
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    report("flow control/slow consumer, median latency", latencies[latencies.size() / 2], "us");
+    report("flow control/slow consumer, p99 latency", latencies[latencies.size() * 99 / 100], "us");
+    report("flow control/slow consumer, max buffered responses", output.max_bytes_, "bytes");
+    report("flow control/BidirectionalPacketBasedChannel size", sizeof(BidirectionalPacketBasedChannel), "bytes");
+}
+
+
+/* Shared memory snapshot ----------------------------------------------------*/
+
+class SnapshotBenchmarkClass {
+public:
+    float values[8] = { 0 };
+
+    FIBRE_EXPORTS(SnapshotBenchmarkClass,
+        make_fibre_property("v0", &values[0]),
+        make_fibre_property("v1", &values[1]),
+        make_fibre_property("v2", &values[2]),
+        make_fibre_property("v3", &values[3]),
+        make_fibre_property("v4", &values[4]),
+        make_fibre_property("v5", &values[5]),
+        make_fibre_property("v6", &values[6]),
+        make_fibre_property("v7", &values[7])
+    );
+};
+
+// @brief Measures updating a snapshot segment with 8 float properties and
+// reading it back, to compare with "channel/process_packet, property read".
+void benchmark_snapshot() {
+    static SnapshotBenchmarkClass obj;
+    fibre_publish(obj.fibre_definitions);
+    const uint16_t endpoint_ids[] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+
+    SnapshotExporter exporter;
+    SnapshotReader reader;
+    if (exporter.open("/fibre_benchmark", endpoint_ids, 8) || reader.open("/fibre_benchmark")) {
+        printf("snapshot: failed to create the segment\n");
+        return;
+    }
+    int index = reader.find("v3");
+
+    report("snapshot/update, 8 properties", ns_per_call(MICRO_ITERATIONS, [&](size_t i) {
+        obj.values[3] = (float)i;
+        exporter.update();
+    }), "ns/update");
+    float value = 0.0f;
+    report("snapshot/read, 1 property", ns_per_call(MICRO_ITERATIONS, [&](size_t i) {
+        reader.read(index, &value, sizeof(value));
+        bench_sink += (uint32_t)value;
+    }), "ns/read");
+    uint8_t values[32];
+    report("snapshot/read_all, 8 properties", ns_per_call(MICRO_ITERATIONS, [&](size_t i) {
+        reader.read_all(values, sizeof(values));
+        bench_sink += values[12];
+    }), "ns/read");
+    if (index < 0 || value != obj.values[3])
+        printf("snapshot: read a wrong value\n");
+}
+
+
+/* Accessor properties -------------------------------------------------------*/
+
+class ExpensiveGetterClass {
+public:
+    std::atomic<uint32_t> n_calls{0};
+
+    // Simulates a getter that derives its value from a slow computation
+    float get_temperature() {
+        n_calls++;
+        busy_wait_us(50);
+        return 42.0f;
+    }
+};
+
+// @brief Reads the endpoint from n_threads threads concurrently and reports the
+// wall time per read and the number of getter invocations.
+template<typename TEndpoint>
+void benchmark_concurrent_reads(const char* name, TEndpoint& endpoint, std::atomic<uint32_t>& n_calls,
+        size_t n_threads, size_t n_reads) {
+    n_calls = 0;
+    auto start = bench_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < n_threads; ++i) {
+        threads.emplace_back([&endpoint, n_reads]{
+            for (size_t j = 0; j < n_reads; ++j) {
+                uint8_t buffer[4];
+                MemoryStreamSink output(buffer, sizeof(buffer));
+                endpoint.handle(nullptr, 0, &output);
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    double total_us = elapsed_us(start);
+    std::string prefix = std::string("accessor/") + name + ", " + std::to_string(n_threads) + " threads";
+    report(prefix, total_us / (n_threads * n_reads), "us/read");
+    report(prefix + ", getter calls", n_calls, "calls");
+}
+
+void benchmark_accessor_properties() {
+    ExpensiveGetterClass obj;
+    auto plain = make_fibre_ro_accessor_property("temperature", obj, &ExpensiveGetterClass::get_temperature);
+    auto memoized = make_fibre_ro_accessor_property("temperature", obj, &ExpensiveGetterClass::get_temperature, 10);
+
+    for (size_t n_threads : { 1, 8 }) {
+        benchmark_concurrent_reads("no memoization", plain, obj.n_calls, n_threads, 2000);
+        benchmark_concurrent_reads("10 ms memoization", memoized, obj.n_calls, n_threads, 2000);
+    }
+}
+
+
+/* Write handoff -------------------------------------------------------------*/
+
+#define CONTROL_LOOP_PERIOD_US 1000
+#define CONTROL_LOOP_WORK_US 200
+#define CONTROL_LOOP_TICKS 2000
+#define REQUEST_SEND_US 50 // time a network thread blocks while it sends the response of a write request
+#define WRITE_INTERVAL_US 300
+
+// @brief Runs a control loop at a fixed rate while another thread writes to
+// the loop's setpoint as fast as a busy client would and reports how late the
+// loop ticks complete.
+// @param handoff: If false, the control loop and the network thread share a
+//        mutex, which is what applications have to do without write handoff mode.
+//        If true, the loop applies pending writes at the start of each tick.
+void benchmark_control_loop_jitter(bool handoff) {
+    float setpoint = 0.0f;
+    auto endpoint = make_fibre_property("setpoint", &setpoint);
+    std::mutex mutex;
+    std::atomic<bool> stop{false};
+
+    fibre_set_write_handoff(handoff);
+    std::thread network_thread([&]{
+        uint8_t request[4];
+        for (float value = 0; !stop; value += 1.0f) {
+            write_le<float>(value, request);
+            // The endpoint handler writes the response to the output stream
+            // itself, so the lock would be held while the response is sent.
+            std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+            if (!handoff)
+                lock.lock();
+            endpoint.handle(request, sizeof(request), nullptr);
+            std::this_thread::sleep_for(std::chrono::microseconds(REQUEST_SEND_US));
+            if (!handoff)
+                lock.unlock();
+            std::this_thread::sleep_for(std::chrono::microseconds(WRITE_INTERVAL_US));
+        }
+    });
+
+    std::vector<double> latencies;
+    auto tick = bench_clock::now();
+    volatile float output = 0.0f;
+    for (size_t i = 0; i < CONTROL_LOOP_TICKS; ++i) {
+        tick += std::chrono::microseconds(CONTROL_LOOP_PERIOD_US);
+        std::this_thread::sleep_until(tick);
+        {
+            std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+            if (handoff)
+                fibre_apply_pending();
+            else
+                lock.lock();
+            output = output + setpoint;
+            busy_wait_us(CONTROL_LOOP_WORK_US);
+        }
+        latencies.push_back(elapsed_us(tick));
+    }
+
+    stop = true;
+    network_thread.join();
+    fibre_apply_pending();
+    fibre_set_write_handoff(false);
+
+    // The latency includes the work, subtract it to get the jitter
+    std::sort(latencies.begin(), latencies.end());
+    std::string prefix = handoff ? "control loop/write handoff" : "control loop/mutex";
+    report(prefix + ", median jitter", latencies[latencies.size() / 2] - CONTROL_LOOP_WORK_US, "us");
+    report(prefix + ", p99 jitter", latencies[latencies.size() * 99 / 100] - CONTROL_LOOP_WORK_US, "us");
+    report(prefix + ", max jitter", latencies.back() - CONTROL_LOOP_WORK_US, "us");
+}
+
+
+/* String conversion ---------------------------------------------------------*/
+
+#define STRING_CONVERSIONS 200000
+
+// @brief Converts values of the property to strings and back like the ASCII
+// protocol does for read and write commands, once with get_string/set_string
+// and once with snprintf/sscanf, which is what they used before.
+template<typename T>
+void benchmark_string_conversion(const char* name, const char* fmt, T (*make_value)(size_t)) {
+    T value = T();
+    auto endpoint = make_fibre_property("value", &value);
+    char buffer[32];
+    std::vector<T> values;
+    for (size_t i = 0; i < 1024; ++i)
+        values.push_back(make_value(i));
+
+    size_t n_mismatches = 0;
+    auto start = bench_clock::now();
+    for (size_t i = 0; i < STRING_CONVERSIONS; ++i) {
+        T expected = value = values[i % values.size()];
+        endpoint.get_string(buffer, sizeof(buffer));
+        endpoint.set_string(buffer, sizeof(buffer));
+        n_mismatches += (value != expected);
+    }
+    double fibre_us = elapsed_us(start);
+
+    start = bench_clock::now();
+    for (size_t i = 0; i < STRING_CONVERSIONS; ++i) {
+        value = values[i % values.size()];
+        snprintf(buffer, sizeof(buffer), fmt, value);
+        sscanf(buffer, fmt, &value);
+    }
+    double stdio_us = elapsed_us(start);
+
+    std::string prefix = std::string("string conversion/") + name;
+    report(prefix + ", get_string/set_string", fibre_us / STRING_CONVERSIONS, "us");
+    report(prefix + ", snprintf/sscanf", stdio_us / STRING_CONVERSIONS, "us");
+    report(prefix + ", mismatches", n_mismatches, "values");
+}
+
+void benchmark_string_conversions() {
+    benchmark_string_conversion<float>("float", "%f",
+            [](size_t i) { return (float)i * 0.37f - 100.0f; });
+    benchmark_string_conversion<int32_t>("int32", "%d",
+            [](size_t i) { return (int32_t)(i * 2654435761u); });
+}
+
+
+/* Publishing large object trees ---------------------------------------------*/
+
+#define GENERATED_PROPERTIES_PER_OBJECT 32
+
+// Property and object names of generated trees, filled in at runtime
+static char generated_names[GENERATED_PROPERTIES_PER_OBJECT * 64][8];
+
+template<size_t... I>
+auto make_generated_object(const char* name, float* values, std::index_sequence<I...>)
+        -> decltype(make_fibre_object(name, make_fibre_property(generated_names[I], &values[I])...)) {
+    return make_fibre_object(name, make_fibre_property(generated_names[I], &values[I])...);
+}
+
+template<size_t... I>
+auto make_generated_tree(float* values, std::index_sequence<I...>)
+        -> decltype(make_fibre_member_list(make_generated_object(generated_names[I],
+            values + I * GENERATED_PROPERTIES_PER_OBJECT,
+            std::make_index_sequence<GENERATED_PROPERTIES_PER_OBJECT>())...)) {
+    return make_fibre_member_list(make_generated_object(generated_names[I],
+            values + I * GENERATED_PROPERTIES_PER_OBJECT,
+            std::make_index_sequence<GENERATED_PROPERTIES_PER_OBJECT>())...);
+}
+
+// @brief Calculates the same CRC as CRC16Calculator but one bit at a time,
+// which is how it was calculated before the lookup table.
+class BitwiseCRC16Calculator : public StreamSink {
+public:
+    int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) {
+        for (size_t i = 0; i < length; ++i)
+            crc16_ = calc_crc_bitwise<uint16_t, CANONICAL_CRC16_POLYNOMIAL>(crc16_, buffer[i]);
+        if (processed_bytes)
+            *processed_bytes += length;
+        return 0;
+    }
+    size_t get_free_space() { return SIZE_MAX; }
+    uint16_t get_crc16() { return crc16_; }
+    uint16_t crc16_ = PROTOCOL_VERSION;
+};
+
+// @brief Publishes a generated tree of N_OBJECTS objects with
+// GENERATED_PROPERTIES_PER_OBJECT float properties each and reports how long
+// publishing takes and what calculating the descriptor CRC costs on top.
+template<size_t N_OBJECTS>
+void benchmark_publish() {
+    static float values[N_OBJECTS * GENERATED_PROPERTIES_PER_OBJECT];
+    static auto tree = make_generated_tree(values, std::make_index_sequence<N_OBJECTS>());
+    uint8_t offset[4] = { 0 };
+
+    auto start = bench_clock::now();
+    fibre_publish(tree);
+    double publish_us = elapsed_us(start);
+
+    start = bench_clock::now();
+    ByteCounter counter;
+    json_file_endpoint_.handle(offset, sizeof(offset), &counter);
+    double json_us = elapsed_us(start);
+
+    start = bench_clock::now();
+    uint16_t crc = fibre_get_json_crc();
+    double crc_us = elapsed_us(start);
+
+    start = bench_clock::now();
+    BitwiseCRC16Calculator bitwise_calculator;
+    json_file_endpoint_.handle(offset, sizeof(offset), &bitwise_calculator);
+    double bitwise_crc_us = elapsed_us(start);
+
+    if (bitwise_calculator.get_crc16() != crc)
+        printf("publish: CRC mismatch\n");
+    std::string prefix = "publish/" + std::to_string(n_endpoints_) + " endpoints";
+    report(prefix + ", JSON size", counter.n_bytes_, "bytes");
+    report(prefix + ", publish", publish_us, "us");
+    report(prefix + ", JSON only", json_us, "us");
+    report(prefix + ", JSON + CRC (table)", crc_us, "us");
+    report(prefix + ", JSON + CRC (bitwise)", bitwise_crc_us, "us");
+}
+
+
+/* ASCII protocol ------------------------------------------------------------*/
+
+#define PATH_LOOKUPS 200000
+
+// @brief Looks up paths of the published object tree with EndpointPathTable
+// and with EndpointProvider::get_by_name() and reports the time per lookup.
+void benchmark_path_lookup() {
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < 64; i += 7)
+        for (size_t j = 0; j < GENERATED_PROPERTIES_PER_OBJECT; j += 5)
+            paths.push_back(std::string(generated_names[i]) + "." + generated_names[j]);
+
+    auto start = bench_clock::now();
+    EndpointPathTable table(*application_endpoints_);
+    double build_us = elapsed_us(start);
+
+    size_t n_misses = 0;
+    start = bench_clock::now();
+    for (size_t i = 0; i < PATH_LOOKUPS; ++i) {
+        const std::string& path = paths[i % paths.size()];
+        n_misses += !table.find(path.c_str(), path.size());
+    }
+    double table_us = elapsed_us(start);
+
+    start = bench_clock::now();
+    for (size_t i = 0; i < PATH_LOOKUPS; ++i) {
+        // get_by_name() modifies the path
+        char buffer[32];
+        const std::string& path = paths[i % paths.size()];
+        memcpy(buffer, path.c_str(), path.size() + 1);
+        n_misses += !application_endpoints_->get_by_name(buffer, path.size() + 1);
+    }
+    double tree_us = elapsed_us(start);
+
+    std::string prefix = "path lookup/" + std::to_string(n_endpoints_) + " endpoints";
+    report(prefix + ", hash table", table_us / PATH_LOOKUPS, "us");
+    report(prefix + ", hash table build", build_us, "us");
+    report(prefix + ", get_by_name", tree_us / PATH_LOOKUPS, "us");
+    report(prefix + ", misses", n_misses, "paths");
+}
+
+
+/* Configuration snapshots ---------------------------------------------------*/
+
+// @brief Saves and restores all properties of the published object tree with
+// a configuration snapshot and compares restoring it with setting each
+// property by path, as a startup script over the ASCII protocol would.
+void benchmark_config() {
+    const char* path = "/tmp/fibre_benchmark_config.bin";
+
+    auto start = bench_clock::now();
+    ConfigTable table(*application_endpoints_);
+    double build_us = elapsed_us(start);
+
+    std::vector<uint8_t> snapshot(table.get_snapshot_size());
+    start = bench_clock::now();
+    size_t length = table.save(snapshot.data(), snapshot.size());
+    double save_us = elapsed_us(start);
+
+    start = bench_clock::now();
+    int n_restored = table.restore(snapshot.data(), length);
+    double restore_us = elapsed_us(start);
+
+    start = bench_clock::now();
+    int save_result = fibre_save_config_file(path);
+    double save_file_us = elapsed_us(start);
+
+    start = bench_clock::now();
+    int n_loaded = fibre_load_config_file(path);
+    double load_file_us = elapsed_us(start);
+    unlink(path);
+
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < 64; ++i)
+        for (size_t j = 0; j < GENERATED_PROPERTIES_PER_OBJECT; ++j)
+            paths.push_back(std::string(generated_names[i]) + "." + generated_names[j]);
+    size_t n_set = 0;
+    start = bench_clock::now();
+    EndpointPathTable path_table(*application_endpoints_);
+    for (const std::string& property_path : paths) {
+        char value[] = "0.5";
+        Endpoint* endpoint = path_table.find(property_path.c_str(), property_path.size());
+        n_set += endpoint && endpoint->set_string(value, sizeof(value) - 1);
+    }
+    double by_path_us = elapsed_us(start);
+
+    if (n_restored != (int)table.get_property_count() || n_loaded != n_restored
+            || save_result || n_set != paths.size())
+        printf("config: restored %d, loaded %d, set %zu of %zu properties\n",
+                n_restored, n_loaded, n_set, table.get_property_count());
+    std::string prefix = "config/" + std::to_string(table.get_property_count()) + " properties";
+    report(prefix + ", snapshot size", length, "bytes");
+    report(prefix + ", table build", build_us, "us");
+    report(prefix + ", save", save_us, "us");
+    report(prefix + ", restore", restore_us, "us");
+    report(prefix + ", save file", save_file_us, "us");
+    report(prefix + ", load file (build + mmap + restore)", load_file_us, "us");
+    report(prefix + ", set each by path", by_path_us, "us");
+}
+
+
+// Usage: run_benchmarks [--json] [group...]
+// Runs all benchmark groups or only the specified ones. Use --json together
+// with tools/compare-benchmarks to check for regressions between commits.
+int main(int argc, const char** argv) {
+    std::vector<std::string> groups;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--json"))
+            json_output = true;
+        else
+            groups.push_back(argv[i]);
+    }
+    auto selected = [&](const char* group) {
+        return groups.empty() || std::find(groups.begin(), groups.end(), group) != groups.end();
+    };
+
+    if (selected("core")) {
+        benchmark_crc();
+        benchmark_varint();
+        benchmark_coder_chains();
+        benchmark_framing(FRAMING_CANONICAL, "canonical");
+        benchmark_framing(FRAMING_LEAN, "lean");
+        benchmark_channel();
+    }
+    if (selected("flow"))
+        benchmark_slow_consumer();
+    if (selected("snapshot"))
+        benchmark_snapshot();
+    if (selected("accessor"))
+        benchmark_accessor_properties();
+    if (selected("control")) {
+        benchmark_control_loop_jitter(false);
+        benchmark_control_loop_jitter(true);
+    }
+    if (selected("string"))
+        benchmark_string_conversions();
+    if (selected("publish")) {
+        for (size_t i = 0; i < sizeof(generated_names) / sizeof(generated_names[0]); ++i)
+            snprintf(generated_names[i], sizeof(generated_names[i]), "m%zu", i);
+        benchmark_publish<8>();
+        benchmark_publish<64>();
+        benchmark_path_lookup(); // uses the tree published by benchmark_publish<64>()
+        benchmark_config(); // same
+    }
+    return 0;
+}
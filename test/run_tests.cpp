@@ -7,9 +7,22 @@
 //#define DEBUG_PROTOCOL
 void hexdump(const uint8_t* buf, size_t len);
 
-#include <fibre/crc.hpp>
-#include <fibre/decoders.hpp>
-#include <fibre/encoders.hpp>
+#include <fibre/fibre.hpp>
+#include <fibre/posix_udp.hpp>
+#include <fibre/upload.hpp>
+#include <fibre/posix_config.hpp>
+#include <fibre/replication.hpp>
+#include <fibre/ascii_protocol.hpp>
+#include <fibre/posix_shm.hpp>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <thread>
 
 void hexdump(const uint8_t* buf, size_t len) {
     for (size_t pos = 0; pos < len; ++pos) {
@@ -38,7 +51,7 @@ bool varint_decoder_test() {
     };
 
     for (size_t i = 0; i < sizeof(test_cases) / sizeof(test_cases[0]); ++i) {
-        uint32_t result;
+        uint32_t result = 0;
         VarintStreamDecoder<uint32_t> decoder = make_varint_decoder(result);
         size_t processed_bytes = 0;
         int status = decoder.process_bytes(test_cases[i].encoded, test_cases[i].length, &processed_bytes);
@@ -71,6 +84,1017 @@ bool varint_decoder_test() {
 }
 
 
+class TelemetryTestClass {
+public:
+    float value = 1.5f;
+    uint32_t counter = 42;
+
+    FIBRE_EXPORTS(TelemetryTestClass,
+        make_fibre_property("value", &value),
+        make_fibre_property("counter", &counter)
+    );
+};
+
+// Publishes a few frames to a multicast group on the loopback interface and
+// checks that they arrive in sequence with the sampled values.
+bool telemetry_multicast_test() {
+    const char* group = "239.255.70.66";
+    const unsigned int port = 9920;
+    const size_t n_frames = 5;
+
+    TelemetryTestClass test_object;
+    auto definitions = test_object.fibre_definitions;
+    fibre_publish(definitions);
+
+    int s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    int reuse = 1;
+    struct sockaddr_in si_me;
+    memset((char *) &si_me, 0, sizeof(si_me));
+    si_me.sin_family = AF_INET;
+    si_me.sin_port = htons(port);
+    si_me.sin_addr.s_addr = htonl(INADDR_ANY);
+    struct ip_mreq membership;
+    inet_pton(AF_INET, group, &membership.imr_multiaddr);
+    inet_pton(AF_INET, "127.0.0.1", &membership.imr_interface);
+    struct timeval timeout = { 1, 0 };
+    if (s == -1
+            || setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse))
+            || bind(s, reinterpret_cast<struct sockaddr *>(&si_me), sizeof(si_me))
+            || setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership))
+            || setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))) {
+        printf("telemetry: failed to join multicast group\n");
+        return false;
+    }
+
+    const uint16_t endpoint_ids[] = { 1, 2 };
+    std::thread publisher(publish_telemetry_on_udp, group, port, "127.0.0.1",
+            endpoint_ids, 2, 10, n_frames);
+
+    bool result = true;
+    for (uint32_t expected_seq_no = 0; expected_seq_no < n_frames && result; ++expected_seq_no) {
+        uint8_t frame[512];
+        ssize_t length = recv(s, frame, sizeof(frame), 0);
+        const uint8_t expected[] = {
+            (uint8_t)expected_seq_no, 0x00, 0x00, 0x00, (uint8_t)fibre_get_json_crc(), (uint8_t)(fibre_get_json_crc() >> 8),
+            0x01, 0x04, 0x00, 0x00, 0xc0, 0x3f, // endpoint 1: 1.5f
+            0x02, 0x04, 0x2a, 0x00, 0x00, 0x00 // endpoint 2: 42
+        };
+        if (length != sizeof(expected) || memcmp(frame, expected, sizeof(expected))) {
+            printf("telemetry frame %u: expected:\n", expected_seq_no);
+            hexdump(expected, sizeof(expected));
+            printf("got: ");
+            hexdump(frame, length > 0 ? length : 0);
+            result = false;
+        }
+    }
+
+    publisher.join();
+    close(s);
+    return result;
+}
+
+// Sends an upload request to the receiver and checks the acknowledged offset
+// and status.
+static bool upload_request(UploadReceiver& receiver, uint8_t op, uint32_t value,
+        const uint8_t* data, size_t length, uint32_t expected_received, UploadStatus expected_status) {
+    uint8_t request[64];
+    request[0] = op;
+    write_le<uint32_t>(value, request + 1);
+    if (length)
+        memcpy(request + 5, data, length);
+    uint8_t response[5] = { 0 };
+    MemoryStreamSink output(response, sizeof(response));
+    receiver.handle(request, 5 + length, &output);
+    uint32_t received;
+    read_le<uint32_t>(&received, response);
+    if (received != expected_received || response[4] != expected_status) {
+        printf("upload op %u at %u: expected %u bytes, status %u but got %u bytes, status %u\n",
+                op, value, expected_received, expected_status, received, response[4]);
+        return false;
+    }
+    return true;
+}
+
+// Uploads an image with lost, reordered and repeated chunks and checks that
+// only a complete image with the correct CRC is committed.
+bool upload_test() {
+    uint8_t image[40];
+    for (size_t i = 0; i < sizeof(image); ++i)
+        image[i] = (uint8_t)(i * 7);
+    uint32_t crc = calc_crc32<UPLOAD_CRC32_POLYNOMIAL>(UPLOAD_CRC32_INIT, image, sizeof(image));
+
+    uint8_t buffer[sizeof(image)] = { 0 };
+    MemoryUploadSink sink(buffer, sizeof(buffer));
+    UploadReceiver receiver(sink);
+
+    return upload_request(receiver, UPLOAD_OP_BEGIN, sizeof(image) + 1, nullptr, 0, 0, UPLOAD_STATUS_SINK_ERROR) // too large
+        && upload_request(receiver, UPLOAD_OP_BEGIN, sizeof(image), nullptr, 0, 0, UPLOAD_STATUS_RECEIVING)
+        && upload_request(receiver, UPLOAD_OP_DATA, 0, image, 16, 16, UPLOAD_STATUS_RECEIVING)
+        && upload_request(receiver, UPLOAD_OP_DATA, 24, image + 24, 16, 16, UPLOAD_STATUS_RECEIVING) // gap: dropped
+        && upload_request(receiver, UPLOAD_OP_DATA, 8, image + 8, 16, 24, UPLOAD_STATUS_RECEIVING) // partly repeated
+        && upload_request(receiver, UPLOAD_OP_FINISH, crc, nullptr, 0, 24, UPLOAD_STATUS_RECEIVING) // incomplete
+        && upload_request(receiver, UPLOAD_OP_DATA, 24, image + 24, 16, 40, UPLOAD_STATUS_RECEIVING)
+        && upload_request(receiver, UPLOAD_OP_FINISH, crc ^ 1, nullptr, 0, 40, UPLOAD_STATUS_CRC_MISMATCH)
+        && sink.get_size() == 0
+        && upload_request(receiver, UPLOAD_OP_BEGIN, sizeof(image), nullptr, 0, 0, UPLOAD_STATUS_RECEIVING)
+        && upload_request(receiver, UPLOAD_OP_DATA, 0, image, 40, 40, UPLOAD_STATUS_RECEIVING)
+        && upload_request(receiver, UPLOAD_OP_FINISH, crc, nullptr, 0, 40, UPLOAD_STATUS_COMPLETE)
+        && upload_request(receiver, UPLOAD_OP_FINISH, crc, nullptr, 0, 40, UPLOAD_STATUS_COMPLETE) // repeated
+        && sink.get_size() == sizeof(image)
+        && !memcmp(buffer, image, sizeof(image));
+}
+
+
+class ConfigTestClass {
+public:
+    float gain = 1.5f;
+    uint8_t mode = 3;
+    uint32_t uptime = 7;
+
+    FIBRE_EXPORTS(ConfigTestClass,
+        make_fibre_property("gain", &gain),
+        make_fibre_property("mode", &mode),
+        make_fibre_ro_property("uptime", &uptime)
+    );
+};
+
+// Saves the writable properties, changes them and checks that restoring the
+// snapshot brings them back while read-only properties and corrupted
+// snapshots are left alone.
+bool config_test() {
+    ConfigTestClass test_object;
+    auto definitions = test_object.fibre_definitions;
+    fibre_publish(definitions);
+
+    ConfigTable table(*application_endpoints_);
+    uint8_t snapshot[64];
+    size_t length = table.save(snapshot, sizeof(snapshot));
+    if (table.get_property_count() != 2 || length != table.get_snapshot_size()
+            || table.save(snapshot, length - 1) != 0) {
+        printf("config: unexpected snapshot with %zu properties, %zu bytes\n", table.get_property_count(), length);
+        return false;
+    }
+
+    test_object.gain = 0.0f;
+    test_object.mode = 0;
+    test_object.uptime = 8;
+    snapshot[length - 1] ^= 1;
+    bool result = table.restore(snapshot, length) == -1 && test_object.gain == 0.0f;
+    snapshot[length - 1] ^= 1;
+    result = result && table.restore(snapshot, length) == 2
+        && test_object.gain == 1.5f && test_object.mode == 3 && test_object.uptime == 8;
+
+    // Round trip through a file
+    const char* path = "/tmp/fibre_config_test.bin";
+    test_object.mode = 5;
+    result = result && fibre_save_config_file(path) == 0;
+    test_object.mode = 0;
+    result = result && fibre_publish(definitions, path) == 2 && test_object.mode == 5;
+    unlink(path);
+    result = result && fibre_load_config_file(path) == -1;
+
+    if (!result)
+        printf("config: restore failed\n");
+    return result;
+}
+
+
+// Another member list type than TelemetryTestClass, because fibre_publish()
+// keeps the first object tree of each type for path lookups
+class ReplicationTestClass {
+public:
+    uint32_t counter = 42;
+    float value = 1.5f;
+
+    FIBRE_EXPORTS(ReplicationTestClass,
+        make_fibre_property("counter", &counter),
+        make_fibre_property("value", &value)
+    );
+};
+
+// Checks that a replication source sends all properties in the full frame
+// and only changed ones afterwards.
+bool replication_test() {
+    ReplicationTestClass test_object;
+    auto definitions = test_object.fibre_definitions;
+    fibre_publish(definitions);
+    uint8_t crc_low = (uint8_t)fibre_get_json_crc(), crc_high = (uint8_t)(fibre_get_json_crc() >> 8);
+
+    ReplicationSource source;
+    const std::vector<uint8_t> expected_full = {
+        0x00, 0x00, 0x00, 0x00, crc_low, crc_high,
+        0x01, 0x04, 0x2a, 0x00, 0x00, 0x00, // endpoint 1: 42
+        0x02, 0x04, 0x00, 0x00, 0xc0, 0x3f // endpoint 2: 1.5f
+    };
+    const std::vector<uint8_t> expected_unchanged = { 0x01, 0x00, 0x00, 0x00, crc_low, crc_high };
+    const std::vector<uint8_t> expected_changed = {
+        0x02, 0x00, 0x00, 0x00, crc_low, crc_high,
+        0x01, 0x04, 0x2b, 0x00, 0x00, 0x00 // endpoint 1: 43
+    };
+
+    bool result = source.get_property_count() == 2 && source.get_full_frame() == expected_full
+        && source.sample() == expected_unchanged;
+    test_object.counter = 43;
+    result = result && source.sample() == expected_changed;
+    if (!result)
+        printf("replication: unexpected frame\n");
+    return result;
+}
+
+
+// @brief Collects the packets that a channel sends
+class PacketCollector : public PacketSink {
+public:
+    int process_packet(const uint8_t* buffer, size_t length) final {
+        packets_.emplace_back(buffer, buffer + length);
+        return 0;
+    }
+    std::vector<std::vector<uint8_t>> packets_;
+};
+
+class ChannelTestClass {
+public:
+    float value = 2.5f;
+    uint32_t counter = 7;
+    float gain = 0.5f;
+    float offset = 1.0f;
+
+    FIBRE_EXPORTS(ChannelTestClass,
+        make_fibre_property("value", &value),
+        make_fibre_property("counter", &counter),
+        make_fibre_object("config",
+            make_fibre_property("gain", &gain),
+            make_fibre_property("offset", &offset)
+        )
+    );
+};
+
+// Shared by all channel tests, because fibre_publish() keeps the first object
+// tree of each type for path lookups
+static ChannelTestClass channel_test_object;
+
+// @brief Publishes channel_test_object and collects the responses of a
+// channel. crc_low and crc_high are the trailer of requests to application
+// endpoints.
+struct ChannelTest {
+    ChannelTest() : channel(output) {
+        fibre_publish(channel_test_object.fibre_definitions);
+        json_crc = fibre_get_json_crc();
+        crc_low = (uint8_t)json_crc;
+        crc_high = (uint8_t)(json_crc >> 8);
+    }
+
+    uint16_t json_crc;
+    uint8_t crc_low;
+    uint8_t crc_high;
+    PacketCollector output;
+    BidirectionalPacketBasedChannel channel;
+};
+
+// Checks that a channel on a reliable stream switches both directions to
+// lean framing after the response to SESSION_OP_SET_FRAMING and that other
+// channels refuse lean framing.
+bool lean_framing_test() {
+    ChannelTest test; // its channel wasn't declared reliable
+
+    // client -> server stream -> channel -> server stream -> client
+    PacketCollector responses;
+    StreamToPacketSegmenter client_input(responses);
+    StreamBasedPacketSink server_output(client_input);
+    BidirectionalPacketBasedChannel channel(server_output);
+    StreamToPacketSegmenter server_input(channel);
+    StreamBasedPacketSink client_output(server_input);
+    channel.enable_lean_framing(server_input, server_output);
+
+    const uint8_t set_lean[] = { 0x01, 0x00, 0xff, 0xff, 0x01, 0x00, 0x01, 0x01, 0x01, 0x00 }; // SESSION_OP_SET_FRAMING
+    client_output.process_packet(set_lean, sizeof(set_lean));
+    client_input.set_framing(FRAMING_LEAN);
+
+    // 16-bit length prefix, then the request without any CRC
+    const uint8_t lean_read[] = { 0x08, 0x00, 0x02, 0x00, 0x01, 0x80, 0x04, 0x00, test.crc_low, test.crc_high }; // endpoint 1: value
+    server_input.process_bytes(lean_read, sizeof(lean_read), nullptr);
+
+    test.channel.process_packet(set_lean, sizeof(set_lean));
+
+    const std::vector<std::vector<uint8_t>> expected = {
+        { 0x01, 0x80, 0x01 },
+        { 0x02, 0x80, 0x00, 0x00, 0x20, 0x40 } // 2.5f
+    };
+    const std::vector<std::vector<uint8_t>> expected_unreliable = { { 0x01, 0x80, 0x00 } };
+    bool result = responses.packets_ == expected && test.output.packets_ == expected_unreliable;
+    if (!result)
+        printf("lean framing: unexpected responses\n");
+    return result;
+}
+
+// Checks that the compact header mode is only granted for the right
+// descriptor CRC and that compact requests are served until the peer
+// switches back to canonical headers.
+bool compact_header_test() {
+    ChannelTest test;
+
+    // SESSION_OP_SET_HEADER_MODE, once with a wrong descriptor CRC
+    const uint8_t set_compact_wrong_crc[] = { 0x01, 0x00, 0xff, 0xff, 0x01, 0x00, 0x02, 0x01, (uint8_t)(test.crc_low ^ 1), test.crc_high, 0x01, 0x00 };
+    const uint8_t set_compact[] = { 0x02, 0x00, 0xff, 0xff, 0x01, 0x00, 0x02, 0x01, test.crc_low, test.crc_high, 0x01, 0x00 };
+    // seq_no, varint endpoint ID << 1 | expect response, varint response length, payload
+    const uint8_t read[] = { 0x03, 0x00, 0x03, 0x04 }; // endpoint 1: value
+    const uint8_t write[] = { 0x04, 0x00, 0x04, 0x00, 0x08, 0x00, 0x00, 0x00 }; // endpoint 2: counter = 8, no response
+    const uint8_t set_canonical[] = { 0x05, 0x00, 0xff, 0xff, 0x03, 0x01, 0x02, 0x00, test.crc_low, test.crc_high };
+    const uint8_t canonical_read[] = { 0x06, 0x00, 0x02, 0x80, 0x04, 0x00, test.crc_low, test.crc_high }; // endpoint 2: counter
+
+    test.channel.process_packet(set_compact_wrong_crc, sizeof(set_compact_wrong_crc));
+    test.channel.process_packet(set_compact, sizeof(set_compact));
+    test.channel.process_packet(read, sizeof(read));
+    test.channel.process_packet(write, sizeof(write));
+    test.channel.process_packet(set_canonical, sizeof(set_canonical));
+    test.channel.process_packet(canonical_read, sizeof(canonical_read));
+
+    const std::vector<std::vector<uint8_t>> expected = {
+        { 0x01, 0x80, 0x00 },
+        { 0x02, 0x80, 0x01 },
+        { 0x03, 0x80, 0x00, 0x00, 0x20, 0x40 }, // 2.5f
+        { 0x05, 0x80, 0x00 },
+        { 0x06, 0x80, 0x08, 0x00, 0x00, 0x00 } // 8
+    };
+    bool result = test.output.packets_ == expected && channel_test_object.counter == 8;
+    channel_test_object.counter = 7;
+    if (!result)
+        printf("compact headers: unexpected responses\n");
+    return result;
+}
+
+// Checks that requests carry no trailer once the peer verified the descriptor
+// CRC and that a changed descriptor invalidates the verification.
+bool verified_session_test() {
+    ChannelTest test;
+
+    // SESSION_OP_VERIFY_DESCRIPTOR, once with a wrong descriptor CRC
+    const uint8_t verify_wrong_crc[] = { 0x02, 0x00, 0xff, 0xff, 0x01, 0x00, 0x03, (uint8_t)(test.crc_low ^ 1), test.crc_high, 0x01, 0x00 };
+    const uint8_t verify[] = { 0x03, 0x00, 0xff, 0xff, 0x01, 0x00, 0x03, test.crc_low, test.crc_high, 0x01, 0x00 };
+    uint8_t read[] = { 0x01, 0x00, 0x01, 0x80, 0x04, 0x00 }; // endpoint 1: value, no trailer
+
+    bool result = test.channel.process_packet(read, sizeof(read)) == -1;
+    test.channel.process_packet(verify_wrong_crc, sizeof(verify_wrong_crc));
+    test.channel.process_packet(verify, sizeof(verify));
+    read[0] = 0x04;
+    result = result && test.channel.process_packet(read, sizeof(read)) == 0;
+
+    fibre_set_json_crc(test.json_crc ^ 1); // as if the application republished a different tree
+    read[0] = 0x05;
+    result = result && test.channel.process_packet(read, sizeof(read)) == -1;
+    fibre_invalidate_json_crc();
+
+    const std::vector<std::vector<uint8_t>> expected = {
+        { 0x02, 0x80, 0x00 },
+        { 0x03, 0x80, 0x01 },
+        { 0x04, 0x80, 0x00, 0x00, 0x20, 0x40 } // 2.5f
+    };
+    result = result && test.output.packets_ == expected;
+    if (!result)
+        printf("verified session: unexpected responses\n");
+    return result;
+}
+
+// Checks that a transaction applies all of its writes or none, and that in
+// write handoff mode it is applied by fibre_apply_pending().
+bool transaction_test() {
+    ChannelTest test;
+
+    // SESSION_OP_TRANSACTION, descriptor CRC, then endpoint ID, value length and value per write
+    uint8_t transaction[] = { 0x01, 0x00, 0xff, 0xff, 0x01, 0x00, 0x07, test.crc_low, test.crc_high,
+        0x01, 0x00, 0x04, 0x00, 0x00, 0x80, 0x3f, // endpoint 1: value = 1.0f
+        0x02, 0x00, 0x04, 0x09, 0x00, 0x00, 0x00, // endpoint 2: counter = 9
+        0x01, 0x00 };
+    uint8_t invalid_transaction[] = { 0x02, 0x00, 0xff, 0xff, 0x01, 0x00, 0x07, test.crc_low, test.crc_high,
+        0x01, 0x00, 0x04, 0x00, 0x00, 0x80, 0x3f, // endpoint 1: value = 1.0f
+        0x63, 0x00, 0x04, 0x09, 0x00, 0x00, 0x00, // endpoint 99 doesn't exist
+        0x01, 0x00 };
+
+    uint32_t seq = fibre_read_begin();
+    test.channel.process_packet(invalid_transaction, sizeof(invalid_transaction));
+    bool result = channel_test_object.value == 2.5f && channel_test_object.counter == 7
+        && !fibre_read_retry(seq);
+    test.channel.process_packet(transaction, sizeof(transaction));
+    result = result && channel_test_object.value == 1.0f && channel_test_object.counter == 9
+        && fibre_read_retry(seq);
+
+    channel_test_object.value = 2.5f;
+    channel_test_object.counter = 7;
+    fibre_set_write_handoff(true);
+    transaction[0] = 0x03;
+    test.channel.process_packet(transaction, sizeof(transaction));
+    result = result && channel_test_object.value == 2.5f && channel_test_object.counter == 7
+        && fibre_apply_pending() == 2 && channel_test_object.value == 1.0f && channel_test_object.counter == 9;
+    fibre_set_write_handoff(false);
+
+    const std::vector<std::vector<uint8_t>> expected = {
+        { 0x02, 0x80, 0x00 },
+        { 0x01, 0x80, 0x02 },
+        { 0x03, 0x80, 0x02 }
+    };
+    result = result && test.output.packets_ == expected;
+    channel_test_object.value = 2.5f;
+    channel_test_object.counter = 7;
+    if (!result)
+        printf("transaction: unexpected values or responses\n");
+    return result;
+}
+
+
+class CallTestClass {
+public:
+    uint32_t n_calls = 0;
+    float value = 2.5f;
+
+    void trigger() { n_calls++; }
+
+    FIBRE_EXPORTS(CallTestClass,
+        make_fibre_function("trigger", *obj, &CallTestClass::trigger),
+        make_fibre_property("value", &value)
+    );
+};
+
+// Checks that a handed off function call runs on fibre_run_pending_calls()
+// and that a read sent behind it is answered only after the call's response.
+// Also checks that an unregistered queue is no longer run and frees its slot.
+bool call_handoff_test() {
+    CallTestClass test_object;
+    auto definitions = test_object.fibre_definitions;
+    fibre_publish(definitions);
+    uint8_t crc_low = (uint8_t)fibre_get_json_crc(), crc_high = (uint8_t)(fibre_get_json_crc() >> 8);
+
+    CallQueue queue(nullptr, nullptr);
+    fibre_register_call_queue(&queue);
+    PacketCollector output;
+    BidirectionalPacketBasedChannel channel(output);
+    channel.set_call_queue(&queue);
+    fibre_set_call_handoff(true);
+
+    const uint8_t call[] = { 0x01, 0x00, 0x01, 0x80, 0x00, 0x00, crc_low, crc_high }; // endpoint 1: trigger
+    const uint8_t read[] = { 0x02, 0x00, 0x02, 0x80, 0x04, 0x00, crc_low, crc_high }; // endpoint 2: value
+    channel.process_packet(call, sizeof(call));
+    channel.process_packet(read, sizeof(read));
+    bool result = output.packets_.empty() && channel.call_in_flight() && test_object.n_calls == 0;
+
+    result = result && fibre_run_pending_calls() == 1 && test_object.n_calls == 1 && output.packets_.empty();
+    result = result && queue.complete_calls() == 1 && !channel.call_in_flight();
+    const std::vector<std::vector<uint8_t>> expected = {
+        { 0x01, 0x80 },
+        { 0x02, 0x80, 0x00, 0x00, 0x20, 0x40 } // 2.5f
+    };
+    result = result && output.packets_ == expected;
+
+    channel.process_packet(call, sizeof(call));
+    fibre_unregister_call_queue(&queue);
+    result = result && fibre_run_pending_calls() == 0 && test_object.n_calls == 1;
+    for (size_t i = 0; i <= MAX_CALL_QUEUES && result; ++i) {
+        result = fibre_register_call_queue(&queue);
+        fibre_unregister_call_queue(&queue);
+    }
+
+    fibre_set_call_handoff(false);
+    if (!result)
+        printf("call handoff: unexpected call order or responses\n");
+    return result;
+}
+
+
+// Checks that bulk requests wait in the bulk lane until they are served while
+// other requests are answered right away, that bulk requests which don't fit
+// into a lane slot are dropped and that only channels whose transport serves
+// the bulk lane grant priority lanes.
+bool bulk_lane_test() {
+    ChannelTest test;
+    test.channel.enable_priority_lanes();
+
+    const uint8_t enable[] = { 0x01, 0x00, 0xff, 0xff, 0x01, 0x00, 0x06, 0x01, 0x01, 0x00 }; // SESSION_OP_SET_PRIORITY_LANES
+    const uint8_t bulk_read[] = { 0x02, 0x40, 0x01, 0x80, 0x04, 0x00, test.crc_low, test.crc_high }; // endpoint 1: value
+    const uint8_t read[] = { 0x03, 0x00, 0x02, 0x80, 0x04, 0x00, test.crc_low, test.crc_high }; // endpoint 2: counter
+    uint8_t oversized[RX_BUF_SIZE + 72] = { 0x04, 0x40, 0x01, 0x80, 0x04, 0x00 };
+    oversized[sizeof(oversized) - 2] = test.crc_low;
+    oversized[sizeof(oversized) - 1] = test.crc_high;
+
+    bool result = test.channel.process_packet(enable, sizeof(enable)) == 0
+        && test.channel.process_packet(bulk_read, sizeof(bulk_read)) == 0
+        && test.channel.process_packet(read, sizeof(read)) == 0
+        && test.channel.process_packet(oversized, sizeof(oversized)) == -1
+        && test.channel.bulk_request_ready();
+    test.channel.process_bulk_request();
+    result = result && !test.channel.bulk_request_ready();
+
+    const std::vector<std::vector<uint8_t>> expected = {
+        { 0x01, 0x80, 0x01 },
+        { 0x03, 0x80, 0x07, 0x00, 0x00, 0x00 }, // 7
+        { 0x02, 0xc0, 0x00, 0x00, 0x20, 0x40 } // 2.5f
+    };
+    result = result && test.output.packets_ == expected;
+
+    // Without a transport that serves the bulk lane, bulk requests are answered right away
+    PacketCollector unserved_output;
+    BidirectionalPacketBasedChannel unserved_channel(unserved_output);
+    unserved_channel.process_packet(enable, sizeof(enable));
+    unserved_channel.process_packet(bulk_read, sizeof(bulk_read));
+    const std::vector<std::vector<uint8_t>> expected_unserved = {
+        { 0x01, 0x80, 0x00 },
+        { 0x02, 0xc0, 0x00, 0x00, 0x20, 0x40 } // 2.5f
+    };
+    result = result && unserved_output.packets_ == expected_unserved;
+    if (!result)
+        printf("bulk lane: unexpected responses\n");
+    return result;
+}
+
+// Grants credit for the specified number of consumed response bytes
+static void grant_credit(BidirectionalPacketBasedChannel& channel, uint16_t seq_no, uint32_t consumed_bytes) {
+    uint8_t grant[] = { 0, 0, 0xff, 0x7f, 0x00, 0x00, 0x05, 0, 0, 0, 0, 0x01, 0x00 }; // SESSION_OP_GRANT_CREDIT
+    write_le<uint16_t>(seq_no, grant);
+    write_le<uint32_t>(consumed_bytes, grant + 7);
+    channel.process_packet(grant, sizeof(grant));
+}
+
+// Checks that with flow control a response is only sent when the peer has
+// room for it, that requests are deferred until credit is granted and that
+// requests beyond the granted window are dropped.
+bool flow_control_test() {
+    ChannelTest test;
+
+    // The smallest window, it only has room for one response
+    const uint8_t enable[] = { 0x01, 0x00, 0xff, 0xff, 0x01, 0x00, 0x04, TX_BUF_SIZE, 0x00, 0x01, 0x00 }; // SESSION_OP_SET_FLOW_CONTROL
+    uint8_t read[] = { 0x02, 0x00, 0x01, 0x80, 0x04, 0x00, test.crc_low, test.crc_high }; // endpoint 1: value
+    bool result = test.channel.process_packet(enable, sizeof(enable)) == 0
+        && test.channel.process_packet(read, sizeof(read)) == 0;
+
+    // Nothing consumed yet: RX_WINDOW_SIZE requests wait, the next one is dropped
+    for (uint8_t seq_no = 3; seq_no < 3 + RX_WINDOW_SIZE; ++seq_no) {
+        read[0] = seq_no;
+        result = result && test.channel.process_packet(read, sizeof(read)) == 0;
+    }
+    read[0] = 3 + RX_WINDOW_SIZE;
+    result = result && test.channel.process_packet(read, sizeof(read)) == -1 && test.output.packets_.size() == 2;
+
+    // Each grant makes room for one more response
+    for (uint8_t i = 1; i <= RX_WINDOW_SIZE; ++i)
+        grant_credit(test.channel, 0x10 + i, 7 * i);
+
+    std::vector<std::vector<uint8_t>> expected = {
+        { 0x01, 0x80, RX_WINDOW_SIZE },
+        { 0x02, 0x80, 0x01, 0x00, 0x00, 0x20, 0x40 } // 2.5f, 1 request completed
+    };
+    for (uint8_t i = 0; i < RX_WINDOW_SIZE; ++i)
+        expected.push_back({ (uint8_t)(3 + i), 0x80, (uint8_t)(3 + i), 0x00, 0x00, 0x20, 0x40 }); // the dropped request counts as completed
+    result = result && test.output.packets_ == expected;
+    if (!result)
+        printf("flow control: unexpected responses\n");
+    return result;
+}
+
+// Checks that writes in write handoff mode are applied by
+// fibre_apply_pending() and that a write that doesn't fit into the queue
+// gets an empty response and is counted as dropped.
+bool write_handoff_test() {
+    ChannelTest test;
+    fibre_set_write_handoff(true);
+    uint32_t dropped_writes = fibre_get_dropped_writes();
+
+    // endpoint 2: counter = 8 + seq_no, respond with the old value
+    uint8_t write[] = { 0x00, 0x00, 0x02, 0x80, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, test.crc_low, test.crc_high };
+    for (uint8_t seq_no = 0; seq_no <= WRITE_QUEUE_SIZE; ++seq_no) {
+        write[0] = seq_no;
+        write[6] = 8 + seq_no;
+        test.channel.process_packet(write, sizeof(write));
+    }
+    bool result = channel_test_object.counter == 7 && fibre_get_dropped_writes() == dropped_writes + 1
+        && fibre_apply_pending() == WRITE_QUEUE_SIZE && channel_test_object.counter == 8 + WRITE_QUEUE_SIZE - 1;
+    fibre_set_write_handoff(false);
+
+    std::vector<std::vector<uint8_t>> expected;
+    for (uint8_t seq_no = 0; seq_no < WRITE_QUEUE_SIZE; ++seq_no)
+        expected.push_back({ seq_no, 0x80, 0x07, 0x00, 0x00, 0x00 }); // not applied yet
+    expected.push_back({ WRITE_QUEUE_SIZE, 0x80 });
+    result = result && test.output.packets_ == expected;
+    channel_test_object.counter = 7;
+    if (!result)
+        printf("write handoff: unexpected values or responses\n");
+    return result;
+}
+
+// Checks that ASCII protocol writes are applied inside the transaction
+// sequence lock, queued in write handoff mode and reported when dropped.
+bool ascii_write_test() {
+    fibre_publish(channel_test_object.fibre_definitions);
+    EndpointPathTable table(*application_endpoints_);
+    char response[64];
+    MemoryStreamSink output(reinterpret_cast<uint8_t*>(response), sizeof(response));
+    AsciiProtocol protocol(table, output);
+    auto command = [&](const char* line) {
+        protocol.process_bytes(reinterpret_cast<const uint8_t*>(line), strlen(line), nullptr);
+    };
+
+    uint32_t seq = fibre_read_begin();
+    command("w config.gain 1.5\n");
+    bool result = channel_test_object.gain == 1.5f && fibre_read_retry(seq);
+
+    fibre_set_write_handoff(true);
+    command("w counter 9\n");
+    result = result && channel_test_object.counter == 7;
+    for (size_t i = 1; i < WRITE_QUEUE_SIZE; ++i)
+        command("w counter 10\n");
+    command("w counter 11\n"); // doesn't fit into the queue anymore
+    result = result && fibre_apply_pending() == WRITE_QUEUE_SIZE && channel_test_object.counter == 10;
+    fibre_set_write_handoff(false);
+
+    const char expected[] = "write dropped\r\n";
+    result = result && sizeof(response) - output.get_free_space() == strlen(expected)
+        && !memcmp(response, expected, strlen(expected));
+    channel_test_object.gain = 0.5f;
+    channel_test_object.counter = 7;
+    if (!result)
+        printf("ascii write: unexpected values or responses\n");
+    return result;
+}
+
+
+class SnapshotTestClass {
+public:
+    uint32_t a = 0;
+    uint32_t b = 0;
+
+    FIBRE_EXPORTS(SnapshotTestClass,
+        make_fibre_property("a", &a),
+        make_fibre_property("b", &b)
+    );
+};
+
+// Creates a snapshot segment with the specified header and one entry
+static bool make_snapshot_segment(const char* name, uint32_t n_entries, const SnapshotEntry& entry, uint32_t values_length) {
+    size_t size = sizeof(SnapshotHeader) + sizeof(SnapshotEntry) + 8;
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    void* segment = MAP_FAILED;
+    if (fd >= 0 && !ftruncate(fd, size))
+        segment = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fd >= 0)
+        close(fd);
+    if (segment == MAP_FAILED)
+        return false;
+    SnapshotHeader* header = reinterpret_cast<SnapshotHeader*>(segment);
+    header->version = SNAPSHOT_VERSION;
+    header->n_entries = n_entries;
+    header->json_offset = sizeof(SnapshotHeader) + sizeof(SnapshotEntry);
+    header->values_offset = sizeof(SnapshotHeader) + sizeof(SnapshotEntry);
+    header->values_length = values_length;
+    *reinterpret_cast<SnapshotEntry*>(header + 1) = entry;
+    header->magic.store(SNAPSHOT_MAGIC, std::memory_order_release);
+    munmap(segment, size);
+    return true;
+}
+
+// Checks that a reader always sees both values of the same update while
+// another thread updates the snapshot, that a new exporter of the same
+// segment name doesn't disturb readers of the previous segment and that
+// segments whose layout doesn't fit are rejected.
+bool snapshot_test() {
+    SnapshotTestClass test_object;
+    auto definitions = test_object.fibre_definitions;
+    fibre_publish(definitions);
+
+    const char* name = "/fibre_run_tests";
+    const uint16_t endpoint_ids[] = { 1, 2 };
+    SnapshotExporter exporter;
+    SnapshotReader reader;
+    if (exporter.open(name, endpoint_ids, 2) || reader.open(name)) {
+        printf("snapshot: failed to create the segment\n");
+        return false;
+    }
+
+    const uint32_t n_updates = 100000;
+    std::thread writer([&]{
+        for (uint32_t i = 1; i <= n_updates; ++i) {
+            test_object.a = test_object.b = i;
+            exporter.update();
+        }
+    });
+    bool result = true;
+    uint8_t values[16]; // each value is 8-byte aligned
+    uint32_t a = 0, b = 0, previous_a = 0;
+    while (result && a < n_updates) {
+        result = reader.read_all(values, sizeof(values));
+        read_le<uint32_t>(&a, values);
+        read_le<uint32_t>(&b, values + 8);
+        result = result && a == b && a >= previous_a;
+        previous_a = a;
+    }
+    writer.join();
+
+    // As if the exporter crashed and was restarted
+    SnapshotExporter new_exporter;
+    SnapshotReader new_reader;
+    test_object.a = test_object.b = 0;
+    result = result && new_exporter.open(name, endpoint_ids, 2) == 0 && new_reader.open(name) == 0
+        && reader.read(reader.find("a"), &a, sizeof(a)) && a == n_updates
+        && new_reader.read(new_reader.find("a"), &a, sizeof(a)) && a == 0;
+
+    const char* bad_name = "/fibre_run_tests_bad";
+    SnapshotReader bad_reader;
+    result = result && make_snapshot_segment(bad_name, 1000000, { 0, 1, 4, 0 }, 8) // entry table too long
+        && bad_reader.open(bad_name) == -1;
+    result = result && make_snapshot_segment(bad_name, 1, { 0, 1, 4, 6 }, 8) // value beyond the values
+        && bad_reader.open(bad_name) == -1;
+    result = result && make_snapshot_segment(bad_name, 1, { 0, 1, 4, 0, 64 }, 8) // path beyond the segment
+        && bad_reader.open(bad_name) == -1;
+    result = result && make_snapshot_segment(bad_name, 1, { 0, 1, 4, 4 }, 8)
+        && bad_reader.open(bad_name) == 0;
+    shm_unlink(bad_name);
+
+    if (!result)
+        printf("snapshot: inconsistent values or unchecked layout\n");
+    return result;
+}
+
+// Reads the JSON descriptor, or only the object at the specified path if path
+// is not null
+static std::string read_descriptor(const char* path) {
+    uint8_t request[64] = { 0 }; // u32 offset = 0, path
+    size_t request_length = 4;
+    if (path) {
+        strcpy(reinterpret_cast<char*>(request + 4), path);
+        request_length += strlen(path) + 1;
+    }
+    char buffer[1024];
+    MemoryStreamSink output(reinterpret_cast<uint8_t*>(buffer), sizeof(buffer));
+    json_file_endpoint_.handle(request, request_length, &output);
+    return std::string(buffer, sizeof(buffer) - output.get_free_space());
+}
+
+// Checks that subtree descriptors list the members of one object with child
+// objects as stubs, that unknown paths get an empty response and that the
+// descriptor of an empty tree is valid JSON.
+bool subtree_descriptor_test() {
+    ChannelTest test;
+
+    const std::string json_endpoint = "{\"name\":\"\",\"id\":0,\"type\":\"json\",\"access\":\"r\"}";
+    const std::string root = "{\"members\":[" + json_endpoint + ","
+        "{\"name\":\"value\",\"id\":1,\"type\":\"float\",\"access\":\"rw\"},"
+        "{\"name\":\"counter\",\"id\":2,\"type\":\"uint32\",\"access\":\"rw\"},"
+        "{\"name\":\"config\",\"type\":\"object\"}]}";
+    const std::string config = "{\"members\":["
+        "{\"name\":\"gain\",\"id\":3,\"type\":\"float\",\"access\":\"rw\"},"
+        "{\"name\":\"offset\",\"id\":4,\"type\":\"float\",\"access\":\"rw\"}]}";
+    bool result = read_descriptor("") == root && read_descriptor("config") == config
+        && read_descriptor("config.gain") == "" && read_descriptor("nope") == "";
+
+    // The same through a channel (endpoint 0 requests carry the protocol version
+    // as trailer), the response to an unknown path has no payload
+    const uint8_t read_unknown[] = { 0x01, 0x00, 0x00, 0x80, 0x1e, 0x00, 0x00, 0x00, 0x00, 0x00, 'n', 'o', 'p', 'e', 0x00, 0x01, 0x00 };
+    const uint8_t read_config[] = { 0x02, 0x00, 0x00, 0x80, 0x1e, 0x00, 0x00, 0x00, 0x00, 0x00, 'c', 'o', 'n', 'f', 'i', 'g', 0x00, 0x01, 0x00 };
+    test.channel.process_packet(read_unknown, sizeof(read_unknown));
+    test.channel.process_packet(read_config, sizeof(read_config));
+    std::vector<uint8_t> expected_config = { 0x02, 0x80 };
+    expected_config.insert(expected_config.end(), config.begin(), config.begin() + 0x1e);
+    result = result && test.output.packets_.size() == 2
+        && test.output.packets_[0] == std::vector<uint8_t>({ 0x01, 0x80 }) && test.output.packets_[1] == expected_config;
+
+    static MemberList<> empty_definitions;
+    fibre_publish(empty_definitions);
+    result = result && read_descriptor(nullptr) == "[" + json_endpoint + "]"
+        && read_descriptor("") == "{\"members\":[" + json_endpoint + "]}";
+
+    if (!result)
+        printf("subtree descriptor: unexpected descriptor\n");
+    return result;
+}
+
+
+// Checks that a channel reports negotiated session state and that the notice
+// of a lost session echoes the seq_no of the dropped request.
+bool session_lost_test() {
+    ChannelTest test;
+    const uint8_t verify[] = { 0x01, 0x00, 0xff, 0xff, 0x01, 0x00, 0x03, test.crc_low, test.crc_high, 0x01, 0x00 };
+    const uint8_t read[] = { 0x82, 0x40, 0x01, 0x80, 0x04, 0x00 }; // bulk read of endpoint 1 without trailer
+
+    bool result = !test.channel.has_session_state();
+    test.channel.process_packet(verify, sizeof(verify));
+    result = result && test.channel.has_session_state();
+    test.channel.send_session_lost(read, sizeof(read));
+
+    const std::vector<std::vector<uint8_t>> expected = {
+        { 0x01, 0x80, 0x01 },
+        { 0x82, 0x40, 0xff, 0x7f, 0x00, 0x00, 0x0b, 0x01, 0x00 } // SESSION_OP_SESSION_LOST
+    };
+    result = result && test.output.packets_ == expected;
+    if (!result)
+        printf("session lost: unexpected state or notice\n");
+    return result;
+}
+
+class CallArgumentsTestClass {
+public:
+    uint32_t stored = 0;
+
+    void store(uint32_t value, bool enable) { stored = enable ? value : 0; }
+
+    FIBRE_EXPORTS(CallArgumentsTestClass,
+        make_fibre_function("store", *obj, &CallArgumentsTestClass::store, "value", "enable")
+    );
+};
+
+// Checks that a handed off call uses the arguments as they were when it was
+// requested, even if another connection overwrites them before it runs.
+bool call_arguments_test() {
+    CallArgumentsTestClass test_object;
+    auto definitions = test_object.fibre_definitions;
+    fibre_publish(definitions);
+    uint8_t crc_low = (uint8_t)fibre_get_json_crc(), crc_high = (uint8_t)(fibre_get_json_crc() >> 8);
+
+    CallQueue queue(nullptr, nullptr);
+    fibre_register_call_queue(&queue);
+    PacketCollector output, other_output;
+    BidirectionalPacketBasedChannel channel(output), other_channel(other_output);
+    channel.set_call_queue(&queue);
+    fibre_set_call_handoff(true);
+
+    const uint8_t set_value[] = { 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00, crc_low, crc_high }; // endpoint 2: value = 5
+    const uint8_t set_enable[] = { 0x02, 0x00, 0x03, 0x00, 0x00, 0x00, 0x01, crc_low, crc_high }; // endpoint 3: enable = true
+    const uint8_t call[] = { 0x03, 0x00, 0x01, 0x80, 0x00, 0x00, crc_low, crc_high }; // endpoint 1: store
+    const uint8_t other_set_value[] = { 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x07, 0x00, 0x00, 0x00, crc_low, crc_high }; // endpoint 2: value = 7
+    channel.process_packet(set_value, sizeof(set_value));
+    channel.process_packet(set_enable, sizeof(set_enable));
+    channel.process_packet(call, sizeof(call));
+    other_channel.process_packet(other_set_value, sizeof(other_set_value));
+    bool result = fibre_run_pending_calls() == 1 && test_object.stored == 5
+        && queue.complete_calls() == 1 && output.packets_.size() == 1;
+
+    fibre_unregister_call_queue(&queue);
+    fibre_set_call_handoff(false);
+    if (!result)
+        printf("call arguments: call didn't use the arguments of its request\n");
+    return result;
+}
+
+// Like CallTestClass, but a separate type because fibre_publish() keeps the
+// first object tree of each type
+class TelemetryFunctionTestClass {
+public:
+    uint32_t n_calls = 0;
+    float value = 2.5f;
+
+    void trigger() { n_calls++; }
+
+    FIBRE_EXPORTS(TelemetryFunctionTestClass,
+        make_fibre_function("trigger", *obj, &TelemetryFunctionTestClass::trigger),
+        make_fibre_property("value", &value)
+    );
+};
+
+// Checks that telemetry frames leave out functions instead of calling them.
+bool telemetry_function_test() {
+    TelemetryFunctionTestClass test_object;
+    auto definitions = test_object.fibre_definitions;
+    fibre_publish(definitions);
+    uint16_t json_crc = fibre_get_json_crc();
+
+    const uint16_t endpoint_ids[] = { 1, 2 }; // trigger, value
+    uint8_t frame[32];
+    size_t length = make_telemetry_frame(0, endpoint_ids, 2, frame, sizeof(frame));
+    const std::vector<uint8_t> expected = {
+        0x00, 0x00, 0x00, 0x00, (uint8_t)json_crc, (uint8_t)(json_crc >> 8),
+        0x02, 0x04, 0x00, 0x00, 0x20, 0x40 // endpoint 2: 2.5f
+    };
+    bool result = std::vector<uint8_t>(frame, frame + length) == expected && test_object.n_calls == 0;
+    if (!result)
+        printf("telemetry function: unexpected frame or call\n");
+    return result;
+}
+
+// Checks that the descriptor and its CRC can be queried before anything
+// was published.
+bool unpublished_descriptor_test() {
+    EndpointProvider* published = application_endpoints_;
+    application_endpoints_ = nullptr;
+    fibre_invalidate_json_crc();
+    bool result = fibre_get_json_crc() == PROTOCOL_VERSION && read_descriptor(nullptr) == ""
+        && read_descriptor("") == "";
+    application_endpoints_ = published;
+    fibre_invalidate_json_crc();
+    if (!result)
+        printf("unpublished descriptor: unexpected descriptor\n");
+    return result;
+}
+
+class PathCollisionTestClass {
+public:
+    uint32_t value = 3;
+
+    // hash_path() of "yomzw." equals that of "gvlpa."
+    FIBRE_EXPORTS(PathCollisionTestClass,
+        make_fibre_object("yomzw",
+            make_fibre_property("value", &value)
+        )
+    );
+};
+
+// Checks that paths whose hash collides with the path of a property don't
+// resolve to that property, in the ASCII protocol and in snapshots.
+bool path_collision_test() {
+    PathCollisionTestClass test_object;
+    auto definitions = test_object.fibre_definitions;
+    fibre_publish(definitions);
+    bool result = hash_path(PATH_HASH_INIT, "yomzw.value", 11) == hash_path(PATH_HASH_INIT, "gvlpa.value", 11);
+
+    EndpointPathTable table(*application_endpoints_);
+    result = result && table.find("yomzw.value", 11) && !table.find("gvlpa.value", 11);
+
+    const char* name = "/fibre_run_tests";
+    const uint16_t endpoint_ids[] = { 1 };
+    SnapshotExporter exporter;
+    SnapshotReader reader;
+    result = result && exporter.open(name, endpoint_ids, 1) == 0 && reader.open(name) == 0
+        && reader.find("yomzw.value") == 0 && reader.find("gvlpa.value") == -1;
+
+    if (!result)
+        printf("path collision: colliding path resolved\n");
+    return result;
+}
+
+// Checks that parse_float() rounds correctly where rounding to double first
+// and then to float would round twice.
+bool parse_float_test() {
+    struct { const char* str; uint32_t bits; } cases[] = {
+        { "4.932110553301782829294098e-10", 0x300792a5 }, // 25 digits decide
+        { "9.075546741485596", 0x41113571 }, // just above halfway
+        { "3.40282356779733661637539395458142568448e38", 0x7f800000 }, // exactly halfway to 2^128
+        // 2^-150, exactly halfway between 0 and the smallest subnormal
+        { "7.00649232162408535461864791644958065640130970938257885878534141944895541"
+          "342930300743319094181060791015625e-46", 0x00000000 },
+        { "7.00649232162408535461864791644958065640130970938257885878534141944895541"
+          "342930300743319094181060791015626e-46", 0x00000001 },
+        { "-0.1", 0xbdcccccd },
+    };
+    bool result = true;
+    for (auto& c : cases) {
+        float value;
+        uint32_t bits;
+        size_t length = parse_float(c.str, strlen(c.str), &value);
+        memcpy(&bits, &value, sizeof(bits));
+        if (length != strlen(c.str) || bits != c.bits) {
+            printf("parse float: %s parsed as %08x\n", c.str, (unsigned)bits);
+            result = false;
+        }
+    }
+    return result;
+}
+
+class SlowGetterTestClass {
+public:
+    std::atomic<uint32_t> value{1};
+    std::atomic<bool> block{false}; // makes the next getter call wait for release
+    std::atomic<bool> blocked{false};
+    std::atomic<bool> release{false};
+
+    uint32_t get_value() {
+        if (block.exchange(false)) {
+            blocked = true;
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+            while (!release && std::chrono::steady_clock::now() < deadline)
+                std::this_thread::yield();
+        }
+        return value;
+    }
+    void set_value(uint32_t new_value) { value = new_value; }
+};
+
+// Checks that readers of a memoized accessor property that have no valid
+// value don't wait for another reader's getter call and don't get a value
+// from before a write.
+bool accessor_memo_test() {
+    SlowGetterTestClass test_object;
+    auto property = make_fibre_accessor_property("value", test_object,
+            &SlowGetterTestClass::get_value, &SlowGetterTestClass::set_value, 60000);
+
+    // Reads the property while another reader is inside the getter
+    // @return the value, or 0 if the read waited for the other reader
+    auto concurrent_get = [&]() -> uint32_t {
+        test_object.block = true;
+        test_object.blocked = false;
+        test_object.release = false;
+        std::thread reader([&]{ property.get(); });
+        while (!test_object.blocked)
+            std::this_thread::yield();
+        auto start = std::chrono::steady_clock::now();
+        uint32_t value = property.get();
+        bool waited = std::chrono::steady_clock::now() - start > std::chrono::milliseconds(500);
+        test_object.release = true;
+        reader.join();
+        return waited ? 0 : value;
+    };
+
+    bool result = concurrent_get() == 1; // nothing memoized yet
+    property.set(2);
+    result = result && concurrent_get() == 2; // memoized before the write
+    if (!result)
+        printf("accessor memo: waited for the getter or got an outdated value\n");
+    return result;
+}
 
 int main(void) {
     /***** Decoder demo (remove or move somewhere else) *****/
@@ -103,16 +1127,15 @@ int main(void) {
     /***** Encoder demo (remove or move somewhere else) *****/    
     printf("Running encoder... ");
     // prepare request
-    Request request = {
-        .endpoint_id = 300,
-        .length = 444,
-    };
+    ReceiverState request;
+    request.endpoint_id = 300;
+    request.length = 444;
 
     // construct encoder for the request
     auto e2 = make_crc8_encoder<CANONICAL_CRC8_INIT, CANONICAL_CRC8_POLYNOMIAL>(
         make_encoder_chain(
-            make_length_encoder(request),
-            make_endpoint_id_encoder(request)
+            make_varint_encoder(request.length),
+            make_varint_encoder(request.endpoint_id)
         )
     );
 
@@ -130,6 +1153,28 @@ int main(void) {
 
     /***** run automated test *****/
     bool test_result = varint_decoder_test();
+    test_result = lean_framing_test() && test_result;
+    test_result = compact_header_test() && test_result;
+    test_result = verified_session_test() && test_result;
+    test_result = transaction_test() && test_result;
+    test_result = telemetry_multicast_test() && test_result;
+    test_result = upload_test() && test_result;
+    test_result = config_test() && test_result;
+    test_result = replication_test() && test_result;
+    test_result = call_handoff_test() && test_result;
+    test_result = bulk_lane_test() && test_result;
+    test_result = flow_control_test() && test_result;
+    test_result = write_handoff_test() && test_result;
+    test_result = ascii_write_test() && test_result;
+    test_result = snapshot_test() && test_result;
+    test_result = subtree_descriptor_test() && test_result;
+    test_result = session_lost_test() && test_result;
+    test_result = call_arguments_test() && test_result;
+    test_result = telemetry_function_test() && test_result;
+    test_result = unpublished_descriptor_test() && test_result;
+    test_result = path_collision_test() && test_result;
+    test_result = parse_float_test() && test_result;
+    test_result = accessor_memo_test() && test_result;
     if (test_result) {
         printf("all tests passed\n");
         return 0;
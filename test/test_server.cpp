@@ -1,18 +1,28 @@
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <thread>
 #include <signal.h>
 
 #include <fibre/fibre.hpp>
+#include <fibre/latency.hpp>
+#include <fibre/posix_shm.hpp>
 #include <fibre/posix_tcp.hpp>
 #include <fibre/posix_udp.hpp>
+#include <fibre/upload.hpp>
 
 
+static uint8_t upload_buffer[16 * 1024 * 1024];
+static MemoryUploadSink upload_sink(upload_buffer, sizeof(upload_buffer));
+static UploadReceiver upload_receiver(upload_sink);
+
 class TestClass {
 public:
     float property1;
     float property2;
+    float gain = 1.0f;
+    float offset = 0.0f;
 
     float set_both(float arg1, float arg2) {
         property1 = arg1;
@@ -20,10 +30,21 @@ public:
         return property1 + property2;
     }
 
+    float get_sum() {
+        return property1 + property2;
+    }
+
     FIBRE_EXPORTS(TestClass,
         make_fibre_property("property1", &property1),
         make_fibre_property("property2", &property2),
-        make_fibre_function("set_both", *obj, &TestClass::set_both, "arg1", "arg2")
+        make_fibre_function("set_both", *obj, &TestClass::set_both, "arg1", "arg2"),
+        make_fibre_ro_accessor_property("sum", *obj, &TestClass::get_sum, 100),
+        make_fibre_object("config",
+            make_fibre_property("gain", &gain),
+            make_fibre_property("offset", &offset)
+        ),
+        make_fibre_latency_object("latency"),
+        make_fibre_upload("upload", upload_receiver)
     );
 };
 
@@ -34,7 +55,31 @@ FIBRE_EXPORT_TYPE(TestClass,
     //FIBRE_FUNCTION(set_both, "arg1", "arg2")
 );*/
 
-int main() {
+// @brief Prints the stages of sampled requests once latency.trace_interval is set.
+static void print_latency_trace(uint16_t endpoint_id, uint16_t seq_no, const RequestTimestamps& timestamps) {
+    uint64_t start = timestamps.kernel_rx_ns ? timestamps.kernel_rx_ns : timestamps.user_rx_ns;
+    auto us = [start](uint64_t t) { return t && start ? (t - start) / 1000.0 : 0.0; };
+    printf("trace: endpoint %u seq %u: read %.1f us, segmented %.1f us, handler %.1f - %.1f us, sent %.1f us\n",
+            endpoint_id, seq_no, us(timestamps.user_rx_ns), us(timestamps.segmented_ns),
+            us(timestamps.handler_ns), us(timestamps.handled_ns), us(timestamps.sent_ns));
+}
+
+static void print_usage(const char* name) {
+    fprintf(stderr, "usage: %s [-s SHARDS]\n", name);
+    fprintf(stderr, "  -s SHARDS  serve TCP with this many shards (0: one per CPU) instead of one thread per client,\n"
+                    "             function calls then run on the main thread (call handoff mode)\n");
+}
+
+int main(int argc, char** argv) {
+    int n_shards = -1;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        switch (opt) {
+            case 's': n_shards = atoi(optarg); break;
+            default: print_usage(argv[0]); return 1;
+        }
+    }
+
     printf("Starting Fibre server...\n");
 
     TestClass test_object = TestClass();
@@ -42,16 +87,40 @@ int main() {
     // publish the object on Fibre
     auto definitions = test_object.fibre_definitions;
     fibre_publish(definitions);
+    latency_metrics_.set_trace_callback(print_latency_trace);
 
-    // Expose Fibre objects on TCP and UDP
-    std::thread server_thread_tcp(serve_on_tcp, 9910);
+    // Expose Fibre objects on TCP and UDP, and the ASCII protocol on TCP
+    std::thread server_thread_tcp;
+    if (n_shards >= 0) {
+        fibre_set_call_handoff(true);
+        server_thread_tcp = std::thread(serve_on_tcp_sharded, 9910, n_shards);
+    } else {
+        server_thread_tcp = std::thread(serve_on_tcp, 9910);
+    }
     std::thread server_thread_udp(serve_on_udp, 9910);
+    std::thread server_thread_ascii(serve_ascii_on_tcp, 9911);
+
+    // Stream property changes to replicas (fibre_proxy -r 9912)
+    std::thread replication_thread(serve_replication_on_tcp, 9912, 10);
+
+    // Mirror property1, property2, sum, config.gain and config.offset into
+    // shared memory for local readers
+    static const uint16_t snapshot_endpoint_ids[] = { 1, 2, 7, 8, 9 };
+    std::thread snapshot_thread(publish_snapshot_on_shm, "/fibre_test_server",
+            snapshot_endpoint_ids, 5, 10, 0);
     printf("Fibre server started.\n");
 
-    // Dump property1 value
-    while (1) {
-        printf("test_object.property1: %f\n", test_object.property1);
-        usleep(1000000 / 5); // 5 Hz
+    // Dump property1 value. In call handoff mode the remote function calls
+    // run here, on a 1 kHz tick like a control loop would run them.
+    for (unsigned int tick = 0; ; ++tick) {
+        if (n_shards < 0 || tick % 200 == 0)
+            printf("test_object.property1: %f\n", test_object.property1);
+        if (n_shards < 0) {
+            usleep(1000000 / 5); // 5 Hz
+        } else {
+            fibre_run_pending_calls();
+            usleep(1000000 / 1000); // 1 kHz
+        }
     }
 
     return 0;